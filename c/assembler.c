@@ -0,0 +1,438 @@
+//> Optimization omit
+// For MAP_ANONYMOUS.
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include "common.h"
+
+#ifdef JIT
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "assembler.h"
+#include "memory.h"
+#include "value.h"
+#include "vm.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// Compiled code is copied into regions of executable memory. When a function
+// or trace is freed, its code's block goes on a free list, and new code goes
+// in the first free block that fits before more of a region is used. So
+// compiling only stops once the regions are full of code that's still live.
+#define CODE_REGION_SIZE (1024 * 1024)
+#define MAX_CODE_REGIONS 64
+
+// Code is laid out on 16-byte boundaries.
+#define ALIGN_CODE(size) (((size) + 15) & ~(size_t)15)
+
+// A run of unused bytes in a region.
+typedef struct {
+  uint8_t* start;
+  size_t size;
+} CodeBlock;
+
+static uint8_t* regions[MAX_CODE_REGIONS];
+static int regionCount = 0;
+static size_t regionUsed = 0;
+
+// The blocks freed code left behind, in address order. Neighbors in the
+// same region are merged.
+static CodeBlock* freeBlocks = NULL;
+static int freeCount = 0;
+static int freeCapacity = 0;
+
+void initAssembler(Assembler* a) {
+  a->code = NULL;
+  a->count = 0;
+  a->capacity = 0;
+}
+
+void freeAssembler(Assembler* a) {
+  free(a->code);
+  initAssembler(a);
+}
+
+void emitByte(Assembler* a, uint8_t byte) {
+  if (a->capacity < a->count + 1) {
+    a->capacity = GROW_CAPACITY(a->capacity);
+    a->code = (uint8_t*)realloc(a->code, a->capacity);
+    if (a->code == NULL) exit(1);
+  }
+
+  a->code[a->count++] = byte;
+}
+
+void emit32(Assembler* a, uint32_t value) {
+  for (int i = 0; i < 4; i++) emitByte(a, (uint8_t)(value >> (i * 8)));
+}
+
+static void emit64(Assembler* a, uint64_t value) {
+  for (int i = 0; i < 8; i++) emitByte(a, (uint8_t)(value >> (i * 8)));
+}
+
+void patch32(Assembler* a, int at, int32_t value) {
+  for (int i = 0; i < 4; i++) {
+    a->code[at + i] = (uint8_t)((uint32_t)value >> (i * 8));
+  }
+}
+
+// A REX prefix for a 64-bit operation on [reg] and [rm].
+static void rexW(Assembler* a, int reg, int rm) {
+  emitByte(a, (uint8_t)(0x48 | ((reg & 8) >> 1) | ((rm & 8) >> 3)));
+}
+
+// A REX prefix for a 32-bit operation, if one is needed.
+static void rex(Assembler* a, int reg, int rm) {
+  if ((reg | rm) & 8) {
+    emitByte(a, (uint8_t)(0x40 | ((reg & 8) >> 1) | ((rm & 8) >> 3)));
+  }
+}
+
+static void emitRegisters(Assembler* a, int reg, int rm) {
+  emitByte(a, (uint8_t)(0xc0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// The ModRM byte addressing [base + disp], with the SIB byte that rsp and
+// r12 need.
+static void emitAddress(Assembler* a, int reg, int base, int32_t disp) {
+  emitByte(a, (uint8_t)(0x80 | ((reg & 7) << 3) | (base & 7)));
+  if ((base & 7) == RSP) emitByte(a, 0x24);
+  emit32(a, (uint32_t)disp);
+}
+
+// mov dst, [base + disp]
+void load(Assembler* a, int dst, int base, int32_t disp) {
+  rexW(a, dst, base);
+  emitByte(a, 0x8b);
+  emitAddress(a, dst, base, disp);
+}
+
+// mov dst32, [base + disp], which clears the upper half of dst.
+void load32(Assembler* a, int dst, int base, int32_t disp) {
+  rex(a, dst, base);
+  emitByte(a, 0x8b);
+  emitAddress(a, dst, base, disp);
+}
+
+// mov [base + disp], src
+void store(Assembler* a, int base, int32_t disp, int src) {
+  rexW(a, src, base);
+  emitByte(a, 0x89);
+  emitAddress(a, src, base, disp);
+}
+
+// mov dst, value
+void loadImmediate(Assembler* a, int dst, uint64_t value) {
+  emitByte(a, (uint8_t)(0x48 | ((dst & 8) >> 3)));
+  emitByte(a, (uint8_t)(0xb8 | (dst & 7)));
+  emit64(a, value);
+}
+
+void move(Assembler* a, int dst, int src) {
+  rexW(a, src, dst);
+  emitByte(a, 0x89);
+  emitRegisters(a, src, dst);
+}
+
+void addImmediate(Assembler* a, int reg, int32_t value) {
+  rexW(a, 0, reg);
+  emitByte(a, 0x81);
+  emitRegisters(a, 0, reg);
+  emit32(a, (uint32_t)value);
+}
+
+void alu(Assembler* a, uint8_t opcode, int dst, int src) {
+  rexW(a, src, dst);
+  emitByte(a, opcode);
+  emitRegisters(a, src, dst);
+}
+
+// cmp byte [base + disp], 0
+void compareByteToZero(Assembler* a, int base, int32_t disp) {
+  rex(a, 0, base);
+  emitByte(a, 0x80);
+  emitAddress(a, 7, base, disp);
+  emitByte(a, 0);
+}
+
+// movq xmm, reg
+void moveToXmm(Assembler* a, int xmm, int reg) {
+  emitByte(a, 0x66);
+  rexW(a, xmm, reg);
+  emitByte(a, 0x0f);
+  emitByte(a, 0x6e);
+  emitRegisters(a, xmm, reg);
+}
+
+// movq reg, xmm
+void moveFromXmm(Assembler* a, int reg, int xmm) {
+  emitByte(a, 0x66);
+  rexW(a, xmm, reg);
+  emitByte(a, 0x0f);
+  emitByte(a, 0x7e);
+  emitRegisters(a, xmm, reg);
+}
+
+// movsd xmm, [base + disp]
+void loadDouble(Assembler* a, int xmm, int base, int32_t disp) {
+  emitByte(a, 0xf2);
+  rex(a, xmm, base);
+  emitByte(a, 0x0f);
+  emitByte(a, 0x10);
+  emitAddress(a, xmm, base, disp);
+}
+
+// movsd [base + disp], xmm
+void storeDouble(Assembler* a, int base, int32_t disp, int xmm) {
+  emitByte(a, 0xf2);
+  rex(a, xmm, base);
+  emitByte(a, 0x0f);
+  emitByte(a, 0x11);
+  emitAddress(a, xmm, base, disp);
+}
+
+void scalarDouble(Assembler* a, uint8_t opcode, int dst, int src) {
+  emitByte(a, 0xf2);
+  emitByte(a, 0x0f);
+  emitByte(a, opcode);
+  emitRegisters(a, dst, src);
+}
+
+// ucomisd left, right
+void compareDoubles(Assembler* a, int left, int right) {
+  emitByte(a, 0x66);
+  emitByte(a, 0x0f);
+  emitByte(a, 0x2e);
+  emitRegisters(a, left, right);
+}
+
+// Sets the low byte of rax, rcx, rdx or rbx to whether [condition] holds.
+void setCondition(Assembler* a, int condition, int reg) {
+  emitByte(a, 0x0f);
+  emitByte(a, (uint8_t)(0x90 | condition));
+  emitRegisters(a, 0, reg);
+}
+
+// and al, cl
+void andLowBytes(Assembler* a) {
+  emitByte(a, 0x20);
+  emitByte(a, 0xc8);
+}
+
+// test al, al
+void testLowByte(Assembler* a) {
+  emitByte(a, 0x84);
+  emitByte(a, 0xc0);
+}
+
+// Turns the flag in al into a Lox Boolean in rax. Uses rcx.
+void boolFromAl(Assembler* a) {
+  emitByte(a, 0x0f); // movzx eax, al
+  emitByte(a, 0xb6);
+  emitByte(a, 0xc0);
+  loadImmediate(a, RCX, FALSE_VAL);
+  alu(a, ALU_OR, RAX, RCX);
+}
+
+void pushCalleeSaved(Assembler* a) {
+  static const uint8_t code[] = {
+    0x53,       // push rbx
+    0x55,       // push rbp
+    0x41, 0x54, // push r12
+    0x41, 0x55, // push r13
+    0x41, 0x56, // push r14
+    0x41, 0x57, // push r15
+  };
+  for (size_t i = 0; i < sizeof(code); i++) emitByte(a, code[i]);
+}
+
+void popCalleeSaved(Assembler* a) {
+  static const uint8_t code[] = {
+    0x41, 0x5f, // pop r15
+    0x41, 0x5e, // pop r14
+    0x41, 0x5d, // pop r13
+    0x41, 0x5c, // pop r12
+    0x5d,       // pop rbp
+    0x5b,       // pop rbx
+  };
+  for (size_t i = 0; i < sizeof(code); i++) emitByte(a, code[i]);
+}
+
+void callRax(Assembler* a) {
+  emitByte(a, 0xff);
+  emitByte(a, 0xd0);
+}
+
+static void emitJump(Assembler* a, int condition) {
+  if (condition == ALWAYS) {
+    emitByte(a, 0xe9);
+  } else {
+    emitByte(a, 0x0f);
+    emitByte(a, (uint8_t)(0x80 | condition));
+  }
+}
+
+// Emits a jump whose target isn't known yet. Returns where to patch it.
+int jumpForward(Assembler* a, int condition) {
+  emitJump(a, condition);
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+void patchHere(Assembler* a, int from) {
+  patch32(a, from, a->count - (from + 4));
+}
+
+void jumpTo(Assembler* a, int condition, int target) {
+  emitJump(a, condition);
+  emit32(a, (uint32_t)(target - (a->count + 4)));
+}
+
+// Returns the region that [code] is in.
+static uint8_t* regionOf(uint8_t* code) {
+  for (int i = 0; i < regionCount; i++) {
+    if (code >= regions[i] && code < regions[i] + CODE_REGION_SIZE) {
+      return regions[i];
+    }
+  }
+
+  return NULL; // Unreachable.
+}
+
+// Takes [size] bytes from the first free block with room for them. Returns
+// NULL if none has.
+static uint8_t* takeFreeBlock(size_t size) {
+  for (int i = 0; i < freeCount; i++) {
+    CodeBlock* block = &freeBlocks[i];
+    if (block->size < size) continue;
+
+    uint8_t* start = block->start;
+    block->start += size;
+    block->size -= size;
+    if (block->size == 0) {
+      freeCount--;
+      memmove(block, block + 1, sizeof(CodeBlock) * (freeCount - i));
+    }
+    return start;
+  }
+
+  return NULL;
+}
+
+// Puts the [size] bytes at [start] on the free list.
+static void addFreeBlock(uint8_t* start, size_t size) {
+  int index = 0;
+  while (index < freeCount && freeBlocks[index].start < start) index++;
+
+  uint8_t* region = regionOf(start);
+  bool mergesBefore = index > 0 &&
+      freeBlocks[index - 1].start + freeBlocks[index - 1].size == start &&
+      regionOf(freeBlocks[index - 1].start) == region;
+  bool mergesAfter = index < freeCount &&
+      start + size == freeBlocks[index].start &&
+      regionOf(freeBlocks[index].start) == region;
+
+  if (mergesBefore && mergesAfter) {
+    freeBlocks[index - 1].size += size + freeBlocks[index].size;
+    freeCount--;
+    memmove(&freeBlocks[index], &freeBlocks[index + 1],
+            sizeof(CodeBlock) * (freeCount - index));
+  } else if (mergesBefore) {
+    freeBlocks[index - 1].size += size;
+  } else if (mergesAfter) {
+    freeBlocks[index].start = start;
+    freeBlocks[index].size += size;
+  } else {
+    if (freeCapacity < freeCount + 1) {
+      freeCapacity = GROW_CAPACITY(freeCapacity);
+      freeBlocks = (CodeBlock*)realloc(freeBlocks,
+                                       sizeof(CodeBlock) * freeCapacity);
+      if (freeBlocks == NULL) exit(1);
+    }
+
+    memmove(&freeBlocks[index + 1], &freeBlocks[index],
+            sizeof(CodeBlock) * (freeCount - index));
+    freeBlocks[index].start = start;
+    freeBlocks[index].size = size;
+    freeCount++;
+  }
+}
+
+// Copies [size] bytes of code into executable memory. Returns NULL if there
+// is no room left.
+uint8_t* copyToExecutable(uint8_t* code, size_t size) {
+  size_t aligned = ALIGN_CODE(size);
+  if (aligned > CODE_REGION_SIZE) return NULL;
+
+  uint8_t* target = takeFreeBlock(aligned);
+  bool fresh = false;
+  if (target == NULL) {
+    if (regionCount == 0 || regionUsed + aligned > CODE_REGION_SIZE) {
+      if (regionCount == MAX_CODE_REGIONS) return NULL;
+
+      void* memory = mmap(NULL, CODE_REGION_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (memory == MAP_FAILED) return NULL;
+
+      // Smaller code can still use what's left of the last region.
+      if (regionCount > 0 && regionUsed < CODE_REGION_SIZE) {
+        addFreeBlock(regions[regionCount - 1] + regionUsed,
+                     CODE_REGION_SIZE - regionUsed);
+      }
+
+      regions[regionCount++] = (uint8_t*)memory;
+      regionUsed = 0;
+      fresh = true;
+    }
+
+    target = regions[regionCount - 1] + regionUsed;
+    regionUsed += aligned;
+  }
+
+  uint8_t* region = regionOf(target);
+  if (!fresh &&
+      mprotect(region, CODE_REGION_SIZE, PROT_READ | PROT_WRITE) != 0) {
+    addFreeBlock(target, aligned);
+    return NULL;
+  }
+
+  memcpy(target, code, size);
+
+  if (mprotect(region, CODE_REGION_SIZE, PROT_READ | PROT_EXEC) != 0) {
+    // The system won't run generated code. Code already in the region
+    // would crash now, but then there can't be any.
+    if (!fresh) exit(1);
+    munmap(region, CODE_REGION_SIZE);
+    regionCount--;
+    vm.jitThreshold = 0;
+    vm.traceThreshold = 0;
+    return NULL;
+  }
+
+  return target;
+}
+
+// Lets the [size] bytes of code at [code], which copyToExecutable() returned,
+// be used for other code.
+void freeExecutable(uint8_t* code, size_t size) {
+  addFreeBlock(code, ALIGN_CODE(size));
+}
+
+void freeExecutableMemory() {
+  for (int i = 0; i < regionCount; i++) {
+    munmap(regions[i], CODE_REGION_SIZE);
+  }
+  regionCount = 0;
+  regionUsed = 0;
+
+  free(freeBlocks);
+  freeBlocks = NULL;
+  freeCount = 0;
+  freeCapacity = 0;
+}
+#endif
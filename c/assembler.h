@@ -0,0 +1,92 @@
+//> Optimization omit
+#ifndef clox_assembler_h
+#define clox_assembler_h
+
+#include "common.h"
+
+#ifdef JIT
+// Emits the handful of x86-64 instructions the compilers in jit.c and
+// trace.c need. Registers are numbered the way the instruction encoding
+// numbers them.
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSP 4
+#define RBP 5
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+
+#define XMM0 0
+#define XMM1 1
+
+// Condition codes, or ALWAYS for an unconditional jump.
+#define ALWAYS -1
+#define CC_AE  0x3
+#define CC_E   0x4
+#define CC_NE  0x5
+#define CC_BE  0x6
+#define CC_A   0x7
+#define CC_P   0xa
+#define CC_NP  0xb
+
+// Opcodes for two-register integer and SSE instructions.
+#define ALU_OR   0x09
+#define ALU_AND  0x21
+#define ALU_XOR  0x31
+#define ALU_CMP  0x39
+#define ALU_TEST 0x85
+#define SSE_ADD  0x58
+#define SSE_MUL  0x59
+#define SSE_SUB  0x5c
+#define SSE_DIV  0x5e
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+} Assembler;
+
+void initAssembler(Assembler* a);
+void freeAssembler(Assembler* a);
+
+void emitByte(Assembler* a, uint8_t byte);
+void emit32(Assembler* a, uint32_t value);
+void patch32(Assembler* a, int at, int32_t value);
+
+void load(Assembler* a, int dst, int base, int32_t disp);
+void load32(Assembler* a, int dst, int base, int32_t disp);
+void store(Assembler* a, int base, int32_t disp, int src);
+void loadImmediate(Assembler* a, int dst, uint64_t value);
+void move(Assembler* a, int dst, int src);
+void addImmediate(Assembler* a, int reg, int32_t value);
+void alu(Assembler* a, uint8_t opcode, int dst, int src);
+void compareByteToZero(Assembler* a, int base, int32_t disp);
+void moveToXmm(Assembler* a, int xmm, int reg);
+void moveFromXmm(Assembler* a, int reg, int xmm);
+void loadDouble(Assembler* a, int xmm, int base, int32_t disp);
+void storeDouble(Assembler* a, int base, int32_t disp, int xmm);
+void scalarDouble(Assembler* a, uint8_t opcode, int dst, int src);
+void compareDoubles(Assembler* a, int left, int right);
+void setCondition(Assembler* a, int condition, int reg);
+void andLowBytes(Assembler* a);
+void testLowByte(Assembler* a);
+void boolFromAl(Assembler* a);
+void pushCalleeSaved(Assembler* a);
+void popCalleeSaved(Assembler* a);
+void callRax(Assembler* a);
+
+int jumpForward(Assembler* a, int condition);
+void patchHere(Assembler* a, int from);
+void jumpTo(Assembler* a, int condition, int target);
+
+uint8_t* copyToExecutable(uint8_t* code, size_t size);
+void freeExecutable(uint8_t* code, size_t size);
+void freeExecutableMemory();
+#endif
+
+#endif
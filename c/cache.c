@@ -0,0 +1,848 @@
+//> Optimization omit
+// For mmap() and getpid().
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "table.h"
+
+// A .loxc file holds a compiled script, so that running it again can skip
+// the compiler. Everything in it is in the byte order of the machine that
+// wrote it, and each 32-bit value is aligned to four bytes. It starts with
+// a header:
+//
+//     uint32 magic          MAGIC
+//     uint32 version        FORMAT_VERSION
+//     uint32 variant        Which instruction set the code is in.
+//     uint32 optimizeLevel
+//     uint64 key            See sourceKey().
+//     uint32 sourceLength   The length of the source it was compiled from.
+//     uint32 stringCount
+//     uint32 globalCount
+//     uint64 checksum       See checksum(), of everything after the header.
+//
+// Next is the string pool. Each string is its length as a uint32 followed
+// by its characters, padded to four bytes. Strings everywhere else in the
+// file are indexes into the pool. Then, for each global variable slot the
+// code uses, the pool index of its name. Last comes the script's function:
+//
+//     int32 arity, upvalueCount, name (a pool index, or -1 for none)
+//     int32 frameSize
+//     int32 codeCount, lineCount, constantCount
+//     int32 cacheCount, invokeCacheCount, loopSiteCount, hoistedCount
+//     uint8 code[codeCount], padded to four bytes
+//     LineStart lines[lineCount]
+//     Each constant's tag, followed by a double for a number, a pool index
+//     for a string, or a whole function laid out like this one.
+//
+// The file is mapped into memory copy-on-write, and each chunk's code and
+// lines point right into it. Instructions that quicken themselves write to
+// the code, which only copies the pages they're on.
+//
+// The VM trusts the code it runs, so a file that was cut short, corrupted or
+// written by something else mustn't get that far. Loading one checks the
+// checksum first, and then that the code only refers to things that exist.
+// See checkCode(). A file that fails is treated like a missing one.
+
+#define MAGIC 0x43584f4c // "LOXC" on a little-endian machine.
+#define FORMAT_VERSION 7
+
+#ifdef REGISTER_VM
+#define VARIANT 1
+#else
+#define VARIANT 0
+#endif
+
+#define HEADER_SIZE 44
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION
+} ConstantTag;
+
+// The file that loadCompiled() mapped, which the code of the functions
+// loaded from it points into until the VM is freed.
+static uint8_t* mapping = NULL;
+static size_t mappingSize = 0;
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+// Adds [size] [bytes] to the FNV-1a [hash].
+static uint64_t checksum(uint64_t hash, const uint8_t* bytes, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+// A hash of [source] and everything else that decides what the compiler
+// makes of it, which names its file in the cache.
+static uint64_t sourceKey(const char* source) {
+  uint64_t hash = checksum(FNV_OFFSET, (const uint8_t*)source,
+                           strlen(source));
+
+  uint32_t settings[] = { FORMAT_VERSION, VARIANT,
+                          (uint32_t)vm.optimizeLevel };
+  for (int i = 0; i < 3; i++) {
+    hash ^= settings[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+} Buffer;
+
+static void initBuffer(Buffer* buffer) {
+  buffer->bytes = NULL;
+  buffer->count = 0;
+  buffer->capacity = 0;
+}
+
+static void writeBytes(Buffer* buffer, const void* bytes, size_t size) {
+  if (buffer->count + size > buffer->capacity) {
+    size_t capacity = buffer->capacity < 256 ? 256 : buffer->capacity;
+    while (capacity < buffer->count + size) capacity *= 2;
+    buffer->bytes = (uint8_t*)realloc(buffer->bytes, capacity);
+    if (buffer->bytes == NULL) exit(1);
+    buffer->capacity = capacity;
+  }
+
+  memcpy(buffer->bytes + buffer->count, bytes, size);
+  buffer->count += size;
+}
+
+static void writeInt(Buffer* buffer, int32_t value) {
+  writeBytes(buffer, &value, sizeof(value));
+}
+
+// Pads [buffer] to a multiple of four bytes.
+static void writePadding(Buffer* buffer) {
+  static const uint8_t zeroes[4] = { 0, 0, 0, 0 };
+  writeBytes(buffer, zeroes, (4 - buffer->count % 4) % 4);
+}
+
+typedef struct {
+  Buffer strings;
+  int stringCount;
+
+  // Maps each string in the pool to its index.
+  Table stringIndexes;
+
+  Buffer functions;
+} Writer;
+
+// Returns the index of [string] in the pool, adding it if it isn't there.
+static int stringIndex(Writer* writer, ObjString* string) {
+  Value index;
+  if (tableGet(&writer->stringIndexes, string, &index)) {
+    return (int)AS_NUMBER(index);
+  }
+
+  tableSet(&writer->stringIndexes, string, NUMBER_VAL(writer->stringCount));
+  writeInt(&writer->strings, string->length);
+  writeBytes(&writer->strings, string->chars, string->length);
+  writePadding(&writer->strings);
+  return writer->stringCount++;
+}
+
+// Writes [function] and the functions in its constant table. Returns false
+// if it has something the format can't hold.
+static bool writeFunction(Writer* writer, ObjFunction* function) {
+  // A function --lazy skipped over doesn't have its code yet.
+  if (function->lazy != NULL) return false;
+
+  Chunk* chunk = &function->chunk;
+  Buffer* out = &writer->functions;
+  writeInt(out, function->arity);
+  writeInt(out, function->upvalueCount);
+  writeInt(out, function->name == NULL
+      ? -1 : stringIndex(writer, function->name));
+  writeInt(out, function->frameSize);
+  writeInt(out, chunk->count);
+  writeInt(out, chunk->lineCount);
+  writeInt(out, chunk->constants.count);
+  writeInt(out, chunk->cacheCount);
+  writeInt(out, chunk->invokeCacheCount);
+  writeInt(out, chunk->loopSiteCount);
+  writeInt(out, chunk->hoisted.count);
+  writeBytes(out, chunk->code, chunk->count);
+  writePadding(out);
+  writeBytes(out, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_NIL(value)) {
+      writeInt(out, CONSTANT_NIL);
+    } else if (IS_BOOL(value)) {
+      writeInt(out, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else if (IS_NUMBER(value)) {
+      double number = AS_NUMBER(value);
+      writeInt(out, CONSTANT_NUMBER);
+      writeBytes(out, &number, sizeof(number));
+    } else if (IS_STRING(value)) {
+      writeInt(out, CONSTANT_STRING);
+      writeInt(out, stringIndex(writer, AS_STRING(value)));
+    } else if (IS_FUNCTION(value)) {
+      writeInt(out, CONSTANT_FUNCTION);
+      if (!writeFunction(writer, AS_FUNCTION(value))) return false;
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Writes the compiled script [function] to the file at [path], replacing
+// it all at once so that nothing ever reads half a file. Returns false if
+// that fails.
+static bool saveCompiled(ObjFunction* function, const char* source,
+                         uint64_t key, const char* path) {
+  Writer writer;
+  initBuffer(&writer.strings);
+  writer.stringCount = 0;
+  initTable(&writer.stringIndexes);
+  initBuffer(&writer.functions);
+
+  // The names of the global variables, in slot order.
+  int globalCount = vm.globalValues.count;
+  ObjString** globals = (ObjString**)malloc(sizeof(ObjString*) *
+                                            (globalCount + 1));
+  if (globals == NULL) exit(1);
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry* entry = &vm.globals.entries[i];
+    if (entry->key != NULL) globals[(int)AS_NUMBER(entry->value)] = entry->key;
+  }
+
+  Buffer globalNames;
+  initBuffer(&globalNames);
+  for (int i = 0; i < globalCount; i++) {
+    writeInt(&globalNames, stringIndex(&writer, globals[i]));
+  }
+  free(globals);
+
+  bool written = writeFunction(&writer, function);
+
+  Buffer* sections[] = { &writer.strings, &globalNames, &writer.functions };
+  uint64_t sum = FNV_OFFSET;
+  for (int i = 0; i < 3; i++) {
+    sum = checksum(sum, sections[i]->bytes, sections[i]->count);
+  }
+
+  Buffer header;
+  initBuffer(&header);
+  writeInt(&header, MAGIC);
+  writeInt(&header, FORMAT_VERSION);
+  writeInt(&header, VARIANT);
+  writeInt(&header, vm.optimizeLevel);
+  writeBytes(&header, &key, sizeof(key));
+  writeInt(&header, (int32_t)strlen(source));
+  writeInt(&header, writer.stringCount);
+  writeInt(&header, globalCount);
+  writeBytes(&header, &sum, sizeof(sum));
+
+  size_t length = strlen(path);
+  char* temporary = (char*)malloc(length + 32);
+  if (temporary == NULL) exit(1);
+  snprintf(temporary, length + 32, "%s.%ld.tmp", path, (long)getpid());
+
+  FILE* file = written ? fopen(temporary, "wb") : NULL;
+  if (file != NULL) {
+    if (fwrite(header.bytes, 1, header.count, file) != header.count) {
+      written = false;
+    }
+
+    for (int i = 0; i < 3; i++) {
+      if (fwrite(sections[i]->bytes, 1, sections[i]->count, file) !=
+          sections[i]->count) {
+        written = false;
+      }
+    }
+
+    if (fclose(file) != 0) written = false;
+    if (written && rename(temporary, path) != 0) written = false;
+    if (!written) remove(temporary);
+  } else {
+    written = false;
+  }
+
+  free(temporary);
+  free(header.bytes);
+  free(globalNames.bytes);
+  free(writer.strings.bytes);
+  free(writer.functions.bytes);
+  freeTable(&writer.stringIndexes);
+  return written;
+}
+
+typedef struct {
+  uint8_t* bytes;
+  size_t size;
+  size_t offset;
+
+  // Set once anything is out of bounds or otherwise malformed. Reads after
+  // that return zeroes.
+  bool failed;
+
+  // Where each string in the pool starts.
+  size_t* strings;
+  int stringCount;
+} Reader;
+
+static uint8_t* readBytes(Reader* reader, size_t size) {
+  if (reader->failed || size > reader->size - reader->offset) {
+    reader->failed = true;
+    return NULL;
+  }
+
+  uint8_t* bytes = reader->bytes + reader->offset;
+  reader->offset += size;
+  return bytes;
+}
+
+static int32_t readInt(Reader* reader) {
+  int32_t value = 0;
+  uint8_t* bytes = readBytes(reader, sizeof(value));
+  if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+  return value;
+}
+
+static void readPadding(Reader* reader) {
+  readBytes(reader, (4 - reader->offset % 4) % 4);
+}
+
+// Reads the length and characters of a string in the pool, and skips past
+// it.
+static void skipString(Reader* reader) {
+  int32_t length = readInt(reader);
+  if (length < 0) reader->failed = true;
+  readBytes(reader, (size_t)length);
+  readPadding(reader);
+}
+
+static ObjString* poolString(Reader* reader, int index) {
+  if (index < 0 || index >= reader->stringCount) {
+    reader->failed = true;
+    return copyString("", 0);
+  }
+
+  int32_t length;
+  memcpy(&length, reader->bytes + reader->strings[index], sizeof(length));
+  return copyString((const char*)reader->bytes + reader->strings[index] +
+                    sizeof(length), length);
+}
+
+// Whether [index] names a string in [chunk]'s constant table.
+static bool isStringConstant(Chunk* chunk, uint32_t index) {
+  return index < (uint32_t)chunk->constants.count &&
+         IS_STRING(chunk->constants.values[index]);
+}
+
+static uint32_t shortAt(uint8_t* code) {
+  return (uint32_t)((code[0] << 8) | code[1]);
+}
+
+// Returns [target] if it's in [chunk]'s code, or else one past the end.
+static int jumpTarget(Chunk* chunk, int64_t target) {
+  return target < 0 || target >= chunk->count ? chunk->count : (int)target;
+}
+
+// Checks the operands of the instruction at [offset] in [function]'s code.
+// If it came after an OP_WIDE prefix, [high] has the high bytes the prefix
+// adds to its first operand. Sets [*target] to where it jumps, if it can.
+// Returns the size of the instruction, or 0 if it's malformed.
+static int checkInstruction(ObjFunction* function, int offset,
+                            bool widened, uint32_t high, int* target) {
+  Chunk* chunk = &function->chunk;
+  uint8_t* code = chunk->code + offset;
+  int available = chunk->count - offset;
+  if (code[0] > OP_METHOD) return 0;
+
+  // instructionSize() reads the operands of these to tell how big they
+  // are, so they're checked first.
+  int size;
+  if (code[0] == OP_WIDE) {
+    if (widened || available < 4) return 0;
+
+    switch (code[3]) {
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+      case OP_GET_PROPERTY:
+      case OP_SET_PROPERTY:
+      case OP_GET_THIS_FIELD:
+      case OP_GET_SUPER:
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_POP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_NOT_EQUAL:
+      case OP_JUMP_IF_NOT_GREATER:
+      case OP_JUMP_IF_NOT_LESS:
+      case OP_LOOP:
+      case OP_INVOKE:
+      case OP_SUPER_INVOKE:
+      case OP_TAIL_INVOKE:
+      case OP_TAIL_SUPER_INVOKE:
+      case OP_CLOSURE:
+      case OP_CLASS:
+      case OP_METHOD:
+        break;
+      default:
+        return 0;
+    }
+
+    size = checkInstruction(function, offset + 3, true, shortAt(code + 1),
+                            target);
+    return size == 0 ? 0 : 3 + size;
+  } else if (code[0] == OP_CLOSURE) {
+    if (available < 2) return 0;
+    uint32_t constant = (high << 8) | code[1];
+    if (constant >= (uint32_t)chunk->constants.count ||
+        !IS_FUNCTION(chunk->constants.values[constant])) {
+      return 0;
+    }
+
+    size = 2 + AS_FUNCTION(chunk->constants.values[constant])
+                   ->upvalueCount * 3;
+  } else {
+    size = instructionSize(chunk, offset);
+  }
+
+  if (size > available) return 0;
+
+  uint32_t first = size > 1 ? (high << 8) | code[1] : 0;
+  switch (code[0]) {
+    case OP_CONSTANT:
+      return first < (uint32_t)chunk->constants.count ? size : 0;
+
+    case OP_CONSTANT_LONG: {
+      uint32_t constant = ((uint32_t)code[1] << 16) | shortAt(code + 2);
+      return constant < (uint32_t)chunk->constants.count ? size : 0;
+    }
+
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+      return first < (uint32_t)function->frameSize ? size : 0;
+
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+      return first < (uint32_t)function->upvalueCount ? size : 0;
+
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+      return shortAt(code + 1) < (uint32_t)vm.globalValues.count ? size : 0;
+
+    case OP_GET_SUPER:
+    case OP_CLASS:
+    case OP_METHOD:
+      return isStringConstant(chunk, first) ? size : 0;
+
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_THIS_FIELD:
+      return isStringConstant(chunk, first) &&
+             shortAt(code + 2) < (uint32_t)chunk->cacheCount ? size : 0;
+
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+      return isStringConstant(chunk, first) &&
+             shortAt(code + 3) < (uint32_t)chunk->invokeCacheCount
+             ? size : 0;
+
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_LESS:
+      *target = jumpTarget(chunk, (int64_t)offset + size +
+                                     ((high << 16) | shortAt(code + 1)));
+      return size;
+
+    case OP_LOOP:
+      *target = jumpTarget(chunk, (int64_t)offset + size -
+                                     ((high << 16) | shortAt(code + 1)));
+      return shortAt(code + 3) < (uint32_t)chunk->loopSiteCount ? size : 0;
+
+    case OP_CLOSURE: {
+      ObjFunction* closed = AS_FUNCTION(chunk->constants.values[first]);
+      for (int i = 0; i < closed->upvalueCount; i++) {
+        uint32_t index = shortAt(code + 3 + i * 3);
+        uint32_t limit = code[2 + i * 3]
+            ? (uint32_t)function->frameSize
+            : (uint32_t)function->upvalueCount;
+        if (index >= limit) return 0;
+      }
+      return size;
+    }
+
+    case OP_ENTER_LOOP:
+      return shortAt(code + 1) + code[3] <=
+             (uint32_t)chunk->hoisted.count ? size : 0;
+
+    case OP_GET_HOISTED:
+      *target = jumpTarget(chunk, offset + size + code[3]);
+      return shortAt(code + 1) < (uint32_t)chunk->hoisted.count ? size : 0;
+
+    case OP_SET_HOISTED:
+      return shortAt(code + 1) < (uint32_t)chunk->hoisted.count ? size : 0;
+
+    case OP_ADD_REG:
+    case OP_SUBTRACT_REG:
+    case OP_MULTIPLY_REG:
+    case OP_DIVIDE_REG:
+    case OP_EQUAL_REG:
+    case OP_GREATER_REG:
+    case OP_LESS_REG:
+      // Register slots are bytes, and every frame has room for those.
+      if (code[1] > OPERAND_KINDS(3, 3) ||
+          RIGHT_KIND(code[1]) == OPERAND_STACK) {
+        return 0;
+      }
+
+      if (RIGHT_KIND(code[1]) == OPERAND_CONSTANT &&
+          code[4] >= chunk->constants.count) {
+        return 0;
+      }
+      // Fallthrough.
+    case OP_MOVE:
+      if (LEFT_KIND(code[1]) == OPERAND_CONSTANT &&
+          code[3] >= chunk->constants.count) {
+        return 0;
+      }
+      return size;
+
+    default:
+      return size;
+  }
+}
+
+// Checks that the code of [function] only refers to things that exist: that
+// each operand names a constant of the right type, a cache, a global, a
+// local or an upvalue the function has, that each jump lands on the start of
+// an instruction, and that the code can't run off its end. It doesn't check
+// how deep the stack gets.
+static void checkCode(Reader* reader, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  if (reader->failed || chunk->count == 0 || chunk->lineCount == 0) {
+    reader->failed = true;
+    return;
+  }
+
+  // Where each instruction starts, and where each one jumps to, if it can.
+  bool* starts = (bool*)calloc((size_t)chunk->count, sizeof(bool));
+  int* targets = (int*)malloc(sizeof(int) * (size_t)chunk->count);
+  if (starts == NULL || targets == NULL) exit(1);
+
+  int last = 0;
+  for (int offset = 0; offset < chunk->count;) {
+    starts[offset] = true;
+    targets[offset] = -1;
+    int size = checkInstruction(function, offset, false, 0,
+                                &targets[offset]);
+    if (size == 0) {
+      reader->failed = true;
+      break;
+    }
+
+    last = offset;
+    offset += size;
+  }
+
+  for (int offset = 0; offset < chunk->count && !reader->failed; offset++) {
+    if (!starts[offset] || targets[offset] == -1) continue;
+
+    int target = targets[offset];
+    if (target == chunk->count || !starts[target]) reader->failed = true;
+  }
+
+  if (!reader->failed) {
+    uint8_t op = chunk->code[last];
+    if (op == OP_WIDE) op = chunk->code[last + 3];
+    if (op != OP_RETURN && op != OP_JUMP && op != OP_LOOP) {
+      reader->failed = true;
+    }
+  }
+
+  free(starts);
+  free(targets);
+}
+
+static ObjFunction* readFunction(Reader* reader) {
+  ObjFunction* function = newFunction();
+  push(OBJ_VAL(function));
+
+  function->arity = readInt(reader);
+  function->upvalueCount = readInt(reader);
+  int name = readInt(reader);
+  if (name != -1) function->name = poolString(reader, name);
+  function->frameSize = readInt(reader);
+
+  Chunk* chunk = &function->chunk;
+  int count = readInt(reader);
+  int lineCount = readInt(reader);
+  int constantCount = readInt(reader);
+  int cacheCount = readInt(reader);
+  int invokeCacheCount = readInt(reader);
+  int loopSiteCount = readInt(reader);
+  int hoistedCount = readInt(reader);
+
+  // Nothing can be bigger than the compiler allows, and every cache, loop
+  // site and hoisted load belongs to an instruction.
+  if (function->arity < 0 || function->arity > UINT8_MAX ||
+      function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT ||
+      function->frameSize < function->arity + 1 + STACK_HEADROOM ||
+      function->frameSize > function->arity + 1 + count + STACK_HEADROOM ||
+      count < 0 || lineCount < 0 || lineCount > count ||
+      cacheCount > count || invokeCacheCount > count ||
+      loopSiteCount > count || hoistedCount > count) {
+    reader->failed = true;
+  }
+
+  chunk->mapped = true;
+  chunk->code = readBytes(reader, (size_t)count);
+  readPadding(reader);
+  chunk->lines = (LineStart*)readBytes(reader,
+                                       sizeof(LineStart) * (size_t)lineCount);
+  if (!reader->failed) {
+    chunk->count = count;
+    chunk->capacity = count;
+    chunk->lineCount = lineCount;
+    chunk->lineCapacity = lineCount;
+  }
+
+  for (int i = 0; i < cacheCount && !reader->failed; i++) {
+    addInlineCache(chunk);
+  }
+
+  for (int i = 0; i < invokeCacheCount && !reader->failed; i++) {
+    addInvokeCache(chunk);
+  }
+
+  for (int i = 0; i < loopSiteCount && !reader->failed; i++) {
+    addLoopSite(chunk);
+  }
+
+  for (int i = 0; i < hoistedCount && !reader->failed; i++) {
+    writeValueArray(&chunk->hoisted, UNDEFINED_VAL);
+  }
+
+  for (int i = 0; i < constantCount && !reader->failed; i++) {
+    Value value = NIL_VAL;
+    switch (readInt(reader)) {
+      case CONSTANT_NIL: break;
+      case CONSTANT_FALSE: value = BOOL_VAL(false); break;
+      case CONSTANT_TRUE: value = BOOL_VAL(true); break;
+      case CONSTANT_NUMBER: {
+        double number = 0;
+        uint8_t* bytes = readBytes(reader, sizeof(number));
+        if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+        value = NUMBER_VAL(number);
+        break;
+      }
+      case CONSTANT_STRING:
+        value = OBJ_VAL(poolString(reader, readInt(reader)));
+        break;
+      case CONSTANT_FUNCTION:
+        value = OBJ_VAL(readFunction(reader));
+        break;
+      default:
+        reader->failed = true;
+        break;
+    }
+
+    addConstant(chunk, value);
+  }
+
+  checkCode(reader, function);
+  pop();
+  return function;
+}
+
+// Maps the compiled file at [path] and loads the script in it. If [source]
+// isn't NULL, the file must also have been compiled from it, which has
+// [key]. Returns NULL if the file is missing, damaged or not one that this
+// build of clox can run.
+static ObjFunction* loadCompiled(const char* path, const char* source,
+                                 uint64_t key) {
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor == -1) return NULL;
+
+  struct stat status;
+  if (fstat(descriptor, &status) != 0 || status.st_size < HEADER_SIZE) {
+    close(descriptor);
+    return NULL;
+  }
+
+  size_t size = (size_t)status.st_size;
+  void* bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     descriptor, 0);
+  close(descriptor);
+  if (bytes == MAP_FAILED) return NULL;
+
+  Reader reader = { (uint8_t*)bytes, size, 0, false, NULL, 0 };
+  uint32_t magic = (uint32_t)readInt(&reader);
+  uint32_t version = (uint32_t)readInt(&reader);
+  uint32_t variant = (uint32_t)readInt(&reader);
+  readInt(&reader); // The optimization level is part of the key.
+  uint64_t fileKey;
+  memcpy(&fileKey, readBytes(&reader, sizeof(fileKey)), sizeof(fileKey));
+  uint32_t sourceLength = (uint32_t)readInt(&reader);
+  int stringCount = readInt(&reader);
+  int globalCount = readInt(&reader);
+  uint64_t sum;
+  memcpy(&sum, readBytes(&reader, sizeof(sum)), sizeof(sum));
+
+  if (magic != MAGIC || version != FORMAT_VERSION || variant != VARIANT ||
+      (source != NULL && (fileKey != key ||
+                          sourceLength != (uint32_t)strlen(source))) ||
+      stringCount < 0 || (size_t)stringCount > size || globalCount < 0 ||
+      sum != checksum(FNV_OFFSET, reader.bytes + HEADER_SIZE,
+                      size - HEADER_SIZE)) {
+    munmap(bytes, size);
+    return NULL;
+  }
+
+  reader.strings = (size_t*)malloc(sizeof(size_t) * (stringCount + 1));
+  if (reader.strings == NULL) exit(1);
+  reader.stringCount = stringCount;
+  for (int i = 0; i < stringCount; i++) {
+    reader.strings[i] = reader.offset;
+    skipString(&reader);
+  }
+
+  // The code refers to global variables by slot, so they have to end up in
+  // the same ones they were in when it was compiled.
+  for (int i = 0; i < globalCount && !reader.failed; i++) {
+    push(OBJ_VAL(poolString(&reader, readInt(&reader))));
+    if (globalSlot(AS_STRING(vm.stackTop[-1])) != i) reader.failed = true;
+    pop();
+  }
+
+  ObjFunction* function = NULL;
+  if (!reader.failed) function = readFunction(&reader);
+  free(reader.strings);
+
+  // The script has no closure to capture anything from.
+  if (function != NULL && function->upvalueCount != 0) reader.failed = true;
+
+  if (reader.failed) {
+    munmap(bytes, size);
+    return NULL;
+  }
+
+  mapping = (uint8_t*)bytes;
+  mappingSize = size;
+  return function;
+}
+
+// Returns true if the file at [path] starts like a compiled script.
+bool isCompiledFile(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+
+  uint32_t magic = 0;
+  size_t read = fread(&magic, sizeof(magic), 1, file);
+  fclose(file);
+  return read == 1 && magic == MAGIC;
+}
+
+// Compiles [source] and writes it to a compiled file at [path] instead of
+// running it.
+InterpretResult compileToFile(const char* source, const char* path) {
+  // The file needs every function's code.
+  bool lazy = vm.lazyCompile;
+  vm.lazyCompile = false;
+  ObjFunction* function = compile(source);
+  vm.lazyCompile = lazy;
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+  push(OBJ_VAL(function));
+  if (!saveCompiled(function, source, sourceKey(source), path)) {
+    fprintf(stderr, "Could not write \"%s\".\n", path);
+    exit(74);
+  }
+  pop();
+
+  return INTERPRET_OK;
+}
+
+// Runs the compiled script at [path].
+InterpretResult interpretCompiled(const char* path) {
+  ObjFunction* function = loadCompiled(path, NULL, 0);
+  if (function == NULL) {
+    fprintf(stderr, "Could not load \"%s\". It may have been compiled by "
+                    "a different build of clox.\n", path);
+    return INTERPRET_COMPILE_ERROR;
+  }
+
+  return interpretFunction(function);
+}
+
+// Runs [source], skipping the compiler if [directory] has a compiled copy
+// of it. Otherwise, it's compiled and a copy is stored there for next time.
+InterpretResult interpretCached(const char* source, const char* directory) {
+  uint64_t key = sourceKey(source);
+  size_t length = strlen(directory);
+  char* path = (char*)malloc(length + 32);
+  if (path == NULL) exit(1);
+  snprintf(path, length + 32, "%s/%016llx.loxc", directory,
+           (unsigned long long)key);
+
+  ObjFunction* function = loadCompiled(path, source, key);
+  if (function == NULL) {
+    bool lazy = vm.lazyCompile;
+    vm.lazyCompile = false;
+    function = compile(source);
+    vm.lazyCompile = lazy;
+    if (function == NULL) {
+      free(path);
+      return INTERPRET_COMPILE_ERROR;
+    }
+
+    // The cache is only an optimization, so failing to fill it is fine.
+    push(OBJ_VAL(function));
+    mkdir(directory, 0777);
+    saveCompiled(function, source, key, path);
+    pop();
+  }
+
+  free(path);
+  return interpretFunction(function);
+}
+
+// Unmaps the compiled file the script was loaded from, if any. Only safe
+// once the functions in it are gone.
+void freeCompiled() {
+  if (mapping == NULL) return;
+
+  munmap(mapping, mappingSize);
+  mapping = NULL;
+  mappingSize = 0;
+}
@@ -0,0 +1,15 @@
+//> Optimization omit
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+bool isCompiledFile(const char* path);
+InterpretResult compileToFile(const char* source, const char* path);
+InterpretResult interpretCompiled(const char* path);
+InterpretResult interpretCached(const char* source, const char* directory);
+void freeCompiled();
+
+#endif
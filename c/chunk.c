@@ -8,6 +8,9 @@
 //> Garbage Collection chunk-include-vm
 #include "vm.h"
 //< Garbage Collection chunk-include-vm
+//> Optimization omit
+#include "trace.h"
+//< Optimization omit
 
 void initChunk(Chunk* chunk) {
   chunk->count = 0;
@@ -15,20 +18,60 @@ void initChunk(Chunk* chunk) {
   chunk->code = NULL;
 //> chunk-null-lines
   chunk->lines = NULL;
+//> Optimization omit
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
+//< Optimization omit
 //< chunk-null-lines
 //> chunk-init-constant-array
   initValueArray(&chunk->constants);
 //< chunk-init-constant-array
+//> Optimization omit
+  chunk->caches = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->invokeCaches = NULL;
+  chunk->invokeCacheCount = 0;
+  chunk->invokeCacheCapacity = 0;
+  chunk->loopSites = NULL;
+  chunk->loopSiteCount = 0;
+  chunk->loopSiteCapacity = 0;
+  initValueArray(&chunk->hoisted);
+  chunk->mapped = false;
+//< Optimization omit
 }
 //> free-chunk
 void freeChunk(Chunk* chunk) {
+//> Optimization omit
+  if (!chunk->mapped) {
+//< Optimization omit
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 //> chunk-free-lines
+/* Chunks of Bytecode chunk-free-lines < Optimization omit
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
+*/
+//> Optimization omit
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+//< Optimization omit
 //< chunk-free-lines
+//> Optimization omit
+  }
+//< Optimization omit
 //> chunk-free-constants
   freeValueArray(&chunk->constants);
 //< chunk-free-constants
+//> Optimization omit
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+  FREE_ARRAY(InvokeCache, chunk->invokeCaches,
+             chunk->invokeCacheCapacity);
+#ifdef JIT
+  for (int i = 0; i < chunk->loopSiteCount; i++) {
+    freeTrace(chunk->loopSites[i].trace);
+  }
+#endif
+  FREE_ARRAY(LoopSite, chunk->loopSites, chunk->loopSiteCapacity);
+  freeValueArray(&chunk->hoisted);
+//< Optimization omit
   initChunk(chunk);
 }
 //< free-chunk
@@ -45,14 +88,31 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->code = GROW_ARRAY(uint8_t, chunk->code,
         oldCapacity, chunk->capacity);
 //> write-chunk-line
+/* Chunks of Bytecode write-chunk-line < Optimization omit
     chunk->lines = GROW_ARRAY(int, chunk->lines,
         oldCapacity, chunk->capacity);
+*/
 //< write-chunk-line
   }
 
   chunk->code[chunk->count] = byte;
 //> chunk-write-line
+/* Chunks of Bytecode chunk-write-line < Optimization omit
   chunk->lines[chunk->count] = line;
+*/
+//> Optimization omit
+  // The compiler sometimes takes code back off the end of the chunk, and
+  // the lines it came from with it.
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= chunk->count) {
+    chunk->lineCount--;
+  }
+
+  if (chunk->lineCount == 0 ||
+      chunk->lines[chunk->lineCount - 1].line != line) {
+    addLineStart(chunk, chunk->count, line);
+  }
+//< Optimization omit
 //< chunk-write-line
   chunk->count++;
 }
@@ -69,3 +129,203 @@ int addConstant(Chunk* chunk, Value value) {
   return chunk->constants.count - 1;
 }
 //< add-constant
+//> Optimization omit
+// Adds an empty inline cache to [chunk] and returns its index.
+int addInlineCache(Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+        oldCapacity, chunk->cacheCapacity);
+  }
+
+  InlineCache* cache = &chunk->caches[chunk->cacheCount];
+  cache->shape = NULL;
+  cache->transition = NULL;
+  cache->slot = -1;
+  cache->method = NIL_VAL;
+  return chunk->cacheCount++;
+}
+
+// Adds an empty method call cache to [chunk] and returns its index.
+int addInvokeCache(Chunk* chunk) {
+  if (chunk->invokeCacheCapacity < chunk->invokeCacheCount + 1) {
+    int oldCapacity = chunk->invokeCacheCapacity;
+    chunk->invokeCacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->invokeCaches = GROW_ARRAY(InvokeCache, chunk->invokeCaches,
+        oldCapacity, chunk->invokeCacheCapacity);
+  }
+
+  InvokeCache* cache = &chunk->invokeCaches[chunk->invokeCacheCount];
+  cache->count = 0;
+#ifdef DEBUG_INVOKE_STATS
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->megamorphic = 0;
+#endif
+  return chunk->invokeCacheCount++;
+}
+
+// Adds a counter for a loop to [chunk] and returns its index.
+int addLoopSite(Chunk* chunk) {
+  if (chunk->loopSiteCapacity < chunk->loopSiteCount + 1) {
+    int oldCapacity = chunk->loopSiteCapacity;
+    chunk->loopSiteCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->loopSites = GROW_ARRAY(LoopSite, chunk->loopSites,
+        oldCapacity, chunk->loopSiteCapacity);
+  }
+
+  LoopSite* site = &chunk->loopSites[chunk->loopSiteCount];
+  site->hotness = 0;
+  site->aborts = 0;
+  site->trace = NULL;
+  return chunk->loopSiteCount++;
+}
+
+// Forgets the values of [count] of the loads hoisted out of loops in
+// [chunk], starting at [first], so that they're loaded again.
+void forgetHoisted(Chunk* chunk, int first, int count) {
+  for (int i = first; i < first + count; i++) {
+    chunk->hoisted.values[i] = UNDEFINED_VAL;
+  }
+}
+
+// Records that the code in [chunk] from [offset] on came from [line].
+void addLineStart(Chunk* chunk, int offset, int line) {
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+        oldCapacity, chunk->lineCapacity);
+  }
+
+  LineStart* start = &chunk->lines[chunk->lineCount++];
+  start->offset = offset;
+  start->line = line;
+}
+
+// Returns the line that the instruction at [offset] in [chunk] came from.
+// Only error messages and debugging output need it, so it's a search.
+int getLine(Chunk* chunk, int offset) {
+  int low = 0;
+  int high = chunk->lineCount - 1;
+  while (low < high) {
+    int middle = low + (high - low + 1) / 2;
+    if (chunk->lines[middle].offset <= offset) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+
+  return chunk->lines[low].line;
+}
+
+// Returns the size of an OP_CLOSURE instruction for the function at
+// [constant]. Each captured upvalue adds three operand bytes: whether it's
+// a local and its two-byte index.
+static int closureSize(Chunk* chunk, int constant) {
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+  return 2 + function->upvalueCount * 3;
+}
+
+// Returns the number of bytes taken up by the instruction at [offset],
+// including its operands. An OP_WIDE prefix is counted together with the
+// instruction it widens.
+int instructionSize(Chunk* chunk, int offset) {
+  switch (chunk->code[offset]) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+      return 1;
+
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_SUPER:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_SMALL_INT:
+    case OP_POPN:
+    case OP_PICK:
+      return 2;
+
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_ADD_LOCALS:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_SET_HOISTED:
+      return 3;
+
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_THIS_FIELD:
+    case OP_MOVE:
+    case OP_CONSTANT_LONG:
+    case OP_ENTER_LOOP:
+    case OP_GET_HOISTED:
+      return 4;
+
+    case OP_LOOP:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+    case OP_ADD_REG:
+    case OP_SUBTRACT_REG:
+    case OP_MULTIPLY_REG:
+    case OP_DIVIDE_REG:
+    case OP_EQUAL_REG:
+    case OP_GREATER_REG:
+    case OP_LESS_REG:
+      return 5;
+
+    case OP_CLOSURE:
+      return closureSize(chunk, chunk->code[offset + 1]);
+
+    case OP_WIDE:
+      // The prefix and the instruction it widens go together.
+      if (chunk->code[offset + 3] == OP_CLOSURE) {
+        int constant = (chunk->code[offset + 1] << 16) |
+                       (chunk->code[offset + 2] << 8) |
+                       chunk->code[offset + 4];
+        return 3 + closureSize(chunk, constant);
+      }
+
+      return 3 + instructionSize(chunk, offset + 3);
+  }
+
+  return 1; // Unreachable.
+}
+//< Optimization omit
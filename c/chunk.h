@@ -91,6 +91,73 @@ typedef enum {
   OP_CLOSE_UPVALUE,
 //< Closures close-upvalue-op
   OP_RETURN,
+//> Optimization omit
+  // Superinstructions. The compiler never emits these directly. The peephole
+  // optimizer fuses common instruction sequences into them.
+  OP_SMALL_INT,
+  OP_POPN,
+  OP_ADD_LOCALS,
+  OP_GET_THIS_FIELD,
+  OP_POP_JUMP_IF_FALSE,
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_NOT_LESS,
+
+  // Copies the value the operand counts down from the top of the stack,
+  // where the same value was computed before. See reuseValues().
+  OP_PICK,
+
+  // Property loads hoisted out of a loop. OP_ENTER_LOOP forgets the values
+  // of the range of hoisted loads its first two operand bytes start and its
+  // third counts. OP_GET_HOISTED pushes the value of the one its first two
+  // name if it's been loaded since and skips the number of bytes in its
+  // third. Otherwise, the loads after it run, and OP_SET_HOISTED remembers
+  // what they loaded. See hoistLoads().
+  OP_ENTER_LOOP,
+  OP_GET_HOISTED,
+  OP_SET_HOISTED,
+
+  // Specialized forms that generic instructions rewrite themselves into
+  // once they've seen the types of their operands. See run().
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+
+  // Calls whose result the function returns right away. The callee reuses
+  // the caller's frame if it can. See tailCall(). The invokes have the same
+  // operands as OP_INVOKE and OP_SUPER_INVOKE.
+  OP_TAIL_CALL,
+  OP_TAIL_INVOKE,
+  OP_TAIL_SUPER_INVOKE,
+
+  // Register instructions, which only the compiler for the register-based
+  // instruction set emits. Each names where its operands are instead of
+  // taking them off the stack. The first operand byte holds the kinds of
+  // the operands (an OperandKind for each, the left in the low two bits),
+  // the second is the local slot to store the result in, or zero to push
+  // it, and the rest are the operands' indexes.
+  OP_ADD_REG,
+  OP_SUBTRACT_REG,
+  OP_MULTIPLY_REG,
+  OP_DIVIDE_REG,
+  OP_EQUAL_REG,
+  OP_GREATER_REG,
+  OP_LESS_REG,
+  // Stores its one operand in a local slot.
+  OP_MOVE,
+
+  // Loads a constant whose index doesn't fit in a byte. The index takes up
+  // three operand bytes.
+  OP_CONSTANT_LONG,
+  // A prefix for the instruction after it. Its two operand bytes are the
+  // high bytes of that instruction's first operand: a constant index or a
+  // local slot, which then has 24 bits, or a jump offset, which then has 32.
+  OP_WIDE,
+//< Optimization omit
 //> Classes and Instances class-op
   OP_CLASS,
 //< Classes and Instances class-op
@@ -102,6 +169,84 @@ typedef enum {
 //< Methods and Initializers method-op
 } OpCode;
 //< op-enum
+//> Optimization omit
+
+// Where a register instruction reads an operand from.
+typedef enum {
+  // A slot in the frame, whether it holds a local or a temporary.
+  OPERAND_REGISTER,
+  // An entry in the chunk's constant table.
+  OPERAND_CONSTANT,
+  // The top of the stack, which the instruction pops. Only the left operand
+  // can be there, so that the operands are still evaluated in order.
+  OPERAND_STACK,
+  // A whole number from 0 to 255, which is the index itself. The peephole
+  // optimizer rewrites constants that are into these.
+  OPERAND_SMALL_INT
+} OperandKind;
+
+#define LEFT_KIND(kinds) ((kinds) & 3)
+#define RIGHT_KIND(kinds) ((kinds) >> 2)
+#define OPERAND_KINDS(left, right) ((uint8_t)((left) | ((right) << 2)))
+
+// Remembers how the last receiver seen by a property instruction was laid
+// out, so that the next receiver with the same shape can skip the hash table
+// lookups.
+typedef struct {
+  // The receiver shape the entry was filled in for, or NULL if it's empty.
+  struct ObjShape* shape;
+
+  // When setting a field the receiver didn't have yet, the shape it moves
+  // to. Otherwise NULL.
+  struct ObjShape* transition;
+
+  // The slot of the field, or -1 if the name resolved to a method.
+  int slot;
+
+  // The method the name resolved to, if it did. A class's methods are all
+  // defined before any instance of it exists, so this can't go stale.
+  Value method;
+} InlineCache;
+
+// The number of receiver types a method call site remembers before it gives
+// up and goes through the VM's global method cache instead.
+#define INVOKE_CACHE_SIZE 4
+
+typedef struct {
+  // The shape of the receiver, or for a super call, the superclass.
+  Obj* key;
+  Value method;
+} InvokeCacheEntry;
+
+typedef struct {
+  InvokeCacheEntry entries[INVOKE_CACHE_SIZE];
+  int count;
+#ifdef DEBUG_INVOKE_STATS
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t megamorphic;
+#endif
+} InvokeCache;
+
+// Counts trips around a loop so the VM can tell when it's hot enough to
+// trace, and holds the trace once it is. See trace.c.
+typedef struct {
+  int hotness;
+
+  // How many times recording a trace for the loop gave up.
+  int aborts;
+
+  struct Trace* trace;
+} LoopSite;
+
+// Marks where the code from one line starts in a chunk. The code from
+// [offset] up to the next LineStart's offset came from [line]. Consecutive
+// instructions from the same line share one entry.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+//< Optimization omit
 //> chunk-struct
 
 typedef struct {
@@ -111,11 +256,37 @@ typedef struct {
 //< count-and-capacity
   uint8_t* code;
 //> chunk-lines
+/* Chunks of Bytecode chunk-lines < Optimization omit
   int* lines;
+*/
+//> Optimization omit
+  LineStart* lines;
+  int lineCount;
+  int lineCapacity;
+//< Optimization omit
 //< chunk-lines
 //> chunk-constants
   ValueArray constants;
 //< chunk-constants
+//> Optimization omit
+  InlineCache* caches;
+  int cacheCount;
+  int cacheCapacity;
+  InvokeCache* invokeCaches;
+  int invokeCacheCount;
+  int invokeCacheCapacity;
+  LoopSite* loopSites;
+  int loopSiteCount;
+  int loopSiteCapacity;
+
+  // The values of the loads hoisted out of the chunk's loops, or undefined
+  // where they haven't been loaded since the loop was entered.
+  ValueArray hoisted;
+
+  // Whether the code and lines point into a compiled file that was mapped
+  // into memory, which owns them. See cache.c.
+  bool mapped;
+//< Optimization omit
 } Chunk;
 //< chunk-struct
 //> init-chunk-h
@@ -134,5 +305,14 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line);
 //> add-constant-h
 int addConstant(Chunk* chunk, Value value);
 //< add-constant-h
+//> Optimization omit
+int addInlineCache(Chunk* chunk);
+int addInvokeCache(Chunk* chunk);
+int addLoopSite(Chunk* chunk);
+void forgetHoisted(Chunk* chunk, int first, int count);
+int instructionSize(Chunk* chunk, int offset);
+void addLineStart(Chunk* chunk, int offset, int line);
+int getLine(Chunk* chunk, int offset);
+//< Optimization omit
 
 #endif
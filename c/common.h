@@ -36,3 +36,44 @@
 #undef DEBUG_STRESS_GC
 #undef DEBUG_LOG_GC
 //< omit
+//> Optimization omit
+
+// Dispatch instructions by jumping straight through a table of label
+// addresses instead of a switch. It's a GCC and Clang extension, so other
+// compilers use the portable switch. Tracing execution needs a single spot
+// to hook every instruction, so that uses the switch too.
+#if defined(__GNUC__) && !defined(DEBUG_TRACE_EXECUTION)
+#define COMPUTED_GOTO
+#endif
+
+// Full collections can mark the heap on several threads. That needs POSIX
+// threads and GCC-style atomics.
+#if defined(__GNUC__) && (defined(__unix__) || defined(__APPLE__))
+#define PARALLEL_MARK
+#endif
+
+// Hot functions are compiled to native code. The compiler only knows how to
+// generate x86-64 for NaN-boxed values, and tracing needs the interpreter.
+#if defined(__x86_64__) && defined(NAN_BOXING) && \
+    (defined(__unix__) || defined(__APPLE__)) && \
+    !defined(DEBUG_TRACE_EXECUTION)
+#define JIT
+#endif
+
+// Compile to three-address instructions that read locals and constants where
+// they are instead of pushing them, and store straight into locals. `make
+// registerlox` defines it. See registerBinary() in compiler.c.
+// #define REGISTER_VM
+
+// Define this to count the hash table entries examined by lookups and print
+// the total when the VM shuts down.
+// #define DEBUG_COUNT_PROBES
+
+// Define this to count how often each method call site hits its inline
+// cache and print the rates when the VM shuts down.
+// #define DEBUG_INVOKE_STATS
+
+// Define this to print how many times each function's instructions
+// specialized themselves and fell back when the VM shuts down.
+// #define DEBUG_QUICKEN_STATS
+//< Optimization omit
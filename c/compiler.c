@@ -12,6 +12,10 @@
 //> Garbage Collection compiler-include-memory
 #include "memory.h"
 //< Garbage Collection compiler-include-memory
+//> Optimization omit
+#include "nursery.h"
+#include "optimizer.h"
+//< Optimization omit
 #include "scanner.h"
 //> Compiling Expressions include-debug
 
@@ -74,9 +78,30 @@ typedef struct {
 //< Closures is-captured-field
 } Local;
 //< Local Variables local-struct
+//> Optimization omit
+
+// An entry in the compiler's map from the values in the chunk's constant
+// table to their indexes.
+typedef struct {
+  Value value;
+
+  // The constant's index, -1 if the entry has never been used, or -2 if the
+  // constant was removed from the table.
+  int index;
+
+  // How many times the compiler has asked for the constant, less the loads
+  // of it that constant folding has taken back out.
+  int uses;
+} ConstantEntry;
+//< Optimization omit
 //> Closures upvalue-struct
 typedef struct {
+/* Closures upvalue-struct < Optimization omit
   uint8_t index;
+*/
+//> Optimization omit
+  uint16_t index;
+//< Optimization omit
   bool isLocal;
 } Upvalue;
 //< Closures upvalue-struct
@@ -106,12 +131,52 @@ typedef struct Compiler {
   FunctionType type;
 
 //< Calls and Functions function-fields
+/* Local Variables compiler-struct < Optimization omit
   Local locals[UINT8_COUNT];
+*/
+//> Optimization omit
+  // Grown as locals are declared. A function can have more than a byte can
+  // name, which take an OP_WIDE prefix.
+  Local* locals;
+  int localCapacity;
+//< Optimization omit
   int localCount;
 //> Closures upvalues-array
   Upvalue upvalues[UINT8_COUNT];
 //< Closures upvalues-array
   int scopeDepth;
+//> Optimization omit
+
+  // Where the last OP_CALL, OP_INVOKE or OP_SUPER_INVOKE starts, so that a
+  // return statement right after it can turn it into a tail call.
+  int lastCall;
+
+  // Where the code for the left operand of the infix operator being
+  // compiled starts.
+  int operandStart;
+
+  // Maps each value in the constant table to its index, so that every load
+  // of the same value shares one entry.
+  ConstantEntry* constants;
+  int constantCount;
+  int constantCapacity;
+
+  // The jumps too long for their operand, which optimizeChunk() widens.
+  FarJump* farJumps;
+  int farJumpCount;
+  int farJumpCapacity;
+#ifdef REGISTER_VM
+
+  // Where the last register instruction that pushes its result starts, or
+  // -1 if a jump has landed after it since.
+  int registerResult;
+
+  // Where the last OP_SET_LOCAL is and where the code for the value it
+  // stores starts, or -1 if a jump has landed after it since.
+  int localStore;
+  int storedValue;
+#endif
+//< Optimization omit
 } Compiler;
 //< Local Variables compiler-struct
 //> Methods and Initializers class-compiler-struct
@@ -132,6 +197,30 @@ Compiler* current = NULL;
 //> Methods and Initializers current-class
 ClassCompiler* currentClass = NULL;
 //< Methods and Initializers current-class
+//> Optimization omit
+
+// What compileLazy() needs to compile the body of a function that --lazy
+// skipped over, since the compilers around it are gone by then.
+typedef struct LazyFunction {
+  // Where the function's parameter list starts in the source.
+  const char* start;
+  int line;
+
+  FunctionType type;
+
+  // Whether the function is inside a class, and if so, whether the class
+  // has a superclass.
+  bool inClass;
+  bool hasSuperclass;
+
+  // The name of the variable each of the function's upvalues captures.
+  Token* upvalueNames;
+} LazyFunction;
+
+// The function compileLazy() is compiling the body of, which the next call
+// to initCompiler() picks up instead of creating a new one.
+static ObjFunction* resumedFunction = NULL;
+//< Optimization omit
 //> Compiling Expressions compiling-chunk
 /* Compiling Expressions compiling-chunk < Calls and Functions current-chunk
 Chunk* compilingChunk;
@@ -226,15 +315,52 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
   emitByte(byte2);
 }
 //< Compiling Expressions emit-bytes
+//> Optimization omit
+// Records that the jump instruction at [offset] lands on [target], which is
+// too far away for its operand.
+static void addFarJump(int offset, int target) {
+  if (current->farJumpCapacity < current->farJumpCount + 1) {
+    int oldCapacity = current->farJumpCapacity;
+    current->farJumpCapacity = GROW_CAPACITY(oldCapacity);
+    current->farJumps = GROW_ARRAY(FarJump, current->farJumps,
+        oldCapacity, current->farJumpCapacity);
+  }
+
+  FarJump* jump = &current->farJumps[current->farJumpCount++];
+  jump->offset = offset;
+  jump->target = target;
+}
+//< Optimization omit
 //> Jumping Back and Forth emit-loop
 static void emitLoop(int loopStart) {
   emitByte(OP_LOOP);
 
+/* Jumping Back and Forth emit-loop < Optimization omit
   int offset = currentChunk()->count - loopStart + 2;
+*/
+//> Optimization omit
+  // The offset also skips back over the loop site index.
+  int offset = currentChunk()->count - loopStart + 4;
+//< Optimization omit
+/* Jumping Back and Forth emit-loop < Optimization omit
   if (offset > UINT16_MAX) error("Loop body too large.");
+*/
+//> Optimization omit
+  if (offset > UINT16_MAX) {
+    addFarJump(currentChunk()->count - 1, loopStart);
+    offset = 0;
+  }
+//< Optimization omit
 
   emitByte((offset >> 8) & 0xff);
   emitByte(offset & 0xff);
+//> Optimization omit
+
+  int site = addLoopSite(currentChunk());
+  if (site > UINT16_MAX) error("Too many loops in one function.");
+  emitByte((site >> 8) & 0xff);
+  emitByte(site & 0xff);
+//< Optimization omit
 }
 //< Jumping Back and Forth emit-loop
 //> Jumping Back and Forth emit-jump
@@ -261,7 +387,89 @@ static void emitReturn() {
   emitByte(OP_RETURN);
 }
 //< Compiling Expressions emit-return
+//> Optimization omit
+// How many constants a chunk can have: as many as a three-byte index can
+// reach.
+#define MAX_CONSTANTS (1 << 24)
+
+// Constants are shared only when they're the same bits, so that 0 and -0
+// stay apart.
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+  return a == b;
+#else
+  if (a.type != b.type) return false;
+  if (IS_NUMBER(a)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+
+  return valuesEqual(a, b);
+#endif
+}
+
+static uint32_t hashConstant(Value value) {
+  if (IS_STRING(value)) return AS_STRING(value)->hash;
+
+  uint64_t bits = 0;
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(double));
+  } else if (IS_OBJ(value)) {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  }
+
+  // Whole numbers only differ in their high bits, so mix those down.
+  bits *= 0x9e3779b97f4a7c15ull;
+  return (uint32_t)(bits >> 32);
+}
+
+// Returns the entry for [value] in [entries], or if it isn't there, the
+// entry to put it in.
+static ConstantEntry* findConstant(ConstantEntry* entries, int capacity,
+                                   Value value) {
+  uint32_t index = hashConstant(value) & (capacity - 1);
+  ConstantEntry* tombstone = NULL;
+  for (;;) {
+    ConstantEntry* entry = &entries[index];
+    if (entry->index == -1) {
+      return tombstone != NULL ? tombstone : entry;
+    } else if (entry->index == -2) {
+      if (tombstone == NULL) tombstone = entry;
+    } else if (sameConstant(entry->value, value)) {
+      return entry;
+    }
+
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growConstants() {
+  int capacity = GROW_CAPACITY(current->constantCapacity);
+  ConstantEntry* entries = ALLOCATE(ConstantEntry, capacity);
+  for (int i = 0; i < capacity; i++) {
+    entries[i].index = -1;
+  }
+
+  // Tombstones are left behind.
+  current->constantCount = 0;
+  for (int i = 0; i < current->constantCapacity; i++) {
+    ConstantEntry* entry = &current->constants[i];
+    if (entry->index < 0) continue;
+
+    *findConstant(entries, capacity, entry->value) = *entry;
+    current->constantCount++;
+  }
+
+  FREE_ARRAY(ConstantEntry, current->constants, current->constantCapacity);
+  current->constants = entries;
+  current->constantCapacity = capacity;
+}
+
+//< Optimization omit
 //> Compiling Expressions make-constant
+/* Compiling Expressions make-constant < Optimization omit
 static uint8_t makeConstant(Value value) {
   int constant = addConstant(currentChunk(), value);
   if (constant > UINT8_MAX) {
@@ -271,23 +479,105 @@ static uint8_t makeConstant(Value value) {
 
   return (uint8_t)constant;
 }
+*/
+//> Optimization omit
+static int makeConstant(Value value) {
+  if ((current->constantCount + 1) * 4 > current->constantCapacity * 3) {
+    // Growing the map can collect garbage, and [value] may be new.
+    push(value);
+    growConstants();
+    pop();
+  }
+
+  ConstantEntry* entry = findConstant(current->constants,
+                                      current->constantCapacity, value);
+  if (entry->index >= 0) {
+    entry->uses++;
+    return entry->index;
+  }
+
+  int constant = addConstant(currentChunk(), value);
+  if (constant >= MAX_CONSTANTS) {
+    error("Too many constants in one chunk.");
+    return 0;
+  }
+
+  // Reusing a tombstone doesn't change how full the map is.
+  if (entry->index == -1) current->constantCount++;
+  entry->value = value;
+  entry->index = constant;
+  entry->uses = 1;
+  return constant;
+}
+//< Optimization omit
 //< Compiling Expressions make-constant
 //> Compiling Expressions emit-constant
 static void emitConstant(Value value) {
+/* Compiling Expressions emit-constant < Optimization omit
   emitBytes(OP_CONSTANT, makeConstant(value));
+*/
+//> Optimization omit
+  int constant = makeConstant(value);
+  if (constant <= UINT8_MAX) {
+    emitBytes(OP_CONSTANT, (uint8_t)constant);
+  } else {
+    emitByte(OP_CONSTANT_LONG);
+    emitByte((constant >> 16) & 0xff);
+    emitBytes((constant >> 8) & 0xff, constant & 0xff);
+  }
+//< Optimization omit
 }
 //< Compiling Expressions emit-constant
+//> Optimization omit
+// Emits [op] with [operand], a constant index or a local slot, as its first
+// operand. If it doesn't fit in a byte, an OP_WIDE prefix carries the rest.
+static void emitWithOperand(uint8_t op, int operand) {
+  if (operand > UINT8_MAX) {
+    emitByte(OP_WIDE);
+    emitBytes((operand >> 16) & 0xff, (operand >> 8) & 0xff);
+  }
+
+  emitBytes(op, operand & 0xff);
+}
+//< Optimization omit
+//> Optimization omit
+// Emits the two-byte index of the inline cache for the instruction that was
+// just emitted.
+static void emitCacheIndex(int cache) {
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one function.");
+  }
+
+  emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+//< Optimization omit
 //> Jumping Back and Forth patch-jump
 static void patchJump(int offset) {
   // -2 to adjust for the bytecode for the jump offset itself.
   int jump = currentChunk()->count - offset - 2;
 
+/* Jumping Back and Forth patch-jump < Optimization omit
   if (jump > UINT16_MAX) {
     error("Too much code to jump over.");
   }
+*/
+//> Optimization omit
+  if (jump > UINT16_MAX) {
+    addFarJump(offset - 1, currentChunk()->count);
+    jump = 0;
+  }
+//< Optimization omit
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+//> Optimization omit
+#ifdef REGISTER_VM
+
+  // Code that's jumped to can't be folded into the code before it.
+  current->registerResult = -1;
+  current->localStore = -1;
+#endif
+//< Optimization omit
 }
 //< Jumping Back and Forth patch-jump
 //> Local Variables init-compiler
@@ -304,12 +594,44 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 //< Calls and Functions init-compiler
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+//> Optimization omit
+  compiler->locals = ALLOCATE(Local, 8);
+  compiler->localCapacity = 8;
+  compiler->lastCall = -1;
+  compiler->operandStart = 0;
+  compiler->constants = NULL;
+  compiler->constantCount = 0;
+  compiler->constantCapacity = 0;
+  compiler->farJumps = NULL;
+  compiler->farJumpCount = 0;
+  compiler->farJumpCapacity = 0;
+#ifdef REGISTER_VM
+  compiler->registerResult = -1;
+  compiler->localStore = -1;
+  compiler->storedValue = -1;
+#endif
+//< Optimization omit
 //> Calls and Functions init-function
+/* Calls and Functions init-function < Optimization omit
   compiler->function = newFunction();
+*/
+//> Optimization omit
+  if (resumedFunction != NULL) {
+    compiler->function = resumedFunction;
+    resumedFunction = NULL;
+  } else {
+    compiler->function = newFunction();
+  }
+//< Optimization omit
 //< Calls and Functions init-function
   current = compiler;
 //> Calls and Functions init-function-name
+/* Calls and Functions init-function-name < Optimization omit
   if (type != TYPE_SCRIPT) {
+*/
+//> Optimization omit
+  if (type != TYPE_SCRIPT && current->function->name == NULL) {
+//< Optimization omit
     current->function->name = copyString(parser.previous.start,
                                          parser.previous.length);
   }
@@ -349,6 +671,19 @@ static ObjFunction* endCompiler() {
   ObjFunction* function = current->function;
 
 //< Calls and Functions end-function
+//> Optimization omit
+  if (!parser.hadError) {
+    int depth = optimizeChunk(currentChunk(), function->arity,
+                              vm.optimizeLevel, current->farJumps,
+                              current->farJumpCount);
+    function->frameSize = depth + STACK_HEADROOM;
+  }
+
+  FREE_ARRAY(Local, current->locals, current->localCapacity);
+  FREE_ARRAY(ConstantEntry, current->constants, current->constantCapacity);
+  FREE_ARRAY(FarJump, current->farJumps, current->farJumpCapacity);
+
+//< Optimization omit
 //> dump-chunk
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
@@ -411,11 +746,43 @@ static void parsePrecedence(Precedence precedence);
 
 //< Compiling Expressions forward-declarations
 //> Global Variables identifier-constant
+/* Global Variables identifier-constant < Optimization omit
 static uint8_t identifierConstant(Token* name) {
+*/
+//> Optimization omit
+static int identifierConstant(Token* name) {
+//< Optimization omit
   return makeConstant(OBJ_VAL(copyString(name->start,
                                          name->length)));
 }
 //< Global Variables identifier-constant
+//> Optimization omit
+// Adds the name of global variable [name] to the constant table, like
+// identifierConstant(), and hands the variable a slot in vm.globalValues if
+// this is the first time the name is used. Running out of slots is reported
+// at the name, as it is for locals and upvalues.
+static int globalConstant(Token* name) {
+  int constant = identifierConstant(name);
+  if (globalSlot(AS_STRING(currentChunk()->constants.values[constant])) ==
+      -1) {
+    errorAt(name, "Too many global variables.");
+  }
+
+  return constant;
+}
+
+// Emits global variable instruction [op] for the name in [constant], which
+// globalConstant() added. The instruction names the variable by its slot.
+static void emitGlobal(uint8_t op, int constant) {
+  // If there was no room, globalConstant() already said so.
+  int slot = globalSlot(AS_STRING(currentChunk()->constants.values[constant]));
+  if (slot == -1) slot = 0;
+
+  emitByte(op);
+  emitByte((slot >> 8) & 0xff);
+  emitByte(slot & 0xff);
+}
+//< Optimization omit
 //> Local Variables identifiers-equal
 static bool identifiersEqual(Token* a, Token* b) {
   if (a->length != b->length) return false;
@@ -440,8 +807,13 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 //< Local Variables resolve-local
 //> Closures add-upvalue
+/* Closures add-upvalue < Optimization omit
 static int addUpvalue(Compiler* compiler, uint8_t index,
                       bool isLocal) {
+*/
+//> Optimization omit
+static int addUpvalue(Compiler* compiler, int index, bool isLocal) {
+//< Optimization omit
   int upvalueCount = compiler->function->upvalueCount;
 //> existing-upvalue
 
@@ -465,22 +837,52 @@ static int addUpvalue(Compiler* compiler, uint8_t index,
   return compiler->function->upvalueCount++;
 }
 //< Closures add-upvalue
+//> Optimization omit
+// Looks for [name] among the upvalues that the function being compiled by
+// compileLazy() captured when it was skipped over.
+static int lazyUpvalue(ObjFunction* function, Token* name) {
+  LazyFunction* lazy = function->lazy;
+  for (int i = 0; i < function->upvalueCount; i++) {
+    if (identifiersEqual(name, &lazy->upvalueNames[i])) return i;
+  }
+
+  return -1;
+}
+//< Optimization omit
 //> Closures resolve-upvalue
 static int resolveUpvalue(Compiler* compiler, Token* name) {
+/* Closures resolve-upvalue < Optimization omit
   if (compiler->enclosing == NULL) return -1;
+*/
+//> Optimization omit
+  if (compiler->enclosing == NULL) {
+    if (compiler->function->lazy == NULL) return -1;
+    return lazyUpvalue(compiler->function, name);
+  }
+//< Optimization omit
 
   int local = resolveLocal(compiler->enclosing, name);
   if (local != -1) {
 //> mark-local-captured
     compiler->enclosing->locals[local].isCaptured = true;
 //< mark-local-captured
+/* Closures resolve-upvalue < Optimization omit
     return addUpvalue(compiler, (uint8_t)local, true);
+*/
+//> Optimization omit
+    return addUpvalue(compiler, local, true);
+//< Optimization omit
   }
 
 //> resolve-upvalue-recurse
   int upvalue = resolveUpvalue(compiler->enclosing, name);
   if (upvalue != -1) {
+/* Closures resolve-upvalue-recurse < Optimization omit
     return addUpvalue(compiler, (uint8_t)upvalue, false);
+*/
+//> Optimization omit
+    return addUpvalue(compiler, upvalue, false);
+//< Optimization omit
   }
   
 //< resolve-upvalue-recurse
@@ -490,12 +892,26 @@ static int resolveUpvalue(Compiler* compiler, Token* name) {
 //> Local Variables add-local
 static void addLocal(Token name) {
 //> too-many-locals
+/* Local Variables too-many-locals < Optimization omit
   if (current->localCount == UINT8_COUNT) {
+*/
+//> Optimization omit
+  if (current->localCount > UINT16_MAX) {
+//< Optimization omit
     error("Too many local variables in function.");
     return;
   }
 
 //< too-many-locals
+//> Optimization omit
+  if (current->localCapacity < current->localCount + 1) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(Local, current->locals,
+        oldCapacity, current->localCapacity);
+  }
+
+//< Optimization omit
   Local* local = &current->locals[current->localCount++];
   local->name = name;
 /* Local Variables add-local < Local Variables declare-undefined
@@ -531,7 +947,12 @@ static void declareVariable() {
 }
 //< Local Variables declare-variable
 //> Global Variables parse-variable
+/* Global Variables parse-variable < Optimization omit
 static uint8_t parseVariable(const char* errorMessage) {
+*/
+//> Optimization omit
+static int parseVariable(const char* errorMessage) {
+//< Optimization omit
   consume(TOKEN_IDENTIFIER, errorMessage);
 //> Local Variables parse-local
 
@@ -539,7 +960,12 @@ static uint8_t parseVariable(const char* errorMessage) {
   if (current->scopeDepth > 0) return 0;
 
 //< Local Variables parse-local
+/* Global Variables parse-variable < Optimization omit
   return identifierConstant(&parser.previous);
+*/
+//> Optimization omit
+  return globalConstant(&parser.previous);
+//< Optimization omit
 }
 //< Global Variables parse-variable
 //> Local Variables mark-initialized
@@ -552,7 +978,12 @@ static void markInitialized() {
 }
 //< Local Variables mark-initialized
 //> Global Variables define-variable
+/* Global Variables define-variable < Optimization omit
 static void defineVariable(uint8_t global) {
+*/
+//> Optimization omit
+static void defineVariable(int global) {
+//< Optimization omit
 //> Local Variables define-variable
   if (current->scopeDepth > 0) {
 //> define-local
@@ -562,7 +993,12 @@ static void defineVariable(uint8_t global) {
   }
 
 //< Local Variables define-variable
+/* Global Variables define-variable < Optimization omit
   emitBytes(OP_DEFINE_GLOBAL, global);
+*/
+//> Optimization omit
+  emitGlobal(OP_DEFINE_GLOBAL, global);
+//< Optimization omit
 }
 //< Global Variables define-variable
 //> Calls and Functions argument-list
@@ -583,8 +1019,205 @@ static uint8_t argumentList() {
   return argCount;
 }
 //< Calls and Functions argument-list
+//> Optimization omit
+// Constant folding. When every operand of an operator is a constant, the
+// compiler evaluates it and replaces the code for the operands with the
+// result. Only operations that can't fail are folded, so a runtime error is
+// still reported at runtime, with the same message.
+
+// Returns the index of the constant that the instruction at [offset] loads
+// from the constant table, or -1 if it isn't one that does.
+static int constantIndexAt(int offset) {
+  uint8_t* code = &currentChunk()->code[offset];
+  switch (code[0]) {
+    case OP_CONSTANT: return code[1];
+    case OP_CONSTANT_LONG: return (code[1] << 16) | (code[2] << 8) | code[3];
+    default: return -1;
+  }
+}
+
+// If the code from [start] to [end] is a single instruction that pushes a
+// constant, stores the constant in [value].
+static bool constantAt(int start, int end, Value* value) {
+  Chunk* chunk = currentChunk();
+  if (end - start == 1) {
+    switch (chunk->code[start]) {
+      case OP_NIL:   *value = NIL_VAL; return true;
+      case OP_TRUE:  *value = BOOL_VAL(true); return true;
+      case OP_FALSE: *value = BOOL_VAL(false); return true;
+      default: return false;
+    }
+  }
+
+  int size = chunk->code[start] == OP_CONSTANT ? 2 : 4;
+  int constant = constantIndexAt(start);
+  if (constant != -1 && end - start == size) {
+    *value = chunk->constants.values[constant];
+    return true;
+  }
+
+  return false;
+}
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Removes the code from [start] to the end of the chunk, which either can
+// never run or is being replaced.
+static void discardCode(int start) {
+  currentChunk()->count = start;
+  if (current->lastCall >= start) current->lastCall = -1;
+
+  int farJumpCount = 0;
+  for (int i = 0; i < current->farJumpCount; i++) {
+    if (current->farJumps[i].offset < start) {
+      current->farJumps[farJumpCount++] = current->farJumps[i];
+    }
+  }
+  current->farJumpCount = farJumpCount;
+#ifdef REGISTER_VM
+  current->registerResult = -1;
+  current->localStore = -1;
+#endif
+}
+
+// Removes the code for the constant operand at [offset] and everything
+// after it. If the operand was the last constant added to the table and
+// nothing else uses it, that goes too, so folding doesn't use up more of the
+// table than the result needs.
+static void discardOperand(int offset) {
+  Chunk* chunk = currentChunk();
+  int constant = constantIndexAt(offset);
+  if (constant != -1) {
+    ConstantEntry* entry = findConstant(current->constants,
+        current->constantCapacity, chunk->constants.values[constant]);
+    entry->uses--;
+    if (entry->uses == 0 && constant == chunk->constants.count - 1) {
+      chunk->constants.count--;
+      entry->index = -2;
+    }
+  }
+
+  discardCode(offset);
+}
+
+static void emitFolded(Value value) {
+  if (IS_NIL(value)) {
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(value);
+  }
+}
+
+static Value concatenateConstants(ObjString* a, ObjString* b) {
+  // The operands are still in the constant table, so a collection here
+  // won't free them.
+  int length = a->length + b->length;
+  char* chars = ALLOCATE(char, length + 1);
+  memcpy(chars, a->chars, a->length);
+  memcpy(chars + a->length, b->chars, b->length);
+  chars[length] = '\0';
+  return OBJ_VAL(takeString(chars, length));
+}
+
+// Folds the binary operator [operatorType] if the code for its operands,
+// which starts at [leftStart] and [rightStart], pushes two constants it can
+// be applied to. Returns false if it doesn't.
+static bool foldBinary(TokenType operatorType, int leftStart,
+                       int rightStart) {
+  Value a;
+  Value b;
+  if (!constantAt(leftStart, rightStart, &a) ||
+      !constantAt(rightStart, currentChunk()->count, &b)) {
+    return false;
+  }
+
+  Value result;
+  if (operatorType == TOKEN_EQUAL_EQUAL) {
+    result = BOOL_VAL(valuesEqual(a, b));
+  } else if (operatorType == TOKEN_BANG_EQUAL) {
+    result = BOOL_VAL(!valuesEqual(a, b));
+  } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    // Like the instructions the operators compile to, ">=" and "<=" are
+    // the negations of "<" and ">", which matters for NaN.
+    switch (operatorType) {
+      case TOKEN_GREATER:       result = BOOL_VAL(x > y); break;
+      case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+      case TOKEN_LESS:          result = BOOL_VAL(x < y); break;
+      case TOKEN_LESS_EQUAL:    result = BOOL_VAL(!(x > y)); break;
+      case TOKEN_PLUS:          result = NUMBER_VAL(x + y); break;
+      case TOKEN_MINUS:         result = NUMBER_VAL(x - y); break;
+      case TOKEN_STAR:          result = NUMBER_VAL(x * y); break;
+      case TOKEN_SLASH:         result = NUMBER_VAL(x / y); break;
+      default: return false; // Unreachable.
+    }
+  } else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    result = concatenateConstants(AS_STRING(a), AS_STRING(b));
+  } else {
+    // Leave the type error for the VM to report.
+    return false;
+  }
+
+  discardOperand(rightStart);
+  discardOperand(leftStart);
+  emitFolded(result);
+  return true;
+}
+
+// Folds the unary operator [operatorType] if the code for its operand,
+// which starts at [start], pushes a constant it can be applied to.
+static bool foldUnary(TokenType operatorType, int start) {
+  Value value;
+  if (!constantAt(start, currentChunk()->count, &value)) return false;
+
+  Value result;
+  if (operatorType == TOKEN_BANG) {
+    result = BOOL_VAL(isFalsey(value));
+  } else if (IS_NUMBER(value)) {
+    result = NUMBER_VAL(-AS_NUMBER(value));
+  } else {
+    return false;
+  }
+
+  discardOperand(start);
+  emitFolded(result);
+  return true;
+}
+
+// When the left operand of "and" or "or", starting at [leftStart], is a
+// constant, it decides at compile time whether the right operand runs and
+// which value the expression has. Returns false if it isn't a constant.
+static bool foldLogical(int leftStart, bool isAnd) {
+  Value left;
+  if (!constantAt(leftStart, currentChunk()->count, &left)) return false;
+
+  Precedence precedence = isAnd ? PREC_AND : PREC_OR;
+  if (isFalsey(left) == isAnd) {
+    // The result is the left operand. The right one is still compiled so
+    // that its errors are reported.
+    int rightStart = currentChunk()->count;
+    parsePrecedence(precedence);
+    discardCode(rightStart);
+  } else {
+    // The result is the right operand.
+    discardOperand(leftStart);
+    parsePrecedence(precedence);
+  }
+
+  return true;
+}
+//< Optimization omit
 //> Jumping Back and Forth and
 static void and_(bool canAssign) {
+//> Optimization omit
+  if (foldLogical(current->operandStart, true)) return;
+
+//< Optimization omit
   int endJump = emitJump(OP_JUMP_IF_FALSE);
 
   emitByte(OP_POP);
@@ -593,6 +1226,84 @@ static void and_(bool canAssign) {
   patchJump(endJump);
 }
 //< Jumping Back and Forth and
+//> Optimization omit
+#ifdef REGISTER_VM
+// In the register-based instruction set, an operator whose operands are
+// locals or constants names them in the instruction instead of pushing
+// them first, and an assignment to a local that's used as a statement has
+// the instruction that computes the value store it there directly. The
+// expression compilers still emit stack code as they go. The code for an
+// operand that the register instruction can name is taken back out once
+// the instruction replacing it is known.
+
+// If the code from [start] to [end] is a single instruction that reads a
+// local or a constant, stores where a register instruction can read the
+// same value from in [kind] and [index].
+static bool namesOperand(int start, int end, OperandKind* kind,
+                         uint8_t* index) {
+  if (end - start != 2) return false;
+
+  Chunk* chunk = currentChunk();
+  switch (chunk->code[start]) {
+    case OP_GET_LOCAL: *kind = OPERAND_REGISTER; break;
+    case OP_CONSTANT:  *kind = OPERAND_CONSTANT; break;
+    default: return false;
+  }
+
+  *index = chunk->code[start + 1];
+  return true;
+}
+
+// Replaces the code for the operands of the binary operator
+// [operatorType], which starts at [leftStart] and [rightStart], with a
+// register instruction. Returns false if the right operand isn't a local or
+// a constant. Reading one of those can be put off until the left operand,
+// wherever it is, has been evaluated, but other expressions can't be.
+static bool registerBinary(TokenType operatorType, int leftStart,
+                           int rightStart) {
+  uint8_t instruction;
+  bool negate = false;
+  switch (operatorType) {
+    case TOKEN_BANG_EQUAL:    instruction = OP_EQUAL_REG; negate = true; break;
+    case TOKEN_EQUAL_EQUAL:   instruction = OP_EQUAL_REG; break;
+    case TOKEN_GREATER:       instruction = OP_GREATER_REG; break;
+    case TOKEN_GREATER_EQUAL: instruction = OP_LESS_REG; negate = true; break;
+    case TOKEN_LESS:          instruction = OP_LESS_REG; break;
+    case TOKEN_LESS_EQUAL:    instruction = OP_GREATER_REG; negate = true; break;
+    case TOKEN_PLUS:          instruction = OP_ADD_REG; break;
+    case TOKEN_MINUS:         instruction = OP_SUBTRACT_REG; break;
+    case TOKEN_STAR:          instruction = OP_MULTIPLY_REG; break;
+    case TOKEN_SLASH:         instruction = OP_DIVIDE_REG; break;
+    default: return false; // Unreachable.
+  }
+
+  Chunk* chunk = currentChunk();
+  OperandKind rightKind;
+  uint8_t right;
+  if (!namesOperand(rightStart, chunk->count, &rightKind, &right)) {
+    return false;
+  }
+
+  OperandKind leftKind;
+  uint8_t left;
+  if (namesOperand(leftStart, rightStart, &leftKind, &left)) {
+    chunk->count = leftStart;
+  } else {
+    leftKind = OPERAND_STACK;
+    left = 0;
+    chunk->count = rightStart;
+  }
+
+  current->registerResult = chunk->count;
+  emitBytes(instruction, OPERAND_KINDS(leftKind, rightKind));
+  emitBytes(0, left);
+  emitByte(right);
+  if (negate) emitByte(OP_NOT);
+  return true;
+}
+#endif
+
+//< Optimization omit
 //> Compiling Expressions binary
 /* Compiling Expressions binary < Global Variables binary
 static void binary() {
@@ -602,7 +1313,17 @@ static void binary(bool canAssign) {
 //< Global Variables binary
   TokenType operatorType = parser.previous.type;
   ParseRule* rule = getRule(operatorType);
+//> Optimization omit
+  int leftStart = current->operandStart;
+  int rightStart = currentChunk()->count;
+//< Optimization omit
   parsePrecedence((Precedence)(rule->precedence + 1));
+//> Optimization omit
+  if (foldBinary(operatorType, leftStart, rightStart)) return;
+#ifdef REGISTER_VM
+  if (registerBinary(operatorType, leftStart, rightStart)) return;
+#endif
+//< Optimization omit
 
   switch (operatorType) {
 //> Types of Values comparison-operators
@@ -624,25 +1345,54 @@ static void binary(bool canAssign) {
 //> Calls and Functions compile-call
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
+//> Optimization omit
+  current->lastCall = currentChunk()->count;
+//< Optimization omit
   emitBytes(OP_CALL, argCount);
 }
 //< Calls and Functions compile-call
 //> Classes and Instances compile-dot
 static void dot(bool canAssign) {
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+/* Classes and Instances compile-dot < Optimization omit
   uint8_t name = identifierConstant(&parser.previous);
+*/
+//> Optimization omit
+  int name = identifierConstant(&parser.previous);
+//< Optimization omit
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
+/* Classes and Instances compile-dot < Optimization omit
     emitBytes(OP_SET_PROPERTY, name);
+*/
+//> Optimization omit
+    emitWithOperand(OP_SET_PROPERTY, name);
+    emitCacheIndex(addInlineCache(currentChunk()));
+//< Optimization omit
 //> Methods and Initializers parse-call
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
+/* Methods and Initializers parse-call < Optimization omit
     emitBytes(OP_INVOKE, name);
+*/
+//> Optimization omit
+    emitWithOperand(OP_INVOKE, name);
+    current->lastCall = currentChunk()->count - 2;
+//< Optimization omit
     emitByte(argCount);
+//> Optimization omit
+    emitCacheIndex(addInvokeCache(currentChunk()));
+//< Optimization omit
 //< Methods and Initializers parse-call
   } else {
+/* Classes and Instances compile-dot < Optimization omit
     emitBytes(OP_GET_PROPERTY, name);
+*/
+//> Optimization omit
+    emitWithOperand(OP_GET_PROPERTY, name);
+    emitCacheIndex(addInlineCache(currentChunk()));
+//< Optimization omit
   }
 }
 //< Classes and Instances compile-dot
@@ -690,6 +1440,10 @@ static void number(bool canAssign) {
 //< Compiling Expressions number
 //> Jumping Back and Forth or
 static void or_(bool canAssign) {
+//> Optimization omit
+  if (foldLogical(current->operandStart, false)) return;
+
+//< Optimization omit
   int elseJump = emitJump(OP_JUMP_IF_FALSE);
   int endJump = emitJump(OP_JUMP);
 
@@ -733,7 +1487,12 @@ static void namedVariable(Token name, bool canAssign) {
     setOp = OP_SET_UPVALUE;
 //< Closures named-variable-upvalue
   } else {
+/* Local Variables named-local < Optimization omit
     arg = identifierConstant(&name);
+*/
+//> Optimization omit
+    arg = globalConstant(&name);
+//< Optimization omit
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
@@ -749,19 +1508,50 @@ static void namedVariable(Token name, bool canAssign) {
 //> named-variable-can-assign
   if (canAssign && match(TOKEN_EQUAL)) {
 //< named-variable-can-assign
+//> Optimization omit
+#ifdef REGISTER_VM
+    int valueStart = currentChunk()->count;
+#endif
+//< Optimization omit
     expression();
+//> Optimization omit
+#ifdef REGISTER_VM
+    if (setOp == OP_SET_LOCAL) {
+      current->localStore = currentChunk()->count;
+      current->storedValue = valueStart;
+    }
+#endif
+//< Optimization omit
 /* Global Variables named-variable < Local Variables emit-set
     emitBytes(OP_SET_GLOBAL, arg);
 */
 //> Local Variables emit-set
+/* Local Variables emit-set < Optimization omit
     emitBytes(setOp, (uint8_t)arg);
+*/
+//> Optimization omit
+    if (setOp == OP_SET_GLOBAL) {
+      emitGlobal(setOp, arg);
+    } else {
+      emitWithOperand(setOp, arg);
+    }
+//< Optimization omit
 //< Local Variables emit-set
   } else {
 /* Global Variables named-variable < Local Variables emit-get
     emitBytes(OP_GET_GLOBAL, arg);
 */
 //> Local Variables emit-get
+/* Local Variables emit-get < Optimization omit
     emitBytes(getOp, (uint8_t)arg);
+*/
+//> Optimization omit
+    if (getOp == OP_GET_GLOBAL) {
+      emitGlobal(getOp, arg);
+    } else {
+      emitWithOperand(getOp, arg);
+    }
+//< Optimization omit
 //< Local Variables emit-get
   }
 //< named-variable
@@ -797,7 +1587,12 @@ static void super_(bool canAssign) {
 //< super-errors
   consume(TOKEN_DOT, "Expect '.' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+/* Superclasses super < Optimization omit
   uint8_t name = identifierConstant(&parser.previous);
+*/
+//> Optimization omit
+  int name = identifierConstant(&parser.previous);
+//< Optimization omit
 //> super-get
   
   namedVariable(syntheticToken("this"), false);
@@ -810,11 +1605,25 @@ static void super_(bool canAssign) {
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
+/* Superclasses super-invoke < Optimization omit
     emitBytes(OP_SUPER_INVOKE, name);
+*/
+//> Optimization omit
+    emitWithOperand(OP_SUPER_INVOKE, name);
+    current->lastCall = currentChunk()->count - 2;
+//< Optimization omit
     emitByte(argCount);
+//> Optimization omit
+    emitCacheIndex(addInvokeCache(currentChunk()));
+//< Optimization omit
   } else {
     namedVariable(syntheticToken("super"), false);
+/* Superclasses super-invoke < Optimization omit
     emitBytes(OP_GET_SUPER, name);
+*/
+//> Optimization omit
+    emitWithOperand(OP_GET_SUPER, name);
+//< Optimization omit
   }
 //< super-invoke
 }
@@ -844,9 +1653,15 @@ static void unary(bool canAssign) {
 /* Compiling Expressions unary < Compiling Expressions unary-operand
   expression();
 */
+//> Optimization omit
+  int operandStart = currentChunk()->count;
+//< Optimization omit
 //> unary-operand
   parsePrecedence(PREC_UNARY);
 //< unary-operand
+//> Optimization omit
+  if (foldUnary(operatorType, operandStart)) return;
+//< Optimization omit
 
   // Emit the operator instruction.
   switch (operatorType) {
@@ -989,6 +1804,9 @@ static void parsePrecedence(Precedence precedence) {
     return;
   }
 
+//> Optimization omit
+  int operandStart = currentChunk()->count;
+//< Optimization omit
 /* Compiling Expressions precedence-body < Global Variables prefix-rule
   prefixRule();
 */
@@ -1001,6 +1819,9 @@ static void parsePrecedence(Precedence precedence) {
   while (precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixRule = getRule(parser.previous.type)->infix;
+//> Optimization omit
+    current->operandStart = operandStart;
+//< Optimization omit
 /* Compiling Expressions infix < Global Variables infix-rule
     infixRule();
 */
@@ -1042,11 +1863,70 @@ static void block() {
   consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 //< Local Variables block
+//> Optimization omit
+// Resolves [name] in the function being compiled. If it's a variable in an
+// enclosing function, it's captured and the upvalue's name is stored in
+// [names].
+static void captureName(Token name, Token* names) {
+  if (resolveLocal(current, &name) != -1) return;
+
+  int upvalue = resolveUpvalue(current, &name);
+  if (upvalue != -1) names[upvalue] = name;
+}
+
+// Skips over the body of the function being compiled, whose parameter list
+// starts at [start] on [line], so that compileLazy() can compile it once
+// it's called. Only the tokens are scanned. The body can only use
+// variables from enclosing functions by naming them, so capturing each one
+// it names captures everything it needs, and sometimes a few it doesn't.
+static void skipBody(const char* start, int line) {
+  Token names[UINT8_COUNT];
+  int depth = 1;
+  while (!check(TOKEN_EOF)) {
+    if (check(TOKEN_LEFT_BRACE)) {
+      depth++;
+    } else if (check(TOKEN_RIGHT_BRACE) && --depth == 0) {
+      break;
+    } else if (check(TOKEN_IDENTIFIER)) {
+      // A name after a dot is a property.
+      if (parser.previous.type != TOKEN_DOT) {
+        captureName(parser.current, names);
+      }
+    } else if (check(TOKEN_THIS)) {
+      captureName(syntheticToken("this"), names);
+    } else if (check(TOKEN_SUPER)) {
+      captureName(syntheticToken("this"), names);
+      captureName(syntheticToken("super"), names);
+    }
+
+    advance();
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+
+  ObjFunction* function = current->function;
+  LazyFunction* lazy = ALLOCATE(LazyFunction, 1);
+  lazy->start = start;
+  lazy->line = line;
+  lazy->type = current->type;
+  lazy->inClass = currentClass != NULL;
+  lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+  lazy->upvalueNames = ALLOCATE(Token, function->upvalueCount);
+  for (int i = 0; i < function->upvalueCount; i++) {
+    lazy->upvalueNames[i] = names[i];
+  }
+  function->lazy = lazy;
+}
+//< Optimization omit
 //> Calls and Functions compile-function
 static void function(FunctionType type) {
   Compiler compiler;
   initCompiler(&compiler, type);
   beginScope(); // [no-end-scope]
+//> Optimization omit
+  const char* start = parser.current.start;
+  int line = parser.current.line;
+//< Optimization omit
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 //> parameters
@@ -1063,20 +1943,45 @@ static void function(FunctionType type) {
 //< parameters
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+/* Calls and Functions compile-function < Optimization omit
   block();
+*/
+//> Optimization omit
+  // When compileLazy() resumes compiling a function, it has no enclosing
+  // compiler and the body is compiled for real.
+  if (vm.lazyCompile && compiler.enclosing != NULL) {
+    skipBody(start, line);
+  } else {
+    block();
+  }
+//< Optimization omit
 
   ObjFunction* function = endCompiler();
+//> Optimization omit
+  if (compiler.enclosing == NULL) return;
+//< Optimization omit
 /* Calls and Functions compile-function < Closures emit-closure
   emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
 */
 //> Closures emit-closure
+/* Closures emit-closure < Optimization omit
   emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+*/
+//> Optimization omit
+  emitWithOperand(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+//< Optimization omit
 //< Closures emit-closure
 //> Closures capture-upvalues
 
   for (int i = 0; i < function->upvalueCount; i++) {
     emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+/* Closures capture-upvalues < Optimization omit
     emitByte(compiler.upvalues[i].index);
+*/
+//> Optimization omit
+    emitBytes(compiler.upvalues[i].index >> 8,
+              compiler.upvalues[i].index & 0xff);
+//< Optimization omit
   }
 //< Closures capture-upvalues
 }
@@ -1084,7 +1989,12 @@ static void function(FunctionType type) {
 //> Methods and Initializers method
 static void method() {
   consume(TOKEN_IDENTIFIER, "Expect method name.");
+/* Methods and Initializers method < Optimization omit
   uint8_t constant = identifierConstant(&parser.previous);
+*/
+//> Optimization omit
+  int constant = identifierConstant(&parser.previous);
+//< Optimization omit
 //> method-body
 
 //< method-body
@@ -1104,7 +2014,12 @@ static void method() {
 //> method-body
   function(type);
 //< method-body
+/* Methods and Initializers method < Optimization omit
   emitBytes(OP_METHOD, constant);
+*/
+//> Optimization omit
+  emitWithOperand(OP_METHOD, constant);
+//< Optimization omit
 }
 //< Methods and Initializers method
 //> Classes and Instances class-declaration
@@ -1113,10 +2028,22 @@ static void classDeclaration() {
 //> Methods and Initializers class-name
   Token className = parser.previous;
 //< Methods and Initializers class-name
+/* Classes and Instances class-declaration < Optimization omit
   uint8_t nameConstant = identifierConstant(&parser.previous);
+*/
+//> Optimization omit
+  int nameConstant = current->scopeDepth > 0
+      ? identifierConstant(&parser.previous)
+      : globalConstant(&parser.previous);
+//< Optimization omit
   declareVariable();
 
+/* Classes and Instances class-declaration < Optimization omit
   emitBytes(OP_CLASS, nameConstant);
+*/
+//> Optimization omit
+  emitWithOperand(OP_CLASS, nameConstant);
+//< Optimization omit
   defineVariable(nameConstant);
 
 //> Methods and Initializers create-class-compiler
@@ -1180,7 +2107,12 @@ static void classDeclaration() {
 //< Classes and Instances class-declaration
 //> Calls and Functions fun-declaration
 static void funDeclaration() {
+/* Calls and Functions fun-declaration < Optimization omit
   uint8_t global = parseVariable("Expect function name.");
+*/
+//> Optimization omit
+  int global = parseVariable("Expect function name.");
+//< Optimization omit
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(global);
@@ -1188,7 +2120,12 @@ static void funDeclaration() {
 //< Calls and Functions fun-declaration
 //> Global Variables var-declaration
 static void varDeclaration() {
+/* Global Variables var-declaration < Optimization omit
   uint8_t global = parseVariable("Expect variable name.");
+*/
+//> Optimization omit
+  int global = parseVariable("Expect variable name.");
+//< Optimization omit
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -1201,11 +2138,55 @@ static void varDeclaration() {
   defineVariable(global);
 }
 //< Global Variables var-declaration
+//> Optimization omit
+// Discards the value of the expression just compiled.
+static void popExpression() {
+#ifdef REGISTER_VM
+  Chunk* chunk = currentChunk();
+  int store = current->localStore;
+  if (store != -1 && store == chunk->count - 2 &&
+      chunk->code[store] == OP_SET_LOCAL) {
+    // Store the value in the local without leaving it on the stack.
+    uint8_t slot = chunk->code[store + 1];
+    chunk->count = store;
+    current->localStore = -1;
+
+    int result = current->registerResult;
+    current->registerResult = -1;
+    if (result != -1 && result + 5 == store) {
+      chunk->code[result + 2] = slot;
+      return;
+    }
+
+    OperandKind kind;
+    uint8_t index;
+    if (namesOperand(current->storedValue, store, &kind, &index)) {
+      chunk->count = current->storedValue;
+    } else {
+      kind = OPERAND_STACK;
+      index = 0;
+    }
+
+    emitBytes(OP_MOVE, OPERAND_KINDS(kind, 0));
+    emitBytes(slot, index);
+    return;
+  }
+#endif
+
+  emitByte(OP_POP);
+}
+
+//< Optimization omit
 //> Global Variables expression-statement
 static void expressionStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+/* Global Variables expression-statement < Optimization omit
   emitByte(OP_POP);
+*/
+//> Optimization omit
+  popExpression();
+//< Optimization omit
 }
 //< Global Variables expression-statement
 //> Jumping Back and Forth for-statement
@@ -1251,7 +2232,12 @@ static void forStatement() {
     int bodyJump = emitJump(OP_JUMP);
     int incrementStart = currentChunk()->count;
     expression();
+/* Jumping Back and Forth for-increment < Optimization omit
     emitByte(OP_POP);
+*/
+//> Optimization omit
+    popExpression();
+//< Optimization omit
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
     emitLoop(loopStart);
@@ -1275,11 +2261,41 @@ static void forStatement() {
 //< for-end-scope
 }
 //< Jumping Back and Forth for-statement
+//> Optimization omit
+// Compiles the rest of an if statement whose condition, which starts at
+// [conditionStart], is a constant. The branch that can't run is still
+// compiled so that its errors are reported, and then dropped.
+static void constantIf(int conditionStart, bool truthy) {
+  discardOperand(conditionStart);
+
+  int thenStart = currentChunk()->count;
+  statement();
+  if (!truthy) discardCode(thenStart);
+
+  if (match(TOKEN_ELSE)) {
+    int elseStart = currentChunk()->count;
+    statement();
+    if (truthy) discardCode(elseStart);
+  }
+}
+
+//< Optimization omit
 //> Jumping Back and Forth if-statement
 static void ifStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+//> Optimization omit
+  int conditionStart = currentChunk()->count;
+//< Optimization omit
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); // [paren]
+//> Optimization omit
+
+  Value condition;
+  if (constantAt(conditionStart, currentChunk()->count, &condition)) {
+    constantIf(conditionStart, !isFalsey(condition));
+    return;
+  }
+//< Optimization omit
 
   int thenJump = emitJump(OP_JUMP_IF_FALSE);
 //> pop-then
@@ -1330,6 +2346,20 @@ static void returnStatement() {
 //< Methods and Initializers return-from-init
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+//> Optimization omit
+
+    // If the value is the result of a call, the callee can take over the
+    // frame. The OP_RETURN stays for callees that aren't Lox functions.
+    Chunk* chunk = currentChunk();
+    int call = current->lastCall;
+    if (call != -1 && call + instructionSize(chunk, call) == chunk->count) {
+      switch (chunk->code[call]) {
+        case OP_CALL:         chunk->code[call] = OP_TAIL_CALL; break;
+        case OP_INVOKE:       chunk->code[call] = OP_TAIL_INVOKE; break;
+        case OP_SUPER_INVOKE: chunk->code[call] = OP_TAIL_SUPER_INVOKE; break;
+      }
+    }
+//< Optimization omit
     emitByte(OP_RETURN);
   }
 }
@@ -1342,6 +2372,20 @@ static void whileStatement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+//> Optimization omit
+
+  // A loop with a constant condition either never exits, so it doesn't
+  // need to check, or never runs, so it's compiled for its errors and then
+  // dropped.
+  Value condition;
+  if (constantAt(loopStart, currentChunk()->count, &condition)) {
+    discardOperand(loopStart);
+    statement();
+    emitLoop(loopStart);
+    if (isFalsey(condition)) discardCode(loopStart);
+    return;
+  }
+//< Optimization omit
 
   int exitJump = emitJump(OP_JUMP_IF_FALSE);
   emitByte(OP_POP);
@@ -1451,9 +2495,33 @@ void compile(const char* source) {
 /* Compiling Expressions compile-signature < Calls and Functions compile-signature
 bool compile(const char* source, Chunk* chunk) {
 */
+//> Optimization omit
+// Copies [source] for the functions that --lazy skips over, which still
+// need it once the caller is done with it.
+static const char* keepSource(const char* source) {
+  size_t length = strlen(source) + 1;
+  char* copy = (char*)malloc(length);
+  if (copy == NULL) exit(1);
+  memcpy(copy, source, length);
+
+  if (vm.sourceCount == vm.sourceCapacity) {
+    vm.sourceCapacity = GROW_CAPACITY(vm.sourceCapacity);
+    vm.sources = (char**)realloc(vm.sources,
+                                 sizeof(char*) * vm.sourceCapacity);
+    if (vm.sources == NULL) exit(1);
+  }
+
+  vm.sources[vm.sourceCount++] = copy;
+  return copy;
+}
+
+//< Optimization omit
 //> Calls and Functions compile-signature
 ObjFunction* compile(const char* source) {
 //< Calls and Functions compile-signature
+//> Optimization omit
+  if (vm.lazyCompile) source = keepSource(source);
+//< Optimization omit
   initScanner(source);
 /* Scanning on Demand dump-tokens < Compiling Expressions compile-chunk
   int line = -1;
@@ -1522,3 +2590,48 @@ void markCompilerRoots() {
   }
 }
 //< Garbage Collection mark-compiler-roots
+//> Optimization omit
+// Compiles the body of [callee], which --lazy skipped over, by parsing the
+// function again from its parameter list. Returns false if the body has a
+// compile error, after reporting it.
+bool compileLazy(ObjFunction* callee) {
+  LazyFunction* lazy = callee->lazy;
+
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = NULL;
+  classCompiler.hasSuperclass = lazy->hasSuperclass;
+  currentClass = lazy->inClass ? &classCompiler : NULL;
+
+  freeChunk(&callee->chunk);
+  callee->arity = 0;
+  resumeScanner(lazy->start, lazy->line);
+  parser.hadError = false;
+  parser.panicMode = false;
+  advance();
+
+  resumedFunction = callee;
+  function(lazy->type);
+  currentClass = NULL;
+  if (parser.hadError) return false;
+
+  freeLazyFunction(callee);
+
+  // The function is old, so the collector may have already scanned it or
+  // dropped it from the remembered set.
+  for (int i = 0; i < callee->chunk.constants.count; i++) {
+    writeBarrier((Obj*)callee, callee->chunk.constants.values[i]);
+  }
+
+  return true;
+}
+
+// Frees what --lazy kept to compile [function]'s body, if anything.
+void freeLazyFunction(ObjFunction* function) {
+  LazyFunction* lazy = function->lazy;
+  if (lazy == NULL) return;
+
+  FREE_ARRAY(Token, lazy->upvalueNames, function->upvalueCount);
+  FREE(LazyFunction, lazy);
+  function->lazy = NULL;
+}
+//< Optimization omit
@@ -21,5 +21,9 @@ ObjFunction* compile(const char* source);
 //> Garbage Collection mark-compiler-roots-h
 void markCompilerRoots();
 //< Garbage Collection mark-compiler-roots-h
+//> Optimization omit
+bool compileLazy(ObjFunction* function);
+void freeLazyFunction(ObjFunction* function);
+//< Optimization omit
 
 #endif
@@ -8,6 +8,9 @@
 //> debug-include-value
 #include "value.h"
 //< debug-include-value
+//> Optimization omit
+#include "vm.h"
+//< Optimization omit
 
 void disassembleChunk(Chunk* chunk, const char* name) {
   printf("== %s ==\n", name);
@@ -16,10 +19,29 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     offset = disassembleInstruction(chunk, offset);
   }
 }
+//> Optimization omit
+
+// The high bytes that the OP_WIDE prefix just printed adds to the first
+// operand of the instruction after it.
+static uint32_t wide = 0;
+
+// Returns [operand], which takes up [bits] bits, with the high bytes from
+// the OP_WIDE prefix before it, if there was one.
+static int widen(uint32_t operand, int bits) {
+  operand |= wide << bits;
+  wide = 0;
+  return (int)operand;
+}
+//< Optimization omit
 //> constant-instruction
 static int constantInstruction(const char* name, Chunk* chunk,
                                int offset) {
+/* Chunks of Bytecode constant-instruction < Optimization omit
   uint8_t constant = chunk->code[offset + 1];
+*/
+//> Optimization omit
+  int constant = widen(chunk->code[offset + 1], 8);
+//< Optimization omit
   printf("%-16s %4d '", name, constant);
   printValue(chunk->constants.values[constant]);
   printf("'\n");
@@ -31,14 +53,102 @@ static int constantInstruction(const char* name, Chunk* chunk,
 //> Methods and Initializers invoke-instruction
 static int invokeInstruction(const char* name, Chunk* chunk,
                                 int offset) {
+/* Methods and Initializers invoke-instruction < Optimization omit
   uint8_t constant = chunk->code[offset + 1];
+*/
+//> Optimization omit
+  int constant = widen(chunk->code[offset + 1], 8);
+//< Optimization omit
   uint8_t argCount = chunk->code[offset + 2];
   printf("%-16s (%d args) %4d '", name, argCount, constant);
   printValue(chunk->constants.values[constant]);
+/* Methods and Initializers invoke-instruction < Optimization omit
   printf("'\n");
   return offset + 3;
+*/
+//> Optimization omit
+  uint16_t cache = (uint16_t)(chunk->code[offset + 3] << 8);
+  cache |= chunk->code[offset + 4];
+  printf("' cache %d\n", cache);
+  return offset + 5;
+//< Optimization omit
 }
 //< Methods and Initializers invoke-instruction
+//> Optimization omit
+static int cachedInstruction(const char* name, Chunk* chunk,
+                             int offset) {
+  int constant = widen(chunk->code[offset + 1], 8);
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
+static int longConstantInstruction(const char* name, Chunk* chunk,
+                                   int offset) {
+  int constant = (chunk->code[offset + 1] << 16) |
+                 (chunk->code[offset + 2] << 8) |
+                 chunk->code[offset + 3];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk,
+                             int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '%s'\n", name, slot, globalName(slot)->chars);
+  return offset + 3;
+}
+
+static void printOperand(Chunk* chunk, int kind, uint8_t index) {
+  switch (kind) {
+    case OPERAND_REGISTER: printf("r%d", index); break;
+    case OPERAND_CONSTANT:
+      printf("'");
+      printValue(chunk->constants.values[index]);
+      printf("'");
+      break;
+    case OPERAND_STACK: printf("pop"); break;
+    case OPERAND_SMALL_INT: printf("%d", index); break;
+  }
+}
+
+static void printDestination(uint8_t slot) {
+  if (slot == 0) {
+    printf("push");
+  } else {
+    printf("r%d", slot);
+  }
+}
+
+static int registerInstruction(const char* name, Chunk* chunk,
+                               int offset) {
+  uint8_t kinds = chunk->code[offset + 1];
+  printf("%-16s ", name);
+  printDestination(chunk->code[offset + 2]);
+  printf(" <- ");
+  printOperand(chunk, LEFT_KIND(kinds), chunk->code[offset + 3]);
+  printf(", ");
+  printOperand(chunk, RIGHT_KIND(kinds), chunk->code[offset + 4]);
+  printf("\n");
+  return offset + 5;
+}
+
+static int moveInstruction(const char* name, Chunk* chunk, int offset) {
+  uint8_t kinds = chunk->code[offset + 1];
+  printf("%-16s ", name);
+  printDestination(chunk->code[offset + 2]);
+  printf(" <- ");
+  printOperand(chunk, LEFT_KIND(kinds), chunk->code[offset + 3]);
+  printf("\n");
+  return offset + 4;
+}
+//< Optimization omit
 //> simple-instruction
 static int simpleInstruction(const char* name, int offset) {
   printf("%s\n", name);
@@ -48,7 +158,12 @@ static int simpleInstruction(const char* name, int offset) {
 //> Local Variables byte-instruction
 static int byteInstruction(const char* name, Chunk* chunk,
                            int offset) {
+/* Local Variables byte-instruction < Optimization omit
   uint8_t slot = chunk->code[offset + 1];
+*/
+//> Optimization omit
+  int slot = widen(chunk->code[offset + 1], 8);
+//< Optimization omit
   printf("%-16s %4d\n", name, slot);
   return offset + 2; // [debug]
 }
@@ -56,23 +171,52 @@ static int byteInstruction(const char* name, Chunk* chunk,
 //> Jumping Back and Forth jump-instruction
 static int jumpInstruction(const char* name, int sign,
                            Chunk* chunk, int offset) {
+/* Jumping Back and Forth jump-instruction < Optimization omit
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
+*/
+//> Optimization omit
+  int jump = widen(
+      (uint32_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]),
+      16);
+//< Optimization omit
   printf("%-16s %4d -> %d\n", name, offset,
          offset + 3 + sign * jump);
   return offset + 3;
 }
 //< Jumping Back and Forth jump-instruction
+//> Optimization omit
+static int loopInstruction(const char* name, Chunk* chunk, int offset) {
+  int jump = widen(
+      (uint32_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]),
+      16);
+  uint16_t site = (uint16_t)(chunk->code[offset + 3] << 8);
+  site |= chunk->code[offset + 4];
+  printf("%-16s %4d -> %d site %d\n", name, offset,
+         offset + 5 - jump, site);
+  return offset + 5;
+}
+//< Optimization omit
 //> disassemble-instruction
 int disassembleInstruction(Chunk* chunk, int offset) {
   printf("%04d ", offset);
 //> show-location
+/* Chunks of Bytecode show-location < Optimization omit
   if (offset > 0 &&
       chunk->lines[offset] == chunk->lines[offset - 1]) {
     printf("   | ");
   } else {
     printf("%4d ", chunk->lines[offset]);
   }
+*/
+//> Optimization omit
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
+    printf("   | ");
+  } else {
+    printf("%4d ", line);
+  }
+//< Optimization omit
 //< show-location
   
   uint8_t instruction = chunk->code[offset];
@@ -101,16 +245,31 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 //< Local Variables disassemble-local
 //> Global Variables disassemble-get-global
     case OP_GET_GLOBAL:
+/* Global Variables disassemble-get-global < Optimization omit
       return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+*/
+//> Optimization omit
+      return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+//< Optimization omit
 //< Global Variables disassemble-get-global
 //> Global Variables disassemble-define-global
     case OP_DEFINE_GLOBAL:
+/* Global Variables disassemble-define-global < Optimization omit
       return constantInstruction("OP_DEFINE_GLOBAL", chunk,
                                  offset);
+*/
+//> Optimization omit
+      return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+//< Optimization omit
 //< Global Variables disassemble-define-global
 //> Global Variables disassemble-set-global
     case OP_SET_GLOBAL:
+/* Global Variables disassemble-set-global < Optimization omit
       return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+*/
+//> Optimization omit
+      return globalInstruction("OP_SET_GLOBAL", chunk, offset);
+//< Optimization omit
 //< Global Variables disassemble-set-global
 //> Closures disassemble-upvalue-ops
     case OP_GET_UPVALUE:
@@ -119,10 +278,18 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return byteInstruction("OP_SET_UPVALUE", chunk, offset);
 //< Closures disassemble-upvalue-ops
 //> Classes and Instances disassemble-property-ops
+/* Classes and Instances disassemble-property-ops < Optimization omit
     case OP_GET_PROPERTY:
       return constantInstruction("OP_GET_PROPERTY", chunk, offset);
     case OP_SET_PROPERTY:
       return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+*/
+//> Optimization omit
+    case OP_GET_PROPERTY:
+      return cachedInstruction("OP_GET_PROPERTY", chunk, offset);
+    case OP_SET_PROPERTY:
+      return cachedInstruction("OP_SET_PROPERTY", chunk, offset);
+//< Optimization omit
 //< Classes and Instances disassemble-property-ops
 //> Superclasses disassemble-get-super
     case OP_GET_SUPER:
@@ -165,8 +332,14 @@ int disassembleInstruction(Chunk* chunk, int offset) {
       return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
 //< Jumping Back and Forth disassemble-jump
 //> Jumping Back and Forth disassemble-loop
+/* Jumping Back and Forth disassemble-loop < Optimization omit
     case OP_LOOP:
       return jumpInstruction("OP_LOOP", -1, chunk, offset);
+*/
+//> Optimization omit
+    case OP_LOOP:
+      return loopInstruction("OP_LOOP", chunk, offset);
+//< Optimization omit
 //< Jumping Back and Forth disassemble-loop
 //> Calls and Functions disassemble-call
     case OP_CALL:
@@ -183,7 +356,12 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 //> Closures disassemble-closure
     case OP_CLOSURE: {
       offset++;
+/* Closures disassemble-closure < Optimization omit
       uint8_t constant = chunk->code[offset++];
+*/
+//> Optimization omit
+      int constant = widen(chunk->code[offset++], 8);
+//< Optimization omit
       printf("%-16s %4d ", "OP_CLOSURE", constant);
       printValue(chunk->constants.values[constant]);
       printf("\n");
@@ -193,9 +371,17 @@ int disassembleInstruction(Chunk* chunk, int offset) {
           chunk->constants.values[constant]);
       for (int j = 0; j < function->upvalueCount; j++) {
         int isLocal = chunk->code[offset++];
+/* Closures disassemble-upvalues < Optimization omit
         int index = chunk->code[offset++];
         printf("%04d      |                     %s %d\n",
                offset - 2, isLocal ? "local" : "upvalue", index);
+*/
+//> Optimization omit
+        int index = (chunk->code[offset] << 8) | chunk->code[offset + 1];
+        offset += 2;
+        printf("%04d      |                     %s %d\n",
+               offset - 3, isLocal ? "local" : "upvalue", index);
+//< Optimization omit
       }
       
 //< disassemble-upvalues
@@ -208,6 +394,107 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 //< Closures disassemble-close-upvalue
     case OP_RETURN:
       return simpleInstruction("OP_RETURN", offset);
+//> Optimization omit
+    case OP_SMALL_INT:
+      return byteInstruction("OP_SMALL_INT", chunk, offset);
+    case OP_POPN:
+      return byteInstruction("OP_POPN", chunk, offset);
+    case OP_ADD_LOCALS: {
+      uint8_t a = chunk->code[offset + 1];
+      uint8_t b = chunk->code[offset + 2];
+      printf("%-16s %4d %4d\n", "OP_ADD_LOCALS", a, b);
+      return offset + 3;
+    }
+    case OP_GET_THIS_FIELD:
+      return cachedInstruction("OP_GET_THIS_FIELD", chunk, offset);
+    case OP_PICK:
+      return byteInstruction("OP_PICK", chunk, offset);
+    case OP_ENTER_LOOP: {
+      int first = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+      printf("%-16s %4d %4d\n", "OP_ENTER_LOOP", first,
+             chunk->code[offset + 3]);
+      return offset + 4;
+    }
+    case OP_GET_HOISTED: {
+      int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+      printf("%-16s %4d -> %d\n", "OP_GET_HOISTED", index,
+             offset + 4 + chunk->code[offset + 3]);
+      return offset + 4;
+    }
+    case OP_SET_HOISTED: {
+      int index = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+      printf("%-16s %4d\n", "OP_SET_HOISTED", index);
+      return offset + 3;
+    }
+    case OP_POP_JUMP_IF_FALSE:
+      return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+      return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+      return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+      return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_ADD_NUM:
+      return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+      return simpleInstruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+      return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+      return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+      return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_NUM:
+      return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+      return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_TAIL_CALL:
+      return byteInstruction("OP_TAIL_CALL", chunk, offset);
+    case OP_TAIL_INVOKE:
+      return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+    case OP_TAIL_SUPER_INVOKE:
+      return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
+    case OP_ADD_REG:
+      return registerInstruction("OP_ADD_REG", chunk, offset);
+    case OP_SUBTRACT_REG:
+      return registerInstruction("OP_SUBTRACT_REG", chunk, offset);
+    case OP_MULTIPLY_REG:
+      return registerInstruction("OP_MULTIPLY_REG", chunk, offset);
+    case OP_DIVIDE_REG:
+      return registerInstruction("OP_DIVIDE_REG", chunk, offset);
+    case OP_EQUAL_REG:
+      return registerInstruction("OP_EQUAL_REG", chunk, offset);
+    case OP_GREATER_REG:
+      return registerInstruction("OP_GREATER_REG", chunk, offset);
+    case OP_LESS_REG:
+      return registerInstruction("OP_LESS_REG", chunk, offset);
+    case OP_MOVE:
+      return moveInstruction("OP_MOVE", chunk, offset);
+    case OP_CONSTANT_LONG:
+      return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_WIDE: {
+      wide = (uint32_t)((chunk->code[offset + 1] << 8) |
+                        chunk->code[offset + 2]);
+      printf("%-16s %4d\n", "OP_WIDE", wide);
+
+      // The VM runs a widened jump or local access as part of the prefix,
+      // so show it now.
+      switch (chunk->code[offset + 3]) {
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_LESS:
+          return disassembleInstruction(chunk, offset + 3);
+        default:
+          return offset + 3;
+      }
+    }
+//< Optimization omit
 //> Classes and Instances disassemble-class
     case OP_CLASS:
       return constantInstruction("OP_CLASS", chunk, offset);
@@ -0,0 +1,326 @@
+//> Optimization omit
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "vm.h"
+
+// The old space is made of pages. Each one is divided into cells of a single
+// size class, and each size class has a free list threaded through its empty
+// cells, so allocating is usually just popping the head of a list.
+//
+// Instead of a mark bit in every object header, each page has a bitmap of the
+// marked cells next to one of the allocated cells. Sweeping a page frees the
+// cells that are allocated but not marked and threads the rest onto the free
+// list of its size class. Pages left empty go back to a pool that any size
+// class can take from.
+//
+// Pages are swept lazily. When marking is done, the pages of each size class
+// are set aside as unswept and their free lists emptied. The dead cells are
+// counted right away from the bitmaps so that the next collection is
+// scheduled as if they were gone, but they aren't freed until the allocator
+// runs out of cells in their size class and sweeps another page to refill
+// it. Whatever is still unswept when the next collection starts is swept
+// then, since marking needs the bitmaps.
+//
+// Pages are carved out of chunks allocated from malloc() a few at a time.
+// Chunks aren't returned until the VM shuts down.
+
+#define PAGES_PER_CHUNK 16
+
+static int sizeClass(size_t size) {
+  return (int)((size + CELL_ALIGN - 1) / CELL_ALIGN) - 1;
+}
+
+static bool testBit(uint64_t* bitmap, size_t bit) {
+  return (bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void setBit(uint64_t* bitmap, size_t bit) {
+  bitmap[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static Obj* cellAt(Page* page, int index) {
+  return (Obj*)((uint8_t*)page + PAGE_HEADER_SIZE + index * page->cellSize);
+}
+
+void initHeap() {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    vm.pages[i] = NULL;
+    vm.unsweptPages[i] = NULL;
+    vm.freeCells[i] = NULL;
+  }
+
+  vm.largePages = NULL;
+  vm.freePages = NULL;
+  vm.chunkCount = 0;
+  vm.chunkCapacity = 0;
+  vm.chunks = NULL;
+}
+
+static void forEachInPages(Page* page, void (*callback)(Obj* object)) {
+  for (; page != NULL; page = page->next) {
+    for (int cell = 0; cell < page->cellCount; cell++) {
+      Obj* object = cellAt(page, cell);
+      if (testBit(page->allocated, cellBit(object))) callback(object);
+    }
+  }
+}
+
+// Calls [callback] with every object in the old space, including dead ones
+// that haven't been swept yet.
+void forEachObject(void (*callback)(Obj* object)) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    forEachInPages(vm.pages[i], callback);
+    forEachInPages(vm.unsweptPages[i], callback);
+  }
+
+  for (Page* page = vm.largePages; page != NULL; page = page->next) {
+    callback(cellAt(page, 0));
+  }
+}
+
+void freeHeap() {
+  Page* page = vm.largePages;
+  while (page != NULL) {
+    Page* next = page->next;
+    free(page->allocation);
+    page = next;
+  }
+
+  for (int i = 0; i < vm.chunkCount; i++) {
+    free(vm.chunks[i]);
+  }
+  free(vm.chunks);
+}
+
+static void addChunk() {
+  uint8_t* memory =
+      (uint8_t*)malloc((PAGES_PER_CHUNK + 1) * HEAP_PAGE_SIZE);
+  if (memory == NULL) exit(1);
+
+  if (vm.chunkCapacity < vm.chunkCount + 1) {
+    vm.chunkCapacity = GROW_CAPACITY(vm.chunkCapacity);
+    vm.chunks = (void**)realloc(vm.chunks,
+                                sizeof(void*) * vm.chunkCapacity);
+    if (vm.chunks == NULL) exit(1);
+  }
+  vm.chunks[vm.chunkCount++] = memory;
+
+  // The extra page leaves room to align the rest.
+  uintptr_t start = ((uintptr_t)memory + HEAP_PAGE_SIZE - 1) &
+                    ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+  for (int i = PAGES_PER_CHUNK - 1; i >= 0; i--) {
+    Page* page = (Page*)(start + (uintptr_t)i * HEAP_PAGE_SIZE);
+    page->next = vm.freePages;
+    vm.freePages = page;
+  }
+}
+
+// Threads the unallocated cells in [page] onto the end of the free list
+// whose last link is [tail] and returns the new last link.
+static Obj** addFreeCells(Page* page, Obj** tail) {
+  for (int i = 0; i < page->cellCount; i++) {
+    Obj* cell = cellAt(page, i);
+    if (testBit(page->allocated, cellBit(cell))) continue;
+
+    *tail = cell;
+    tail = (Obj**)cell;
+  }
+
+  return tail;
+}
+
+static void addPage(int sizeClass) {
+  if (vm.freePages == NULL) addChunk();
+
+  Page* page = vm.freePages;
+  vm.freePages = page->next;
+
+  page->sizeClass = sizeClass;
+  page->cellSize = (size_t)(sizeClass + 1) * CELL_ALIGN;
+  page->cellCount =
+      (int)((HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) / page->cellSize);
+  page->allocation = NULL;
+  memset(page->marks, 0, sizeof(page->marks));
+  memset(page->allocated, 0, sizeof(page->allocated));
+
+  page->next = vm.pages[sizeClass];
+  vm.pages[sizeClass] = page;
+
+  // The free list is only empty when a new page is needed.
+  Obj** tail = addFreeCells(page, &vm.freeCells[sizeClass]);
+  *tail = NULL;
+}
+
+static Obj* allocateLarge(size_t size) {
+  size = (size + CELL_ALIGN - 1) & ~(size_t)(CELL_ALIGN - 1);
+  void* allocation = malloc(HEAP_PAGE_SIZE + PAGE_HEADER_SIZE + size);
+  if (allocation == NULL) exit(1);
+
+  Page* page = (Page*)(((uintptr_t)allocation + HEAP_PAGE_SIZE - 1) &
+                       ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+  page->sizeClass = -1;
+  page->cellSize = size;
+  page->cellCount = 1;
+  page->allocation = allocation;
+  memset(page->marks, 0, sizeof(page->marks));
+  memset(page->allocated, 0, sizeof(page->allocated));
+
+  page->next = vm.largePages;
+  vm.largePages = page;
+
+  Obj* object = cellAt(page, 0);
+  setBit(page->allocated, cellBit(object));
+  vm.bytesAllocated += size;
+  return object;
+}
+
+static bool sweepNextPage(int sizeClass);
+
+// Returns a cell for an object of [size] bytes without collecting garbage.
+Obj* takeCell(size_t size) {
+  int index = sizeClass(size);
+  if (index >= SIZE_CLASS_COUNT) return allocateLarge(size);
+
+  if (vm.freeCells[index] == NULL) {
+    double start = vm.gcLogPauses ? gcClock() : 0;
+    while (vm.freeCells[index] == NULL && sweepNextPage(index)) {}
+    if (vm.gcLogPauses) {
+      double elapsed = gcClock() - start;
+      vm.gcLazySweepTime += elapsed;
+      vm.gcCycle.lazySweepTime += elapsed;
+    }
+
+    if (vm.freeCells[index] == NULL) addPage(index);
+  }
+
+  Obj* cell = vm.freeCells[index];
+  vm.freeCells[index] = *(Obj**)cell;
+  setBit(pageOf(cell)->allocated, cellBit(cell));
+  vm.bytesAllocated += (size_t)(index + 1) * CELL_ALIGN;
+  return cell;
+}
+
+// Returns a cell for an object of [size] bytes. Like reallocate(), this may
+// collect garbage first.
+Obj* allocateCell(size_t size) {
+#ifdef DEBUG_STRESS_GC
+  collectGarbage();
+#endif
+
+  if (vm.bytesAllocated + size > vm.nextGC) {
+    collectGarbage();
+  }
+
+  return takeCell(size);
+}
+
+// Frees the unmarked objects in [page] and clears the marks. Returns how many
+// objects are left. The bytes for the cells were already subtracted by
+// startSweeping().
+static int sweepPage(Page* page) {
+  int live = 0;
+  for (int i = 0; i < page->cellCount; i++) {
+    Obj* cell = cellAt(page, i);
+    size_t bit = cellBit(cell);
+    if (!testBit(page->allocated, bit)) continue;
+
+    if (testBit(page->marks, bit)) {
+      live++;
+    } else {
+      freeObject(cell);
+    }
+  }
+
+  memcpy(page->allocated, page->marks, sizeof(page->marks));
+  memset(page->marks, 0, sizeof(page->marks));
+  return live;
+}
+
+// Sweeps the next unswept page of [sizeClass] and puts its free cells on the
+// free list. Returns false if there are none left.
+static bool sweepNextPage(int sizeClass) {
+  Page* page = vm.unsweptPages[sizeClass];
+  if (page == NULL) return false;
+  vm.unsweptPages[sizeClass] = page->next;
+
+  if (sweepPage(page) == 0) {
+    page->next = vm.freePages;
+    vm.freePages = page;
+    return true;
+  }
+
+  page->next = vm.pages[sizeClass];
+  vm.pages[sizeClass] = page;
+
+  // Cells are only swept onto an empty free list.
+  Obj** tail = addFreeCells(page, &vm.freeCells[sizeClass]);
+  *tail = NULL;
+  return true;
+}
+
+static int countBits(uint64_t word) {
+  int count = 0;
+  while (word != 0) {
+    word &= word - 1;
+    count++;
+  }
+  return count;
+}
+
+// Called once marking is done. Subtracts the size of every unmarked cell from
+// the bytes allocated and sets the pages aside to be swept as cells are
+// needed. Large objects are freed right away.
+void startSweeping() {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    for (Page* page = vm.pages[i]; page != NULL; page = page->next) {
+      int dead = 0;
+      for (int word = 0; word < PAGE_BITMAP_WORDS; word++) {
+        dead += countBits(page->allocated[word] & ~page->marks[word]);
+      }
+      vm.bytesAllocated -= dead * page->cellSize;
+    }
+
+    vm.unsweptPages[i] = vm.pages[i];
+    vm.pages[i] = NULL;
+    vm.freeCells[i] = NULL;
+  }
+
+  Page** link = &vm.largePages;
+  while (*link != NULL) {
+    Page* page = *link;
+    if (sweepPage(page) == 0) {
+      vm.bytesAllocated -= page->cellSize;
+      *link = page->next;
+      free(page->allocation);
+    } else {
+      link = &page->next;
+    }
+  }
+}
+
+// Sweeps every page that the allocator hasn't gotten to yet.
+void finishSweeping() {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    // Keep whatever is already on the free list ahead of the new cells.
+    Obj** tail = &vm.freeCells[i];
+    while (*tail != NULL) tail = (Obj**)*tail;
+
+    while (vm.unsweptPages[i] != NULL) {
+      Page* page = vm.unsweptPages[i];
+      vm.unsweptPages[i] = page->next;
+
+      if (sweepPage(page) == 0) {
+        page->next = vm.freePages;
+        vm.freePages = page;
+      } else {
+        page->next = vm.pages[i];
+        vm.pages[i] = page;
+        tail = addFreeCells(page, tail);
+      }
+    }
+    *tail = NULL;
+  }
+}
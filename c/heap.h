@@ -0,0 +1,71 @@
+//> Optimization omit
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include "object.h"
+
+// Pages are aligned to their size so that the page holding an object can be
+// found by masking its address.
+#define HEAP_PAGE_SIZE (16 * 1024)
+
+// Objects start on a multiple of this many bytes. Every object is at least
+// this big, so each one has its own bit in a page's bitmaps.
+#define CELL_ALIGN 16
+
+#define PAGE_BITMAP_WORDS (HEAP_PAGE_SIZE / CELL_ALIGN / 64)
+
+// Cells come in sizes that are multiples of CELL_ALIGN up to this many.
+// Bigger objects get a page to themselves.
+#define SIZE_CLASS_COUNT 64
+
+typedef struct Page {
+  struct Page* next;
+
+  // The index of the size class of the cells in the page, or -1 if it holds
+  // a single large object.
+  int sizeClass;
+  size_t cellSize;
+  int cellCount;
+
+  // For a large object's page, the block returned by malloc() that it was
+  // aligned within.
+  void* allocation;
+
+  // One bit per CELL_ALIGN bytes of the page, set for the cell starting
+  // there.
+  uint64_t marks[PAGE_BITMAP_WORDS];
+  uint64_t allocated[PAGE_BITMAP_WORDS];
+} Page;
+
+#define PAGE_HEADER_SIZE \
+    ((sizeof(Page) + CELL_ALIGN - 1) & ~(size_t)(CELL_ALIGN - 1))
+
+void initHeap();
+void freeHeap();
+
+Obj* allocateCell(size_t size);
+Obj* takeCell(size_t size);
+void startSweeping();
+void finishSweeping();
+void forEachObject(void (*callback)(Obj* object));
+
+static inline Page* pageOf(Obj* object) {
+  return (Page*)((uintptr_t)object & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+static inline size_t cellBit(Obj* object) {
+  return ((uintptr_t)object & (HEAP_PAGE_SIZE - 1)) / CELL_ALIGN;
+}
+
+static inline bool isMarked(Obj* object) {
+  size_t bit = cellBit(object);
+  return (pageOf(object)->marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+static inline void setMarked(Obj* object) {
+  size_t bit = cellBit(object);
+  pageOf(object)->marks[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+#endif
@@ -0,0 +1,713 @@
+//> Optimization omit
+#include "common.h"
+
+#ifdef JIT
+#include <stdlib.h>
+
+#include "assembler.h"
+#include "chunk.h"
+#include "jit.h"
+#include "memory.h"
+#include "trace.h"
+#include "vm.h"
+
+// Once a function has been called or has looped vm.jitThreshold times, its
+// chunk is translated to x86-64 one instruction at a time. Simple
+// instructions and the number fast paths of arithmetic and comparisons are
+// done inline. Everything else calls a helper in vm.c that does what run()
+// would.
+//
+// The compiled code works on the VM's stack in place, so the interpreter and
+// the compiled code can hand a frame back and forth at any instruction. The
+// start of each instruction's native code is recorded, and run() enters the
+// code wherever the frame's ip is. Calls and returns go back out to run(),
+// which carries on with the new frame in whichever of the two has code for
+// it. Compiled code never calls compiled code, so deep Lox recursion doesn't
+// use up the C stack.
+//
+// While it runs, the top of the VM's stack is kept in r12, the frame's slots
+// in r13, the frame in r14, and &vm in r15. They are all callee-saved, so
+// they survive calls into C. The stack top is written back to vm.stackTop
+// before every call and reloaded after, since the helpers push and pop.
+//
+// Objects can move when the nursery is collected, so the code never holds
+// on to one across a call. Object constants are loaded from the chunk's
+// constant table each time, which is where the collector updates them.
+
+#define STACK_TOP ((int32_t)offsetof(VM, stackTop))
+#define GLOBAL_VALUES \
+    ((int32_t)(offsetof(VM, globalValues) + offsetof(ValueArray, values)))
+
+typedef int (*JitHelper)(CallFrame* frame, uint8_t* ip);
+typedef int (*JitEntry)(CallFrame* frame, uint8_t* start);
+
+typedef struct {
+  // Where the jump's 32-bit displacement is in the code.
+  int from;
+  // The offset of the instruction it jumps to in the chunk.
+  int target;
+} BytecodeJump;
+
+typedef struct {
+  Assembler a;
+  Chunk* chunk;
+
+  // Where the code that returns to run() starts.
+  int exit;
+
+  int* entries;
+  BytecodeJump* jumps;
+  int jumpCount;
+  int jumpCapacity;
+} FunctionCompiler;
+
+// Jumps to the code for the instruction at [target] in the chunk.
+static void jumpToInstruction(FunctionCompiler* c, int condition,
+                              int target) {
+  int from = jumpForward(&c->a, condition);
+
+  if (c->jumpCapacity < c->jumpCount + 1) {
+    c->jumpCapacity = GROW_CAPACITY(c->jumpCapacity);
+    c->jumps = (BytecodeJump*)realloc(c->jumps,
+        sizeof(BytecodeJump) * c->jumpCapacity);
+    if (c->jumps == NULL) exit(1);
+  }
+
+  c->jumps[c->jumpCount].from = from;
+  c->jumps[c->jumpCount].target = target;
+  c->jumpCount++;
+}
+
+static void pushRax(Assembler* a) {
+  store(a, R12, 0, RAX);
+  addImmediate(a, R12, 8);
+}
+
+static void callAddress(Assembler* a, uint64_t address) {
+  store(a, R15, STACK_TOP, R12);
+  loadImmediate(a, RAX, address);
+  callRax(a);
+  load(a, R12, R15, STACK_TOP);
+}
+
+// Calls [helper] and goes back to run() with its status unless it returns
+// JIT_CONTINUE.
+static void callHelper(FunctionCompiler* c, JitHelper helper, uint8_t* ip) {
+  Assembler* a = &c->a;
+  move(a, RDI, R14);
+  loadImmediate(a, RSI, (uint64_t)(uintptr_t)ip);
+  callAddress(a, (uint64_t)(uintptr_t)helper);
+
+  emitByte(a, 0x83); // cmp eax, JIT_CONTINUE
+  emitByte(a, 0xf8);
+  emitByte(a, JIT_CONTINUE);
+  jumpTo(a, CC_NE, c->exit);
+}
+
+// Jumps if [reg] isn't a number. Expects QNAN in rdx and uses rsi. Returns
+// where to patch the jump.
+static int jumpIfNotNumber(Assembler* a, int reg) {
+  move(a, RSI, reg);
+  alu(a, ALU_AND, RSI, RDX);
+  alu(a, ALU_CMP, RSI, RDX);
+  return jumpForward(a, CC_E);
+}
+
+// Jumps to the instruction at [target] if rax is nil or false.
+static void jumpIfFalsey(FunctionCompiler* c, int target) {
+  loadImmediate(&c->a, RCX, NIL_VAL);
+  alu(&c->a, ALU_CMP, RAX, RCX);
+  jumpToInstruction(c, CC_E, target);
+  loadImmediate(&c->a, RCX, FALSE_VAL);
+  alu(&c->a, ALU_CMP, RAX, RCX);
+  jumpToInstruction(c, CC_E, target);
+}
+
+// Sets al to whether rax and rcx are equal, following valuesEqual().
+static void compareValues(Assembler* a) {
+  loadImmediate(a, RDX, QNAN);
+  int leftNotNumber = jumpIfNotNumber(a, RAX);
+  int rightNotNumber = jumpIfNotNumber(a, RCX);
+
+  moveToXmm(a, XMM0, RAX);
+  moveToXmm(a, XMM1, RCX);
+  compareDoubles(a, XMM0, XMM1);
+  setCondition(a, CC_NP, RAX);
+  setCondition(a, CC_E, RCX);
+  andLowBytes(a);
+  int done = jumpForward(a, ALWAYS);
+
+  patchHere(a, leftNotNumber);
+  patchHere(a, rightNotNumber);
+  alu(a, ALU_CMP, RAX, RCX);
+  setCondition(a, CC_E, RAX);
+  patchHere(a, done);
+}
+
+// Pops two values and sets al to whether they're equal.
+static void emitEquality(Assembler* a) {
+  load(a, RAX, R12, -16);
+  load(a, RCX, R12, -8);
+  addImmediate(a, R12, -16);
+  compareValues(a);
+}
+
+// Moves rax and rcx into xmm0 and xmm1, jumping to the returned patch
+// positions if either isn't a number.
+static void checkNumbers(Assembler* a, int notNumber[2]) {
+  loadImmediate(a, RDX, QNAN);
+  notNumber[0] = jumpIfNotNumber(a, RAX);
+  notNumber[1] = jumpIfNotNumber(a, RCX);
+  moveToXmm(a, XMM0, RAX);
+  moveToXmm(a, XMM1, RCX);
+}
+
+// Loads the values at [leftDisp] and [rightDisp] from [base] into xmm0 and
+// xmm1, jumping to the returned patch positions if either isn't a number.
+static void loadNumbers(Assembler* a, int base, int32_t leftDisp,
+                        int32_t rightDisp, int notNumber[2]) {
+  load(a, RAX, base, leftDisp);
+  load(a, RCX, base, rightDisp);
+  checkNumbers(a, notNumber);
+}
+
+// Emits the slow path for an instruction whose fast path jumped to
+// [notNumber] and otherwise continues at the returned patch position.
+static int beginSlowPath(Assembler* a, int notNumber[2]) {
+  int done = jumpForward(a, ALWAYS);
+  patchHere(a, notNumber[0]);
+  patchHere(a, notNumber[1]);
+  return done;
+}
+
+static void emitArithmetic(FunctionCompiler* c, uint8_t opcode,
+                           JitHelper slow, uint8_t* next) {
+  Assembler* a = &c->a;
+  int notNumber[2];
+  loadNumbers(a, R12, -16, -8, notNumber);
+  scalarDouble(a, opcode, XMM0, XMM1);
+  moveFromXmm(a, RAX, XMM0);
+  store(a, R12, -16, RAX);
+  addImmediate(a, R12, -8);
+
+  int done = beginSlowPath(a, notNumber);
+  callHelper(c, slow, next);
+  patchHere(a, done);
+}
+
+// Emits a comparison of the top two values. If [target] is -1, pushes the
+// result. Otherwise, jumps there if it's false.
+static void emitComparison(FunctionCompiler* c, bool greater, int target,
+                           uint8_t* next) {
+  Assembler* a = &c->a;
+  int notNumber[2];
+  loadNumbers(a, R12, -16, -8, notNumber);
+  addImmediate(a, R12, -16);
+
+  // NaN compares unordered, which leaves the "above" condition false.
+  if (greater) {
+    compareDoubles(a, XMM0, XMM1);
+  } else {
+    compareDoubles(a, XMM1, XMM0);
+  }
+
+  if (target == -1) {
+    setCondition(a, CC_A, RAX);
+    boolFromAl(a);
+    pushRax(a);
+  } else {
+    jumpToInstruction(c, CC_BE, target);
+  }
+
+  int done = beginSlowPath(a, notNumber);
+  callHelper(c, jitOperandsError, next);
+  patchHere(a, done);
+}
+
+static void loadConstant(FunctionCompiler* c, int reg, int index) {
+  Value* constant = &c->chunk->constants.values[index];
+  if (IS_OBJ(*constant)) {
+    loadImmediate(&c->a, reg, (uint64_t)(uintptr_t)constant);
+    load(&c->a, reg, reg, 0);
+  } else {
+    loadImmediate(&c->a, reg, *constant);
+  }
+}
+
+// Loads a register instruction's operand of [kind] at [index] into [reg].
+// One on the stack is left there until storeResult().
+static void loadOperand(FunctionCompiler* c, int reg, int kind,
+                        uint8_t index) {
+  switch (kind) {
+    case OPERAND_REGISTER: load(&c->a, reg, R13, 8 * index); break;
+    case OPERAND_CONSTANT: loadConstant(c, reg, index); break;
+    case OPERAND_STACK:    load(&c->a, reg, R12, -8); break;
+    case OPERAND_SMALL_INT:
+      loadImmediate(&c->a, reg, NUMBER_VAL(index));
+      break;
+  }
+}
+
+// Pops a register instruction's left operand if it's on the stack and
+// stores rax in local [slot], or pushes it if [slot] is zero.
+static void storeResult(Assembler* a, uint8_t kinds, uint8_t slot) {
+  if (LEFT_KIND(kinds) == OPERAND_STACK) addImmediate(a, R12, -8);
+  if (slot == 0) {
+    pushRax(a);
+  } else {
+    store(a, R13, 8 * slot, RAX);
+  }
+}
+
+// Emits a register instruction whose operands must be numbers. Arithmetic
+// is done with [opcode]. If [opcode] is -1, compares them instead, the
+// greater way around if [greater] is true.
+static void emitRegisterOp(FunctionCompiler* c, int opcode, bool greater,
+                           uint8_t* operands) {
+  Assembler* a = &c->a;
+  uint8_t kinds = operands[0];
+  loadOperand(c, RAX, LEFT_KIND(kinds), operands[2]);
+  loadOperand(c, RCX, RIGHT_KIND(kinds), operands[3]);
+
+  int notNumber[2];
+  checkNumbers(a, notNumber);
+  if (opcode != -1) {
+    scalarDouble(a, (uint8_t)opcode, XMM0, XMM1);
+    moveFromXmm(a, RAX, XMM0);
+  } else {
+    if (greater) {
+      compareDoubles(a, XMM0, XMM1);
+    } else {
+      compareDoubles(a, XMM1, XMM0);
+    }
+    setCondition(a, CC_A, RAX);
+    boolFromAl(a);
+  }
+  storeResult(a, kinds, operands[1]);
+
+  int done = beginSlowPath(a, notNumber);
+  callHelper(c, jitRegisterOp, operands);
+  patchHere(a, done);
+}
+
+// Loads the array of global values into rcx and global [operands] into rax.
+// The array can grow, so it's loaded each time. Jumps to a helper that
+// reports the error if the global isn't defined.
+static void loadGlobal(FunctionCompiler* c, uint8_t* operands) {
+  Assembler* a = &c->a;
+  int32_t disp = 8 * ((operands[0] << 8) | operands[1]);
+  load(a, RCX, R15, GLOBAL_VALUES);
+  load(a, RAX, RCX, disp);
+  loadImmediate(a, RDX, UNDEFINED_VAL);
+  alu(a, ALU_CMP, RAX, RDX);
+  int defined = jumpForward(a, CC_NE);
+  callHelper(c, jitUndefinedGlobal, operands);
+  patchHere(a, defined);
+}
+
+static void emitSafepoint(Assembler* a) {
+#ifdef DEBUG_STRESS_GC
+  callAddress(a, (uint64_t)(uintptr_t)collectAtSafepoint);
+#else
+  compareByteToZero(a, R15, (int32_t)offsetof(VM, nurseryFull));
+  int collect = jumpForward(a, CC_NE);
+  compareByteToZero(a, R15, (int32_t)offsetof(VM, gcRequested));
+  int skip = jumpForward(a, CC_E);
+  patchHere(a, collect);
+  callAddress(a, (uint64_t)(uintptr_t)collectAtSafepoint);
+  patchHere(a, skip);
+#endif
+}
+
+// Emits the code for the instruction at [offset]. Returns false if it's one
+// the compiler doesn't know.
+static bool compileInstruction(FunctionCompiler* c, int offset) {
+  Assembler* a = &c->a;
+  Chunk* chunk = c->chunk;
+  uint8_t* operands = chunk->code + offset + 1;
+  uint8_t* next = chunk->code + offset + instructionSize(chunk, offset);
+  int nextOffset = (int)(next - chunk->code);
+
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+      loadConstant(c, RAX, operands[0]);
+      pushRax(a);
+      return true;
+
+    case OP_CONSTANT_LONG:
+      loadConstant(c, RAX,
+          (operands[0] << 16) | (operands[1] << 8) | operands[2]);
+      pushRax(a);
+      return true;
+
+    case OP_NIL:   loadImmediate(a, RAX, NIL_VAL); pushRax(a); return true;
+    case OP_TRUE:  loadImmediate(a, RAX, TRUE_VAL); pushRax(a); return true;
+    case OP_FALSE: loadImmediate(a, RAX, FALSE_VAL); pushRax(a); return true;
+    case OP_POP:   addImmediate(a, R12, -8); return true;
+
+    case OP_POPN:
+      addImmediate(a, R12, -8 * operands[0]);
+      return true;
+
+    case OP_SMALL_INT:
+      loadImmediate(a, RAX, NUMBER_VAL(operands[0]));
+      pushRax(a);
+      return true;
+
+    case OP_GET_LOCAL:
+      load(a, RAX, R13, 8 * operands[0]);
+      pushRax(a);
+      return true;
+
+    case OP_SET_LOCAL:
+      load(a, RAX, R12, -8);
+      store(a, R13, 8 * operands[0], RAX);
+      return true;
+
+    case OP_GET_GLOBAL:
+      loadGlobal(c, operands);
+      pushRax(a);
+      return true;
+
+    case OP_DEFINE_GLOBAL:
+      load(a, RCX, R15, GLOBAL_VALUES);
+      load(a, RAX, R12, -8);
+      store(a, RCX, 8 * ((operands[0] << 8) | operands[1]), RAX);
+      addImmediate(a, R12, -8);
+      return true;
+
+    case OP_SET_GLOBAL:
+      loadGlobal(c, operands);
+      load(a, RAX, R12, -8);
+      store(a, RCX, 8 * ((operands[0] << 8) | operands[1]), RAX);
+      return true;
+
+    case OP_GET_UPVALUE:
+      load(a, RAX, R14, (int32_t)offsetof(CallFrame, closure));
+      load(a, RAX, RAX, (int32_t)offsetof(ObjClosure, upvalues));
+      load(a, RAX, RAX, 8 * operands[0]);
+      load(a, RAX, RAX, (int32_t)offsetof(ObjUpvalue, location));
+      load(a, RAX, RAX, 0);
+      pushRax(a);
+      return true;
+
+    case OP_EQUAL:
+      emitEquality(a);
+      boolFromAl(a);
+      pushRax(a);
+      return true;
+
+    // Quickened instructions get the same code as the generic ones, which
+    // already does numbers inline.
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+      emitComparison(c, true, -1, next);
+      return true;
+    case OP_LESS:
+    case OP_LESS_NUM:
+      emitComparison(c, false, -1, next);
+      return true;
+
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      emitArithmetic(c, SSE_ADD, jitAdd, next);
+      return true;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+      emitArithmetic(c, SSE_SUB, jitOperandsError, next);
+      return true;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+      emitArithmetic(c, SSE_MUL, jitOperandsError, next);
+      return true;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+      emitArithmetic(c, SSE_DIV, jitOperandsError, next);
+      return true;
+
+    case OP_ADD_LOCALS: {
+      int notNumber[2];
+      loadNumbers(a, R13, 8 * operands[0], 8 * operands[1], notNumber);
+      scalarDouble(a, SSE_ADD, XMM0, XMM1);
+      moveFromXmm(a, RAX, XMM0);
+      pushRax(a);
+
+      int done = beginSlowPath(a, notNumber);
+      callHelper(c, jitAddLocals, operands);
+      patchHere(a, done);
+      return true;
+    }
+
+    case OP_ADD_REG:
+      emitRegisterOp(c, SSE_ADD, false, operands);
+      return true;
+    case OP_SUBTRACT_REG:
+      emitRegisterOp(c, SSE_SUB, false, operands);
+      return true;
+    case OP_MULTIPLY_REG:
+      emitRegisterOp(c, SSE_MUL, false, operands);
+      return true;
+    case OP_DIVIDE_REG:
+      emitRegisterOp(c, SSE_DIV, false, operands);
+      return true;
+    case OP_GREATER_REG:
+      emitRegisterOp(c, -1, true, operands);
+      return true;
+    case OP_LESS_REG:
+      emitRegisterOp(c, -1, false, operands);
+      return true;
+
+    case OP_EQUAL_REG:
+      loadOperand(c, RAX, LEFT_KIND(operands[0]), operands[2]);
+      loadOperand(c, RCX, RIGHT_KIND(operands[0]), operands[3]);
+      compareValues(a);
+      boolFromAl(a);
+      storeResult(a, operands[0], operands[1]);
+      return true;
+
+    case OP_MOVE:
+      loadOperand(c, RAX, LEFT_KIND(operands[0]), operands[2]);
+      storeResult(a, operands[0], operands[1]);
+      return true;
+
+    case OP_NOT: {
+      load(a, RAX, R12, -8);
+      loadImmediate(a, RDX, TRUE_VAL);
+      loadImmediate(a, RCX, NIL_VAL);
+      alu(a, ALU_CMP, RAX, RCX);
+      int isNil = jumpForward(a, CC_E);
+      loadImmediate(a, RCX, FALSE_VAL);
+      alu(a, ALU_CMP, RAX, RCX);
+      int isFalse = jumpForward(a, CC_E);
+      move(a, RDX, RCX);
+      patchHere(a, isNil);
+      patchHere(a, isFalse);
+      store(a, R12, -8, RDX);
+      return true;
+    }
+
+    case OP_NEGATE: {
+      load(a, RAX, R12, -8);
+      loadImmediate(a, RDX, QNAN);
+      int notNumber = jumpIfNotNumber(a, RAX);
+      loadImmediate(a, RCX, SIGN_BIT);
+      alu(a, ALU_XOR, RAX, RCX);
+      store(a, R12, -8, RAX);
+      int done = jumpForward(a, ALWAYS);
+      patchHere(a, notNumber);
+      callHelper(c, jitOperandError, next);
+      patchHere(a, done);
+      return true;
+    }
+
+    case OP_JUMP:
+      jumpToInstruction(c, ALWAYS,
+                        nextOffset + ((operands[0] << 8) | operands[1]));
+      return true;
+
+    case OP_JUMP_IF_FALSE:
+      load(a, RAX, R12, -8);
+      jumpIfFalsey(c, nextOffset + ((operands[0] << 8) | operands[1]));
+      return true;
+
+    case OP_POP_JUMP_IF_FALSE:
+      load(a, RAX, R12, -8);
+      addImmediate(a, R12, -8);
+      jumpIfFalsey(c, nextOffset + ((operands[0] << 8) | operands[1]));
+      return true;
+
+    case OP_JUMP_IF_NOT_EQUAL:
+      emitEquality(a);
+      testLowByte(a);
+      jumpToInstruction(c, CC_E,
+                        nextOffset + ((operands[0] << 8) | operands[1]));
+      return true;
+
+    case OP_JUMP_IF_NOT_GREATER:
+      emitComparison(c, true,
+                     nextOffset + ((operands[0] << 8) | operands[1]), next);
+      return true;
+
+    case OP_JUMP_IF_NOT_LESS:
+      emitComparison(c, false,
+                     nextOffset + ((operands[0] << 8) | operands[1]), next);
+      return true;
+
+    case OP_LOOP: {
+      emitSafepoint(a);
+
+      // Leave the counting to jitLoop() while the loop warms up, and call
+      // it to run the trace once there is one.
+      LoopSite* site = &chunk->loopSites[(operands[2] << 8) | operands[3]];
+      loadImmediate(a, RAX, (uint64_t)(uintptr_t)site);
+      load(a, RCX, RAX, (int32_t)offsetof(LoopSite, trace));
+      alu(a, ALU_TEST, RCX, RCX);
+      int traced = jumpForward(a, CC_NE);
+      load32(a, RCX, RAX, (int32_t)offsetof(LoopSite, hotness));
+      load32(a, RDX, R15, (int32_t)offsetof(VM, traceThreshold));
+      alu(a, ALU_CMP, RCX, RDX);
+      int cold = jumpForward(a, CC_AE);
+      patchHere(a, traced);
+      callHelper(c, jitLoop, operands);
+      patchHere(a, cold);
+
+      jumpToInstruction(c, ALWAYS,
+                        nextOffset - ((operands[0] << 8) | operands[1]));
+      return true;
+    }
+
+    case OP_PICK: {
+      load(a, RAX, R12, -8 * (operands[0] + 1));
+      loadImmediate(a, RDX, SIGN_BIT | QNAN);
+      move(a, RCX, RAX);
+      alu(a, ALU_AND, RCX, RDX);
+      alu(a, ALU_CMP, RCX, RDX);
+      int object = jumpForward(a, CC_E);
+      pushRax(a);
+      int done = jumpForward(a, ALWAYS);
+      patchHere(a, object);
+      callHelper(c, jitPick, operands);
+      patchHere(a, done);
+      return true;
+    }
+
+    case OP_GET_HOISTED: {
+      // The optimizer is done adding to the table, so it doesn't move.
+      Value* hoisted =
+          &chunk->hoisted.values[(operands[0] << 8) | operands[1]];
+      loadImmediate(a, RCX, (uint64_t)(uintptr_t)hoisted);
+      load(a, RAX, RCX, 0);
+      loadImmediate(a, RCX, UNDEFINED_VAL);
+      alu(a, ALU_CMP, RAX, RCX);
+      int missing = jumpForward(a, CC_E);
+      pushRax(a);
+      jumpToInstruction(c, ALWAYS, nextOffset + operands[2]);
+      patchHere(a, missing);
+      return true;
+    }
+
+    case OP_ENTER_LOOP:    callHelper(c, jitEnterLoop, operands); return true;
+    case OP_SET_HOISTED:   callHelper(c, jitSetHoisted, operands); return true;
+    case OP_SET_UPVALUE:   callHelper(c, jitSetUpvalue, operands); return true;
+    case OP_GET_PROPERTY:  callHelper(c, jitGetProperty, operands); return true;
+    case OP_SET_PROPERTY:  callHelper(c, jitSetProperty, operands); return true;
+    case OP_GET_SUPER:     callHelper(c, jitGetSuper, operands); return true;
+    case OP_GET_THIS_FIELD:
+      callHelper(c, jitGetThisField, operands);
+      return true;
+    case OP_PRINT:         callHelper(c, jitPrint, next); return true;
+    case OP_CALL:          callHelper(c, jitCall, operands); return true;
+    case OP_TAIL_CALL:     callHelper(c, jitTailCall, operands); return true;
+    case OP_INVOKE:        callHelper(c, jitInvoke, operands); return true;
+    case OP_SUPER_INVOKE:  callHelper(c, jitSuperInvoke, operands); return true;
+    case OP_TAIL_INVOKE:   callHelper(c, jitTailInvoke, operands); return true;
+    case OP_TAIL_SUPER_INVOKE:
+      callHelper(c, jitTailSuperInvoke, operands);
+      return true;
+    case OP_CLOSURE:       callHelper(c, jitClosure, operands); return true;
+    case OP_CLOSE_UPVALUE: callHelper(c, jitCloseUpvalue, next); return true;
+    case OP_RETURN:        callHelper(c, jitReturn, next); return true;
+    case OP_CLASS:         callHelper(c, jitClass, operands); return true;
+    case OP_INHERIT:       callHelper(c, jitInherit, next); return true;
+    case OP_METHOD:        callHelper(c, jitMethod, operands); return true;
+
+    default:
+      return false;
+  }
+}
+
+// Compiles [function] to native code. If it uses an instruction the
+// compiler doesn't handle, or there's no room for the code, the function is
+// left to the interpreter.
+void compileFunction(ObjFunction* function) {
+  FunctionCompiler c;
+  Assembler* a = &c.a;
+  initAssembler(a);
+  c.chunk = &function->chunk;
+  c.jumps = NULL;
+  c.jumpCount = 0;
+  c.jumpCapacity = 0;
+  c.entries = (int*)malloc(sizeof(int) * c.chunk->count);
+  if (c.entries == NULL) exit(1);
+  for (int i = 0; i < c.chunk->count; i++) c.entries[i] = -1;
+
+  // Entered with the frame in rdi and where to start in rsi.
+  pushCalleeSaved(a);
+  addImmediate(a, RSP, -8);
+  move(a, R14, RDI);
+  loadImmediate(a, R15, (uint64_t)(uintptr_t)&vm);
+  load(a, R13, R14, (int32_t)offsetof(CallFrame, slots));
+  load(a, R12, R15, STACK_TOP);
+  emitByte(a, 0xff); // jmp rsi
+  emitByte(a, 0xe6);
+
+  // Returns the status in eax.
+  c.exit = a->count;
+  addImmediate(a, RSP, 8);
+  popCalleeSaved(a);
+  emitByte(a, 0xc3); // ret
+
+  bool compiled = true;
+  for (int offset = 0; offset < c.chunk->count;
+       offset += instructionSize(c.chunk, offset)) {
+    c.entries[offset] = a->count;
+    if (!compileInstruction(&c, offset)) {
+      compiled = false;
+      break;
+    }
+  }
+
+  // Every chunk ends in a return, which never falls through.
+  emitByte(a, 0x0f); // ud2
+  emitByte(a, 0x0b);
+
+  for (int i = 0; compiled && i < c.jumpCount; i++) {
+    int target = c.jumps[i].target;
+    if (target < 0 || target >= c.chunk->count ||
+        c.entries[target] == -1) {
+      compiled = false;
+    } else {
+      patch32(a, c.jumps[i].from,
+              c.entries[target] - (c.jumps[i].from + 4));
+    }
+  }
+
+  uint8_t* code = compiled ? copyToExecutable(a->code, a->count) : NULL;
+  if (code != NULL) {
+    JitCode* jit = (JitCode*)malloc(sizeof(JitCode));
+    if (jit == NULL) exit(1);
+    jit->code = code;
+    jit->size = (size_t)a->count;
+    jit->entries = c.entries;
+    function->jit = jit;
+  } else {
+    free(c.entries);
+  }
+
+  freeAssembler(a);
+  free(c.jumps);
+}
+
+void freeJitCode(JitCode* jit) {
+  if (jit == NULL) return;
+  freeExecutable(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+}
+
+void freeJit() {
+  freeExecutableMemory();
+}
+
+// Runs [frame]'s compiled code starting at its ip until it calls, returns,
+// or fails.
+JitStatus runCompiled(CallFrame* frame) {
+  ObjFunction* function = frame->closure->function;
+  JitCode* jit = function->jit;
+  int offset = (int)(frame->ip - function->chunk.code);
+
+  JitEntry entry = (JitEntry)(uintptr_t)jit->code;
+  return (JitStatus)entry(frame, jit->code + jit->entries[offset]);
+}
+#endif
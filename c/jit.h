@@ -0,0 +1,73 @@
+//> Optimization omit
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// How many calls and loop iterations make a function hot unless --jit says
+// otherwise.
+#define JIT_THRESHOLD 1000
+
+#ifdef JIT
+typedef enum {
+  // A runtime error was reported.
+  JIT_ERROR,
+  // Only returned by the helpers below. The compiled code keeps going.
+  JIT_CONTINUE,
+  // The frame on top carries on from its ip, after a call or return
+  // changed which frame is running or a trace ran the loop.
+  JIT_SWITCH,
+  // The script returned.
+  JIT_DONE
+} JitStatus;
+
+typedef struct JitCode {
+  uint8_t* code;
+  size_t size;
+
+  // For each byte in the chunk, where the native code for the instruction
+  // starting there begins in [code], or -1 if no instruction starts there.
+  int* entries;
+} JitCode;
+
+void freeJit();
+void compileFunction(ObjFunction* function);
+void freeJitCode(JitCode* jit);
+JitStatus runCompiled(CallFrame* frame);
+
+// The compiled code calls these in vm.c for the instructions it doesn't
+// handle inline. Each takes a pointer to the instruction's operands, or to
+// the next instruction if it has none.
+int jitUndefinedGlobal(CallFrame* frame, uint8_t* ip);
+int jitSetUpvalue(CallFrame* frame, uint8_t* ip);
+int jitGetProperty(CallFrame* frame, uint8_t* ip);
+int jitSetProperty(CallFrame* frame, uint8_t* ip);
+int jitGetSuper(CallFrame* frame, uint8_t* ip);
+int jitGetThisField(CallFrame* frame, uint8_t* ip);
+int jitPick(CallFrame* frame, uint8_t* ip);
+int jitEnterLoop(CallFrame* frame, uint8_t* ip);
+int jitSetHoisted(CallFrame* frame, uint8_t* ip);
+int jitAdd(CallFrame* frame, uint8_t* ip);
+int jitAddLocals(CallFrame* frame, uint8_t* ip);
+int jitRegisterOp(CallFrame* frame, uint8_t* ip);
+int jitOperandsError(CallFrame* frame, uint8_t* ip);
+int jitOperandError(CallFrame* frame, uint8_t* ip);
+int jitPrint(CallFrame* frame, uint8_t* ip);
+int jitCall(CallFrame* frame, uint8_t* ip);
+int jitTailCall(CallFrame* frame, uint8_t* ip);
+int jitInvoke(CallFrame* frame, uint8_t* ip);
+int jitSuperInvoke(CallFrame* frame, uint8_t* ip);
+int jitTailInvoke(CallFrame* frame, uint8_t* ip);
+int jitTailSuperInvoke(CallFrame* frame, uint8_t* ip);
+int jitClosure(CallFrame* frame, uint8_t* ip);
+int jitCloseUpvalue(CallFrame* frame, uint8_t* ip);
+int jitReturn(CallFrame* frame, uint8_t* ip);
+int jitClass(CallFrame* frame, uint8_t* ip);
+int jitInherit(CallFrame* frame, uint8_t* ip);
+int jitMethod(CallFrame* frame, uint8_t* ip);
+int jitLoop(CallFrame* frame, uint8_t* ip);
+#endif
+
+#endif
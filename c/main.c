@@ -3,6 +3,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+//> Optimization omit
+#include <ctype.h>
+#include <errno.h>
+//< Optimization omit
 
 //< Scanning on Demand main-includes
 #include "common.h"
@@ -12,6 +16,11 @@
 //> main-include-debug
 #include "debug.h"
 //< main-include-debug
+//> Optimization omit
+#include "cache.h"
+#include "jit.h"
+#include "trace.h"
+//< Optimization omit
 //> A Virtual Machine main-include-vm
 #include "vm.h"
 //< A Virtual Machine main-include-vm
@@ -67,16 +76,161 @@ static char* readFile(const char* path) {
   return buffer;
 }
 //< Scanning on Demand read-file
+//> Optimization omit
+// Where --compile writes the compiled script, if it was given.
+static const char* compilePath = NULL;
+
+// Where compiled scripts are kept to skip compiling them again, if
+// anywhere.
+static const char* cacheDirectory = NULL;
+
+//< Optimization omit
 //> Scanning on Demand run-file
 static void runFile(const char* path) {
+/* Scanning on Demand run-file < Optimization omit
   char* source = readFile(path);
   InterpretResult result = interpret(source);
   free(source); // [owner]
+*/
+//> Optimization omit
+  InterpretResult result;
+  if (compilePath == NULL && isCompiledFile(path)) {
+    result = interpretCompiled(path);
+  } else {
+    char* source = readFile(path);
+    if (compilePath != NULL) {
+      result = compileToFile(source, compilePath);
+    } else if (cacheDirectory != NULL) {
+      result = interpretCached(source, cacheDirectory);
+    } else {
+      result = interpret(source);
+    }
+    free(source);
+  }
+//< Optimization omit
 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 //< Scanning on Demand run-file
+//> Optimization omit
+static void usage() {
+  fprintf(stderr, "Usage: clox [options] [path]\n");
+  fprintf(stderr, "  --gc-slice=<count>  Collect garbage incrementally, "
+                  "marking <count> objects\n"
+                  "                      at a time.\n");
+  fprintf(stderr, "  --gc-threads=<count> Mark the heap on <count> threads "
+                  "in full collections.\n");
+  fprintf(stderr, "  --gc-pauses         Print a histogram of garbage "
+                  "collection pauses.\n");
+  fprintf(stderr, "  --gc-stats[=json]   Print what the garbage collector "
+                  "did in each full\n"
+                  "                      collection, as text or JSON.\n");
+  fprintf(stderr, "  --gc-percent=<n>    Let the heap grow by <n> percent "
+                  "of the live objects\n"
+                  "                      before collecting. Defaults to "
+                  "100.\n");
+  fprintf(stderr, "  --gc-min-heap=<size> Don't collect before the heap "
+                  "reaches <size>.\n");
+  fprintf(stderr, "  --gc-max-heap=<size> Always collect before the heap "
+                  "passes <size>.\n");
+  fprintf(stderr, "  --gc-limit=<size>   Collect more often to stay under "
+                  "<size> unless that\n"
+                  "                      takes most of the time.\n");
+  fprintf(stderr, "  --jit=<count>       Compile functions to native code "
+                  "once they've been\n"
+                  "                      called or looped <count> times. "
+                  "Defaults to %d.\n", JIT_THRESHOLD);
+  fprintf(stderr, "  --jit=always        Compile every function before "
+                  "running it.\n");
+  fprintf(stderr, "  --jit=off           Only interpret.\n");
+  fprintf(stderr, "  --trace=<count>     Trace loops and compile the traces "
+                  "to native code once\n"
+                  "                      they've looped <count> times. "
+                  "Defaults to %d.\n", TRACE_THRESHOLD);
+  fprintf(stderr, "  --trace=off         Don't trace loops.\n");
+  fprintf(stderr, "  --frames=<count>    Start with room for <count> call "
+                  "frames. Defaults to %d.\n", FRAMES_INITIAL);
+  fprintf(stderr, "  --max-frames=<count> Report a stack overflow past "
+                  "<count> frames. Defaults\n"
+                  "                      to %d.\n", FRAMES_MAX);
+  fprintf(stderr, "  -O0                 Only run the quick optimizations. "
+                  "The default.\n");
+  fprintf(stderr, "  -O2                 Also run the slower ones that follow "
+                  "control flow through\n"
+                  "                      each function.\n");
+  fprintf(stderr, "  --lazy              Only compile a function's body once "
+                  "it's called. Errors\n"
+                  "                      in functions that never are go "
+                  "unreported.\n");
+  fprintf(stderr, "  --compile=<file>    Compile the script to <file> "
+                  "instead of running it. The\n"
+                  "                      file can then be run in its "
+                  "place.\n");
+  fprintf(stderr, "  --cache-dir=<dir>   Keep compiled scripts in <dir> and "
+                  "run them from there\n"
+                  "                      until their source changes.\n");
+  fprintf(stderr, "Sizes are in bytes, or with a K, M or G suffix. The "
+                  "CLOX_GC_PERCENT,\n"
+                  "CLOX_GC_MIN_HEAP, CLOX_GC_MAX_HEAP, CLOX_GC_LIMIT and "
+                  "CLOX_CACHE_DIR\n"
+                  "environment variables set the same things.\n");
+  exit(64);
+}
+
+// Parses a size like "512K" or "64M" into [size]. Returns false if [text]
+// isn't one, or if it's too big for a size_t.
+static bool parseSize(const char* text, size_t* size) {
+  // strtoull() skips spaces and takes a sign, and negates what follows one.
+  if (!isdigit((unsigned char)text[0])) return false;
+
+  char* end;
+  errno = 0;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (errno == ERANGE) return false;
+
+  int shift = 0;
+  switch (*end) {
+    case 'G': case 'g': shift = 30; end++; break;
+    case 'M': case 'm': shift = 20; end++; break;
+    case 'K': case 'k': shift = 10; end++; break;
+    default: break;
+  }
+
+  if (*end != '\0' || value > (SIZE_MAX >> shift)) return false;
+  *size = (size_t)value << shift;
+  return true;
+}
+
+// Parses the largest the heap may get. Zero means there's no limit, so
+// it's only the default and can't be asked for.
+static bool parseMaxHeap(const char* text, size_t* size) {
+  return parseSize(text, size) && *size != 0;
+}
+
+static bool parsePercent(const char* text, int* percent) {
+  char* end;
+  long value = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || value <= 0) return false;
+  *percent = (int)value;
+  return true;
+}
+
+// Reads the heap targets from the environment. The command line overrides
+// them.
+static void readEnvironment() {
+  const char* text = getenv("CLOX_GC_PERCENT");
+  if (text != NULL && !parsePercent(text, &vm.gcPercent)) usage();
+  text = getenv("CLOX_GC_MIN_HEAP");
+  if (text != NULL && !parseSize(text, &vm.gcMinHeap)) usage();
+  text = getenv("CLOX_GC_MAX_HEAP");
+  if (text != NULL && !parseMaxHeap(text, &vm.gcMaxHeap)) usage();
+  text = getenv("CLOX_GC_LIMIT");
+  if (text != NULL && !parseSize(text, &vm.gcSoftLimit)) usage();
+  text = getenv("CLOX_CACHE_DIR");
+  if (text != NULL && text[0] != '\0') cacheDirectory = text;
+}
+//< Optimization omit
 
 int main(int argc, const char* argv[]) {
 //> A Virtual Machine main-init-vm
@@ -132,6 +286,7 @@ int main(int argc, const char* argv[]) {
   interpret(&chunk);
 */
 //> Scanning on Demand args
+/* Scanning on Demand args < Optimization omit
   if (argc == 1) {
     repl();
   } else if (argc == 2) {
@@ -140,6 +295,87 @@ int main(int argc, const char* argv[]) {
     fprintf(stderr, "Usage: clox [path]\n");
     exit(64);
   }
+*/
+//> Optimization omit
+  readEnvironment();
+
+  const char* path = NULL;
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strncmp(arg, "--gc-slice=", 11) == 0) {
+      vm.gcSliceBudget = atoi(arg + 11);
+      if (vm.gcSliceBudget <= 0) usage();
+    } else if (strncmp(arg, "--gc-threads=", 13) == 0) {
+      vm.gcThreads = atoi(arg + 13);
+      if (vm.gcThreads <= 0) usage();
+    } else if (strcmp(arg, "--gc-pauses") == 0) {
+      vm.gcLogPauses = true;
+    } else if (strcmp(arg, "--gc-stats") == 0 ||
+               strcmp(arg, "--gc-stats=text") == 0) {
+      vm.gcStats = GC_STATS_TEXT;
+      vm.gcLogPauses = true;
+    } else if (strcmp(arg, "--gc-stats=json") == 0) {
+      vm.gcStats = GC_STATS_JSON;
+      vm.gcLogPauses = true;
+    } else if (strncmp(arg, "--gc-percent=", 13) == 0) {
+      if (!parsePercent(arg + 13, &vm.gcPercent)) usage();
+    } else if (strncmp(arg, "--gc-min-heap=", 14) == 0) {
+      if (!parseSize(arg + 14, &vm.gcMinHeap)) usage();
+    } else if (strncmp(arg, "--gc-max-heap=", 14) == 0) {
+      if (!parseMaxHeap(arg + 14, &vm.gcMaxHeap)) usage();
+    } else if (strncmp(arg, "--gc-limit=", 11) == 0) {
+      if (!parseSize(arg + 11, &vm.gcSoftLimit)) usage();
+    } else if (strcmp(arg, "--jit=off") == 0) {
+      vm.jitThreshold = 0;
+    } else if (strcmp(arg, "--jit=always") == 0) {
+      vm.jitThreshold = 1;
+    } else if (strncmp(arg, "--jit=", 6) == 0) {
+      vm.jitThreshold = atoi(arg + 6);
+      if (vm.jitThreshold <= 0) usage();
+    } else if (strcmp(arg, "--trace=off") == 0) {
+      vm.traceThreshold = 0;
+    } else if (strncmp(arg, "--trace=", 8) == 0) {
+      vm.traceThreshold = atoi(arg + 8);
+      if (vm.traceThreshold <= 0) usage();
+    } else if (strncmp(arg, "--frames=", 9) == 0) {
+      int frames = atoi(arg + 9);
+      if (frames <= 0) usage();
+      reserveFrames(frames);
+    } else if (strncmp(arg, "--max-frames=", 13) == 0) {
+      vm.maxFrames = atoi(arg + 13);
+      if (vm.maxFrames <= 0) usage();
+    } else if (strcmp(arg, "-O0") == 0) {
+      vm.optimizeLevel = 0;
+    } else if (strcmp(arg, "-O2") == 0) {
+      vm.optimizeLevel = 2;
+    } else if (strcmp(arg, "--lazy") == 0) {
+      vm.lazyCompile = true;
+    } else if (strncmp(arg, "--compile=", 10) == 0) {
+      compilePath = arg + 10;
+    } else if (strncmp(arg, "--cache-dir=", 12) == 0) {
+      cacheDirectory = arg + 12;
+    } else if (arg[0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = arg;
+    }
+  }
+
+  if (vm.gcMaxHeap != 0 && vm.gcMinHeap > vm.gcMaxHeap) {
+    fprintf(stderr, "The minimum heap can't be larger than the maximum.\n");
+    usage();
+  }
+
+  // The first collection waits for the minimum heap like later ones do.
+  vm.nextGC = vm.gcMinHeap;
+
+  if (path == NULL) {
+    if (compilePath != NULL) usage();
+    repl();
+  } else {
+    runFile(path);
+  }
+//< Optimization omit
   
   freeVM();
 //< Scanning on Demand args
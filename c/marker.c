@@ -0,0 +1,242 @@
+//> Optimization omit
+#include "common.h"
+
+#ifdef PARALLEL_MARK
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "marker.h"
+#include "memory.h"
+
+// A full collection can mark the heap on several threads. Each worker
+// starts with its share of the roots and then traces from the objects it
+// marked itself. Setting a mark bit is atomic, so exactly one worker wins
+// the race to gray an object and pushes it on its own stack.
+//
+// A worker's stack is private, so pushing and popping don't synchronize.
+// When a worker has plenty of gray objects and another one is idle, it moves
+// half of them to its shared stack, where idle workers can steal them. The
+// phase is over when every worker is idle. Since only a worker publishes to
+// its own shared stack, and it empties that before going idle, none of them
+// can have work left at that point.
+
+// The most threads that can mark at once.
+#define MAX_WORKERS 64
+
+// A worker only publishes gray objects when it has at least this many.
+#define PUBLISH_MIN 64
+
+typedef struct {
+  int index;
+
+  Obj** stack;
+  int count;
+  int capacity;
+  int highWater;
+
+  pthread_mutex_t lock;
+  Obj** shared;
+  int sharedCount;
+  int sharedCapacity;
+} Worker;
+
+static Worker workers[MAX_WORKERS];
+static int workerCount;
+static int idleCount;
+
+static __thread Worker* currentWorker;
+
+static void pushGray(Obj*** stack, int* count, int* capacity, Obj* object) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *stack = (Obj**)realloc(*stack, sizeof(Obj*) * *capacity);
+    if (*stack == NULL) exit(1);
+  }
+
+  (*stack)[(*count)++] = object;
+}
+
+// Grays [object] for the worker on the current thread if no other worker
+// got to it first.
+void markInParallel(Obj* object) {
+  size_t bit = cellBit(object);
+  uint64_t mask = (uint64_t)1 << (bit % 64);
+  uint64_t* word = &pageOf(object)->marks[bit / 64];
+  if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) return;
+  if (__atomic_fetch_or(word, mask, __ATOMIC_RELAXED) & mask) return;
+
+  Worker* worker = currentWorker;
+  pushGray(&worker->stack, &worker->count, &worker->capacity, object);
+  if (worker->count > worker->highWater) worker->highWater = worker->count;
+}
+
+// Moves the oldest half of [worker]'s gray objects to its shared stack.
+static void publish(Worker* worker) {
+  int half = worker->count / 2;
+
+  // Other workers check the count without taking the lock.
+  pthread_mutex_lock(&worker->lock);
+  int count = worker->sharedCount;
+  for (int i = 0; i < half; i++) {
+    pushGray(&worker->shared, &count, &worker->sharedCapacity,
+             worker->stack[i]);
+  }
+  __atomic_store_n(&worker->sharedCount, count, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&worker->lock);
+
+  memmove(worker->stack, worker->stack + half,
+          sizeof(Obj*) * (worker->count - half));
+  worker->count -= half;
+}
+
+// Moves gray objects from [victim]'s shared stack to [thief]'s own. Takes
+// them all from the thief's own shared stack and half from anyone else's.
+static bool stealFrom(Worker* thief, Worker* victim) {
+  if (__atomic_load_n(&victim->sharedCount, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+
+  pthread_mutex_lock(&victim->lock);
+  int count = victim->sharedCount;
+  int take = victim == thief ? count : (count + 1) / 2;
+  for (int i = 0; i < take; i++) {
+    pushGray(&thief->stack, &thief->count, &thief->capacity,
+             victim->shared[--count]);
+  }
+  __atomic_store_n(&victim->sharedCount, count, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&victim->lock);
+
+  if (thief->count > thief->highWater) thief->highWater = thief->count;
+  return take > 0;
+}
+
+static bool steal(Worker* thief) {
+  for (int i = 0; i < workerCount; i++) {
+    Worker* victim = &workers[(thief->index + i) % workerCount];
+    if (stealFrom(thief, victim)) return true;
+  }
+
+  return false;
+}
+
+static bool anyShared() {
+  for (int i = 0; i < workerCount; i++) {
+    if (__atomic_load_n(&workers[i].sharedCount, __ATOMIC_ACQUIRE) > 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Waits for gray objects to steal. Returns false once every worker has run
+// out.
+static bool findWork(Worker* worker) {
+  if (steal(worker)) return true;
+
+  __atomic_add_fetch(&idleCount, 1, __ATOMIC_ACQ_REL);
+  for (;;) {
+    if (anyShared()) {
+      __atomic_sub_fetch(&idleCount, 1, __ATOMIC_ACQ_REL);
+      if (steal(worker)) return true;
+      __atomic_add_fetch(&idleCount, 1, __ATOMIC_ACQ_REL);
+    }
+
+    if (__atomic_load_n(&idleCount, __ATOMIC_ACQUIRE) == workerCount) {
+      return false;
+    }
+
+    sched_yield();
+  }
+}
+
+static void* runWorker(void* argument) {
+  Worker* worker = (Worker*)argument;
+  currentWorker = worker;
+
+  markRootShare(worker->index, workerCount);
+
+  do {
+    while (worker->count > 0) {
+      blackenObject(worker->stack[--worker->count]);
+
+      if (worker->count >= PUBLISH_MIN &&
+          __atomic_load_n(&idleCount, __ATOMIC_RELAXED) > 0 &&
+          __atomic_load_n(&worker->sharedCount, __ATOMIC_RELAXED) == 0) {
+        publish(worker);
+      }
+    }
+  } while (findWork(worker));
+
+  return NULL;
+}
+
+// Marks everything reachable from the roots using [threadCount] threads,
+// including the calling one.
+void markHeapInParallel(int threadCount) {
+  if (threadCount > MAX_WORKERS) threadCount = MAX_WORKERS;
+  workerCount = threadCount;
+  idleCount = 0;
+
+  for (int i = 0; i < workerCount; i++) {
+    Worker* worker = &workers[i];
+    worker->index = i;
+    worker->stack = NULL;
+    worker->count = 0;
+    worker->capacity = 0;
+    worker->highWater = 0;
+    worker->shared = NULL;
+    worker->sharedCount = 0;
+    worker->sharedCapacity = 0;
+    pthread_mutex_init(&worker->lock, NULL);
+  }
+
+  pthread_t threads[MAX_WORKERS];
+  int started = 1;
+  for (; started < workerCount; started++) {
+    if (pthread_create(&threads[started], NULL, runWorker,
+                       &workers[started]) != 0) {
+      break;
+    }
+  }
+
+  // If the system wouldn't start them all, the ones that did start can
+  // still steal the missing workers' roots.
+  for (int i = started; i < workerCount; i++) {
+    Worker* worker = &workers[i];
+    currentWorker = worker;
+    markRootShare(i, workerCount);
+
+    pthread_mutex_lock(&worker->lock);
+    worker->shared = worker->stack;
+    worker->sharedCapacity = worker->capacity;
+    __atomic_store_n(&worker->sharedCount, worker->count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&worker->lock);
+
+    worker->stack = NULL;
+    worker->count = 0;
+    worker->capacity = 0;
+    __atomic_add_fetch(&idleCount, 1, __ATOMIC_ACQ_REL);
+  }
+
+  runWorker(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  currentWorker = NULL;
+  for (int i = 0; i < workerCount; i++) {
+    // Report the deepest any one worker's gray stack got.
+    if (workers[i].highWater > vm.gcCycle.grayHighWater) {
+      vm.gcCycle.grayHighWater = workers[i].highWater;
+    }
+
+    free(workers[i].stack);
+    free(workers[i].shared);
+    pthread_mutex_destroy(&workers[i].lock);
+  }
+}
+#endif
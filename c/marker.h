@@ -0,0 +1,13 @@
+//> Optimization omit
+#ifndef clox_marker_h
+#define clox_marker_h
+
+#include "common.h"
+#include "object.h"
+
+#ifdef PARALLEL_MARK
+void markInParallel(Obj* object);
+void markHeapInParallel(int threadCount);
+#endif
+
+#endif
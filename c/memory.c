@@ -1,10 +1,27 @@
 //> Chunks of Bytecode memory-c
+//> Optimization omit
+// For clock_gettime().
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+//< Optimization omit
 #include <stdlib.h>
+//> Optimization omit
+#include <stdio.h>
+#include <time.h>
+//< Optimization omit
 
 //> Garbage Collection memory-include-compiler
 #include "compiler.h"
 //< Garbage Collection memory-include-compiler
 #include "memory.h"
+//> Optimization omit
+#include "jit.h"
+#include "marker.h"
+#include "nursery.h"
+#include "pacer.h"
+//< Optimization omit
 //> Strings memory-include-vm
 #include "vm.h"
 //< Strings memory-include-vm
@@ -16,8 +33,10 @@
 #endif
 //< Garbage Collection debug-log-includes
 //> Garbage Collection heap-grow-factor
+/* Garbage Collection heap-grow-factor < Optimization omit
 
 #define GC_HEAP_GROW_FACTOR 2
+*/
 //< Garbage Collection heap-grow-factor
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
@@ -52,8 +71,25 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 //> Garbage Collection mark-object
 void markObject(Obj* object) {
   if (object == NULL) return;
+//> Optimization omit
+  // Young objects may move before the incremental marking is done, so they
+  // are traced when it finishes instead.
+  if (vm.gcState == GC_MARKING && isYoung(object)) return;
+
+#ifdef PARALLEL_MARK
+  if (vm.markingInParallel) {
+    markInParallel(object);
+    return;
+  }
+#endif
+//< Optimization omit
 //> check-is-marked
+/* Garbage Collection check-is-marked < Optimization omit
   if (object->isMarked) return;
+*/
+//> Optimization omit
+  if (isMarked(object)) return;
+//< Optimization omit
 
 //< check-is-marked
 //> log-mark-object
@@ -64,7 +100,12 @@ void markObject(Obj* object) {
 #endif
 
 //< log-mark-object
+/* Garbage Collection mark-object < Optimization omit
   object->isMarked = true;
+*/
+//> Optimization omit
+  setMarked(object);
+//< Optimization omit
 //> add-to-gray-stack
 
   if (vm.grayCapacity < vm.grayCount + 1) {
@@ -79,6 +120,11 @@ void markObject(Obj* object) {
 
   vm.grayStack[vm.grayCount++] = object;
 //< add-to-gray-stack
+//> Optimization omit
+  if (vm.grayCount > vm.gcCycle.grayHighWater) {
+    vm.gcCycle.grayHighWater = vm.grayCount;
+  }
+//< Optimization omit
 }
 //< Garbage Collection mark-object
 //> Garbage Collection mark-value
@@ -94,7 +140,12 @@ static void markArray(ValueArray* array) {
 }
 //< Garbage Collection mark-array
 //> Garbage Collection blacken-object
+/* Garbage Collection blacken-object < Optimization omit
 static void blackenObject(Obj* object) {
+*/
+//> Optimization omit
+void blackenObject(Obj* object) {
+//< Optimization omit
 //> log-blacken-object
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
@@ -119,6 +170,9 @@ static void blackenObject(Obj* object) {
 //> Methods and Initializers mark-methods
       markTable(&klass->methods);
 //< Methods and Initializers mark-methods
+//> Optimization omit
+      markObject((Obj*)klass->rootShape);
+//< Optimization omit
       break;
     }
 //< Classes and Instances blacken-class
@@ -137,6 +191,25 @@ static void blackenObject(Obj* object) {
       ObjFunction* function = (ObjFunction*)object;
       markObject((Obj*)function->name);
       markArray(&function->chunk.constants);
+//> Optimization omit
+      markArray(&function->chunk.hoisted);
+      // A cache that outlived its shape could falsely match a new shape
+      // allocated at the same address.
+      for (int i = 0; i < function->chunk.cacheCount; i++) {
+        InlineCache* cache = &function->chunk.caches[i];
+        markObject((Obj*)cache->shape);
+        markObject((Obj*)cache->transition);
+        markValue(cache->method);
+      }
+
+      for (int i = 0; i < function->chunk.invokeCacheCount; i++) {
+        InvokeCache* cache = &function->chunk.invokeCaches[i];
+        for (int j = 0; j < cache->count; j++) {
+          markObject(cache->entries[j].key);
+          markValue(cache->entries[j].method);
+        }
+      }
+//< Optimization omit
       break;
     }
 //< blacken-function
@@ -144,10 +217,36 @@ static void blackenObject(Obj* object) {
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
       markObject((Obj*)instance->klass);
+/* Classes and Instances blacken-instance < Optimization omit
       markTable(&instance->fields);
+*/
+//> Optimization omit
+      // While converting to a dictionary, an instance has both.
+      if (instance->shape != NULL) {
+        markObject((Obj*)instance->shape);
+        for (int i = 0; i < instance->shape->slotCount; i++) {
+          markValue(instance->fields[i]);
+        }
+      }
+
+      if (instance->dictionary != NULL) markTable(instance->dictionary);
+//< Optimization omit
       break;
     }
 //< Classes and Instances blacken-instance
+//> Optimization omit
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject((Obj*)shape->parent);
+      markObject((Obj*)shape->name);
+      for (int i = 0; i < shape->slotCount; i++) {
+        markObject((Obj*)shape->names[i]);
+      }
+      markTable(&shape->transitions);
+      markTable(&shape->slots);
+      break;
+    }
+//< Optimization omit
 //> blacken-upvalue
     case OBJ_UPVALUE:
       markValue(((ObjUpvalue*)object)->closed);
@@ -160,7 +259,15 @@ static void blackenObject(Obj* object) {
 }
 //< Garbage Collection blacken-object
 //> Strings free-object
+/* Strings free-object < Optimization omit
 static void freeObject(Obj* object) {
+*/
+//> Optimization omit
+// Frees the memory [object] owns outside of its cell. The sweeper frees the
+// cell itself.
+void freeObject(Obj* object) {
+  vm.gcCycle.freed[object->type]++;
+//< Optimization omit
 //> Garbage Collection log-free-object
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*)object, object->type);
@@ -170,7 +277,9 @@ static void freeObject(Obj* object) {
   switch (object->type) {
 //> Methods and Initializers free-bound-method
     case OBJ_BOUND_METHOD:
+/* Methods and Initializers free-bound-method < Optimization omit
       FREE(ObjBoundMethod, object);
+*/
       break;
 //< Methods and Initializers free-bound-method
 //> Classes and Instances free-class
@@ -179,7 +288,9 @@ static void freeObject(Obj* object) {
       ObjClass* klass = (ObjClass*)object;
       freeTable(&klass->methods);
 //< Methods and Initializers free-methods
+/* Classes and Instances free-class < Optimization omit
       FREE(ObjClass, object);
+*/
       break;
     } // [braces]
 //< Classes and Instances free-class
@@ -190,7 +301,9 @@ static void freeObject(Obj* object) {
       FREE_ARRAY(ObjUpvalue*, closure->upvalues,
                  closure->upvalueCount);
 //< free-upvalues
+/* Closures free-closure < Optimization omit
       FREE(ObjClosure, object);
+*/
       break;
     }
 //< Closures free-closure
@@ -198,32 +311,67 @@ static void freeObject(Obj* object) {
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       freeChunk(&function->chunk);
+//> Optimization omit
+#ifdef JIT
+      freeJitCode(function->jit);
+#endif
+      freeLazyFunction(function);
+//< Optimization omit
+/* Calls and Functions free-function < Optimization omit
       FREE(ObjFunction, object);
+*/
       break;
     }
 //< Calls and Functions free-function
 //> Classes and Instances free-instance
     case OBJ_INSTANCE: {
       ObjInstance* instance = (ObjInstance*)object;
+/* Classes and Instances free-instance < Optimization omit
       freeTable(&instance->fields);
       FREE(ObjInstance, object);
+*/
+//> Optimization omit
+      if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+      }
+
+      if (instance->dictionary != NULL) {
+        freeTable(instance->dictionary);
+        FREE(Table, instance->dictionary);
+      }
+//< Optimization omit
       break;
     }
 //< Classes and Instances free-instance
+//> Optimization omit
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      FREE_ARRAY(ObjString*, shape->names, shape->slotCount);
+      freeTable(&shape->transitions);
+      freeTable(&shape->slots);
+      break;
+    }
+//< Optimization omit
 //> Calls and Functions free-native
     case OBJ_NATIVE:
+/* Calls and Functions free-native < Optimization omit
       FREE(ObjNative, object);
+*/
       break;
 //< Calls and Functions free-native
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
       FREE_ARRAY(char, string->chars, string->length + 1);
+/* Strings free-object < Optimization omit
       FREE(ObjString, object);
+*/
       break;
     }
 //> Closures free-upvalue
     case OBJ_UPVALUE:
+/* Closures free-upvalue < Optimization omit
       FREE(ObjUpvalue, object);
+*/
       break;
 //< Closures free-upvalue
   }
@@ -251,6 +399,9 @@ static void markRoots() {
 //> mark-globals
 
   markTable(&vm.globals);
+//> Optimization omit
+  markArray(&vm.globalValues);
+//< Optimization omit
 //< mark-globals
 //> call-mark-compiler-roots
   markCompilerRoots();
@@ -268,15 +419,34 @@ static void traceReferences() {
   }
 }
 //< Garbage Collection trace-references
+//> Optimization omit
+// Adds the time since [start] to the totals and the current collection's.
+static void recordMarkTime(double start) {
+  double elapsed = gcClock() - start;
+  vm.gcMarkTime += elapsed;
+  vm.gcCycle.markTime += elapsed;
+}
+
+static void recordSweepTime(double start) {
+  double elapsed = gcClock() - start;
+  vm.gcSweepTime += elapsed;
+  vm.gcCycle.sweepTime += elapsed;
+}
+//< Optimization omit
 //> Garbage Collection sweep
 static void sweep() {
+/* Garbage Collection sweep < Optimization omit
   Obj* previous = NULL;
   Obj* object = vm.objects;
   while (object != NULL) {
     if (object->isMarked) {
+*/
 //> unmark
+/* Garbage Collection unmark < Optimization omit
       object->isMarked = false;
+*/
 //< unmark
+/* Garbage Collection sweep < Optimization omit
       previous = object;
       object = object->next;
     } else {
@@ -291,10 +461,412 @@ static void sweep() {
       freeObject(unreached);
     }
   }
+*/
+//> Optimization omit
+  double start = gcClock();
+  startSweeping();
+  recordSweepTime(start);
+//< Optimization omit
 }
 //< Garbage Collection sweep
+//> Optimization omit
+// Returns the time in microseconds. Marking on several threads takes less
+// time on the wall clock than the processor time it uses, so that's the clock
+// used where there is one.
+double gcClock() {
+#ifdef PARALLEL_MARK
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000.0 + time.tv_nsec / 1000.0;
+#else
+  return (double)clock() * 1000000.0 / CLOCKS_PER_SEC;
+#endif
+}
+
+static double beginPause() {
+  return vm.gcLogPauses ? gcClock() : 0;
+}
+
+// Records how long the program was paused since [start].
+static void endPause(double start) {
+  if (!vm.gcLogPauses) return;
+
+  double micros = gcClock() - start;
+  int bucket = 0;
+  while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= (double)(1 << bucket)) {
+    bucket++;
+  }
+
+  vm.gcPauses[bucket]++;
+  vm.gcPauseTotal += micros;
+  if (micros > vm.gcLongestPause) vm.gcLongestPause = micros;
+}
+
+// Marks worker [index]'s share of the roots when [count] threads are marking
+// in parallel. The stack and globals are split evenly between them.
+void markRootShare(int index, int count) {
+  size_t slots = (size_t)(vm.stackTop - vm.stack);
+  Value* end = vm.stack + slots * (index + 1) / count;
+  for (Value* slot = vm.stack + slots * index / count; slot < end; slot++) {
+    markValue(*slot);
+  }
+
+  int capacity = vm.globals.capacity;
+  for (int i = capacity * index / count;
+       i < capacity * (index + 1) / count; i++) {
+    Entry* entry = &vm.globals.entries[i];
+    markObject((Obj*)entry->key);
+    markValue(entry->value);
+  }
+
+  int globalCount = vm.globalValues.count;
+  for (int i = globalCount * index / count;
+       i < globalCount * (index + 1) / count; i++) {
+    markValue(vm.globalValues.values[i]);
+  }
+
+  if (index != 0) return;
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    markObject((Obj*)vm.frames[i].closure);
+  }
+
+  for (ObjUpvalue* upvalue = vm.openUpvalues;
+       upvalue != NULL;
+       upvalue = upvalue->next) {
+    markObject((Obj*)upvalue);
+  }
+
+  markCompilerRoots();
+  markObject((Obj*)vm.initString);
+}
+
+// Marks everything reachable from the roots all at once.
+static void markHeap() {
+  double start = gcClock();
+
+#ifdef PARALLEL_MARK
+  if (vm.gcThreads > 1) {
+    vm.markingInParallel = true;
+    markHeapInParallel(vm.gcThreads);
+    vm.markingInParallel = false;
+  } else {
+    markRoots();
+    traceReferences();
+  }
+#else
+  markRoots();
+  traceReferences();
+#endif
+
+  recordMarkTime(start);
+}
+
+// Sweeps the pages the allocator didn't get to since the last collection so
+// that the next one starts with clear mark bitmaps.
+static void sweepRemaining() {
+  double start = gcClock();
+  finishSweeping();
+  recordSweepTime(start);
+}
+
+// Starts recording the stats for a new collection. The last one's are done
+// once its objects are all swept.
+static void beginCycleStats(bool incremental) {
+  if (vm.gcCycleCount > 0 && vm.gcStats != GC_STATS_OFF) {
+    if (vm.gcHistoryCapacity < vm.gcHistoryCount + 1) {
+      vm.gcHistoryCapacity = GROW_CAPACITY(vm.gcHistoryCapacity);
+      vm.gcHistory = (GcCycleStats*)realloc(
+          vm.gcHistory, sizeof(GcCycleStats) * vm.gcHistoryCapacity);
+      if (vm.gcHistory == NULL) exit(1);
+    }
+
+    vm.gcHistory[vm.gcHistoryCount++] = vm.gcCycle;
+  }
+
+  memset(&vm.gcCycle, 0, sizeof(vm.gcCycle));
+  vm.gcCycle.incremental = incremental;
+  vm.gcCycle.bytesBefore = vm.bytesAllocated;
+  vm.gcCycleCount++;
+}
+
+// An incremental collection marks the heap a slice at a time in between
+// running the program instead of all at once. It starts by graying the
+// roots. After that, every allocation that would have triggered a
+// collection blackens a slice of the gray objects instead, as does every
+// nursery collection. Once none are left, it rescans the roots for objects
+// the program moved there in the meantime and sweeps.
+//
+// The program keeps changing the heap while it's being marked. Storing an
+// object into one that was already blackened would hide it from the
+// collector, so writeBarrier() and tableSet() shade every object stored in
+// the heap. New objects start out white and are found through the roots or
+// whatever they are stored in.
+//
+// Young objects are skipped while marking since they may move. When the
+// cycle finishes, they are traced starting from the roots and from the
+// remembered set, which holds every old object that refers to one.
+//
+// The compiler's roots are only scanned when a cycle starts or finishes,
+// and neither can happen while it has objects in C locals, so they are
+// only done at safepoints in the interpreter loop.
+static void beginCycle() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin marking\n");
+#endif
+
+  sweepRemaining();
+  beginCycleStats(true);
+  noteMarkingStarted();
+
+  double start = gcClock();
+  vm.gcState = GC_MARKING;
+  markRoots();
+  recordMarkTime(start);
+}
+
+// Blackens [slices] slices' worth of gray objects.
+static void markSlice(int slices) {
+  double start = gcClock();
+  int budget = vm.gcSliceBudget * slices;
+  for (int work = 0; work < budget && vm.grayCount > 0; work++) {
+    blackenObject(vm.grayStack[--vm.grayCount]);
+  }
+
+  if (vm.grayCount == 0) vm.gcRequested = true;
+  recordMarkTime(start);
+}
+
+static void finishCycle() {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc finish marking\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  double start = gcClock();
+  vm.gcState = GC_IDLE;
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    if (isMarked(vm.remembered[i])) blackenObject(vm.remembered[i]);
+  }
+
+  traceReferences();
+  recordMarkTime(start);
+  noteMarkingFinished();
+
+  double stringStart = gcClock();
+  tableRemoveWhite(&vm.strings);
+  vm.gcCycle.stringTime = gcClock() - stringStart;
+
+  pruneRememberedSet();
+  sweep();
+  vm.gcCycle.bytesAfter = vm.bytesAllocated;
+  clearYoungMarks();
+  flushMethodCache();
+
+  vm.nextGC = paceNextCollection();
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated,
+         vm.nextGC);
+#endif
+}
+
+// Does the collector work that can only be done when every reference to
+// an object is in a root. Called from the interpreter loop.
+void collectAtSafepoint() {
+  double start = beginPause();
+
+  bool collectYoung = vm.nurseryFull;
+#ifdef DEBUG_STRESS_GC
+  collectYoung = true;
+#endif
+
+  int promoted = 0;
+  if (collectYoung) {
+    promoted = collectNursery();
+    vm.gcNurseryCount++;
+    vm.gcPromotedCount += promoted;
+  }
+
+  if (vm.gcRequested || vm.gcState == GC_MARKING) {
+    vm.gcRequested = false;
+    if (vm.gcState == GC_IDLE) {
+      beginCycle();
+    } else if (vm.grayCount == 0) {
+      finishCycle();
+    } else {
+      // Promoting an object allocates it in the old space. Keep up with
+      // that the same way as with any other allocation there.
+      markSlice(1 + promoted);
+    }
+  }
+
+  endPause(start);
+}
+
+static void printPauseBuckets() {
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (vm.gcPauses[i] == 0) continue;
+    if (i == GC_PAUSE_BUCKETS - 1) {
+      fprintf(stderr, "  >= %8d us: %llu\n", 1 << (i - 1),
+              (unsigned long long)vm.gcPauses[i]);
+    } else {
+      fprintf(stderr, "   < %8d us: %llu\n", 1 << i,
+              (unsigned long long)vm.gcPauses[i]);
+    }
+  }
+}
+
+static uint64_t pauseCount() {
+  uint64_t count = 0;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) count += vm.gcPauses[i];
+  return count;
+}
+
+void printGcPauses() {
+  fprintf(stderr, "%llu gc pauses, %.3f ms total, longest %.3f ms\n",
+          (unsigned long long)pauseCount(), vm.gcPauseTotal / 1000.0,
+          vm.gcLongestPause / 1000.0);
+  fprintf(stderr, "%.3f ms marking, %.3f ms sweeping in pauses, "
+          "%.3f ms sweeping lazily\n", vm.gcMarkTime / 1000.0,
+          vm.gcSweepTime / 1000.0, vm.gcLazySweepTime / 1000.0);
+  printPauseBuckets();
+}
+
+static const char* objTypeNames[OBJ_TYPE_COUNT] = {
+  "bound_method", "class", "closure", "function", "instance", "native",
+  "shape", "string", "upvalue"
+};
+
+// Returns the number of full collections with stats to print. The one in
+// progress is left out if it hasn't finished marking.
+static int statsCycleCount() {
+  bool lastDone = vm.gcCycleCount > 0 && vm.gcState == GC_IDLE;
+  return vm.gcHistoryCount + (lastDone ? 1 : 0);
+}
+
+static GcCycleStats* statsCycle(int index) {
+  return index < vm.gcHistoryCount ? &vm.gcHistory[index] : &vm.gcCycle;
+}
+
+static void printStatsText() {
+  fprintf(stderr, "%d full collections, %llu nursery collections "
+          "promoting %llu objects\n", vm.gcCycleCount,
+          (unsigned long long)vm.gcNurseryCount,
+          (unsigned long long)vm.gcPromotedCount);
+  printGcPauses();
+
+  int count = statsCycleCount();
+  if (count == 0) return;
+
+  fprintf(stderr, "     #  kind          before        after  mark ms  "
+          "strings ms  sweep ms  lazy ms      gray  freed\n");
+  for (int i = 0; i < count; i++) {
+    GcCycleStats* cycle = statsCycle(i);
+    fprintf(stderr, "%6d  %-4s  %12zu %12zu %8.3f %11.3f %9.3f %8.3f %9d ",
+            i + 1, cycle->incremental ? "incr" : "full",
+            cycle->bytesBefore, cycle->bytesAfter,
+            cycle->markTime / 1000.0, cycle->stringTime / 1000.0,
+            cycle->sweepTime / 1000.0, cycle->lazySweepTime / 1000.0,
+            cycle->grayHighWater);
+
+    bool first = true;
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+      if (cycle->freed[type] == 0) continue;
+      fprintf(stderr, "%s %s %llu", first ? "" : ",", objTypeNames[type],
+              (unsigned long long)cycle->freed[type]);
+      first = false;
+    }
+    fprintf(stderr, "%s\n", first ? " -" : "");
+  }
+}
+
+static void printStatsJson() {
+  fprintf(stderr, "{\n  \"full_collections\": %d,\n", vm.gcCycleCount);
+  fprintf(stderr, "  \"nursery_collections\": %llu,\n",
+          (unsigned long long)vm.gcNurseryCount);
+  fprintf(stderr, "  \"promoted_objects\": %llu,\n",
+          (unsigned long long)vm.gcPromotedCount);
+  fprintf(stderr, "  \"mark_ms\": %.3f,\n", vm.gcMarkTime / 1000.0);
+  fprintf(stderr, "  \"sweep_ms\": %.3f,\n", vm.gcSweepTime / 1000.0);
+  fprintf(stderr, "  \"lazy_sweep_ms\": %.3f,\n",
+          vm.gcLazySweepTime / 1000.0);
+
+  fprintf(stderr, "  \"pauses\": {\n    \"count\": %llu,\n",
+          (unsigned long long)pauseCount());
+  fprintf(stderr, "    \"total_ms\": %.3f,\n", vm.gcPauseTotal / 1000.0);
+  fprintf(stderr, "    \"longest_ms\": %.3f,\n",
+          vm.gcLongestPause / 1000.0);
+  fprintf(stderr, "    \"histogram\": [");
+  bool first = true;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    if (vm.gcPauses[i] == 0) continue;
+    fprintf(stderr, "%s\n      {", first ? "" : ",");
+    if (i == GC_PAUSE_BUCKETS - 1) {
+      fprintf(stderr, "\"at_least_us\": %d", 1 << (i - 1));
+    } else {
+      fprintf(stderr, "\"below_us\": %d", 1 << i);
+    }
+    fprintf(stderr, ", \"count\": %llu}", (unsigned long long)vm.gcPauses[i]);
+    first = false;
+  }
+  fprintf(stderr, "%s]\n  },\n", first ? "" : "\n    ");
+
+  fprintf(stderr, "  \"collections\": [");
+  int count = statsCycleCount();
+  for (int i = 0; i < count; i++) {
+    GcCycleStats* cycle = statsCycle(i);
+    fprintf(stderr, "%s\n    {\"incremental\": %s, ", i == 0 ? "" : ",",
+            cycle->incremental ? "true" : "false");
+    fprintf(stderr, "\"bytes_before\": %zu, \"bytes_after\": %zu, ",
+            cycle->bytesBefore, cycle->bytesAfter);
+    fprintf(stderr, "\"mark_ms\": %.3f, \"strings_ms\": %.3f, ",
+            cycle->markTime / 1000.0, cycle->stringTime / 1000.0);
+    fprintf(stderr, "\"sweep_ms\": %.3f, \"lazy_sweep_ms\": %.3f, ",
+            cycle->sweepTime / 1000.0, cycle->lazySweepTime / 1000.0);
+    fprintf(stderr, "\"gray_high_water\": %d, \"freed\": {",
+            cycle->grayHighWater);
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+      fprintf(stderr, "%s\"%s\": %llu", type == 0 ? "" : ", ",
+              objTypeNames[type], (unsigned long long)cycle->freed[type]);
+    }
+    fprintf(stderr, "}}");
+  }
+  fprintf(stderr, "%s]\n}\n", count == 0 ? "" : "\n  ");
+}
+
+// Prints what the collector did, for --gc-stats. The objects freed by the
+// last collection are only the ones swept so far.
+void printGcStats() {
+  if (vm.gcStats == GC_STATS_JSON) {
+    printStatsJson();
+  } else {
+    printStatsText();
+  }
+}
+//< Optimization omit
 //> Garbage Collection collect-garbage
 void collectGarbage() {
+//> Optimization omit
+  // See beginCycle().
+  if (vm.gcSliceBudget > 0) {
+    if (vm.gcState == GC_MARKING) {
+      double start = beginPause();
+      markSlice(1);
+      endPause(start);
+    } else {
+      vm.gcRequested = true;
+    }
+    return;
+  }
+
+  double start = beginPause();
+  sweepRemaining();
+  beginCycleStats(false);
+//< Optimization omit
 //> log-before-collect
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
@@ -305,20 +877,46 @@ void collectGarbage() {
 //< log-before-collect
 //> call-mark-roots
 
+/* Garbage Collection call-mark-roots < Optimization omit
   markRoots();
+*/
 //< call-mark-roots
 //> call-trace-references
+/* Garbage Collection call-trace-references < Optimization omit
   traceReferences();
+*/
 //< call-trace-references
+//> Optimization omit
+  markHeap();
+  double stringStart = gcClock();
+//< Optimization omit
 //> sweep-strings
   tableRemoveWhite(&vm.strings);
 //< sweep-strings
+//> Optimization omit
+  vm.gcCycle.stringTime = gcClock() - stringStart;
+  pruneRememberedSet();
+//< Optimization omit
 //> call-sweep
   sweep();
 //< call-sweep
+//> Optimization omit
+  vm.gcCycle.bytesAfter = vm.bytesAllocated;
+//< Optimization omit
+//> Optimization omit
+  clearYoungMarks();
+//< Optimization omit
+//> Optimization omit
+  flushMethodCache();
+//< Optimization omit
 //> update-next-gc
 
+/* Garbage Collection update-next-gc < Optimization omit
   vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+*/
+//> Optimization omit
+  vm.nextGC = paceNextCollection();
+//< Optimization omit
 //< update-next-gc
 //> log-after-collect
 
@@ -331,19 +929,33 @@ void collectGarbage() {
 //< log-collected-amount
 #endif
 //< log-after-collect
+//> Optimization omit
+
+  endPause(start);
+//< Optimization omit
 }
 //< Garbage Collection collect-garbage
 //> Strings free-objects
 void freeObjects() {
+/* Strings free-objects < Optimization omit
   Obj* object = vm.objects;
   while (object != NULL) {
     Obj* next = object->next;
     freeObject(object);
     object = next;
   }
+*/
+//> Optimization omit
+  forEachObject(freeObject);
+  freeHeap();
+//< Optimization omit
 //> Garbage Collection free-gray-stack
 
   free(vm.grayStack);
 //< Garbage Collection free-gray-stack
+//> Optimization omit
+  free(vm.gcHistory);
+  freeNursery();
+//< Optimization omit
 }
 //< Strings free-objects
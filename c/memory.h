@@ -6,6 +6,10 @@
 //> Strings memory-include-object
 #include "object.h"
 //< Strings memory-include-object
+//> Optimization omit
+#include "heap.h"
+#include "vm.h"
+//< Optimization omit
 
 //> Strings allocate
 #define ALLOCATE(type, count) \
@@ -43,5 +47,28 @@ void collectGarbage();
 //> Strings free-objects-h
 void freeObjects();
 //< Strings free-objects-h
+//> Optimization omit
+void blackenObject(Obj* object);
+void markRootShare(int index, int count);
+void freeObject(Obj* object);
+void collectAtSafepoint();
+void printGcPauses();
+void printGcStats();
+double gcClock();
+
+// Call after storing a reference to [object] in the heap. While an
+// incremental collection is marking, the object may be stored in one that
+// was already blackened, so it's grayed in case that was the only path to
+// it.
+static inline void shadeObject(Obj* object) {
+  if (vm.gcState == GC_MARKING && object != NULL && !isMarked(object)) {
+    markObject(object);
+  }
+}
+
+static inline void shadeValue(Value value) {
+  if (IS_OBJ(value)) shadeObject(AS_OBJ(value));
+}
+//< Optimization omit
 
 #endif
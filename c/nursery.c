@@ -0,0 +1,434 @@
+//> Optimization omit
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "nursery.h"
+#include "table.h"
+#include "vm.h"
+
+#ifdef DEBUG_LOG_GC
+#include <stdio.h>
+#endif
+
+// Most objects die young, so new bound methods, instances, strings and
+// upvalues are bump allocated in a fixed arena. When it fills up, the live
+// ones are copied out into the old space, which is the malloc()-backed heap
+// that collectGarbage() manages, and the arena is reused. Objects that tend
+// to live as long as the program, like functions and classes, go straight
+// to the old space.
+//
+// Moving an object means fixing every pointer to it, and the C code all
+// over clox holds object pointers in locals. So the nursery is only
+// collected at safepoints in the interpreter loop where every reference is
+// in a root the collector can update. Until the next one, new objects spill
+// into the old space.
+//
+// Any old object that may point into the nursery is kept in the remembered
+// set. Old objects allocated since the last collection are added when
+// they're created. Later stores into them go through writeBarrier(). The
+// stack, globals and other VM roots aren't heap objects and are always
+// scanned instead.
+//
+// The nursery is split into pages laid out like the old space's, so that
+// isMarked() works the same on young objects. Young objects are laid out
+// back to back in each page.
+
+#define NURSERY_PAGES 16
+#define NURSERY_SIZE (NURSERY_PAGES * HEAP_PAGE_SIZE)
+
+// Each young object is rounded up to this size so that the next one is
+// aligned.
+#define NURSERY_ALIGN 8
+
+static size_t alignSize(size_t size) {
+  return (size + NURSERY_ALIGN - 1) & ~(size_t)(NURSERY_ALIGN - 1);
+}
+
+static Page* nurseryPage(int index) {
+  return (Page*)(vm.nurseryStart + (size_t)index * HEAP_PAGE_SIZE);
+}
+
+void initNursery() {
+  // The extra page leaves room to align the rest.
+  vm.nurseryMemory = malloc(NURSERY_SIZE + HEAP_PAGE_SIZE);
+  if (vm.nurseryMemory == NULL) exit(1);
+  vm.nurseryStart = (uint8_t*)(((uintptr_t)vm.nurseryMemory +
+                                HEAP_PAGE_SIZE - 1) &
+                               ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+  vm.nurseryTop = vm.nurseryStart + PAGE_HEADER_SIZE;
+  vm.nurseryEnd = vm.nurseryStart + NURSERY_SIZE;
+  vm.nurseryFull = false;
+
+  for (int i = 0; i < NURSERY_PAGES; i++) {
+    memset(nurseryPage(i)->marks, 0, sizeof(nurseryPage(i)->marks));
+  }
+
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+
+  vm.youngMemoryCount = 0;
+  vm.youngMemoryCapacity = 0;
+  vm.youngMemory = NULL;
+
+  vm.survivorCount = 0;
+  vm.survivorCapacity = 0;
+  vm.survivors = NULL;
+}
+
+// Frees the memory outside the nursery owned by a young object that died.
+static void freeYoungMemory(Obj* object) {
+  switch (object->type) {
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+      }
+
+      if (instance->dictionary != NULL) {
+        freeTable(instance->dictionary);
+        FREE(Table, instance->dictionary);
+      }
+      break;
+    }
+
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      FREE_ARRAY(char, string->chars, string->length + 1);
+      break;
+    }
+
+    default:
+      break; // Nothing outside the nursery.
+  }
+}
+
+void freeNursery() {
+  for (int i = 0; i < vm.youngMemoryCount; i++) {
+    freeYoungMemory(vm.youngMemory[i]);
+  }
+
+  free(vm.youngMemory);
+  free(vm.remembered);
+  free(vm.survivors);
+  free(vm.nurseryMemory);
+}
+
+// Returns [size] bytes in the nursery, or NULL if it's full.
+Obj* allocateYoung(size_t size) {
+  size = alignSize(size);
+
+  // The top is never at the start of a page, so this is the page it's in.
+  uint8_t* pageEnd = (uint8_t*)pageOf((Obj*)(vm.nurseryTop - 1)) +
+                     HEAP_PAGE_SIZE;
+  if ((size_t)(pageEnd - vm.nurseryTop) < size) {
+    if (size > HEAP_PAGE_SIZE - PAGE_HEADER_SIZE) return NULL;
+
+    if (pageEnd == vm.nurseryEnd) {
+      vm.nurseryFull = true;
+      return NULL;
+    }
+
+    vm.nurseryTop = pageEnd + PAGE_HEADER_SIZE;
+  }
+
+  Obj* object = (Obj*)vm.nurseryTop;
+  vm.nurseryTop += size;
+  return object;
+}
+
+static void appendObject(Obj*** array, int* count, int* capacity,
+                         Obj* object) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *array = (Obj**)realloc(*array, sizeof(Obj*) * *capacity);
+    if (*array == NULL) exit(1);
+  }
+
+  (*array)[(*count)++] = object;
+}
+
+// Records that the young [object] owns memory outside the nursery that
+// needs to be freed if it dies there. Call once per object.
+void trackYoungMemory(Obj* object) {
+  if (!isYoung(object)) return;
+  appendObject(&vm.youngMemory, &vm.youngMemoryCount,
+               &vm.youngMemoryCapacity, object);
+}
+
+void rememberObject(Obj* object) {
+  object->isRemembered = true;
+  appendObject(&vm.remembered, &vm.rememberedCount,
+               &vm.rememberedCapacity, object);
+}
+
+static size_t youngSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance) +
+          sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+    case OBJ_STRING: return sizeof(ObjString);
+    case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+    default:
+      return 0; // Unreachable.
+  }
+}
+
+// The collector makes two passes over the references to young objects.
+// The first marks the live ones. Then they're copied out in the order they
+// were allocated, which keeps objects that were built together close
+// together. The second pass updates the references to point to the copies.
+static bool forwarding = false;
+
+// Once a young object is copied, the field after its header holds where it
+// went. Every object has one.
+static Obj** forwardingAddress(Obj* object) {
+  return (Obj**)(object + 1);
+}
+
+// Visits a reference to [object] and returns what it should now be.
+static Obj* visit(Obj* object) {
+  if (object == NULL || !isYoung(object)) return object;
+
+  if (forwarding) return *forwardingAddress(object);
+
+  if (!isMarked(object)) {
+    setMarked(object);
+
+    // The survivors are scanned front to back while more are appended,
+    // like the scan pointer in Cheney's algorithm.
+    appendObject(&vm.survivors, &vm.survivorCount, &vm.survivorCapacity,
+                 object);
+  }
+  return object;
+}
+
+static void visitValue(Value* value) {
+  if (IS_OBJ(*value)) *value = OBJ_VAL(visit(AS_OBJ(*value)));
+}
+
+// Moving a key doesn't change its hash, so entries can be updated in place.
+static void visitTable(Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key == NULL) continue;
+    entry->key = (ObjString*)visit((Obj*)entry->key);
+    visitValue(&entry->value);
+  }
+}
+
+// Visits everything [object] refers to.
+static void scavengeObject(Obj* object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      visitValue(&bound->receiver);
+      break;
+    }
+
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      klass->name = (ObjString*)visit((Obj*)klass->name);
+      visitTable(&klass->methods);
+      break;
+    }
+
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        closure->upvalues[i] =
+            (ObjUpvalue*)visit((Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+
+    case OBJ_FUNCTION: {
+      // The inline caches only refer to shapes, classes and closures, which
+      // are never young.
+      ObjFunction* function = (ObjFunction*)object;
+      function->name = (ObjString*)visit((Obj*)function->name);
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        visitValue(&function->chunk.constants.values[i]);
+      }
+      for (int i = 0; i < function->chunk.hoisted.count; i++) {
+        visitValue(&function->chunk.hoisted.values[i]);
+      }
+      break;
+    }
+
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      if (instance->shape != NULL) {
+        for (int i = 0; i < instance->shape->slotCount; i++) {
+          visitValue(&instance->fields[i]);
+        }
+      }
+
+      if (instance->dictionary != NULL) visitTable(instance->dictionary);
+      break;
+    }
+
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      shape->name = (ObjString*)visit((Obj*)shape->name);
+      for (int i = 0; i < shape->slotCount; i++) {
+        shape->names[i] = (ObjString*)visit((Obj*)shape->names[i]);
+      }
+      visitTable(&shape->transitions);
+      visitTable(&shape->slots);
+      break;
+    }
+
+    case OBJ_UPVALUE:
+      // The link to the next open upvalue is handled when walking the list
+      // from the VM. Once closed, it's stale.
+      visitValue(&((ObjUpvalue*)object)->closed);
+      break;
+
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+static void visitRoots() {
+  for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    visitValue(slot);
+  }
+
+  for (ObjUpvalue** upvalue = &vm.openUpvalues; *upvalue != NULL;
+       upvalue = &(*upvalue)->next) {
+    *upvalue = (ObjUpvalue*)visit((Obj*)*upvalue);
+  }
+
+  visitTable(&vm.globals);
+  for (int i = 0; i < vm.globalValues.count; i++) {
+    visitValue(&vm.globalValues.values[i]);
+  }
+  vm.initString = (ObjString*)visit((Obj*)vm.initString);
+
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    scavengeObject(vm.remembered[i]);
+  }
+}
+
+static int compareAddresses(const void* a, const void* b) {
+  uintptr_t left = (uintptr_t)*(Obj* const*)a;
+  uintptr_t right = (uintptr_t)*(Obj* const*)b;
+  return (left > right) - (left < right);
+}
+
+static Obj* promote(Obj* object) {
+  size_t size = youngSize(object);
+  Obj* copy = takeCell(size);
+  memcpy(copy, object, size);
+
+  // Fix pointers into the object itself.
+  if (object->type == OBJ_INSTANCE) {
+    ObjInstance* instance = (ObjInstance*)copy;
+    if (instance->fields == ((ObjInstance*)object)->inlineFields) {
+      instance->fields = instance->inlineFields;
+    }
+  } else if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue* upvalue = (ObjUpvalue*)copy;
+    if (upvalue->location == &((ObjUpvalue*)object)->closed) {
+      upvalue->location = &upvalue->closed;
+    }
+  }
+
+  *forwardingAddress(object) = copy;
+
+  // An incremental collection in progress skipped it while it was young.
+  if (vm.gcState == GC_MARKING) markObject(copy);
+
+#ifdef DEBUG_LOG_GC
+  printf("%p promote to %p\n", (void*)object, (void*)copy);
+#endif
+  return copy;
+}
+
+// Copies every live young object into the old space and empties the
+// nursery. Must only be called at a safepoint. Returns how many objects were
+// promoted.
+int collectNursery() {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  visitRoots();
+  for (int i = 0; i < vm.survivorCount; i++) {
+    scavengeObject(vm.survivors[i]);
+  }
+
+  qsort(vm.survivors, vm.survivorCount, sizeof(Obj*), compareAddresses);
+  for (int i = 0; i < vm.survivorCount; i++) {
+    vm.survivors[i] = promote(vm.survivors[i]);
+  }
+
+  forwarding = true;
+  visitRoots();
+  for (int i = 0; i < vm.survivorCount; i++) {
+    scavengeObject(vm.survivors[i]);
+  }
+  forwarding = false;
+  int promoted = vm.survivorCount;
+  vm.survivorCount = 0;
+
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->isRemembered = false;
+  }
+  vm.rememberedCount = 0;
+
+  // The string table holds its keys weakly.
+  for (int i = 0; i < vm.youngMemoryCount; i++) {
+    Obj* object = vm.youngMemory[i];
+    if (isMarked(object)) {
+      if (object->type == OBJ_STRING) {
+        tableReplaceKey(&vm.strings, (ObjString*)object,
+                        (ObjString*)*forwardingAddress(object));
+      }
+    } else {
+      if (object->type == OBJ_STRING) {
+        tableDelete(&vm.strings, (ObjString*)object);
+      }
+      freeYoungMemory(object);
+    }
+  }
+  vm.youngMemoryCount = 0;
+
+  vm.nurseryTop = vm.nurseryStart + PAGE_HEADER_SIZE;
+  vm.nurseryFull = false;
+  clearYoungMarks();
+
+  // The method cache may be keyed on a name that moved.
+  flushMethodCache();
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   promoted %zu bytes\n", vm.bytesAllocated - before);
+#endif
+  return promoted;
+}
+
+// Called by a full collection once it knows which objects are live, to drop
+// the remembered objects it's about to free.
+void pruneRememberedSet() {
+  int count = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    Obj* object = vm.remembered[i];
+    if (isMarked(object)) vm.remembered[count++] = object;
+  }
+  vm.rememberedCount = count;
+}
+
+// A full collection marks young objects too, but doesn't sweep the nursery
+// to clear them again.
+void clearYoungMarks() {
+  for (int i = 0; i < NURSERY_PAGES; i++) {
+    memset(nurseryPage(i)->marks, 0, sizeof(nurseryPage(i)->marks));
+  }
+}
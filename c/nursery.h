@@ -0,0 +1,36 @@
+//> Optimization omit
+#ifndef clox_nursery_h
+#define clox_nursery_h
+
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+void initNursery();
+void freeNursery();
+
+Obj* allocateYoung(size_t size);
+void trackYoungMemory(Obj* object);
+void rememberObject(Obj* object);
+int collectNursery();
+
+void pruneRememberedSet();
+void clearYoungMarks();
+
+static inline bool isYoung(Obj* object) {
+  return (uintptr_t)object >= (uintptr_t)vm.nurseryStart &&
+         (uintptr_t)object < (uintptr_t)vm.nurseryEnd;
+}
+
+// Call after storing [value] somewhere inside [object].
+static inline void writeBarrier(Obj* object, Value value) {
+  if (!IS_OBJ(value)) return;
+
+  if (isYoung(AS_OBJ(value))) {
+    if (!object->isRemembered && !isYoung(object)) rememberObject(object);
+  } else {
+    shadeObject(AS_OBJ(value));
+  }
+}
+
+#endif
@@ -9,6 +9,10 @@
 //< Hash Tables object-include-table
 #include "value.h"
 #include "vm.h"
+//> Optimization omit
+#include "heap.h"
+#include "nursery.h"
+//< Optimization omit
 //> allocate-obj
 
 #define ALLOCATE_OBJ(type, objectType) \
@@ -17,16 +21,50 @@
 //> allocate-object
 
 static Obj* allocateObject(size_t size, ObjType type) {
+//> Optimization omit
+  Obj* object = NULL;
+  switch (type) {
+    case OBJ_BOUND_METHOD:
+    case OBJ_INSTANCE:
+    case OBJ_STRING:
+    case OBJ_UPVALUE:
+      object = allocateYoung(size);
+      break;
+    default:
+      break; // The rest are usually long-lived.
+  }
+
+  if (object != NULL) {
+    object->type = type;
+    object->isRemembered = false;
+    return object;
+  }
+
+//< Optimization omit
+/* Strings allocate-object < Optimization omit
   Obj* object = (Obj*)reallocate(NULL, 0, size);
+*/
+//> Optimization omit
+  object = allocateCell(size);
+//< Optimization omit
   object->type = type;
 //> Garbage Collection init-is-marked
+/* Garbage Collection init-is-marked < Optimization omit
   object->isMarked = false;
+*/
 //< Garbage Collection init-is-marked
 //> add-to-list
+/* Strings add-to-list < Optimization omit
   
   object->next = vm.objects;
   vm.objects = object;
+*/
 //< add-to-list
+//> Optimization omit
+
+  // It may be about to be filled in with references to young objects.
+  rememberObject(object);
+//< Optimization omit
 //> Garbage Collection debug-log-allocate
 
 #ifdef DEBUG_LOG_GC
@@ -47,6 +85,77 @@ ObjBoundMethod* newBoundMethod(Value receiver,
   return bound;
 }
 //< Methods and Initializers new-bound-method
+//> Optimization omit
+#define SHAPE_MAX_FIELDS 64
+#define SHAPE_MAX_TRANSITIONS 16
+
+// Shapes with more fields than this look up slots by hashing.
+#define SHAPE_SCAN_FIELDS 8
+
+static ObjShape* newShape(ObjShape* parent, ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->names = NULL;
+  shape->slotCount = 0;
+  initTable(&shape->transitions);
+  initTable(&shape->slots);
+  if (parent == NULL) return shape;
+
+  push(OBJ_VAL(shape));
+  ObjString** names = ALLOCATE(ObjString*, parent->slotCount + 1);
+  for (int i = 0; i < parent->slotCount; i++) {
+    names[i] = parent->names[i];
+  }
+  names[parent->slotCount] = name;
+  shape->names = names;
+  shape->slotCount = parent->slotCount + 1;
+  pop();
+  return shape;
+}
+
+// Returns the shape reached by adding a field named [name] to an instance
+// with [shape], creating it if needed. Returns NULL if the instance should
+// switch to dictionary mode instead, either because it has too many fields
+// or because instances have already added too many different fields at this
+// point in the tree.
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) return AS_SHAPE(next);
+
+  if (shape->slotCount >= SHAPE_MAX_FIELDS) return NULL;
+  if (shape->transitions.count >= SHAPE_MAX_TRANSITIONS) return NULL;
+
+  ObjShape* child = newShape(shape, name);
+  push(OBJ_VAL(child));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  writeBarrier((Obj*)shape, OBJ_VAL(name));
+  pop();
+  return child;
+}
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  if (shape->slotCount <= SHAPE_SCAN_FIELDS) {
+    for (int i = 0; i < shape->slotCount; i++) {
+      if (shape->names[i] == name) return i;
+    }
+
+    return -1;
+  }
+
+  // Most shapes along a chain are only passed through while an instance is
+  // being initialized, so build the index the first time it's needed.
+  if (shape->slots.count == 0) {
+    for (int i = 0; i < shape->slotCount; i++) {
+      tableSet(&shape->slots, shape->names[i], NUMBER_VAL(i));
+    }
+  }
+
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+//< Optimization omit
 //> Classes and Instances new-class
 ObjClass* newClass(ObjString* name) {
   ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
@@ -54,6 +163,16 @@ ObjClass* newClass(ObjString* name) {
 //> Methods and Initializers init-methods
   initTable(&klass->methods);
 //< Methods and Initializers init-methods
+//> Optimization omit
+  klass->rootShape = NULL;
+  klass->fieldCountHint = 0;
+  klass->windowFieldCount = 0;
+  klass->windowInstances = 0;
+
+  push(OBJ_VAL(klass));
+  klass->rootShape = newShape(NULL, NULL);
+  pop();
+//< Optimization omit
   return klass;
 }
 //< Classes and Instances new-class
@@ -85,17 +204,141 @@ ObjFunction* newFunction() {
 //< Closures init-upvalue-count
   function->name = NULL;
   initChunk(&function->chunk);
+//> Optimization omit
+  function->jit = NULL;
+  function->hotness = 0;
+  function->quickenCount = 0;
+  function->dequickenCount = 0;
+  function->lazy = NULL;
+  function->frameSize = UINT8_COUNT;
+//< Optimization omit
   return function;
 }
 //< Calls and Functions new-function
 //> Classes and Instances new-instance
 ObjInstance* newInstance(ObjClass* klass) {
+/* Classes and Instances new-instance < Optimization omit
   ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+*/
+//> Optimization omit
+  if (++klass->windowInstances > FIELD_HINT_WINDOW) {
+    klass->fieldCountHint = klass->windowFieldCount;
+    klass->windowFieldCount = 0;
+    klass->windowInstances = 1;
+  }
+
+  int capacity = klass->fieldCountHint;
+  ObjInstance* instance = (ObjInstance*)allocateObject(
+      sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
+//< Optimization omit
   instance->klass = klass;
+/* Classes and Instances new-instance < Optimization omit
   initTable(&instance->fields);
+*/
+//> Optimization omit
+  instance->shape = klass->rootShape;
+  instance->fields = instance->inlineFields;
+  instance->fieldCapacity = capacity;
+  instance->dictionary = NULL;
+  instance->inlineCapacity = capacity;
+//< Optimization omit
   return instance;
 }
 //< Classes and Instances new-instance
+//> Optimization omit
+bool instanceGetField(ObjInstance* instance, ObjString* name,
+                      Value* value) {
+  if (instance->shape == NULL) {
+    return tableGet(instance->dictionary, name, value);
+  }
+
+  int slot = shapeSlot(instance->shape, name);
+  if (slot == -1) return false;
+
+  *value = instance->fields[slot];
+  return true;
+}
+
+// Moves [instance] out of its shape and into a hash table of its own.
+static void convertToDictionary(ObjInstance* instance) {
+  // Keep the fields reachable through the shape until they're all copied.
+  Table* dictionary = ALLOCATE(Table, 1);
+  if (instance->fields == instance->inlineFields) {
+    trackYoungMemory((Obj*)instance);
+  }
+
+  initTable(dictionary);
+  instance->dictionary = dictionary;
+
+  ObjShape* shape = instance->shape;
+  for (int i = 0; i < shape->slotCount; i++) {
+    tableSet(dictionary, shape->names[i], instance->fields[i]);
+  }
+
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  }
+
+  instance->shape = NULL;
+  instance->fields = NULL;
+  instance->fieldCapacity = 0;
+}
+
+// Called whenever an instance of [klass] moves to a shape with
+// [fieldCount] fields, including through a set-property site's cached
+// transition, so that the hint sees every instance's final field count.
+void noteFieldCount(ObjClass* klass, int fieldCount) {
+  if (fieldCount > klass->windowFieldCount) {
+    klass->windowFieldCount = fieldCount;
+  }
+  if (fieldCount > klass->fieldCountHint) {
+    klass->fieldCountHint = fieldCount;
+  }
+}
+
+void instanceSetField(ObjInstance* instance, ObjString* name,
+                      Value value) {
+  writeBarrier((Obj*)instance, value);
+  if (instance->shape != NULL) {
+    int slot = shapeSlot(instance->shape, name);
+    if (slot != -1) {
+      instance->fields[slot] = value;
+      return;
+    }
+
+    ObjShape* next = shapeTransition(instance->shape, name);
+    if (next == NULL) {
+      convertToDictionary(instance);
+    } else {
+      if (next->slotCount > instance->fieldCapacity) {
+        int capacity = GROW_CAPACITY(instance->fieldCapacity);
+        Value* fields = ALLOCATE(Value, capacity);
+        for (int i = 0; i < instance->shape->slotCount; i++) {
+          fields[i] = instance->fields[i];
+        }
+
+        if (instance->fields != instance->inlineFields) {
+          FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+        } else {
+          trackYoungMemory((Obj*)instance);
+        }
+
+        instance->fields = fields;
+        instance->fieldCapacity = capacity;
+      }
+
+      instance->fields[next->slotCount - 1] = value;
+      instance->shape = next;
+
+      noteFieldCount(instance->klass, next->slotCount);
+      return;
+    }
+  }
+
+  tableSet(instance->dictionary, name, value);
+  writeBarrier((Obj*)instance, OBJ_VAL(name));
+}
+//< Optimization omit
 //> Calls and Functions new-native
 ObjNative* newNative(NativeFn function) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
@@ -118,6 +361,9 @@ static ObjString* allocateString(char* chars, int length,
 //> Hash Tables allocate-store-hash
   string->hash = hash;
 //< Hash Tables allocate-store-hash
+//> Optimization omit
+  trackYoungMemory((Obj*)string);
+//< Optimization omit
 //> Hash Tables allocate-store-string
 //> Garbage Collection push-string
 
@@ -240,6 +486,11 @@ void printObject(Value value) {
       printf("<native fn>");
       break;
 //< Calls and Functions print-native
+//> Optimization omit
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
+//< Optimization omit
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
@@ -57,6 +57,9 @@
 #define AS_NATIVE(value) \
     (((ObjNative*)AS_OBJ(value))->function)
 //< Calls and Functions as-native
+//> Optimization omit
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
+//< Optimization omit
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 //< as-string
@@ -81,20 +84,35 @@ typedef enum {
 //> Calls and Functions obj-type-native
   OBJ_NATIVE,
 //< Calls and Functions obj-type-native
+//> Optimization omit
+  OBJ_SHAPE,
+//< Optimization omit
   OBJ_STRING,
 //> Closures obj-type-upvalue
   OBJ_UPVALUE
 //< Closures obj-type-upvalue
 } ObjType;
+//> Optimization omit
+
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+//< Optimization omit
 //< obj-type
 
 struct Obj {
   ObjType type;
 //> Garbage Collection is-marked-field
+/* Garbage Collection is-marked-field < Optimization omit
   bool isMarked;
+*/
 //< Garbage Collection is-marked-field
+//> Optimization omit
+  // Whether this old object is in the remembered set.
+  bool isRemembered;
+//< Optimization omit
 //> next-field
+/* Strings next-field < Optimization omit
   struct Obj* next;
+*/
 //< next-field
 };
 //> Calls and Functions obj-function
@@ -107,6 +125,26 @@ typedef struct {
 //< Closures upvalue-count
   Chunk chunk;
   ObjString* name;
+//> Optimization omit
+
+  // The function's native code once it's been called or looped enough, and
+  // how many times it has been so far. See jit.c.
+  struct JitCode* jit;
+  int hotness;
+
+  // How many times instructions in the chunk have specialized themselves
+  // and how many times the speculation failed. See run().
+  int quickenCount;
+  int dequickenCount;
+
+  // Under --lazy, what the compiler needs to compile the function's body
+  // the first time it's called, or NULL once it has. See compileLazy().
+  struct LazyFunction* lazy;
+
+  // How many stack slots a call to the function may use from the start of
+  // its frame. call() makes sure they're there before it runs.
+  int frameSize;
+//< Optimization omit
 } ObjFunction;
 //< Calls and Functions obj-function
 //> Calls and Functions obj-native
@@ -151,14 +189,61 @@ typedef struct {
 //< upvalue-fields
 } ObjClosure;
 //< Closures obj-closure
+//> Optimization omit
+
+// A hidden class describing the layout of an instance's fields. Instances
+// that have had the same fields added in the same order share a shape, which
+// maps each field name to a slot in the instance's field array. Adding a
+// field moves the instance to a child shape in the transition tree rooted at
+// its class.
+typedef struct ObjShape {
+  Obj obj;
+  struct ObjShape* parent;
+
+  // The field added by the transition that led to this shape, or NULL for
+  // the root.
+  ObjString* name;
+
+  // The names of all fields in the shape, indexed by slot.
+  ObjString** names;
+  int slotCount;
+
+  // Maps the name of a field to the shape reached by adding it.
+  Table transitions;
+
+  // Maps field names to slots. Only built for shapes with too many fields
+  // to find by scanning [names].
+  Table slots;
+} ObjShape;
+//< Optimization omit
 //> Classes and Instances obj-class
 
+//> Optimization omit
+// How many instances of a class are made before its field count hint
+// forgets the instances before them.
+#define FIELD_HINT_WINDOW 64
+
+//< Optimization omit
 typedef struct {
   Obj obj;
   ObjString* name;
 //> Methods and Initializers class-methods
   Table methods;
 //< Methods and Initializers class-methods
+//> Optimization omit
+  ObjShape* rootShape;
+
+  // How many fields to make room for in new instances: the most any of the
+  // last FIELD_HINT_WINDOW instances, or the ones since, has ended up with.
+  // An instance with more fields than usual only makes the instances after
+  // it bigger until the window has moved past it.
+  int fieldCountHint;
+
+  // The most fields any instance since the window last moved has ended up
+  // with, and how many instances have been made since.
+  int windowFieldCount;
+  int windowInstances;
+//< Optimization omit
 } ObjClass;
 //< Classes and Instances obj-class
 //> Classes and Instances obj-instance
@@ -166,7 +251,22 @@ typedef struct {
 typedef struct {
   Obj obj;
   ObjClass* klass;
+/* Classes and Instances obj-instance < Optimization omit
   Table fields; // [fields]
+*/
+//> Optimization omit
+  // The layout of [fields], or NULL if the instance has fallen back to
+  // storing its fields in [dictionary].
+  ObjShape* shape;
+  Value* fields;
+  int fieldCapacity;
+  Table* dictionary;
+
+  // Storage allocated along with the instance itself. [fields] points here
+  // until the instance outgrows it.
+  int inlineCapacity;
+  Value inlineFields[];
+//< Optimization omit
 } ObjInstance;
 //< Classes and Instances obj-instance
 
@@ -194,6 +294,14 @@ ObjFunction* newFunction();
 //> Classes and Instances new-instance-h
 ObjInstance* newInstance(ObjClass* klass);
 //< Classes and Instances new-instance-h
+//> Optimization omit
+int shapeSlot(ObjShape* shape, ObjString* name);
+bool instanceGetField(ObjInstance* instance, ObjString* name,
+                      Value* value);
+void instanceSetField(ObjInstance* instance, ObjString* name,
+                      Value value);
+void noteFieldCount(ObjClass* klass, int fieldCount);
+//< Optimization omit
 //> Calls and Functions new-native-h
 ObjNative* newNative(NativeFn function);
 //< Calls and Functions new-native-h
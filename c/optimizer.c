@@ -0,0 +1,1332 @@
+//> Optimization omit
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "memory.h"
+#include "optimizer.h"
+
+// One instruction in the chunk being rewritten.
+typedef struct {
+  // The opcode to emit. If the instruction is the start of a fused sequence,
+  // this is the superinstruction.
+  uint8_t op;
+
+  // The operands of a superinstruction or a rewritten register instruction.
+  // Other instructions copy their operands from the original code.
+  uint8_t operands[4];
+
+  // Where the instruction starts in the original code and how many bytes it
+  // takes up there.
+  int offset;
+  int size;
+
+  // The number of bytes it takes up in the optimized code.
+  int newSize;
+
+  // Where it starts in the optimized code.
+  int newOffset;
+
+  // If it's a jump, the original offset of the instruction it lands on.
+  int target;
+
+  int line;
+
+  // Whether a jump lands on it. A fused sequence may start at a jump target
+  // but can't extend through one.
+  bool isTarget;
+
+  // Whether the instruction was rewritten to a superinstruction.
+  bool rewritten;
+
+  // Whether it was folded into a superinstruction earlier in the code.
+  bool fused;
+
+  // Whether it's a jump that needs an OP_WIDE prefix to reach its target.
+  bool wide;
+
+  // If a loop whose loads were hoisted starts here, the range of hoisted
+  // loads that the OP_ENTER_LOOP in front of it forgets, and the index of
+  // the last instruction in the loop. Jumps from inside the loop land past
+  // the prefix.
+  int enterFirst;
+  int enterCount;
+  int loopEnd;
+
+  // If a hoisted load starts here, its entry in the chunk's hoisted loads
+  // and the index of its last instruction, or -1.
+  int hoisted;
+  int hoistedEnd;
+
+  // If a hoisted load ends here, the entry that the OP_SET_HOISTED after it
+  // fills in, or -1.
+  int cached;
+} Instruction;
+
+typedef struct {
+  Chunk* chunk;
+  Instruction* code;
+  int count;
+
+  // Maps an offset in the original code to the index of the instruction
+  // that starts there.
+  int* indexes;
+} Optimizer;
+
+static bool isJump(uint8_t op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_LESS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void decode(Optimizer* optimizer, FarJump* farJumps,
+                   int farJumpCount) {
+  Chunk* chunk = optimizer->chunk;
+  int lineStart = 0;
+  for (int offset = 0; offset < chunk->count;) {
+    while (lineStart + 1 < chunk->lineCount &&
+           chunk->lines[lineStart + 1].offset <= offset) {
+      lineStart++;
+    }
+
+    Instruction* instruction = &optimizer->code[optimizer->count];
+    instruction->op = chunk->code[offset];
+    instruction->offset = offset;
+    instruction->size = instructionSize(chunk, offset);
+    instruction->newSize = instruction->size;
+    instruction->target = -1;
+    instruction->line = chunk->lines[lineStart].line;
+    instruction->isTarget = false;
+    instruction->rewritten = false;
+    instruction->fused = false;
+    instruction->wide = false;
+    instruction->enterFirst = 0;
+    instruction->enterCount = 0;
+    instruction->loopEnd = -1;
+    instruction->hoisted = -1;
+    instruction->hoistedEnd = -1;
+    instruction->cached = -1;
+
+    if (isJump(instruction->op)) {
+      uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) |
+                                 chunk->code[offset + 2]);
+      instruction->target = instruction->op == OP_LOOP
+          ? offset + instruction->size - jump : offset + 3 + jump;
+    }
+
+    optimizer->indexes[offset] = optimizer->count++;
+    offset += instruction->size;
+  }
+
+  optimizer->indexes[chunk->count] = optimizer->count;
+
+  for (int i = 0; i < farJumpCount; i++) {
+    int index = optimizer->indexes[farJumps[i].offset];
+    optimizer->code[index].target = farJumps[i].target;
+  }
+}
+
+// Returns the instruction that a jump at [instruction] lands on, or NULL if
+// it jumps to the very end of the chunk.
+static Instruction* jumpTarget(Optimizer* optimizer,
+                               Instruction* instruction) {
+  int index = optimizer->indexes[instruction->target];
+  if (index == optimizer->count) return NULL;
+  return &optimizer->code[index];
+}
+
+static void markTargets(Optimizer* optimizer) {
+  for (int i = 0; i < optimizer->count; i++) {
+    optimizer->code[i].isTarget = false;
+  }
+
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused || instruction->target == -1) continue;
+
+    Instruction* target = jumpTarget(optimizer, instruction);
+    if (target != NULL) target->isTarget = true;
+  }
+}
+
+// Returns the live instruction [distance] places after the one at [index] if
+// it can be folded into a superinstruction starting at [index]. Returns NULL
+// if there is no such instruction or a jump lands on it.
+static Instruction* following(Optimizer* optimizer, int index,
+                              int distance) {
+  for (int i = index + 1; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+    if (instruction->isTarget) return NULL;
+    if (--distance == 0) return instruction;
+  }
+
+  return NULL;
+}
+
+static void rewrite(Instruction* instruction, uint8_t op, int operandCount) {
+  instruction->op = op;
+  instruction->newSize = 1 + operandCount;
+  instruction->rewritten = true;
+}
+
+// The condition of an if statement or loop is tested with OP_JUMP_IF_FALSE,
+// which leaves the condition on the stack so that `and` can reuse it. Both
+// paths then immediately discard it. When the jump lands on an OP_POP, fold
+// the pop on the fallthrough path into the jump and skip past the one at the
+// target.
+static void fusePopJumps(Optimizer* optimizer) {
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->op != OP_JUMP_IF_FALSE) continue;
+
+    Instruction* pop = following(optimizer, i, 1);
+    if (pop == NULL || pop->op != OP_POP) continue;
+
+    Instruction* target = jumpTarget(optimizer, instruction);
+    if (target == NULL || target->op != OP_POP) continue;
+
+    instruction->op = OP_POP_JUMP_IF_FALSE;
+    instruction->target = target->offset + target->size;
+    pop->fused = true;
+  }
+
+  markTargets(optimizer);
+}
+
+// Retargeting jumps can leave the pop they used to land on unreachable. Drop
+// any instruction that follows an unconditional transfer of control and that
+// no jump lands on.
+static void removeUnreachable(Optimizer* optimizer) {
+  bool reachable = true;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+
+    if (instruction->isTarget) reachable = true;
+    if (!reachable) {
+      instruction->fused = true;
+      continue;
+    }
+
+    if (instruction->op == OP_JUMP || instruction->op == OP_LOOP ||
+        instruction->op == OP_RETURN) {
+      reachable = false;
+    }
+  }
+
+  markTargets(optimizer);
+}
+
+// The passes below only run at -O2. Each follows control flow through the
+// whole function, which costs more compile time than the peephole rewrites.
+
+// Retargets jumps that land on another jump to where that one goes. An
+// OP_JUMP_IF_FALSE that lands on another one testing the same value, as at
+// the end of an "and" used as a condition, skips it. An OP_JUMP that lands
+// on an OP_LOOP or OP_RETURN becomes a copy of it.
+static void threadJumps(Optimizer* optimizer) {
+  Chunk* chunk = optimizer->chunk;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused || instruction->target == -1 ||
+        instruction->op == OP_LOOP) {
+      continue;
+    }
+
+    // Forward jumps can't form a cycle, so this ends.
+    for (;;) {
+      Instruction* target = jumpTarget(optimizer, instruction);
+      if (target == NULL) break;
+
+      if (target->op == OP_JUMP ||
+          (target->op == OP_JUMP_IF_FALSE &&
+           instruction->op == OP_JUMP_IF_FALSE)) {
+        instruction->target = target->target;
+      } else if (target->op == OP_LOOP && instruction->op == OP_JUMP) {
+        // Both share the loop's counter.
+        rewrite(instruction, OP_LOOP, 4);
+        memcpy(instruction->operands, &chunk->code[target->offset + 1], 4);
+        instruction->target = target->target;
+        break;
+      } else if (target->op == OP_RETURN && instruction->op == OP_JUMP) {
+        rewrite(instruction, OP_RETURN, 0);
+        instruction->target = -1;
+        break;
+      } else {
+        break;
+      }
+    }
+  }
+
+  markTargets(optimizer);
+}
+
+// A set of local slots.
+typedef struct {
+  uint64_t bits[UINT8_COUNT / 64];
+} SlotSet;
+
+static void addSlot(SlotSet* set, uint8_t slot) {
+  set->bits[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static void removeSlot(SlotSet* set, uint8_t slot) {
+  set->bits[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+static bool hasSlot(SlotSet* set, uint8_t slot) {
+  return (set->bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void addSlots(SlotSet* set, SlotSet* other) {
+  for (int i = 0; i < UINT8_COUNT / 64; i++) set->bits[i] |= other->bits[i];
+}
+
+static bool fallsThrough(uint8_t op) {
+  return op != OP_JUMP && op != OP_LOOP && op != OP_RETURN;
+}
+
+// Returns the slot that [instruction] stores to, or -1 if it doesn't.
+static int storedSlot(Optimizer* optimizer, Instruction* instruction) {
+  uint8_t* code = &optimizer->chunk->code[instruction->offset];
+  switch (instruction->op) {
+    case OP_SET_LOCAL:
+      return instruction->rewritten ? instruction->operands[0] : code[1];
+
+    case OP_ADD_REG:
+    case OP_SUBTRACT_REG:
+    case OP_MULTIPLY_REG:
+    case OP_DIVIDE_REG:
+    case OP_EQUAL_REG:
+    case OP_GREATER_REG:
+    case OP_LESS_REG:
+    case OP_MOVE:
+      return code[2] == 0 ? -1 : code[2];
+
+    default:
+      return -1;
+  }
+}
+
+// Adds the slots that [instruction] reads to [live].
+static void addReadSlots(Optimizer* optimizer, Instruction* instruction,
+                         SlotSet* live) {
+  uint8_t* code = &optimizer->chunk->code[instruction->offset];
+  switch (instruction->op) {
+    case OP_GET_LOCAL:
+      addSlot(live, code[1]);
+      break;
+
+    case OP_ADD_REG:
+    case OP_SUBTRACT_REG:
+    case OP_MULTIPLY_REG:
+    case OP_DIVIDE_REG:
+    case OP_EQUAL_REG:
+    case OP_GREATER_REG:
+    case OP_LESS_REG:
+      if (RIGHT_KIND(code[1]) == OPERAND_REGISTER) addSlot(live, code[4]);
+      // Fallthrough.
+    case OP_MOVE:
+      if (LEFT_KIND(code[1]) == OPERAND_REGISTER) addSlot(live, code[3]);
+      break;
+  }
+}
+
+// Finds the slots that are read after each instruction before anything
+// stores to them again, and returns the set for each instruction, indexed
+// like the instructions. Slots captured by a closure can be read at any
+// time, so they're always included.
+static SlotSet* liveSlots(Optimizer* optimizer) {
+  Chunk* chunk = optimizer->chunk;
+  SlotSet captured = {{0}};
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+
+    // Skip the prefix on a closure whose function's constant index is wide.
+    int start = instruction->offset;
+    if (instruction->op == OP_WIDE) start += 3;
+    if (chunk->code[start] != OP_CLOSURE) continue;
+
+    // A slot past the first 256 is only ever named with an OP_WIDE prefix,
+    // which the passes leave alone, so it doesn't need tracking.
+    uint8_t* code = &chunk->code[start];
+    int size = instruction->offset + instruction->size - start;
+    for (int j = 2; j < size; j += 3) {
+      if (code[j] && code[j + 1] == 0) addSlot(&captured, code[j + 2]);
+    }
+  }
+
+  // Live on entry to each instruction, then live on exit once solved.
+  SlotSet* liveIn = ALLOCATE(SlotSet, optimizer->count);
+  SlotSet* liveOut = ALLOCATE(SlotSet, optimizer->count);
+  for (int i = 0; i < optimizer->count; i++) {
+    liveIn[i] = captured;
+    liveOut[i] = captured;
+  }
+
+  // Loops carry liveness back to their headers, so go around until nothing
+  // changes. Walking backwards, most of it settles in the first sweep.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int next = -1;
+    for (int i = optimizer->count - 1; i >= 0; i--) {
+      Instruction* instruction = &optimizer->code[i];
+      if (instruction->fused) continue;
+
+      SlotSet live = captured;
+      if (fallsThrough(instruction->op) && next != -1) {
+        addSlots(&live, &liveIn[next]);
+      }
+
+      if (instruction->target != -1) {
+        int target = optimizer->indexes[instruction->target];
+        if (target != optimizer->count) addSlots(&live, &liveIn[target]);
+      }
+
+      liveOut[i] = live;
+      int stored = storedSlot(optimizer, instruction);
+      if (stored != -1 && !hasSlot(&captured, (uint8_t)stored)) {
+        removeSlot(&live, (uint8_t)stored);
+      }
+      addReadSlots(optimizer, instruction, &live);
+
+      if (memcmp(&live, &liveIn[i], sizeof(SlotSet)) != 0) {
+        liveIn[i] = live;
+        changed = true;
+      }
+
+      next = i;
+    }
+  }
+
+  FREE_ARRAY(SlotSet, liveIn, optimizer->count);
+  return liveOut;
+}
+
+// Drops the load in a store to a local that's popped and then loaded right
+// back, leaving the stored value on the stack instead.
+static void forwardStores(Optimizer* optimizer) {
+  Chunk* chunk = optimizer->chunk;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+
+    uint8_t* code = &chunk->code[instruction->offset];
+    if (instruction->op == OP_SET_LOCAL) {
+      Instruction* pop = following(optimizer, i, 1);
+      Instruction* load = following(optimizer, i, 2);
+      if (pop == NULL || pop->op != OP_POP || load == NULL ||
+          load->op != OP_GET_LOCAL ||
+          chunk->code[load->offset + 1] != code[1]) {
+        continue;
+      }
+
+      pop->fused = true;
+      load->fused = true;
+    } else if (instruction->op == OP_MOVE &&
+               LEFT_KIND(code[1]) == OPERAND_STACK) {
+      // The register form pops the value as it stores it.
+      Instruction* load = following(optimizer, i, 1);
+      if (load == NULL || load->op != OP_GET_LOCAL ||
+          chunk->code[load->offset + 1] != code[2]) {
+        continue;
+      }
+
+      rewrite(instruction, OP_SET_LOCAL, 1);
+      instruction->operands[0] = code[2];
+      load->fused = true;
+    }
+  }
+}
+
+static bool pushesConstant(uint8_t op) {
+  return op == OP_CONSTANT || op == OP_CONSTANT_LONG || op == OP_NIL ||
+         op == OP_TRUE || op == OP_FALSE || op == OP_GET_LOCAL;
+}
+
+// Removes stores to locals that nothing reads before the next store, and
+// values that are pushed only to be popped right away.
+static void removeDeadStores(Optimizer* optimizer) {
+  SlotSet* liveOut = liveSlots(optimizer);
+
+  Chunk* chunk = optimizer->chunk;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+
+    uint8_t* code = &chunk->code[instruction->offset];
+    int stored = storedSlot(optimizer, instruction);
+    if (stored != -1 && !hasSlot(&liveOut[i], (uint8_t)stored)) {
+      if (instruction->op == OP_SET_LOCAL) {
+        // The value stays on the stack, as it would have after the store.
+        if (!instruction->isTarget) instruction->fused = true;
+      } else if (instruction->op == OP_MOVE && !instruction->rewritten) {
+        if (LEFT_KIND(code[1]) == OPERAND_STACK) {
+          rewrite(instruction, OP_POP, 0);
+        } else if (!instruction->isTarget) {
+          instruction->fused = true;
+        }
+      }
+
+      // The register arithmetic instructions can fail, so they stay.
+    }
+  }
+
+  FREE_ARRAY(SlotSet, liveOut, optimizer->count);
+
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused || instruction->rewritten ||
+        instruction->isTarget || !pushesConstant(instruction->op)) {
+      continue;
+    }
+
+    Instruction* pop = following(optimizer, i, 1);
+    if (pop != NULL && pop->op == OP_POP) {
+      instruction->fused = true;
+      pop->fused = true;
+    }
+  }
+}
+
+// The most distinct expressions reuseValues() numbers in a block before it
+// starts over, which keeps the search for a match short.
+#define MAX_EXPRESSIONS 256
+
+// How a value was computed: an operator or load with its operand, applied
+// to the values numbered [left] and [right], or -1 where there's none.
+typedef struct {
+  uint8_t op;
+  int operand;
+  int left;
+  int right;
+} Expression;
+
+// A value on the stack while reuseValues() walks a block.
+typedef struct {
+  // The number of the expression that computed it.
+  int number;
+
+  // The index of the first instruction in the code that computes it.
+  int start;
+} StackValue;
+
+typedef struct {
+  Expression expressions[MAX_EXPRESSIONS];
+  int expressionCount;
+
+  // The values pushed since the numbering last started over. Anything below
+  // them is unknown.
+  StackValue* stack;
+  int stackCount;
+} Numbering;
+
+// Returns the number of [expression], numbering it if it's new, or -1 if
+// there's no room for another.
+static int numberExpression(Numbering* numbering, Expression* expression) {
+  for (int i = 0; i < numbering->expressionCount; i++) {
+    Expression* other = &numbering->expressions[i];
+    if (other->op == expression->op &&
+        other->operand == expression->operand &&
+        other->left == expression->left &&
+        other->right == expression->right) {
+      return i;
+    }
+  }
+
+  if (numbering->expressionCount == MAX_EXPRESSIONS) return -1;
+  numbering->expressions[numbering->expressionCount] = *expression;
+  return numbering->expressionCount++;
+}
+
+// Returns how many values the instruction that computes an expression
+// takes off the stack, or -1 if it isn't one that reuseValues() knows
+// won't change with nothing stored in between. Fills in its operand.
+static int expressionInputs(Optimizer* optimizer, Instruction* instruction,
+                            int* operand) {
+  uint8_t* code = &optimizer->chunk->code[instruction->offset];
+  *operand = 0;
+  switch (instruction->op) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      return 0;
+
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+      *operand = code[1];
+      return 0;
+
+    case OP_CONSTANT_LONG:
+      *operand = (code[1] << 16) | (code[2] << 8) | code[3];
+      return 0;
+
+    case OP_GET_GLOBAL:
+      *operand = (code[1] << 8) | code[2];
+      return 0;
+
+    case OP_GET_PROPERTY:
+      // The name. The cache index differs from one load to the next.
+      *operand = code[1];
+      return 1;
+
+    case OP_NOT:
+    case OP_NEGATE:
+      return 1;
+
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return 2;
+
+    default:
+      return -1;
+  }
+}
+
+// Local common subexpression elimination. Within a basic block, numbers
+// each value on the stack by how it was computed. When the code for a
+// value computes one that is still on the stack, as in "p.x * p.x", it's
+// replaced with an OP_PICK that copies that one. Stores, calls and anything
+// else that could change what a load sees make it start over.
+static void reuseValues(Optimizer* optimizer) {
+  Numbering numbering;
+  numbering.expressionCount = 0;
+  numbering.stack = ALLOCATE(StackValue, optimizer->count);
+  numbering.stackCount = 0;
+
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+
+    if (instruction->isTarget) {
+      numbering.expressionCount = 0;
+      numbering.stackCount = 0;
+    }
+
+    Expression expression;
+    int inputs = expressionInputs(optimizer, instruction,
+                                  &expression.operand);
+    if (instruction->op == OP_POP && numbering.stackCount > 0) {
+      numbering.stackCount--;
+      continue;
+    }
+
+    if (inputs == -1 || inputs > numbering.stackCount) {
+      numbering.expressionCount = 0;
+      numbering.stackCount = 0;
+      continue;
+    }
+
+    // Both load from the constant table.
+    expression.op = instruction->op == OP_CONSTANT_LONG
+        ? (uint8_t)OP_CONSTANT : instruction->op;
+    StackValue* operands = &numbering.stack[numbering.stackCount - inputs];
+    expression.left = inputs > 0 ? operands[0].number : -1;
+    expression.right = inputs > 1 ? operands[1].number : -1;
+    int start = inputs > 0 ? operands[0].start : i;
+    numbering.stackCount -= inputs;
+
+    int number = numberExpression(&numbering, &expression);
+    if (number == -1) {
+      numbering.expressionCount = 0;
+      numbering.stackCount = 0;
+      continue;
+    }
+
+    // A single load is no slower than copying what it loads.
+    for (int j = numbering.stackCount - 1;
+         start != i && j >= 0 && numbering.stackCount - 1 - j <= UINT8_MAX;
+         j--) {
+      if (numbering.stack[j].number != number) continue;
+
+      Instruction* pick = &optimizer->code[start];
+      rewrite(pick, OP_PICK, 1);
+      pick->operands[0] = (uint8_t)(numbering.stackCount - 1 - j);
+      for (int k = start + 1; k <= i; k++) optimizer->code[k].fused = true;
+      break;
+    }
+
+    numbering.stack[numbering.stackCount].number = number;
+    numbering.stack[numbering.stackCount].start = start;
+    numbering.stackCount++;
+  }
+
+  FREE_ARRAY(StackValue, numbering.stack, optimizer->count);
+}
+
+static bool isSmallInt(Value value) {
+  if (!IS_NUMBER(value)) return false;
+
+  double number = AS_NUMBER(value);
+  return number >= 0 && number <= UINT8_MAX &&
+         number == (int)number && !signbit(number);
+}
+
+// Rewrites the operand of [kind] at [*index] in a register instruction into
+// a small integer if it's a constant that is one. Returns the new kind.
+static int smallIntOperand(Chunk* chunk, int kind, uint8_t* index) {
+  if (kind != OPERAND_CONSTANT) return kind;
+
+  Value constant = chunk->constants.values[*index];
+  if (!isSmallInt(constant)) return kind;
+
+  *index = (uint8_t)AS_NUMBER(constant);
+  return OPERAND_SMALL_INT;
+}
+
+static void fuseSequences(Optimizer* optimizer) {
+  Chunk* chunk = optimizer->chunk;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+
+    uint8_t operand = instruction->size > 1
+        ? chunk->code[instruction->offset + 1] : 0;
+    Instruction* next = following(optimizer, i, 1);
+
+    switch (instruction->op) {
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG: {
+        int index = operand;
+        if (instruction->op == OP_CONSTANT_LONG) {
+          uint8_t* code = &chunk->code[instruction->offset];
+          index = (code[1] << 16) | (code[2] << 8) | code[3];
+        }
+
+        Value constant = chunk->constants.values[index];
+        if (isSmallInt(constant)) {
+          rewrite(instruction, OP_SMALL_INT, 1);
+          instruction->operands[0] = (uint8_t)AS_NUMBER(constant);
+        }
+        break;
+      }
+
+      case OP_POP: {
+        int count = 1;
+        Instruction* pop = next;
+        while (count < UINT8_MAX && pop != NULL && pop->op == OP_POP) {
+          pop->fused = true;
+          count++;
+          pop = following(optimizer, i, 1);
+        }
+
+        if (count > 1) {
+          rewrite(instruction, OP_POPN, 1);
+          instruction->operands[0] = (uint8_t)count;
+        }
+        break;
+      }
+
+      case OP_GET_LOCAL: {
+        if (next == NULL) break;
+
+        Instruction* add = following(optimizer, i, 2);
+        if (next->op == OP_GET_LOCAL && add != NULL && add->op == OP_ADD) {
+          rewrite(instruction, OP_ADD_LOCALS, 2);
+          instruction->operands[0] = operand;
+          instruction->operands[1] = chunk->code[next->offset + 1];
+          instruction->line = add->line;
+          next->fused = true;
+          add->fused = true;
+        } else if (operand == 0 && next->op == OP_GET_PROPERTY) {
+          // Slot zero is only ever accessed by name as "this".
+          rewrite(instruction, OP_GET_THIS_FIELD, 3);
+          memcpy(instruction->operands, &chunk->code[next->offset + 1], 3);
+          instruction->line = next->line;
+          next->fused = true;
+        }
+        break;
+      }
+
+      case OP_ADD_REG:
+      case OP_SUBTRACT_REG:
+      case OP_MULTIPLY_REG:
+      case OP_DIVIDE_REG:
+      case OP_EQUAL_REG:
+      case OP_GREATER_REG:
+      case OP_LESS_REG:
+      case OP_MOVE: {
+        uint8_t* operands = instruction->operands;
+        memcpy(operands, &chunk->code[instruction->offset + 1],
+               instruction->size - 1);
+        int left = smallIntOperand(chunk, LEFT_KIND(operands[0]),
+                                   &operands[2]);
+        int right = RIGHT_KIND(operands[0]);
+        if (instruction->op != OP_MOVE) {
+          right = smallIntOperand(chunk, right, &operands[3]);
+        }
+
+        uint8_t kinds = OPERAND_KINDS(left, right);
+        if (kinds != operands[0]) {
+          operands[0] = kinds;
+          rewrite(instruction, instruction->op, instruction->size - 1);
+        }
+        break;
+      }
+
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS: {
+        if (next == NULL || next->op != OP_POP_JUMP_IF_FALSE) break;
+
+        uint8_t op = instruction->op == OP_EQUAL ? OP_JUMP_IF_NOT_EQUAL
+            : instruction->op == OP_GREATER ? OP_JUMP_IF_NOT_GREATER
+            : OP_JUMP_IF_NOT_LESS;
+        rewrite(instruction, op, 2);
+        instruction->target = next->target;
+        next->fused = true;
+        break;
+      }
+    }
+  }
+}
+
+// The most property loads in a chain that hoistLoads() caches as one.
+#define MAX_HOISTED_PROPERTIES 8
+
+// A loop's code, from its header to the last instruction that jumps back
+// to it.
+typedef struct {
+  int start;
+  int end;
+
+  // Whether loads can be hoisted out of it. Nothing in it may call anything
+  // or store to a property, so that a property load from an object that
+  // stays the same does too, and no jump from outside may land past the
+  // header.
+  bool hoistable;
+
+  // The hoisted loads in the loop.
+  int first;
+  int count;
+} Loop;
+
+static bool overlaps(Loop* a, Loop* b) {
+  if (a->start == b->start) return true;
+  return (a->start < b->start && b->start <= a->end && a->end < b->end) ||
+         (b->start < a->start && a->start <= b->end && b->end < a->end);
+}
+
+// Finds the loops in the code. A for loop's increment clause jumps back to
+// the condition and its body jumps back to the increment, so loops that
+// partly overlap are one loop. Returns the number found.
+static int findLoops(Optimizer* optimizer, Loop* loops) {
+  int count = 0;
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused || instruction->op != OP_LOOP) continue;
+
+    loops[count].start = optimizer->indexes[instruction->target];
+    loops[count].end = i;
+    count++;
+  }
+
+  bool merged = true;
+  while (merged) {
+    merged = false;
+    for (int i = 0; i < count; i++) {
+      for (int j = i + 1; j < count; j++) {
+        if (!overlaps(&loops[i], &loops[j])) continue;
+
+        if (loops[j].start < loops[i].start) {
+          loops[i].start = loops[j].start;
+        }
+        if (loops[j].end > loops[i].end) loops[i].end = loops[j].end;
+        loops[j--] = loops[--count];
+        merged = true;
+      }
+    }
+  }
+
+  // Outer loops first.
+  for (int i = 1; i < count; i++) {
+    Loop loop = loops[i];
+    int j = i;
+    for (; j > 0 && loops[j - 1].start > loop.start; j--) {
+      loops[j] = loops[j - 1];
+    }
+    loops[j] = loop;
+  }
+
+  for (int i = 0; i < count; i++) {
+    Loop* loop = &loops[i];
+    loop->hoistable = true;
+    loop->first = 0;
+    loop->count = 0;
+    for (int j = 0; j < optimizer->count; j++) {
+      Instruction* instruction = &optimizer->code[j];
+      if (instruction->fused) continue;
+
+      if (j >= loop->start && j <= loop->end) {
+        switch (instruction->op) {
+          case OP_CALL:
+          case OP_INVOKE:
+          case OP_SUPER_INVOKE:
+          case OP_TAIL_CALL:
+          case OP_TAIL_INVOKE:
+          case OP_TAIL_SUPER_INVOKE:
+          case OP_SET_PROPERTY:
+          // Could be either of those with a wide operand.
+          case OP_WIDE:
+            loop->hoistable = false;
+            break;
+        }
+      } else if (instruction->target != -1) {
+        // The OP_ENTER_LOOP only runs when the loop is entered at the top.
+        int target = optimizer->indexes[instruction->target];
+        if (target > loop->start && target <= loop->end) {
+          loop->hoistable = false;
+        }
+      }
+    }
+  }
+
+  return count;
+}
+
+// Returns true if nothing in [loop] stores to the variable that the load
+// at [instruction] reads.
+static bool isInvariant(Optimizer* optimizer, Loop* loop,
+                        Instruction* instruction) {
+  Chunk* chunk = optimizer->chunk;
+  uint8_t* load = &chunk->code[instruction->offset];
+  for (int i = loop->start; i <= loop->end; i++) {
+    Instruction* other = &optimizer->code[i];
+    if (other->fused) continue;
+
+    uint8_t* code = &chunk->code[other->offset];
+    switch (instruction->op) {
+      case OP_GET_GLOBAL:
+        if ((other->op == OP_SET_GLOBAL ||
+             other->op == OP_DEFINE_GLOBAL) &&
+            code[1] == load[1] && code[2] == load[2]) {
+          return false;
+        }
+        break;
+
+      case OP_GET_UPVALUE:
+        if (other->op == OP_SET_UPVALUE && code[1] == load[1]) return false;
+        break;
+
+      case OP_GET_LOCAL:
+        if (storedSlot(optimizer, other) == load[1]) return false;
+        break;
+
+      // "this" can't be assigned.
+      case OP_GET_THIS_FIELD:
+        break;
+    }
+  }
+
+  return true;
+}
+
+// Returns the index of the last property load in the chain that starts
+// with the load at [index], or -1 if the value it loads could change while
+// a loop runs even if nothing is stored to the variable. A parameter or
+// "this" stays put, but the loop itself may declare a local in the same
+// slot as some other one.
+static int loadChainEnd(Optimizer* optimizer, int index, int arity) {
+  Instruction* instruction = &optimizer->code[index];
+  int properties = 0;
+  switch (instruction->op) {
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+      if (instruction->rewritten) return -1;
+      break;
+
+    case OP_GET_LOCAL:
+      if (instruction->rewritten ||
+          optimizer->chunk->code[instruction->offset + 1] > arity) {
+        return -1;
+      }
+      break;
+
+    case OP_GET_THIS_FIELD:
+      properties = 1;
+      break;
+
+    default:
+      return -1;
+  }
+
+  int end = index;
+  for (;;) {
+    if (properties == MAX_HOISTED_PROPERTIES) break;
+
+    Instruction* next = following(optimizer, end, 1);
+    if (next == NULL || next->op != OP_GET_PROPERTY || next->rewritten) {
+      break;
+    }
+
+    end = (int)(next - optimizer->code);
+    properties++;
+  }
+
+  // Loading a global or local is already as quick as the cache.
+  return properties > 0 ? end : -1;
+}
+
+// Loop-invariant code motion for loads. In a loop that makes no calls and
+// stores to no property, a chain of property loads from a global, upvalue,
+// parameter or "this" that the loop doesn't assign gets the same value
+// every time around. The first trip around loads it as usual, and an
+// OP_SET_HOISTED after the chain caches it. From then on, the
+// OP_GET_HOISTED in front pushes the cached value and skips the chain. The
+// OP_ENTER_LOOP in front of the loop forgets the cached values each time
+// the loop starts. Errors are still reported where and when the loads
+// would have reported them.
+static void hoistLoads(Optimizer* optimizer, int arity) {
+  Loop* loops = ALLOCATE(Loop, optimizer->count);
+  int loopCount = findLoops(optimizer, loops);
+
+  // Each chain goes with the outermost loop it's invariant in.
+  int* chainLoops = ALLOCATE(int, optimizer->count);
+  for (int i = 0; i < optimizer->count; i++) chainLoops[i] = -1;
+
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+
+    int end = loadChainEnd(optimizer, i, arity);
+    if (end == -1) continue;
+
+    for (int j = 0; j < loopCount; j++) {
+      Loop* loop = &loops[j];
+      if (loop->hoistable && i >= loop->start && end <= loop->end &&
+          isInvariant(optimizer, loop, instruction)) {
+        chainLoops[i] = j;
+        instruction->hoistedEnd = end;
+        break;
+      }
+    }
+
+    i = end;
+  }
+
+  // The loads for each loop are numbered together so that its
+  // OP_ENTER_LOOP can forget them all at once.
+  ValueArray* hoisted = &optimizer->chunk->hoisted;
+  for (int j = 0; j < loopCount; j++) {
+    Loop* loop = &loops[j];
+    loop->first = hoisted->count;
+    for (int i = loop->start; i <= loop->end; i++) {
+      if (chainLoops[i] != j) continue;
+      if (loop->count == UINT8_MAX || hoisted->count > UINT16_MAX) break;
+
+      Instruction* instruction = &optimizer->code[i];
+      instruction->hoisted = hoisted->count;
+      optimizer->code[instruction->hoistedEnd].cached = hoisted->count;
+      writeValueArray(hoisted, UNDEFINED_VAL);
+      loop->count++;
+    }
+
+    if (loop->count > 0) {
+      Instruction* header = &optimizer->code[loop->start];
+      header->enterFirst = loop->first;
+      header->enterCount = loop->count;
+      header->loopEnd = loop->end;
+    }
+  }
+
+  FREE_ARRAY(int, chainLoops, optimizer->count);
+  FREE_ARRAY(Loop, loops, optimizer->count);
+}
+
+// Returns the number of bytes emitted in front of [instruction] for the
+// loads hoisted out of loops.
+static int prefixSize(Instruction* instruction) {
+  return (instruction->enterCount > 0 ? 4 : 0) +
+         (instruction->hoisted != -1 ? 4 : 0);
+}
+
+// Returns the offset to store in the jump at [instruction] once the code is
+// laid out, given that the new code is [newCount] bytes long.
+static int jumpOffset(Optimizer* optimizer, Instruction* instruction,
+                      int newCount) {
+  Instruction* target = jumpTarget(optimizer, instruction);
+  int to = target == NULL ? newCount : target->newOffset;
+
+  // Only entering a loop from outside runs its OP_ENTER_LOOP.
+  int index = (int)(instruction - optimizer->code);
+  if (target != NULL && target->enterCount > 0 &&
+      index >= (int)(target - optimizer->code) && index <= target->loopEnd) {
+    to += 4;
+  }
+
+  int from = instruction->newOffset + prefixSize(instruction) +
+             instruction->newSize;
+  return instruction->op == OP_LOOP ? from - to : to - from;
+}
+
+static void emit(Optimizer* optimizer) {
+  Chunk* chunk = optimizer->chunk;
+
+  // Lay the code out with every jump short. Widening one that can't reach
+  // its target moves code, which can put other targets out of reach, so
+  // repeat until none need it. Jumps only grow, so this ends.
+  int newCount;
+  bool widened = true;
+  while (widened) {
+    newCount = 0;
+    for (int i = 0; i < optimizer->count; i++) {
+      Instruction* instruction = &optimizer->code[i];
+      if (instruction->fused) continue;
+
+      instruction->newOffset = newCount;
+      newCount += prefixSize(instruction) + instruction->newSize;
+      if (instruction->cached != -1) newCount += 3;
+    }
+
+    widened = false;
+    for (int i = 0; i < optimizer->count; i++) {
+      Instruction* instruction = &optimizer->code[i];
+      if (instruction->fused || instruction->wide ||
+          !isJump(instruction->op)) {
+        continue;
+      }
+
+      if (jumpOffset(optimizer, instruction, newCount) > UINT16_MAX) {
+        instruction->wide = true;
+        instruction->newSize += 3;
+        widened = true;
+      }
+    }
+  }
+
+  uint8_t* code = ALLOCATE(uint8_t, newCount);
+
+  // The instructions are still in order, so the lines can be rebuilt in
+  // place.
+  chunk->lineCount = 0;
+
+  for (int i = 0; i < optimizer->count; i++) {
+    Instruction* instruction = &optimizer->code[i];
+    if (instruction->fused) continue;
+
+    uint8_t* bytes = &code[instruction->newOffset];
+    if (instruction->enterCount > 0) {
+      bytes[0] = OP_ENTER_LOOP;
+      bytes[1] = (instruction->enterFirst >> 8) & 0xff;
+      bytes[2] = instruction->enterFirst & 0xff;
+      bytes[3] = (uint8_t)instruction->enterCount;
+      bytes += 4;
+    }
+
+    if (instruction->hoisted != -1) {
+      // Skip to just past the OP_SET_HOISTED at the end of the chain.
+      Instruction* end = &optimizer->code[instruction->hoistedEnd];
+      int skip = end->newOffset + prefixSize(end) + end->newSize + 3 -
+                 (int)(bytes + 4 - code);
+      bytes[0] = OP_GET_HOISTED;
+      bytes[1] = (instruction->hoisted >> 8) & 0xff;
+      bytes[2] = instruction->hoisted & 0xff;
+      bytes[3] = (uint8_t)skip;
+      bytes += 4;
+    }
+
+    if (isJump(instruction->op)) {
+      int jump = jumpOffset(optimizer, instruction, newCount);
+      if (instruction->wide) {
+        bytes[0] = OP_WIDE;
+        bytes[1] = (jump >> 24) & 0xff;
+        bytes[2] = (jump >> 16) & 0xff;
+        bytes += 3;
+      }
+
+      bytes[0] = instruction->op;
+      bytes[1] = (jump >> 8) & 0xff;
+      bytes[2] = jump & 0xff;
+
+      // Keep the loop site index.
+      if (instruction->op == OP_LOOP) {
+        uint8_t* site = instruction->rewritten
+            ? &instruction->operands[2]
+            : &chunk->code[instruction->offset + 3];
+        memcpy(&bytes[3], site, 2);
+      }
+    } else if (instruction->rewritten) {
+      bytes[0] = instruction->op;
+      memcpy(&bytes[1], instruction->operands, instruction->newSize - 1);
+    } else {
+      memcpy(bytes, &chunk->code[instruction->offset], instruction->size);
+    }
+
+    if (instruction->cached != -1) {
+      bytes += instruction->newSize;
+      bytes[0] = OP_SET_HOISTED;
+      bytes[1] = (instruction->cached >> 8) & 0xff;
+      bytes[2] = instruction->cached & 0xff;
+    }
+
+    if (chunk->lineCount == 0 ||
+        chunk->lines[chunk->lineCount - 1].line != instruction->line) {
+      addLineStart(chunk, instruction->newOffset, instruction->line);
+    }
+  }
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  chunk->code = code;
+  chunk->count = newCount;
+  chunk->capacity = newCount;
+}
+
+// Returns how many values [instruction] leaves on the stack less how many it
+// takes off. Only covers what the compiler emits.
+static int stackEffect(Optimizer* optimizer, Instruction* instruction) {
+  uint8_t* code = &optimizer->chunk->code[instruction->offset];
+  if (code[0] == OP_WIDE) code += 3;
+
+  switch (code[0]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_CLASS:
+      return 1;
+
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_INHERIT:
+    case OP_METHOD:
+      return -1;
+
+    // The callee's result replaces it and its arguments.
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -code[1];
+    case OP_INVOKE:
+    case OP_TAIL_INVOKE:
+      return -code[2];
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_SUPER_INVOKE:
+      return -code[2] - 1;
+
+    case OP_ADD_REG:
+    case OP_SUBTRACT_REG:
+    case OP_MULTIPLY_REG:
+    case OP_DIVIDE_REG:
+    case OP_EQUAL_REG:
+    case OP_GREATER_REG:
+    case OP_LESS_REG:
+    case OP_MOVE:
+      return (code[2] == 0 ? 1 : 0) -
+             (LEFT_KIND(code[1]) == OPERAND_STACK ? 1 : 0);
+
+    default:
+      return 0;
+  }
+}
+
+// Returns the most values the code has on the stack at once, counting the
+// callee, its [arity] arguments and its locals. Walks the code in order,
+// carrying the depth along and to where each jump lands. The increment
+// clause of a for loop is only reached by jumping back to it, so the walk
+// goes around again until no jump reaches anything new.
+static int maxStackDepth(Optimizer* optimizer, int arity) {
+  // How deep the stack is where a jump lands, or -1 if none does.
+  int* depths = ALLOCATE(int, optimizer->count);
+  for (int i = 0; i < optimizer->count; i++) depths[i] = -1;
+
+  int most = arity + 1;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int depth = arity + 1;
+    for (int i = 0; i < optimizer->count; i++) {
+      Instruction* instruction = &optimizer->code[i];
+      if (depths[i] > depth) depth = depths[i];
+
+      // Nothing reaches it.
+      if (depth == -1) continue;
+
+      depth += stackEffect(optimizer, instruction);
+      if (depth > most) most = depth;
+
+      if (instruction->target != -1) {
+        int target = optimizer->indexes[instruction->target];
+        if (target != optimizer->count && depths[target] < depth) {
+          depths[target] = depth;
+          if (target <= i) changed = true;
+        }
+      }
+
+      if (!fallsThrough(instruction->op)) depth = -1;
+    }
+  }
+
+  FREE_ARRAY(int, depths, optimizer->count);
+  return most;
+}
+
+// Fuses common instruction sequences in [chunk] into superinstructions so
+// that the VM dispatches fewer instructions to do the same work. At [level]
+// 2, also runs the passes that look at the whole function, and hoists
+// loads out of loops in a function with [arity] parameters. [farJumps] are
+// the jumps whose targets the compiler couldn't encode. Returns the most
+// values the function has on the stack at once. None of the rewrites make
+// that more, so it's measured before them.
+int optimizeChunk(Chunk* chunk, int arity, int level, FarJump* farJumps,
+                  int farJumpCount) {
+  int size = chunk->count;
+
+  Optimizer optimizer;
+  optimizer.chunk = chunk;
+  optimizer.code = ALLOCATE(Instruction, size);
+  optimizer.count = 0;
+  optimizer.indexes = ALLOCATE(int, size + 1);
+
+  decode(&optimizer, farJumps, farJumpCount);
+  int depth = maxStackDepth(&optimizer, arity);
+  markTargets(&optimizer);
+  if (level >= 2) threadJumps(&optimizer);
+  fusePopJumps(&optimizer);
+  removeUnreachable(&optimizer);
+  if (level >= 2) {
+    forwardStores(&optimizer);
+    removeDeadStores(&optimizer);
+    reuseValues(&optimizer);
+  }
+  fuseSequences(&optimizer);
+  if (level >= 2) hoistLoads(&optimizer, arity);
+  emit(&optimizer);
+
+  FREE_ARRAY(Instruction, optimizer.code, size);
+  FREE_ARRAY(int, optimizer.indexes, size + 1);
+  return depth;
+}
@@ -0,0 +1,21 @@
+//> Optimization omit
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// A jump whose offset doesn't fit in its two operand bytes. The compiler
+// leaves the operand zero and hands these to the optimizer, which lays the
+// code out and gives the ones that still don't fit an OP_WIDE prefix.
+typedef struct {
+  // Where the jump instruction starts.
+  int offset;
+
+  // Where it lands.
+  int target;
+} FarJump;
+
+int optimizeChunk(Chunk* chunk, int arity, int level, FarJump* farJumps,
+                  int farJumpCount);
+
+#endif
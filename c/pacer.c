@@ -0,0 +1,76 @@
+//> Optimization omit
+#include "memory.h"
+#include "pacer.h"
+#include "vm.h"
+
+// The pacer decides how big the heap can get before the next full collection.
+// Like GOGC, the goal is the heap that was live after the last collection
+// plus vm.gcPercent percent of it, kept between vm.gcMinHeap and
+// vm.gcMaxHeap.
+//
+// The soft limit caps the goal too. As the live heap gets close to it, there
+// is less room left under the limit and collections come more and more
+// often. That could end with the program doing nothing but collecting, so
+// the limit is ignored while the collector is using more than
+// GC_CPU_LIMIT of the time. Either way, the goal leaves at least
+// MIN_HEADROOM_SHIFT's share of the live heap to allocate into.
+//
+// An incremental collection has to start before the heap reaches the goal
+// since the program keeps allocating while it's being marked. It starts
+// early by the number of bytes that were allocated while marking the last
+// time, which is how fast the program allocates times how long marking
+// takes.
+
+#define GC_CPU_LIMIT 0.5
+#define MIN_HEADROOM_SHIFT 4
+#define MIN_HEADROOM (64 * 1024)
+
+void noteMarkingStarted() {
+  vm.gcMarkStartBytes = vm.bytesAllocated;
+}
+
+void noteMarkingFinished() {
+  vm.gcRunway = vm.bytesAllocated > vm.gcMarkStartBytes
+      ? vm.bytesAllocated - vm.gcMarkStartBytes : 0;
+}
+
+// Returns the fraction of the time since the last full collection finished
+// that was spent marking and sweeping. Nursery collections aren't counted
+// since collecting the old space more or less often doesn't change them.
+static double collectorShare() {
+  double time = gcClock();
+  double work = vm.gcMarkTime + vm.gcSweepTime;
+  double elapsed = time - vm.gcLastCycleEnd;
+  double share = elapsed > 0 ? (work - vm.gcLastCycleWork) / elapsed : 0;
+
+  vm.gcLastCycleEnd = time;
+  vm.gcLastCycleWork = work;
+  return share;
+}
+
+// Called once the dead objects have been subtracted from the bytes allocated
+// at the end of a full collection. Returns the next value for vm.nextGC.
+size_t paceNextCollection() {
+  size_t live = vm.bytesAllocated;
+  size_t goal = live + (size_t)((double)live * vm.gcPercent / 100);
+
+  if (goal < vm.gcMinHeap) goal = vm.gcMinHeap;
+  if (vm.gcMaxHeap != 0 && goal > vm.gcMaxHeap) goal = vm.gcMaxHeap;
+
+  double share = collectorShare();
+  if (vm.gcSoftLimit != 0 && goal > vm.gcSoftLimit &&
+      share < GC_CPU_LIMIT) {
+    goal = vm.gcSoftLimit;
+  }
+
+  size_t headroom = live >> MIN_HEADROOM_SHIFT;
+  if (headroom < MIN_HEADROOM) headroom = MIN_HEADROOM;
+  if (goal < live + headroom) goal = live + headroom;
+
+  if (vm.gcSliceBudget == 0) return goal;
+
+  // Start marking early, but not before a quarter of the way to the goal.
+  size_t earliest = live + (goal - live) / 4;
+  if (goal - earliest < vm.gcRunway) return earliest;
+  return goal - vm.gcRunway;
+}
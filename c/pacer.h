@@ -0,0 +1,11 @@
+//> Optimization omit
+#ifndef clox_pacer_h
+#define clox_pacer_h
+
+#include "common.h"
+
+void noteMarkingStarted();
+void noteMarkingFinished();
+size_t paceNextCollection();
+
+#endif
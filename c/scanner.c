@@ -19,6 +19,15 @@ void initScanner(const char* source) {
   scanner.line = 1;
 }
 //< init-scanner
+//> Optimization omit
+// Starts scanning again from [start], which is on [line]. Used to compile
+// a function body that was skipped over the first time.
+void resumeScanner(const char* start, int line) {
+  scanner.start = start;
+  scanner.current = start;
+  scanner.line = line;
+}
+//< Optimization omit
 //> is-alpha
 static bool isAlpha(char c) {
   return (c >= 'a' && c <= 'z') ||
@@ -36,6 +36,9 @@ typedef struct {
 //< token-struct
 
 void initScanner(const char* source);
+//> Optimization omit
+void resumeScanner(const char* start, int line);
+//< Optimization omit
 //> scan-token-h
 Token scanToken();
 //< scan-token-h
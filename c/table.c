@@ -11,6 +11,12 @@
 #define TABLE_MAX_LOAD 0.75
 
 //< max-load
+//> Optimization omit
+#ifdef DEBUG_COUNT_PROBES
+uint64_t tableProbeCount = 0;
+#endif
+
+//< Optimization omit
 void initTable(Table* table) {
   table->count = 0;
   table->capacity = 0;
@@ -41,6 +47,11 @@ static Entry* findEntry(Entry* entries, int capacity,
 //< find-entry-tombstone
   for (;;) {
     Entry* entry = &entries[index];
+//> Optimization omit
+#ifdef DEBUG_COUNT_PROBES
+    tableProbeCount++;
+#endif
+//< Optimization omit
 /* Hash Tables find-entry < Hash Tables find-tombstone
     if (entry->key == key || entry->key == NULL) {
       return entry;
@@ -133,6 +144,10 @@ bool tableSet(Table* table, ObjString* key, Value value) {
 
   entry->key = key;
   entry->value = value;
+//> Optimization omit
+  shadeObject((Obj*)key);
+  shadeValue(value);
+//< Optimization omit
   return isNewKey;
 }
 //< table-set
@@ -150,6 +165,15 @@ bool tableDelete(Table* table, ObjString* key) {
   return true;
 }
 //< table-delete
+//> Optimization omit
+// Replaces the key [from] with [to], which must have the same hash.
+void tableReplaceKey(Table* table, ObjString* from, ObjString* to) {
+  if (table->count == 0) return;
+
+  Entry* entry = findEntry(table->entries, table->capacity, from);
+  if (entry->key == from) entry->key = to;
+}
+//< Optimization omit
 //> table-add-all
 void tableAddAll(Table* from, Table* to) {
   for (int i = 0; i < from->capacity; i++) {
@@ -196,7 +220,12 @@ ObjString* tableFindString(Table* table, const char* chars,
 void tableRemoveWhite(Table* table) {
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
+/* Garbage Collection table-remove-white < Optimization omit
     if (entry->key != NULL && !entry->key->obj.isMarked) {
+*/
+//> Optimization omit
+    if (entry->key != NULL && !isMarked((Obj*)entry->key)) {
+//< Optimization omit
       tableDelete(table, entry->key);
     }
   }
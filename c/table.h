@@ -31,6 +31,9 @@ bool tableSet(Table* table, ObjString* key, Value value);
 //< table-set-h
 //> table-delete-h
 bool tableDelete(Table* table, ObjString* key);
+//> Optimization omit
+void tableReplaceKey(Table* table, ObjString* from, ObjString* to);
+//< Optimization omit
 //< table-delete-h
 //> table-add-all-h
 void tableAddAll(Table* from, Table* to);
@@ -46,6 +49,12 @@ void tableRemoveWhite(Table* table);
 //> Garbage Collection mark-table-h
 void markTable(Table* table);
 //< Garbage Collection mark-table-h
+//> Optimization omit
+
+#ifdef DEBUG_COUNT_PROBES
+extern uint64_t tableProbeCount;
+#endif
+//< Optimization omit
 
 //< init-table-h
 #endif
@@ -0,0 +1,1283 @@
+//> Optimization omit
+#include "common.h"
+
+#ifdef JIT
+#include <stdlib.h>
+#include <string.h>
+
+#include "assembler.h"
+#include "memory.h"
+#include "trace.h"
+#include "vm.h"
+
+// Every OP_LOOP has a counter. Once a loop has gone around
+// vm.traceThreshold times, the next trip around it is recorded: the
+// recorder runs each instruction itself, on the VM's real stack and
+// variables, and writes down what it did as a list of IR instructions. Each
+// value the IR computes gets a number, its "ref", which is its index in the
+// list. The values are typed by what was seen while recording. Each branch
+// becomes a guard that the same way is taken again. If the recorder gets
+// back to the loop header, the IR is compiled. If it runs into an
+// instruction it doesn't handle, it gives up there and the interpreter
+// carries on from that instruction. A loop that gives up too often is left
+// alone.
+//
+// The compiled trace goes around the loop until a guard fails. It never
+// touches the VM's stack on the way. Every ref has a slot in a spill area
+// of unboxed values, and the variables the loop reads are loaded once
+// before it starts. Checks that a variable holds a number are done there
+// too, so the loop body has none. Values computed from constants alone are
+// folded, and values no guard or side exit needs are never computed.
+//
+// Each guard has a snapshot of the refs that are on the stack and in the
+// variables at that point. When a guard fails, the trace writes them back
+// and returns the snapshot's index, and the interpreter picks up where the
+// recorded code would have gone the other way.
+//
+// Traces are straight-line code without calls, so nothing can allocate in
+// one and objects can't move under it. The nursery is only collected when
+// the trace comes back around to the header, after the variables have been
+// written back.
+
+// How many instructions a trace can run through before the recorder gives
+// up on it.
+#define MAX_TRACE_LENGTH 1000
+
+// How many times the recorder gives up on a loop before leaving it be.
+#define MAX_TRACE_ABORTS 4
+
+#define STACK_TOP ((int32_t)offsetof(VM, stackTop))
+#define GLOBALS_CAPACITY \
+    ((int32_t)(offsetof(VM, globalValues) + offsetof(ValueArray, capacity)))
+
+typedef int (*TraceEntry)(Value* slots, Value* spill);
+
+typedef enum {
+  // A constant number, Boolean, or nil.
+  IR_CONSTANT,
+  // An object from the chunk's constant table.
+  IR_OBJECT,
+  // The value a variable has when the loop comes around.
+  IR_VARIABLE,
+  IR_ADD,
+  IR_SUBTRACT,
+  IR_MULTIPLY,
+  IR_DIVIDE,
+  IR_NEGATE,
+  IR_GREATER,
+  IR_LESS,
+  IR_EQUAL,
+  IR_NOT,
+  // Exits unless the value's truthiness is the one recorded.
+  IR_GUARD
+} IrOp;
+
+typedef enum {
+  TYPE_NUMBER,
+  // Only ever true or false.
+  TYPE_BOOL,
+  TYPE_ANY
+} IrType;
+
+typedef struct {
+  IrOp op;
+  IrType type;
+
+  // The refs of the operands. For IR_VARIABLE, [a] is the variable's index
+  // instead. For IR_GUARD, [b] is the snapshot to exit with.
+  int a;
+  int b;
+
+  // For IR_CONSTANT, the value. For IR_VARIABLE, the value seen when
+  // recording started. For IR_GUARD, whether the value must be truthy.
+  Value value;
+
+  // For IR_OBJECT, the slot in the constant table.
+  Value* constant;
+
+  // Whether the value needs to be computed and spilled.
+  bool live;
+} IrInstruction;
+
+typedef struct {
+  // The local slot in the frame, or -1 if it's a global.
+  int slot;
+  Value* global;
+
+  // The IR_VARIABLE instruction and the ref of the value the variable has
+  // at the point the recorder has gotten to.
+  int ref;
+  int current;
+
+  // Whether the trace only runs if the variable holds a number.
+  bool isNumber;
+  bool written;
+} TraceVariable;
+
+typedef struct {
+  uint8_t* ip;
+
+  // The refs for the stack above the values that were there when the loop
+  // started, and the current refs of the variables the recorder knew about.
+  // Variables first used after the snapshot still have their entry values.
+  int* refs;
+  int stackCount;
+  int variableCount;
+} Snapshot;
+
+typedef struct {
+  CallFrame* frame;
+  Chunk* chunk;
+
+  // The number of slots the frame used when the loop started. Slots below
+  // are variables. The ones above are temporaries and locals declared in the
+  // loop body, which live on the recorder's stack.
+  int base;
+
+  IrInstruction* code;
+  int count;
+  int capacity;
+
+  TraceVariable* variables;
+  int variableCount;
+  int variableCapacity;
+
+  Snapshot* snapshots;
+  int snapshotCount;
+  int snapshotCapacity;
+
+  // The refs of the values pushed since the loop started.
+  int* stack;
+  int stackCount;
+  int stackCapacity;
+
+  // The capacity of vm.globalValues when a global was first used, or -1.
+  int globalsCapacity;
+} Recorder;
+
+// Grows [array] of [size] byte elements to hold one more than [count].
+static void* growArray(void* array, size_t size, int count, int* capacity) {
+  if (*capacity >= count + 1) return array;
+
+  *capacity = GROW_CAPACITY(*capacity);
+  array = realloc(array, size * (size_t)*capacity);
+  if (array == NULL) exit(1);
+  return array;
+}
+
+static int emitIr(Recorder* r, IrOp op, IrType type, int a, int b) {
+  r->code = (IrInstruction*)growArray(r->code, sizeof(IrInstruction),
+                                      r->count, &r->capacity);
+  IrInstruction* instruction = &r->code[r->count];
+  instruction->op = op;
+  instruction->type = type;
+  instruction->a = a;
+  instruction->b = b;
+  instruction->value = NIL_VAL;
+  instruction->constant = NULL;
+  instruction->live = false;
+  return r->count++;
+}
+
+static int emitConstant(Recorder* r, Value value) {
+  for (int i = 0; i < r->count; i++) {
+    if (r->code[i].op == IR_CONSTANT && r->code[i].value == value) return i;
+  }
+
+  IrType type = IS_NUMBER(value) ? TYPE_NUMBER
+      : IS_BOOL(value) ? TYPE_BOOL : TYPE_ANY;
+  int ref = emitIr(r, IR_CONSTANT, type, -1, -1);
+  r->code[ref].value = value;
+  return ref;
+}
+
+static int emitObject(Recorder* r, Value* constant) {
+  for (int i = 0; i < r->count; i++) {
+    if (r->code[i].op == IR_OBJECT && r->code[i].constant == constant) {
+      return i;
+    }
+  }
+
+  int ref = emitIr(r, IR_OBJECT, TYPE_ANY, -1, -1);
+  r->code[ref].constant = constant;
+  return ref;
+}
+
+static bool isConstant(Recorder* r, int ref) {
+  return r->code[ref].op == IR_CONSTANT;
+}
+
+static IrType typeOf(Recorder* r, int ref) {
+  IrInstruction* instruction = &r->code[ref];
+  if (instruction->op == IR_VARIABLE) {
+    return r->variables[instruction->a].isNumber ? TYPE_NUMBER : TYPE_ANY;
+  }
+  return instruction->type;
+}
+
+// Notes that the value [ref], which was seen to be a number, is assumed to
+// be one from here on.
+static void assumeNumber(Recorder* r, int ref) {
+  if (r->code[ref].op == IR_VARIABLE) {
+    r->variables[r->code[ref].a].isNumber = true;
+  }
+}
+
+// Returns the variable for a local [slot] or a [global].
+static TraceVariable* findVariable(Recorder* r, int slot, Value* global) {
+  for (int i = 0; i < r->variableCount; i++) {
+    TraceVariable* variable = &r->variables[i];
+    if (variable->slot == slot && variable->global == global) {
+      return variable;
+    }
+  }
+
+  r->variables = (TraceVariable*)growArray(r->variables,
+      sizeof(TraceVariable), r->variableCount, &r->variableCapacity);
+  int index = r->variableCount++;
+  int ref = emitIr(r, IR_VARIABLE, TYPE_ANY, index, -1);
+  r->code[ref].value = global != NULL ? *global : r->frame->slots[slot];
+
+  TraceVariable* variable = &r->variables[index];
+  variable->slot = slot;
+  variable->global = global;
+  variable->ref = ref;
+  variable->current = ref;
+  variable->isNumber = false;
+  variable->written = false;
+  return variable;
+}
+
+// Returns the ref for the value in local [slot].
+static int localRef(Recorder* r, int slot) {
+  if (slot < r->base) return findVariable(r, slot, NULL)->current;
+  return r->stack[slot - r->base];
+}
+
+static void pushRef(Recorder* r, int ref, Value value) {
+  r->stack = (int*)growArray(r->stack, sizeof(int), r->stackCount,
+                             &r->stackCapacity);
+  r->stack[r->stackCount++] = ref;
+  push(value);
+}
+
+static int popRef(Recorder* r) {
+  pop();
+  return r->stack[--r->stackCount];
+}
+
+static int peekRef(Recorder* r, int distance) {
+  return r->stack[r->stackCount - 1 - distance];
+}
+
+// Replaces every use of [from] on the stack and in the variables with [to].
+static void replaceRef(Recorder* r, int from, int to) {
+  for (int i = 0; i < r->stackCount; i++) {
+    if (r->stack[i] == from) r->stack[i] = to;
+  }
+
+  for (int i = 0; i < r->variableCount; i++) {
+    if (r->variables[i].current == from) r->variables[i].current = to;
+  }
+}
+
+// Takes a snapshot for a side exit that resumes at [ip]. Uses of [from] are
+// recorded as [to] instead.
+static int takeSnapshot(Recorder* r, uint8_t* ip, int from, int to) {
+  r->snapshots = (Snapshot*)growArray(r->snapshots, sizeof(Snapshot),
+      r->snapshotCount, &r->snapshotCapacity);
+  Snapshot* snapshot = &r->snapshots[r->snapshotCount];
+  snapshot->ip = ip;
+  snapshot->stackCount = r->stackCount;
+  snapshot->variableCount = r->variableCount;
+  snapshot->refs = (int*)malloc(sizeof(int) *
+                                (size_t)(r->stackCount + r->variableCount + 1));
+  if (snapshot->refs == NULL) exit(1);
+
+  for (int i = 0; i < r->stackCount; i++) {
+    snapshot->refs[i] = r->stack[i] == from ? to : r->stack[i];
+  }
+  for (int i = 0; i < r->variableCount; i++) {
+    int ref = r->variables[i].current;
+    snapshot->refs[r->stackCount + i] = ref == from ? to : ref;
+  }
+
+  return r->snapshotCount++;
+}
+
+// Guards that [ref] has the truthiness seen while recording. If it doesn't,
+// the trace exits to [exit] with the stack as it is now.
+static void emitGuard(Recorder* r, int ref, bool truthy, uint8_t* exit) {
+  if (isConstant(r, ref)) return;
+
+  // Numbers are always truthy.
+  if (typeOf(r, ref) == TYPE_NUMBER) return;
+
+  int from = -1;
+  int to = -1;
+  if (typeOf(r, ref) == TYPE_BOOL) {
+    // A Boolean's value is known on either side of the guard, which saves
+    // computing it.
+    from = ref;
+    to = emitConstant(r, BOOL_VAL(!truthy));
+  }
+
+  int snapshot = takeSnapshot(r, exit, from, to);
+  int guard = emitIr(r, IR_GUARD, TYPE_ANY, ref, snapshot);
+  r->code[guard].value = BOOL_VAL(truthy);
+
+  if (from != -1) replaceRef(r, ref, emitConstant(r, BOOL_VAL(truthy)));
+}
+
+static bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Pops two numbers and pushes [result], which the recorder computed.
+static void recordBinary(Recorder* r, IrOp op, IrType type, Value result) {
+  int b = popRef(r);
+  int a = popRef(r);
+  assumeNumber(r, a);
+  assumeNumber(r, b);
+
+  int ref = isConstant(r, a) && isConstant(r, b)
+      ? emitConstant(r, result) : emitIr(r, op, type, a, b);
+  pushRef(r, ref, result);
+}
+
+// Pops two values and pushes whether they are equal.
+static void recordEqual(Recorder* r) {
+  Value b = vm.stackTop[-1];
+  Value a = vm.stackTop[-2];
+  Value result = BOOL_VAL(valuesEqual(a, b));
+
+  int right = popRef(r);
+  int left = popRef(r);
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    assumeNumber(r, left);
+    assumeNumber(r, right);
+  }
+
+  int ref = isConstant(r, left) && isConstant(r, right)
+      ? emitConstant(r, result)
+      : emitIr(r, IR_EQUAL, TYPE_BOOL, left, right);
+  pushRef(r, ref, result);
+}
+
+// Stores the value on top of the stack in local [slot].
+static void setLocal(Recorder* r, int slot) {
+  r->frame->slots[slot] = vm.stackTop[-1];
+  if (slot < r->base) {
+    TraceVariable* variable = findVariable(r, slot, NULL);
+    variable->current = peekRef(r, 0);
+    variable->written = true;
+  } else {
+    r->stack[slot - r->base] = peekRef(r, 0);
+  }
+}
+
+// Returns the value of a register instruction's operand of [kind] at
+// [index].
+static Value operandValue(Recorder* r, int kind, uint8_t index) {
+  switch (kind) {
+    case OPERAND_REGISTER: return r->frame->slots[index];
+    case OPERAND_CONSTANT: return r->chunk->constants.values[index];
+    case OPERAND_STACK: return vm.stackTop[-1];
+    default: return NUMBER_VAL(index);
+  }
+}
+
+// Pushes the value of [constant] from the chunk's constant table.
+static void pushConstant(Recorder* r, Value* constant) {
+  int ref = IS_OBJ(*constant) ? emitObject(r, constant)
+                              : emitConstant(r, *constant);
+  pushRef(r, ref, *constant);
+}
+
+// Pushes a register instruction's operand of [kind] at [index] the way the
+// stack instructions it replaces would have. One on the stack already is.
+static void pushOperand(Recorder* r, int kind, uint8_t index) {
+  switch (kind) {
+    case OPERAND_REGISTER:
+      pushRef(r, localRef(r, index), r->frame->slots[index]);
+      break;
+    case OPERAND_CONSTANT:
+      pushConstant(r, &r->chunk->constants.values[index]);
+      break;
+    case OPERAND_STACK:
+      break;
+    case OPERAND_SMALL_INT:
+      pushRef(r, emitConstant(r, NUMBER_VAL(index)), NUMBER_VAL(index));
+      break;
+  }
+}
+
+static bool topTwoAreNumbers() {
+  return IS_NUMBER(vm.stackTop[-1]) && IS_NUMBER(vm.stackTop[-2]);
+}
+
+// Runs and records instructions starting at the loop header. Returns true
+// if it made it around the loop. Otherwise, [*ip] is the instruction it
+// stopped at, which hasn't been run.
+static bool record(Recorder* r, uint8_t* header, uint8_t** ip) {
+  Chunk* chunk = r->chunk;
+  Value* slots = r->frame->slots;
+  uint8_t* next = header;
+
+#define READ_BYTE() (*next++)
+#define READ_SHORT() \
+    (next += 2, (uint16_t)((next[-2] << 8) | next[-1]))
+#define NUMBER_OP(op, type, valueType, operator) \
+    do { \
+      if (!topTwoAreNumbers()) return false; \
+      double b = AS_NUMBER(vm.stackTop[-1]); \
+      double a = AS_NUMBER(vm.stackTop[-2]); \
+      recordBinary(r, op, type, valueType(a operator b)); \
+    } while (false)
+
+  for (int length = 0; length < MAX_TRACE_LENGTH; length++) {
+    *ip = next;
+
+    switch (READ_BYTE()) {
+      case OP_CONSTANT:
+        pushConstant(r, &chunk->constants.values[READ_BYTE()]);
+        break;
+
+      case OP_CONSTANT_LONG: {
+        int index = READ_BYTE() << 16;
+        index |= READ_SHORT();
+        pushConstant(r, &chunk->constants.values[index]);
+        break;
+      }
+
+      case OP_NIL:   pushRef(r, emitConstant(r, NIL_VAL), NIL_VAL); break;
+      case OP_TRUE:  pushRef(r, emitConstant(r, TRUE_VAL), TRUE_VAL); break;
+      case OP_FALSE: pushRef(r, emitConstant(r, FALSE_VAL), FALSE_VAL); break;
+
+      case OP_SMALL_INT: {
+        Value value = NUMBER_VAL(READ_BYTE());
+        pushRef(r, emitConstant(r, value), value);
+        break;
+      }
+
+      // Popping what was there before the loop started means leaving the
+      // scope the loop is in.
+      case OP_POP:
+        if (r->stackCount == 0) return false;
+        popRef(r);
+        break;
+
+      case OP_POPN: {
+        int count = READ_BYTE();
+        if (count > r->stackCount) return false;
+        for (int i = 0; i < count; i++) popRef(r);
+        break;
+      }
+
+      case OP_GET_LOCAL: {
+        int slot = READ_BYTE();
+        pushRef(r, localRef(r, slot), slots[slot]);
+        break;
+      }
+
+      // Copying a bound method makes a new one, which a trace can't do.
+      case OP_PICK: {
+        int distance = READ_BYTE();
+        Value value = vm.stackTop[-1 - distance];
+        if (distance >= r->stackCount || IS_BOUND_METHOD(value)) {
+          return false;
+        }
+
+        pushRef(r, peekRef(r, distance), value);
+        break;
+      }
+
+      // The trace runs the loads that a hoisted one would skip, so it can
+      // leave the hoisted values alone. See traceLoop().
+      case OP_ENTER_LOOP:
+      case OP_GET_HOISTED:
+        next += 3;
+        break;
+
+      case OP_SET_HOISTED:
+        next += 2;
+        break;
+
+      case OP_SET_LOCAL:
+        setLocal(r, READ_BYTE());
+        break;
+
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL: {
+        bool set = next[-1] == OP_SET_GLOBAL;
+        Value* global = &vm.globalValues.values[READ_SHORT()];
+
+        // Leave undefined variables to the interpreter to report.
+        if (IS_UNDEFINED(*global)) return false;
+        if (r->globalsCapacity == -1) {
+          r->globalsCapacity = vm.globalValues.capacity;
+        }
+
+        TraceVariable* variable = findVariable(r, -1, global);
+        if (set) {
+          *global = vm.stackTop[-1];
+          variable->current = peekRef(r, 0);
+          variable->written = true;
+        } else {
+          pushRef(r, variable->current, *global);
+        }
+        break;
+      }
+
+      case OP_EQUAL: recordEqual(r); break;
+
+      // The recorder checks the types itself, so quickened instructions
+      // are recorded like the generic ones.
+      case OP_GREATER:
+      case OP_GREATER_NUM:
+        NUMBER_OP(IR_GREATER, TYPE_BOOL, BOOL_VAL, >);
+        break;
+      case OP_LESS:
+      case OP_LESS_NUM:
+        NUMBER_OP(IR_LESS, TYPE_BOOL, BOOL_VAL, <);
+        break;
+      case OP_ADD:
+      case OP_ADD_NUM:
+      case OP_ADD_STR:
+        NUMBER_OP(IR_ADD, TYPE_NUMBER, NUMBER_VAL, +);
+        break;
+      case OP_SUBTRACT:
+      case OP_SUBTRACT_NUM:
+        NUMBER_OP(IR_SUBTRACT, TYPE_NUMBER, NUMBER_VAL, -);
+        break;
+      case OP_MULTIPLY:
+      case OP_MULTIPLY_NUM:
+        NUMBER_OP(IR_MULTIPLY, TYPE_NUMBER, NUMBER_VAL, *);
+        break;
+      case OP_DIVIDE:
+      case OP_DIVIDE_NUM:
+        NUMBER_OP(IR_DIVIDE, TYPE_NUMBER, NUMBER_VAL, /);
+        break;
+
+      case OP_ADD_LOCALS: {
+        int left = READ_BYTE();
+        int right = READ_BYTE();
+        if (!IS_NUMBER(slots[left]) || !IS_NUMBER(slots[right])) {
+          return false;
+        }
+
+        // Push the operands the way the instructions this replaced did.
+        pushRef(r, localRef(r, left), slots[left]);
+        pushRef(r, localRef(r, right), slots[right]);
+        NUMBER_OP(IR_ADD, TYPE_NUMBER, NUMBER_VAL, +);
+        break;
+      }
+
+      // A register instruction is recorded as the stack instructions it
+      // replaces.
+      case OP_ADD_REG:
+      case OP_SUBTRACT_REG:
+      case OP_MULTIPLY_REG:
+      case OP_DIVIDE_REG:
+      case OP_EQUAL_REG:
+      case OP_GREATER_REG:
+      case OP_LESS_REG:
+      case OP_MOVE: {
+        uint8_t instruction = next[-1];
+        uint8_t kinds = READ_BYTE();
+        uint8_t slot = READ_BYTE();
+        uint8_t left = READ_BYTE();
+        uint8_t right = instruction == OP_MOVE ? 0 : READ_BYTE();
+        if (LEFT_KIND(kinds) == OPERAND_STACK && r->stackCount == 0) {
+          return false;
+        }
+
+        // Check before touching the stack, so that the interpreter can
+        // still run the instruction.
+        if (instruction != OP_EQUAL_REG && instruction != OP_MOVE &&
+            (!IS_NUMBER(operandValue(r, LEFT_KIND(kinds), left)) ||
+             !IS_NUMBER(operandValue(r, RIGHT_KIND(kinds), right)))) {
+          return false;
+        }
+
+        pushOperand(r, LEFT_KIND(kinds), left);
+        if (instruction != OP_MOVE) {
+          pushOperand(r, RIGHT_KIND(kinds), right);
+        }
+
+        switch (instruction) {
+          case OP_ADD_REG:
+            NUMBER_OP(IR_ADD, TYPE_NUMBER, NUMBER_VAL, +);
+            break;
+          case OP_SUBTRACT_REG:
+            NUMBER_OP(IR_SUBTRACT, TYPE_NUMBER, NUMBER_VAL, -);
+            break;
+          case OP_MULTIPLY_REG:
+            NUMBER_OP(IR_MULTIPLY, TYPE_NUMBER, NUMBER_VAL, *);
+            break;
+          case OP_DIVIDE_REG:
+            NUMBER_OP(IR_DIVIDE, TYPE_NUMBER, NUMBER_VAL, /);
+            break;
+          case OP_GREATER_REG:
+            NUMBER_OP(IR_GREATER, TYPE_BOOL, BOOL_VAL, >);
+            break;
+          case OP_LESS_REG:
+            NUMBER_OP(IR_LESS, TYPE_BOOL, BOOL_VAL, <);
+            break;
+          case OP_EQUAL_REG:
+            recordEqual(r);
+            break;
+        }
+
+        if (slot != 0) {
+          setLocal(r, slot);
+          popRef(r);
+        }
+        break;
+      }
+
+      case OP_NOT: {
+        Value value = BOOL_VAL(isFalsey(vm.stackTop[-1]));
+        int operand = popRef(r);
+        int ref;
+        if (isConstant(r, operand)) {
+          ref = emitConstant(r, value);
+        } else if (typeOf(r, operand) == TYPE_NUMBER) {
+          ref = emitConstant(r, FALSE_VAL);
+        } else {
+          ref = emitIr(r, IR_NOT, TYPE_BOOL, operand, -1);
+        }
+        pushRef(r, ref, value);
+        break;
+      }
+
+      case OP_NEGATE: {
+        if (!IS_NUMBER(vm.stackTop[-1])) return false;
+        Value value = NUMBER_VAL(-AS_NUMBER(vm.stackTop[-1]));
+        int operand = popRef(r);
+        assumeNumber(r, operand);
+        int ref = isConstant(r, operand) ? emitConstant(r, value)
+            : emitIr(r, IR_NEGATE, TYPE_NUMBER, operand, -1);
+        pushRef(r, ref, value);
+        break;
+      }
+
+      case OP_JUMP: {
+        uint16_t offset = READ_SHORT();
+        next += offset;
+        break;
+      }
+
+      case OP_JUMP_IF_FALSE:
+      case OP_POP_JUMP_IF_FALSE: {
+        bool pops = next[-1] == OP_POP_JUMP_IF_FALSE;
+        uint16_t offset = READ_SHORT();
+        bool truthy = !isFalsey(vm.stackTop[-1]);
+        int ref = pops ? popRef(r) : peekRef(r, 0);
+        emitGuard(r, ref, truthy, truthy ? next + offset : next);
+        if (!truthy) next += offset;
+        break;
+      }
+
+      case OP_JUMP_IF_NOT_EQUAL:
+      case OP_JUMP_IF_NOT_GREATER:
+      case OP_JUMP_IF_NOT_LESS: {
+        uint8_t instruction = next[-1];
+        uint16_t offset = READ_SHORT();
+        if (instruction == OP_JUMP_IF_NOT_EQUAL) {
+          recordEqual(r);
+        } else if (!topTwoAreNumbers()) {
+          return false;
+        } else {
+          double b = AS_NUMBER(vm.stackTop[-1]);
+          double a = AS_NUMBER(vm.stackTop[-2]);
+          if (instruction == OP_JUMP_IF_NOT_GREATER) {
+            recordBinary(r, IR_GREATER, TYPE_BOOL, BOOL_VAL(a > b));
+          } else {
+            recordBinary(r, IR_LESS, TYPE_BOOL, BOOL_VAL(a < b));
+          }
+        }
+
+        bool truthy = AS_BOOL(vm.stackTop[-1]);
+        int ref = popRef(r);
+        emitGuard(r, ref, truthy, truthy ? next + offset : next);
+        if (!truthy) next += offset;
+        break;
+      }
+
+      case OP_LOOP: {
+        uint16_t offset = READ_SHORT();
+        next += 2;
+        next -= offset;
+        if (next != header) {
+          // A for loop's increment clause ends in a second OP_LOOP. An inner
+          // loop is unrolled, which only works out if it's short.
+          break;
+        }
+
+        if (r->stackCount != 0) return false;
+        *ip = header;
+        return true;
+      }
+
+      default:
+        return false;
+    }
+  }
+
+  // The last instruction recorded has already run.
+  *ip = next;
+  return false;
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef NUMBER_OP
+}
+
+// A variable assumed to hold a number when the trace starts must still hold
+// one when it loops. Where it's copied from another variable, that one is
+// assumed to be a number too. Returns false if a variable would need to be
+// a number but can't be.
+static bool checkLoopTypes(Recorder* r) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < r->variableCount; i++) {
+      TraceVariable* variable = &r->variables[i];
+      if (!variable->isNumber || !variable->written) continue;
+      if (typeOf(r, variable->current) == TYPE_NUMBER) continue;
+
+      IrInstruction* source = &r->code[variable->current];
+      if (source->op != IR_VARIABLE || !IS_NUMBER(source->value)) {
+        return false;
+      }
+      r->variables[source->a].isNumber = true;
+      changed = true;
+    }
+  }
+
+  return true;
+}
+
+// Guards on a comparison of two numbers test the flags directly instead of
+// materializing a Boolean.
+static bool isFusedCompare(Recorder* r, IrInstruction* instruction) {
+  switch (instruction->op) {
+    case IR_GREATER:
+    case IR_LESS:
+      return true;
+    case IR_EQUAL:
+      return typeOf(r, instruction->a) == TYPE_NUMBER &&
+             typeOf(r, instruction->b) == TYPE_NUMBER;
+    default:
+      return false;
+  }
+}
+
+// Marks the values that side exits, guards, and the next trip around the
+// loop need, and the values those are computed from.
+static void markLive(Recorder* r) {
+  for (int i = 0; i < r->variableCount; i++) {
+    TraceVariable* variable = &r->variables[i];
+    r->code[variable->ref].live = true;
+    if (variable->written) r->code[variable->current].live = true;
+  }
+
+  for (int i = 0; i < r->snapshotCount; i++) {
+    Snapshot* snapshot = &r->snapshots[i];
+    for (int j = 0; j < snapshot->stackCount; j++) {
+      r->code[snapshot->refs[j]].live = true;
+    }
+    for (int j = 0; j < snapshot->variableCount; j++) {
+      if (!r->variables[j].written) continue;
+      r->code[snapshot->refs[snapshot->stackCount + j]].live = true;
+    }
+  }
+
+  for (int i = r->count - 1; i >= 0; i--) {
+    IrInstruction* instruction = &r->code[i];
+    switch (instruction->op) {
+      case IR_CONSTANT:
+      case IR_OBJECT:
+      case IR_VARIABLE:
+        break;
+
+      case IR_GUARD: {
+        IrInstruction* operand = &r->code[instruction->a];
+        if (isFusedCompare(r, operand)) {
+          r->code[operand->a].live = true;
+          r->code[operand->b].live = true;
+        } else {
+          operand->live = true;
+        }
+        break;
+      }
+
+      case IR_NEGATE:
+      case IR_NOT:
+        if (instruction->live) r->code[instruction->a].live = true;
+        break;
+
+      default:
+        if (instruction->live) {
+          r->code[instruction->a].live = true;
+          r->code[instruction->b].live = true;
+        }
+        break;
+    }
+  }
+}
+
+#define SPILL(ref) ((int32_t)(8 * (ref)))
+
+// Loads or stores rax from where [variable] lives. Uses rcx.
+static void loadVariable(Assembler* a, TraceVariable* variable) {
+  if (variable->global != NULL) {
+    loadImmediate(a, RCX, (uint64_t)(uintptr_t)variable->global);
+    load(a, RAX, RCX, 0);
+  } else {
+    load(a, RAX, R13, 8 * variable->slot);
+  }
+}
+
+static void storeVariable(Assembler* a, TraceVariable* variable) {
+  if (variable->global != NULL) {
+    loadImmediate(a, RCX, (uint64_t)(uintptr_t)variable->global);
+    store(a, RCX, 0, RAX);
+  } else {
+    store(a, R13, 8 * variable->slot, RAX);
+  }
+}
+
+typedef struct {
+  // Where the jump's 32-bit displacement is in the code.
+  int from;
+  int snapshot;
+} ExitJump;
+
+typedef struct {
+  Recorder* recorder;
+  Assembler a;
+
+  ExitJump* exits;
+  int exitCount;
+  int exitCapacity;
+} TraceCompiler;
+
+static void jumpToExit(TraceCompiler* c, int condition, int snapshot) {
+  c->exits = (ExitJump*)growArray(c->exits, sizeof(ExitJump), c->exitCount,
+                                  &c->exitCapacity);
+  c->exits[c->exitCount].from = jumpForward(&c->a, condition);
+  c->exits[c->exitCount].snapshot = snapshot;
+  c->exitCount++;
+}
+
+// Jumps if [reg] isn't a number. Expects QNAN in rdx and uses rsi.
+static int jumpIfNotNumber(Assembler* a, int reg) {
+  move(a, RSI, reg);
+  alu(a, ALU_AND, RSI, RDX);
+  alu(a, ALU_CMP, RSI, RDX);
+  return jumpForward(a, CC_E);
+}
+
+static void loadOperands(Assembler* a, IrInstruction* instruction) {
+  loadDouble(a, XMM0, RBX, SPILL(instruction->a));
+  loadDouble(a, XMM1, RBX, SPILL(instruction->b));
+}
+
+// Compares the operands of a comparison and returns the condition that
+// holds when it's true.
+static int compareOperands(Assembler* a, IrInstruction* instruction) {
+  loadOperands(a, instruction);
+
+  // NaN compares unordered, which leaves the "above" condition false.
+  switch (instruction->op) {
+    case IR_GREATER: compareDoubles(a, XMM0, XMM1); return CC_A;
+    case IR_LESS:    compareDoubles(a, XMM1, XMM0); return CC_A;
+    default:         compareDoubles(a, XMM0, XMM1); return CC_E;
+  }
+}
+
+// Sets al to whether the values in rax and rcx are equal, following
+// valuesEqual(). Uses rdx and rsi.
+static void emitEquality(Assembler* a) {
+  loadImmediate(a, RDX, QNAN);
+  int leftNotNumber = jumpIfNotNumber(a, RAX);
+  int rightNotNumber = jumpIfNotNumber(a, RCX);
+
+  moveToXmm(a, XMM0, RAX);
+  moveToXmm(a, XMM1, RCX);
+  compareDoubles(a, XMM0, XMM1);
+  setCondition(a, CC_NP, RAX);
+  setCondition(a, CC_E, RCX);
+  andLowBytes(a);
+  int done = jumpForward(a, ALWAYS);
+
+  patchHere(a, leftNotNumber);
+  patchHere(a, rightNotNumber);
+  alu(a, ALU_CMP, RAX, RCX);
+  setCondition(a, CC_E, RAX);
+  patchHere(a, done);
+}
+
+static void compileGuard(TraceCompiler* c, IrInstruction* guard) {
+  Assembler* a = &c->a;
+  IrInstruction* operand = &c->recorder->code[guard->a];
+  bool truthy = AS_BOOL(guard->value);
+  int snapshot = guard->b;
+
+  if (isFusedCompare(c->recorder, operand)) {
+    int condition = compareOperands(a, operand);
+    if (operand->op != IR_EQUAL) {
+      jumpToExit(c, truthy ? CC_BE : CC_A, snapshot);
+    } else if (truthy) {
+      jumpToExit(c, CC_P, snapshot);
+      jumpToExit(c, CC_NE, snapshot);
+    } else {
+      int unordered = jumpForward(a, CC_P);
+      jumpToExit(c, condition, snapshot);
+      patchHere(a, unordered);
+    }
+    return;
+  }
+
+  load(a, RAX, RBX, SPILL(guard->a));
+  if (typeOf(c->recorder, guard->a) == TYPE_BOOL) {
+    loadImmediate(a, RCX, TRUE_VAL);
+    alu(a, ALU_CMP, RAX, RCX);
+    jumpToExit(c, truthy ? CC_NE : CC_E, snapshot);
+    return;
+  }
+
+  loadImmediate(a, RCX, NIL_VAL);
+  alu(a, ALU_CMP, RAX, RCX);
+  if (truthy) {
+    jumpToExit(c, CC_E, snapshot);
+    loadImmediate(a, RCX, FALSE_VAL);
+    alu(a, ALU_CMP, RAX, RCX);
+    jumpToExit(c, CC_E, snapshot);
+  } else {
+    int isNil = jumpForward(a, CC_E);
+    loadImmediate(a, RCX, FALSE_VAL);
+    alu(a, ALU_CMP, RAX, RCX);
+    jumpToExit(c, CC_NE, snapshot);
+    patchHere(a, isNil);
+  }
+}
+
+static void compileInstruction(TraceCompiler* c, int ref) {
+  Assembler* a = &c->a;
+  IrInstruction* instruction = &c->recorder->code[ref];
+
+  if (instruction->op == IR_GUARD) {
+    compileGuard(c, instruction);
+    return;
+  }
+
+  if (!instruction->live) return;
+
+  switch (instruction->op) {
+    case IR_ADD:
+    case IR_SUBTRACT:
+    case IR_MULTIPLY:
+    case IR_DIVIDE: {
+      static const uint8_t opcodes[] = {SSE_ADD, SSE_SUB, SSE_MUL, SSE_DIV};
+      loadOperands(a, instruction);
+      scalarDouble(a, opcodes[instruction->op - IR_ADD], XMM0, XMM1);
+      storeDouble(a, RBX, SPILL(ref), XMM0);
+      return;
+    }
+
+    case IR_NEGATE:
+      load(a, RAX, RBX, SPILL(instruction->a));
+      loadImmediate(a, RCX, SIGN_BIT);
+      alu(a, ALU_XOR, RAX, RCX);
+      store(a, RBX, SPILL(ref), RAX);
+      return;
+
+    case IR_GREATER:
+    case IR_LESS:
+    case IR_EQUAL:
+      if (isFusedCompare(c->recorder, instruction)) {
+        int condition = compareOperands(a, instruction);
+        setCondition(a, condition, RAX);
+        if (instruction->op == IR_EQUAL) {
+          setCondition(a, CC_NP, RCX);
+          andLowBytes(a);
+        }
+      } else {
+        load(a, RAX, RBX, SPILL(instruction->a));
+        load(a, RCX, RBX, SPILL(instruction->b));
+        emitEquality(a);
+      }
+      boolFromAl(a);
+      store(a, RBX, SPILL(ref), RAX);
+      return;
+
+    case IR_NOT: {
+      load(a, RAX, RBX, SPILL(instruction->a));
+      loadImmediate(a, RDX, TRUE_VAL);
+      loadImmediate(a, RCX, NIL_VAL);
+      alu(a, ALU_CMP, RAX, RCX);
+      int isNil = jumpForward(a, CC_E);
+      loadImmediate(a, RCX, FALSE_VAL);
+      alu(a, ALU_CMP, RAX, RCX);
+      int isFalse = jumpForward(a, CC_E);
+      move(a, RDX, RCX);
+      patchHere(a, isNil);
+      patchHere(a, isFalse);
+      store(a, RBX, SPILL(ref), RDX);
+      return;
+    }
+
+    default:
+      // Constants and variables are loaded before the loop.
+      return;
+  }
+}
+
+// Writes the variables and stack back the way [snapshot] has them and
+// returns its index.
+static void compileExit(TraceCompiler* c, int index, int epilogue) {
+  Assembler* a = &c->a;
+  Recorder* r = c->recorder;
+  Snapshot* snapshot = &r->snapshots[index];
+
+  for (int i = 0; i < r->variableCount; i++) {
+    TraceVariable* variable = &r->variables[i];
+    if (!variable->written) continue;
+
+    int ref = i < snapshot->variableCount
+        ? snapshot->refs[snapshot->stackCount + i] : variable->ref;
+    load(a, RAX, RBX, SPILL(ref));
+    storeVariable(a, variable);
+  }
+
+  for (int i = 0; i < snapshot->stackCount; i++) {
+    load(a, RAX, RBX, SPILL(snapshot->refs[i]));
+    store(a, R12, 8 * i, RAX);
+  }
+  if (snapshot->stackCount > 0) {
+    addImmediate(a, R12, 8 * snapshot->stackCount);
+    store(a, R15, STACK_TOP, R12);
+  }
+
+  loadImmediate(a, RAX, (uint64_t)index);
+  jumpTo(a, ALWAYS, epilogue);
+}
+
+// Compiles the recorded trace. Returns NULL if there's no room for it.
+static Trace* compileTrace(Recorder* r, uint8_t* header) {
+  TraceCompiler c;
+  Assembler* a = &c.a;
+  c.recorder = r;
+  c.exits = NULL;
+  c.exitCount = 0;
+  c.exitCapacity = 0;
+  initAssembler(a);
+
+  // Entered with the frame's slots in rdi and the spill area in rsi.
+  pushCalleeSaved(a);
+  addImmediate(a, RSP, -8);
+  move(a, R13, RDI);
+  move(a, RBX, RSI);
+  loadImmediate(a, R15, (uint64_t)(uintptr_t)&vm);
+  load(a, R12, R15, STACK_TOP);
+
+  // Each check that the trace can run jumps to the end if not.
+  int* entryFailed = (int*)malloc(sizeof(int) *
+                                  (size_t)(r->variableCount + 1));
+  if (entryFailed == NULL) exit(1);
+  int entryFailedCount = 0;
+
+  // The globals are only where they were while the array hasn't grown.
+  if (r->globalsCapacity != -1) {
+    load32(a, RAX, R15, GLOBALS_CAPACITY);
+    loadImmediate(a, RCX, (uint64_t)r->globalsCapacity);
+    alu(a, ALU_CMP, RAX, RCX);
+    entryFailed[entryFailedCount++] = jumpForward(a, CC_NE);
+  }
+
+  loadImmediate(a, RDX, QNAN);
+  for (int i = 0; i < r->variableCount; i++) {
+    TraceVariable* variable = &r->variables[i];
+    loadVariable(a, variable);
+    if (variable->isNumber) {
+      entryFailed[entryFailedCount++] = jumpIfNotNumber(a, RAX);
+    }
+    store(a, RBX, SPILL(variable->ref), RAX);
+  }
+
+  for (int i = 0; i < r->count; i++) {
+    IrInstruction* instruction = &r->code[i];
+    if (!instruction->live) continue;
+
+    if (instruction->op == IR_CONSTANT) {
+      loadImmediate(a, RAX, instruction->value);
+      store(a, RBX, SPILL(i), RAX);
+    } else if (instruction->op == IR_OBJECT) {
+      loadImmediate(a, RAX, (uint64_t)(uintptr_t)instruction->constant);
+      load(a, RAX, RAX, 0);
+      store(a, RBX, SPILL(i), RAX);
+    }
+  }
+
+  int loop = a->count;
+  for (int i = 0; i < r->count; i++) compileInstruction(&c, i);
+
+  // Copy the values each variable ends up with to where the next trip
+  // around reads them, by way of scratch slots past the IR in case one is
+  // copied from another.
+  for (int i = 0; i < r->variableCount; i++) {
+    TraceVariable* variable = &r->variables[i];
+    if (!variable->written || variable->current == variable->ref) continue;
+    load(a, RAX, RBX, SPILL(variable->current));
+    store(a, RBX, SPILL(r->count + i), RAX);
+  }
+  for (int i = 0; i < r->variableCount; i++) {
+    TraceVariable* variable = &r->variables[i];
+    if (!variable->written || variable->current == variable->ref) continue;
+    load(a, RAX, RBX, SPILL(r->count + i));
+    store(a, RBX, SPILL(variable->ref), RAX);
+  }
+
+  // Leave through the exit at the header when the nursery needs collecting.
+#ifdef DEBUG_STRESS_GC
+  jumpToExit(&c, ALWAYS, 0);
+#else
+  compareByteToZero(a, R15, (int32_t)offsetof(VM, nurseryFull));
+  jumpToExit(&c, CC_NE, 0);
+  compareByteToZero(a, R15, (int32_t)offsetof(VM, gcRequested));
+  jumpToExit(&c, CC_NE, 0);
+#endif
+  jumpTo(a, ALWAYS, loop);
+
+  // Nothing has been written yet when an entry check fails.
+  for (int i = 0; i < entryFailedCount; i++) patchHere(a, entryFailed[i]);
+  free(entryFailed);
+  loadImmediate(a, RAX, (uint64_t)-1);
+
+  int epilogue = a->count;
+  addImmediate(a, RSP, 8);
+  popCalleeSaved(a);
+  emitByte(a, 0xc3); // ret
+
+  int* stubs = (int*)malloc(sizeof(int) * (size_t)r->snapshotCount);
+  if (stubs == NULL) exit(1);
+  for (int i = 0; i < r->snapshotCount; i++) {
+    stubs[i] = a->count;
+    compileExit(&c, i, epilogue);
+  }
+
+  for (int i = 0; i < c.exitCount; i++) {
+    ExitJump* jump = &c.exits[i];
+    patch32(a, jump->from, stubs[jump->snapshot] - (jump->from + 4));
+  }
+  free(stubs);
+  free(c.exits);
+
+  size_t size = (size_t)a->count;
+  uint8_t* code = copyToExecutable(a->code, size);
+  freeAssembler(a);
+  if (code == NULL) return NULL;
+
+  Trace* trace = (Trace*)malloc(sizeof(Trace));
+  if (trace == NULL) exit(1);
+  trace->code = code;
+  trace->size = size;
+  trace->header = header;
+  trace->exitCount = r->snapshotCount;
+  trace->exits = (uint8_t**)malloc(sizeof(uint8_t*) *
+                                   (size_t)r->snapshotCount);
+  trace->spill = (Value*)malloc(sizeof(Value) *
+                                (size_t)(r->count + r->variableCount));
+  if (trace->exits == NULL || trace->spill == NULL) exit(1);
+  for (int i = 0; i < r->snapshotCount; i++) {
+    trace->exits[i] = r->snapshots[i].ip;
+  }
+  return trace;
+}
+
+static void freeRecorder(Recorder* r) {
+  for (int i = 0; i < r->snapshotCount; i++) free(r->snapshots[i].refs);
+  free(r->snapshots);
+  free(r->code);
+  free(r->variables);
+  free(r->stack);
+}
+
+// Records a trip around the loop at [header] and compiles it. Returns where
+// the interpreter should carry on.
+static uint8_t* recordTrace(CallFrame* frame, LoopSite* site,
+                            uint8_t* header) {
+  Recorder r;
+  r.frame = frame;
+  r.chunk = &frame->closure->function->chunk;
+  r.base = (int)(vm.stackTop - frame->slots);
+  r.code = NULL;
+  r.count = 0;
+  r.capacity = 0;
+  r.variables = NULL;
+  r.variableCount = 0;
+  r.variableCapacity = 0;
+  r.snapshots = NULL;
+  r.snapshotCount = 0;
+  r.snapshotCapacity = 0;
+  r.stack = NULL;
+  r.stackCount = 0;
+  r.stackCapacity = 0;
+  r.globalsCapacity = -1;
+
+  // The first exit goes back to the header.
+  takeSnapshot(&r, header, -1, -1);
+
+  uint8_t* ip;
+  if (record(&r, header, &ip) && checkLoopTypes(&r)) {
+    markLive(&r);
+    site->trace = compileTrace(&r, header);
+  }
+
+  if (site->trace == NULL) {
+    // Try again later unless it keeps failing.
+    if (++site->aborts < MAX_TRACE_ABORTS) site->hotness = 0;
+  }
+
+  freeRecorder(&r);
+  return ip;
+}
+
+static uint8_t* runTrace(Trace* trace, CallFrame* frame) {
+  TraceEntry entry = (TraceEntry)(uintptr_t)trace->code;
+  for (;;) {
+    int index = entry(frame->slots, trace->spill);
+    if (index == -1) return trace->header;
+    if (index != 0) return trace->exits[index];
+
+    // Back at the header because the nursery needs collecting.
+    collectAtSafepoint();
+  }
+}
+
+// Runs the hot loop at [header] with its trace, recording one first if
+// there isn't one yet. Returns the instruction where the interpreter should
+// carry on.
+uint8_t* traceLoop(CallFrame* frame, LoopSite* site, uint8_t* header) {
+  uint8_t* ip = header;
+  if (site->trace == NULL) ip = recordTrace(frame, site, header);
+  if (site->trace != NULL && ip == header) ip = runTrace(site->trace, frame);
+
+  // Loops inside this one may have been entered without forgetting what
+  // was hoisted out of them, so the interpreter loads everything again.
+  Chunk* chunk = &frame->closure->function->chunk;
+  forgetHoisted(chunk, 0, chunk->hoisted.count);
+  return ip;
+}
+
+void freeTrace(Trace* trace) {
+  if (trace == NULL) return;
+  freeExecutable(trace->code, trace->size);
+  free(trace->exits);
+  free(trace->spill);
+  free(trace);
+}
+#endif
@@ -0,0 +1,34 @@
+//> Optimization omit
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+
+// How many trips around a loop make it hot enough to trace unless --trace
+// says otherwise.
+#define TRACE_THRESHOLD 100
+
+#ifdef JIT
+typedef struct Trace {
+  uint8_t* code;
+  size_t size;
+
+  // Where the loop starts, which is also where the trace starts.
+  uint8_t* header;
+
+  // Where the interpreter picks up after each side exit. The first one is
+  // the loop header.
+  uint8_t** exits;
+  int exitCount;
+
+  // Where the code keeps the value of each instruction in the trace.
+  Value* spill;
+} Trace;
+
+uint8_t* traceLoop(CallFrame* frame, LoopSite* site, uint8_t* header);
+void freeTrace(Trace* trace);
+#endif
+
+#endif
@@ -151,6 +151,18 @@ typedef struct {
 
 #endif
 //< Optimization end-if-nan-boxing
+//> Optimization omit
+
+// What a global variable that's been named but not defined yet holds. It's
+// never the value of a Lox expression.
+#ifdef NAN_BOXING
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | 4))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#else
+#define UNDEFINED_VAL   ((Value){VAL_NIL, {.number = 1}})
+#define IS_UNDEFINED(value) (IS_NIL(value) && (value).as.number == 1)
+#endif
+//< Optimization omit
 //> value-array
 
 typedef struct {
@@ -4,6 +4,9 @@
 //< Types of Values include-stdarg
 //> vm-include-stdio
 #include <stdio.h>
+//> Optimization omit
+#include <stdlib.h>
+//< Optimization omit
 //> Strings vm-include-string
 #include <string.h>
 //< Strings vm-include-string
@@ -23,6 +26,13 @@
 #include "object.h"
 #include "memory.h"
 //< Strings vm-include-object-memory
+//> Optimization omit
+#include "cache.h"
+#include "heap.h"
+#include "jit.h"
+#include "nursery.h"
+#include "trace.h"
+//< Optimization omit
 #include "vm.h"
 
 VM vm; // [one]
@@ -42,6 +52,51 @@ static void resetStack() {
 //< Closures init-open-upvalues
 }
 //< reset-stack
+//> Optimization omit
+// Moves the value stack to a new array of [capacity] slots and points the
+// frames and open upvalues into the new one.
+static void resizeStack(int capacity) {
+  Value* stack = (Value*)malloc(sizeof(Value) * capacity);
+  if (stack == NULL) exit(1);
+
+  int count = (int)(vm.stackTop - vm.stack);
+  memcpy(stack, vm.stack, sizeof(Value) * count);
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+
+  for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm.stack);
+  }
+
+  free(vm.stack);
+  vm.stack = stack;
+  vm.stackTop = stack + count;
+  vm.stackCapacity = capacity;
+}
+
+// Nothing keeps a pointer to a frame across a call, so the call stack can
+// simply be reallocated.
+static void resizeFrames(int capacity) {
+  vm.frames = (CallFrame*)realloc(vm.frames, sizeof(CallFrame) * capacity);
+  if (vm.frames == NULL) exit(1);
+  vm.frameCapacity = capacity;
+}
+
+// Grows the value stack until it has room for [count] slots.
+static void growStack(int count) {
+  int capacity = vm.stackCapacity * 2;
+  while (capacity < count) capacity *= 2;
+  resizeStack(capacity);
+}
+
+// Resizes both stacks to hold [count] frames before they next need to grow.
+void reserveFrames(int count) {
+  resizeFrames(count);
+  resizeStack(count * UINT8_COUNT);
+}
+//< Optimization omit
 //> Types of Values runtime-error
 static void runtimeError(const char* format, ...) {
   va_list args;
@@ -72,13 +127,25 @@ static void runtimeError(const char* format, ...) {
     ObjFunction* function = frame->closure->function;
 //< Closures runtime-error-function
     size_t instruction = frame->ip - function->chunk.code - 1;
+/* Calls and Functions runtime-error-stack < Optimization omit
     fprintf(stderr, "[line %d] in ", // [minus]
             function->chunk.lines[instruction]);
+*/
+//> Optimization omit
+    fprintf(stderr, "[line %d] in ", // [minus]
+            getLine(&function->chunk, (int)instruction));
+//< Optimization omit
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
       fprintf(stderr, "%s()\n", function->name->chars);
     }
+//> Optimization omit
+    if (frame->tailCalls > 0) {
+      fprintf(stderr, "[%llu frames elided by tail calls]\n",
+              (unsigned long long)frame->tailCalls);
+    }
+//< Optimization omit
   }
 
 //< Calls and Functions runtime-error-stack
@@ -89,22 +156,85 @@ static void runtimeError(const char* format, ...) {
 static void defineNative(const char* name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
+/* Calls and Functions define-native < Optimization omit
   tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+*/
+//> Optimization omit
+  int slot = globalSlot(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
+//< Optimization omit
   pop();
   pop();
 }
 //< Calls and Functions define-native
 
 void initVM() {
+//> Optimization omit
+  vm.frameCapacity = FRAMES_INITIAL;
+  vm.frames = (CallFrame*)malloc(sizeof(CallFrame) * vm.frameCapacity);
+  vm.stackCapacity = FRAMES_INITIAL * UINT8_COUNT;
+  vm.stack = (Value*)malloc(sizeof(Value) * vm.stackCapacity);
+  if (vm.frames == NULL || vm.stack == NULL) exit(1);
+  vm.maxFrames = FRAMES_MAX;
+
+//< Optimization omit
 //> call-reset-stack
   resetStack();
 //< call-reset-stack
 //> Strings init-objects-root
+/* Strings init-objects-root < Optimization omit
   vm.objects = NULL;
+*/
 //< Strings init-objects-root
+//> Optimization omit
+  flushMethodCache();
+  initHeap();
+  initNursery();
+
+  vm.gcSliceBudget = 0;
+  vm.gcState = GC_IDLE;
+  vm.gcRequested = false;
+  vm.gcThreads = 1;
+  vm.markingInParallel = false;
+  vm.gcPercent = 100;
+  vm.gcMinHeap = 4 * 1024 * 1024;
+  vm.gcMaxHeap = 0;
+  vm.gcSoftLimit = 0;
+  vm.gcMarkStartBytes = 0;
+  vm.gcRunway = 0;
+  vm.gcLastCycleEnd = gcClock();
+  vm.gcLastCycleWork = 0;
+  vm.gcStats = GC_STATS_OFF;
+  memset(&vm.gcCycle, 0, sizeof(vm.gcCycle));
+  vm.gcCycleCount = 0;
+  vm.gcHistoryCount = 0;
+  vm.gcHistoryCapacity = 0;
+  vm.gcHistory = NULL;
+  vm.gcNurseryCount = 0;
+  vm.gcPromotedCount = 0;
+  vm.gcLogPauses = false;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) vm.gcPauses[i] = 0;
+  vm.gcPauseTotal = 0;
+  vm.gcLongestPause = 0;
+  vm.gcMarkTime = 0;
+  vm.gcSweepTime = 0;
+  vm.gcLazySweepTime = 0;
+  vm.jitThreshold = JIT_THRESHOLD;
+  vm.traceThreshold = TRACE_THRESHOLD;
+  vm.optimizeLevel = 0;
+  vm.lazyCompile = false;
+  vm.sources = NULL;
+  vm.sourceCount = 0;
+  vm.sourceCapacity = 0;
+//< Optimization omit
 //> Garbage Collection init-gc-fields
   vm.bytesAllocated = 0;
+/* Garbage Collection init-gc-fields < Optimization omit
   vm.nextGC = 1024 * 1024;
+*/
+//> Optimization omit
+  vm.nextGC = vm.gcMinHeap;
+//< Optimization omit
 //< Garbage Collection init-gc-fields
 //> Garbage Collection init-gray-stack
 
@@ -115,6 +245,9 @@ void initVM() {
 //> Global Variables init-globals
 
   initTable(&vm.globals);
+//> Optimization omit
+  initValueArray(&vm.globalValues);
+//< Optimization omit
 //< Global Variables init-globals
 //> Hash Tables init-strings
   initTable(&vm.strings);
@@ -132,9 +265,58 @@ void initVM() {
 //< Calls and Functions define-native-clock
 }
 
+//> Optimization omit
+#ifdef DEBUG_QUICKEN_STATS
+static void printQuickenStats(Obj* object) {
+  if (object->type != OBJ_FUNCTION) return;
+
+  ObjFunction* function = (ObjFunction*)object;
+  if (function->quickenCount == 0) return;
+
+  fprintf(stderr, "%s(): %d quickened, %d de-quickened\n",
+          function->name == NULL ? "script" : function->name->chars,
+          function->quickenCount, function->dequickenCount);
+}
+#endif
+
+#ifdef DEBUG_INVOKE_STATS
+// Prints how each method call site in [object] that ran fared against its
+// cache.
+static void printInvokeStats(Obj* object) {
+  if (object->type != OBJ_FUNCTION) return;
+
+  ObjFunction* function = (ObjFunction*)object;
+  Chunk* chunk = &function->chunk;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionSize(chunk, offset)) {
+    uint8_t op = chunk->code[offset];
+    if (op != OP_INVOKE && op != OP_SUPER_INVOKE) continue;
+
+    int index = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    InvokeCache* cache = &chunk->invokeCaches[index];
+    uint64_t calls = cache->hits + cache->misses + cache->megamorphic;
+    if (calls == 0) continue;
+
+    ObjString* name = AS_STRING(
+        chunk->constants.values[chunk->code[offset + 1]]);
+    fprintf(stderr, "[line %d] in %s() .%s: %llu calls, %.1f%% hit, "
+            "%.1f%% miss, %.1f%% megamorphic (%d types)\n",
+            getLine(chunk, offset),
+            function->name == NULL ? "script" : function->name->chars,
+            name->chars, (unsigned long long)calls,
+            100.0 * cache->hits / calls, 100.0 * cache->misses / calls,
+            100.0 * cache->megamorphic / calls, cache->count);
+  }
+}
+#endif
+//< Optimization omit
+
 void freeVM() {
 //> Global Variables free-globals
   freeTable(&vm.globals);
+//> Optimization omit
+  freeValueArray(&vm.globalValues);
+//< Optimization omit
 //< Global Variables free-globals
 //> Hash Tables free-strings
   freeTable(&vm.strings);
@@ -143,9 +325,73 @@ void freeVM() {
   vm.initString = NULL;
 //< Methods and Initializers clear-init-string
 //> Strings call-free-objects
+//> Optimization omit
+#ifdef DEBUG_INVOKE_STATS
+  forEachObject(printInvokeStats);
+#endif
+#ifdef DEBUG_QUICKEN_STATS
+  forEachObject(printQuickenStats);
+#endif
+  if (vm.gcLogPauses && vm.gcStats == GC_STATS_OFF) printGcPauses();
+  if (vm.gcStats != GC_STATS_OFF) printGcStats();
+//< Optimization omit
   freeObjects();
 //< Strings call-free-objects
+//> Optimization omit
+#ifdef JIT
+  freeJit();
+#endif
+#ifdef DEBUG_COUNT_PROBES
+  fprintf(stderr, "%llu hash table probes\n",
+          (unsigned long long)tableProbeCount);
+#endif
+  free(vm.frames);
+  free(vm.stack);
+  vm.frames = NULL;
+  vm.stack = NULL;
+  freeCompiled();
+  for (int i = 0; i < vm.sourceCount; i++) free(vm.sources[i]);
+  free(vm.sources);
+  vm.sources = NULL;
+  vm.sourceCount = 0;
+  vm.sourceCapacity = 0;
+//< Optimization omit
+}
+//> Optimization omit
+// Returns the slot of the global variable named [name], giving it a new,
+// undefined one if it doesn't have one yet. Returns -1 if there's no room
+// for another.
+int globalSlot(ObjString* name) {
+  Value slot;
+  if (tableGet(&vm.globals, name, &slot)) return (int)AS_NUMBER(slot);
+  if (vm.globalValues.count > UINT16_MAX) return -1;
+
+  tableSet(&vm.globals, name, NUMBER_VAL(vm.globalValues.count));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  return vm.globalValues.count - 1;
+}
+
+// Finds the name of the global variable in [slot]. Only errors and the
+// disassembler need it, so it isn't kept anywhere faster to get at.
+ObjString* globalName(int slot) {
+  for (int i = 0; i < vm.globals.capacity; i++) {
+    Entry* entry = &vm.globals.entries[i];
+    if (entry->key != NULL && AS_NUMBER(entry->value) == slot) {
+      return entry->key;
+    }
+  }
+
+  return NULL; // Unreachable.
+}
+
+// The global method cache doesn't keep classes alive, so it has to be
+// emptied whenever one might be freed.
+void flushMethodCache() {
+  for (int i = 0; i < METHOD_CACHE_SIZE; i++) {
+    vm.methodCache[i].klass = NULL;
+  }
 }
+//< Optimization omit
 //> push
 void push(Value value) {
   *vm.stackTop = value;
@@ -163,6 +409,35 @@ static Value peek(int distance) {
   return vm.stackTop[-1 - distance];
 }
 //< Types of Values peek
+//> Optimization omit
+#ifdef JIT
+// Counts a call or loop iteration toward compiling [function]. Functions
+// that fail to compile stay at the threshold, so they aren't tried again.
+static inline void warmUp(ObjFunction* function) {
+  if (function->hotness < vm.jitThreshold &&
+      ++function->hotness == vm.jitThreshold) {
+    compileFunction(function);
+  }
+}
+
+// Counts a trip around a loop toward tracing it. Like functions, loops that
+// are given up on stay at the threshold.
+static inline bool warmUpLoop(LoopSite* site) {
+  return site->hotness < vm.traceThreshold &&
+         ++site->hotness == vm.traceThreshold;
+}
+#endif
+
+// Compiles the body of [function], which --lazy skipped over, before its
+// first call. The compiler has already reported any errors in it if that
+// fails.
+static bool compileBody(ObjFunction* function) {
+  if (compileLazy(function)) return true;
+
+  runtimeError("Couldn't compile %s().", function->name->chars);
+  return false;
+}
+//< Optimization omit
 /* Calls and Functions call < Closures call-signature
 static bool call(ObjFunction* function, int argCount) {
 */
@@ -186,12 +461,34 @@ static bool call(ObjClosure* closure, int argCount) {
 
 //< check-arity
 //> check-overflow
+/* Calls and Functions check-overflow < Optimization omit
   if (vm.frameCount == FRAMES_MAX) {
+*/
+//> Optimization omit
+  if (vm.frameCount == vm.maxFrames) {
+//< Optimization omit
     runtimeError("Stack overflow.");
     return false;
   }
 
 //< check-overflow
+//> Optimization omit
+  if (vm.frameCount == vm.frameCapacity) {
+    resizeFrames(vm.frameCapacity * 2);
+  }
+
+  if (closure->function->lazy != NULL && !compileBody(closure->function)) {
+    return false;
+  }
+
+  int stackEnd = (int)(vm.stackTop - vm.stack) - argCount - 1 +
+                 closure->function->frameSize;
+  if (stackEnd > vm.stackCapacity) growStack(stackEnd);
+
+#ifdef JIT
+  warmUp(closure->function);
+#endif
+//< Optimization omit
   CallFrame* frame = &vm.frames[vm.frameCount++];
 /* Calls and Functions call < Closures call-init-closure
   frame->function = function;
@@ -202,6 +499,9 @@ static bool call(ObjClosure* closure, int argCount) {
   frame->ip = closure->function->chunk.code;
 //< Closures call-init-closure
   frame->slots = vm.stackTop - argCount - 1;
+//> Optimization omit
+  frame->tailCalls = 0;
+//< Optimization omit
   return true;
 }
 //< Calls and Functions call
@@ -263,7 +563,71 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 //< Calls and Functions call-value
+//> Optimization omit
+// Returns the method the call site [cache] remembers for receivers with
+// [key], or NULL if it hasn't seen one.
+static inline ObjClosure* probeInvokeCache(InvokeCache* cache, Obj* key) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].key == key) {
+#ifdef DEBUG_INVOKE_STATS
+      cache->hits++;
+#endif
+      return AS_CLOSURE(cache->entries[i].method);
+    }
+  }
+
+  return NULL;
+}
+
+// Looks up [name] in [klass] for a call site that missed its cache. Once the
+// site has seen too many receiver types, this goes through the global method
+// cache. Otherwise, the result is added to the site's cache under [key], if
+// there is one.
+static bool findMethod(InvokeCache* cache, Obj* key, ObjClass* klass,
+                       ObjString* name, Value* method) {
+  if (cache->count == INVOKE_CACHE_SIZE) {
+#ifdef DEBUG_INVOKE_STATS
+    cache->megamorphic++;
+#endif
+    uint32_t hash = (uint32_t)((uintptr_t)klass >> 4) ^ name->hash;
+    MethodCacheEntry* entry =
+        &vm.methodCache[hash & (METHOD_CACHE_SIZE - 1)];
+    if (entry->klass == klass && entry->name == name) {
+      *method = entry->method;
+      return true;
+    }
+
+    if (!tableGet(&klass->methods, name, method)) {
+      runtimeError("Undefined property '%s'.", name->chars);
+      return false;
+    }
+
+    entry->klass = klass;
+    entry->name = name;
+    entry->method = *method;
+    return true;
+  }
+
+#ifdef DEBUG_INVOKE_STATS
+  cache->misses++;
+#endif
+  if (!tableGet(&klass->methods, name, method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  if (key != NULL) {
+    InvokeCacheEntry* entry = &cache->entries[cache->count++];
+    entry->key = key;
+    entry->method = *method;
+    shadeObject(key);
+    shadeValue(*method);
+  }
+  return true;
+}
+//< Optimization omit
 //> Methods and Initializers invoke-from-class
+/* Methods and Initializers invoke-from-class < Optimization omit
 static bool invokeFromClass(ObjClass* klass, ObjString* name,
                             int argCount) {
   Value method;
@@ -271,11 +635,24 @@ static bool invokeFromClass(ObjClass* klass, ObjString* name,
     runtimeError("Undefined property '%s'.", name->chars);
     return false;
   }
+*/
+//> Optimization omit
+static bool invokeFromClass(InvokeCache* cache, Obj* key,
+                            ObjClass* klass, ObjString* name,
+                            int argCount) {
+  Value method;
+  if (!findMethod(cache, key, klass, name, &method)) return false;
+//< Optimization omit
   return call(AS_CLOSURE(method), argCount);
 }
 //< Methods and Initializers invoke-from-class
 //> Methods and Initializers invoke
+/* Methods and Initializers invoke < Optimization omit
 static bool invoke(ObjString* name, int argCount) {
+*/
+//> Optimization omit
+static bool invoke(InvokeCache* cache, ObjString* name, int argCount) {
+//< Optimization omit
   Value receiver = peek(argCount);
 //> invoke-check-type
 
@@ -289,13 +666,27 @@ static bool invoke(ObjString* name, int argCount) {
 //> invoke-field
 
   Value value;
+/* Methods and Initializers invoke-field < Optimization omit
   if (tableGet(&instance->fields, name, &value)) {
+*/
+//> Optimization omit
+  if (instanceGetField(instance, name, &value)) {
+//< Optimization omit
     vm.stackTop[-argCount - 1] = value;
     return callValue(value, argCount);
   }
 
 //< invoke-field
+/* Methods and Initializers invoke < Optimization omit
   return invokeFromClass(instance->klass, name, argCount);
+*/
+//> Optimization omit
+  // Only receivers without a field of the same name are cached, so a hit
+  // never has to check for one. Dictionary mode instances have no shape to
+  // key the cache on.
+  return invokeFromClass(cache, (Obj*)instance->shape, instance->klass,
+                         name, argCount);
+//< Optimization omit
 }
 //< Methods and Initializers invoke
 //> Methods and Initializers bind-method
@@ -313,6 +704,93 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
   return true;
 }
 //< Methods and Initializers bind-method
+//> Optimization omit
+// Pushes a copy of the value [distance] slots below the top of the stack.
+// Computing a bound method again would have made a new one, so a bound
+// method is copied into one.
+static void pickValue(int distance) {
+  Value value = peek(distance);
+  if (IS_BOUND_METHOD(value)) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(value);
+    value = OBJ_VAL(newBoundMethod(bound->receiver, bound->method));
+  }
+  push(value);
+}
+
+// Remembers [value] as what the load hoisted out of a loop in [function]
+// with entry [index] loaded.
+static void setHoisted(ObjFunction* function, int index, Value value) {
+  // Each load of a method makes a new bound method.
+  if (IS_BOUND_METHOD(value)) return;
+
+  function->chunk.hoisted.values[index] = value;
+  writeBarrier((Obj*)function, value);
+}
+
+// Replaces the instance on top of the stack with the value of its property
+// [name] and records where it was found in [cache].
+static bool getProperty(InlineCache* cache, ObjInstance* instance,
+                        ObjString* name) {
+  ObjShape* shape = instance->shape;
+  Value value;
+  if (shape != NULL) {
+    int slot = shapeSlot(shape, name);
+    if (slot != -1) {
+      cache->shape = shape;
+      cache->slot = slot;
+      cache->method = NIL_VAL;
+      shadeObject((Obj*)shape);
+
+      pop(); // Instance.
+      push(instance->fields[slot]);
+      return true;
+    }
+  } else if (tableGet(instance->dictionary, name, &value)) {
+    pop(); // Instance.
+    push(value);
+    return true;
+  }
+
+  Value method;
+  if (!tableGet(&instance->klass->methods, name, &method)) {
+    runtimeError("Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  // Dictionary mode instances don't have a shape to key the cache on.
+  if (shape != NULL) {
+    cache->shape = shape;
+    cache->slot = -1;
+    cache->method = method;
+    shadeObject((Obj*)shape);
+    shadeValue(method);
+  }
+
+  ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
+  pop();
+  push(OBJ_VAL(bound));
+  return true;
+}
+
+static void setProperty(InlineCache* cache, ObjInstance* instance,
+                        ObjString* name, Value value) {
+  ObjShape* shape = instance->shape;
+  instanceSetField(instance, name, value);
+  if (shape == NULL || instance->shape == NULL) return;
+
+  cache->shape = shape;
+  shadeObject((Obj*)shape);
+  if (instance->shape == shape) {
+    cache->transition = NULL;
+    cache->slot = shapeSlot(shape, name);
+  } else {
+    // The field was added.
+    cache->transition = instance->shape;
+    cache->slot = instance->shape->slotCount - 1;
+    shadeObject((Obj*)instance->shape);
+  }
+}
+//< Optimization omit
 //> Closures capture-upvalue
 static ObjUpvalue* captureUpvalue(Value* local) {
 //> look-for-existing-upvalue
@@ -349,15 +827,108 @@ static void closeUpvalues(Value* last) {
     ObjUpvalue* upvalue = vm.openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+//> Optimization omit
+    writeBarrier((Obj*)upvalue, upvalue->closed);
+//< Optimization omit
     vm.openUpvalues = upvalue->next;
   }
 }
 //< Closures close-upvalues
+//> Optimization omit
+// Calls [callee] with the [argCount] arguments on top of the stack for the
+// function running in [frame], which returns whatever the callee does. A
+// closure or bound method takes over the frame: its upvalues are closed and
+// the callee and arguments slide down into its slots. Anything else is called
+// as usual, and the OP_RETURN after the call returns the result.
+static bool tailCall(CallFrame* frame, Value callee, int argCount) {
+  ObjClosure* closure;
+  if (IS_CLOSURE(callee)) {
+    closure = AS_CLOSURE(callee);
+  } else if (IS_BOUND_METHOD(callee)) {
+    ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+    vm.stackTop[-argCount - 1] = bound->receiver;
+    closure = bound->method;
+  } else {
+    return callValue(callee, argCount);
+  }
+
+  if (argCount != closure->function->arity) {
+    runtimeError("Expected %d arguments but got %d.",
+        closure->function->arity, argCount);
+    return false;
+  }
+
+  if (closure->function->lazy != NULL && !compileBody(closure->function)) {
+    return false;
+  }
+
+  int stackEnd = (int)(frame->slots - vm.stack) +
+                 closure->function->frameSize;
+  if (stackEnd > vm.stackCapacity) growStack(stackEnd);
+
+#ifdef JIT
+  warmUp(closure->function);
+#endif
+  closeUpvalues(frame->slots);
+  memmove(frame->slots, vm.stackTop - argCount - 1,
+          sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  frame->tailCalls++;
+  return true;
+}
+
+// Invokes [name] on the receiver under the [argCount] arguments on top of
+// the stack as a tail call from [frame]. The method is found the way
+// OP_INVOKE finds it, through the call site's [cache].
+static bool tailInvoke(CallFrame* frame, InvokeCache* cache,
+                       ObjString* name, int argCount) {
+  Value receiver = peek(argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError("Only instances have methods.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  ObjClosure* closure = probeInvokeCache(cache, (Obj*)instance->shape);
+  if (closure != NULL) return tailCall(frame, OBJ_VAL(closure), argCount);
+
+  Value value;
+  if (instanceGetField(instance, name, &value)) {
+    vm.stackTop[-argCount - 1] = value;
+    return tailCall(frame, value, argCount);
+  }
+
+  if (!findMethod(cache, (Obj*)instance->shape, instance->klass, name,
+                  &value)) {
+    return false;
+  }
+  return tailCall(frame, value, argCount);
+}
+
+// Invokes [name] on [superclass] as a tail call from [frame].
+static bool tailSuperInvoke(CallFrame* frame, InvokeCache* cache,
+                            ObjClass* superclass, ObjString* name,
+                            int argCount) {
+  ObjClosure* closure = probeInvokeCache(cache, (Obj*)superclass);
+  if (closure != NULL) return tailCall(frame, OBJ_VAL(closure), argCount);
+
+  Value method;
+  if (!findMethod(cache, (Obj*)superclass, superclass, name, &method)) {
+    return false;
+  }
+  return tailCall(frame, method, argCount);
+}
+//< Optimization omit
 //> Methods and Initializers define-method
 static void defineMethod(ObjString* name) {
   Value method = peek(0);
   ObjClass* klass = AS_CLASS(peek(1));
   tableSet(&klass->methods, name, method);
+//> Optimization omit
+  writeBarrier((Obj*)klass, OBJ_VAL(name));
+//< Optimization omit
   pop();
 }
 //< Methods and Initializers define-method
@@ -391,15 +962,76 @@ static void concatenate() {
   push(OBJ_VAL(result));
 }
 //< Strings concatenate
+//> Optimization omit
+// Returns the operand of a register instruction in [frame] that is of
+// [kind] at [index]. An operand on the stack is left there until the
+// instruction is done with it.
+static inline Value readOperand(CallFrame* frame, int kind, uint8_t index) {
+  switch (kind) {
+    case OPERAND_REGISTER: return frame->slots[index];
+    case OPERAND_CONSTANT:
+      return frame->closure->function->chunk.constants.values[index];
+    case OPERAND_STACK: return vm.stackTop[-1];
+    default: return NUMBER_VAL(index);
+  }
+}
+
+// Finishes a register instruction in [frame] with operands of [kinds] by
+// popping its left operand if that's on the stack and storing [result] in
+// local [slot], or pushing it if [slot] is zero.
+static inline void writeResult(CallFrame* frame, uint8_t kinds,
+                               uint8_t slot, Value result) {
+  if (LEFT_KIND(kinds) == OPERAND_STACK) vm.stackTop--;
+  if (slot == 0) {
+    push(result);
+  } else {
+    frame->slots[slot] = result;
+  }
+}
+
+// Does what writeResult() does with the concatenation of strings [a] and
+// [b]. They go through the stack, where the collector can see them.
+static void concatenateOperands(CallFrame* frame, uint8_t kinds,
+                                uint8_t slot, Value a, Value b) {
+  if (LEFT_KIND(kinds) != OPERAND_STACK) push(a);
+  push(b);
+  concatenate();
+  if (slot != 0) frame->slots[slot] = pop();
+}
+
+// Returns the constant at the index whose low byte is [low] and whose high
+// bytes, from an OP_WIDE prefix, are in [*wide]. Clears [*wide] for the
+// next instruction.
+static Value wideConstant(CallFrame* frame, uint32_t* wide, uint8_t low) {
+  uint32_t index = *wide | low;
+  *wide = 0;
+  return frame->closure->function->chunk.constants.values[index];
+}
+//< Optimization omit
 //> run
 static InterpretResult run() {
 //> Calls and Functions run
   CallFrame* frame = &vm.frames[vm.frameCount - 1];
+//> Optimization omit
+  // Keep the instruction pointer in a local so the compiler can hold it in a
+  // register. It gets written back to the frame before anything that reads
+  // it there: reporting a runtime error or pushing a new call frame.
+  uint8_t* ip = frame->ip;
+
+  // The high bytes of the next instruction's constant index, shifted into
+  // place, when an OP_WIDE prefix supplied them.
+  uint32_t wide = 0;
+//< Optimization omit
 
 /* A Virtual Machine run < Calls and Functions run
 #define READ_BYTE() (*vm.ip++)
 */
+/* Calls and Functions run < Optimization omit
 #define READ_BYTE() (*frame->ip++)
+*/
+//> Optimization omit
+#define READ_BYTE() (*ip++)
+//< Optimization omit
 /* A Virtual Machine read-constant < Calls and Functions run
 #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
 */
@@ -408,9 +1040,15 @@ static InterpretResult run() {
 #define READ_SHORT() \
     (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
 */
+/* Calls and Functions run < Optimization omit
 #define READ_SHORT() \
     (frame->ip += 2, \
     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+*/
+//> Optimization omit
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+//< Optimization omit
 
 /* Calls and Functions run < Closures read-constant
 #define READ_CONSTANT() \
@@ -423,8 +1061,66 @@ static InterpretResult run() {
 
 //< Calls and Functions run
 //> Global Variables read-string
+/* Global Variables read-string < Optimization omit
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+*/
+//> Optimization omit
+#define READ_STRING() AS_STRING(READ_WIDE_CONSTANT())
+//< Optimization omit
 //< Global Variables read-string
+//> Optimization omit
+#define READ_WIDE_CONSTANT() wideConstant(frame, &wide, READ_BYTE())
+#define READ_CACHE() \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_INVOKE_CACHE() \
+    (&frame->closure->function->chunk.invokeCaches[READ_SHORT()])
+
+// Backward jumps, tail calls, and returns are where the nursery can be
+// collected. The only references to objects are in the VM's roots there, so
+// they can move.
+#ifdef DEBUG_STRESS_GC
+#define SAFEPOINT() collectAtSafepoint()
+#else
+#define SAFEPOINT() \
+    if (vm.nurseryFull || vm.gcRequested) collectAtSafepoint()
+#endif
+
+// Once the frame that is running has been compiled, hands it over to the
+// native code.
+#ifdef JIT
+#define ENTER_JIT() \
+    if (frame->closure->function->jit != NULL) goto enterJit
+#else
+#define ENTER_JIT() do {} while (false)
+#endif
+
+// The first time an arithmetic or comparison instruction runs, it rewrites
+// its opcode in the chunk into a form specialized for the operand types it
+// saw. The specialized form only checks that the types still match and
+// otherwise rewrites itself back and runs the generic instruction again.
+// Once a function's instructions have fallen back too often, they're left
+// generic so a site that sees mixed types doesn't keep flipping.
+#define MAX_DEQUICKENS 64
+
+// Rewrites the instruction just read into [quickened].
+#define QUICKEN(quickened) \
+    do { \
+      ObjFunction* quickening = frame->closure->function; \
+      if (quickening->dequickenCount < MAX_DEQUICKENS) { \
+        ip[-1] = quickened; \
+        quickening->quickenCount++; \
+      } \
+    } while (false)
+
+// Rewrites the instruction just read back into [generic] and backs up to run
+// it again.
+#define DEQUICKEN(generic) \
+    do { \
+      ip[-1] = generic; \
+      frame->closure->function->dequickenCount++; \
+      ip--; \
+    } while (false)
+//< Optimization omit
 /* A Virtual Machine binary-op < Types of Values binary-op
 #define BINARY_OP(op) \
     do { \
@@ -434,6 +1130,7 @@ static InterpretResult run() {
     } while (false)
 */
 //> Types of Values binary-op
+/* Types of Values binary-op < Optimization omit
 #define BINARY_OP(valueType, op) \
     do { \
       if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
@@ -444,8 +1141,153 @@ static InterpretResult run() {
       double a = AS_NUMBER(pop()); \
       push(valueType(a op b)); \
     } while (false)
+*/
+//> Optimization omit
+#define BINARY_OP(valueType, op, quickened) \
+    do { \
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+        frame->ip = ip; \
+        runtimeError("Operands must be numbers."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      QUICKEN(quickened); \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(valueType(a op b)); \
+    } while (false)
+
+// The quickened form of BINARY_OP(). If the operands aren't numbers after
+// all, goes back to the [generic] instruction, which reports the error.
+#define NUMBER_OP(valueType, op, generic) \
+    do { \
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) { \
+        double b = AS_NUMBER(pop()); \
+        double a = AS_NUMBER(pop()); \
+        push(valueType(a op b)); \
+      } else { \
+        DEQUICKEN(generic); \
+      } \
+    } while (false)
+
+// Runs a register instruction whose operands must both be numbers.
+#define REGISTER_OP(valueType, op) \
+    do { \
+      uint8_t kinds = READ_BYTE(); \
+      uint8_t slot = READ_BYTE(); \
+      Value a = readOperand(frame, LEFT_KIND(kinds), READ_BYTE()); \
+      Value b = readOperand(frame, RIGHT_KIND(kinds), READ_BYTE()); \
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+        frame->ip = ip; \
+        runtimeError("Operands must be numbers."); \
+        return INTERPRET_RUNTIME_ERROR; \
+      } \
+      writeResult(frame, kinds, slot, \
+                  valueType(AS_NUMBER(a) op AS_NUMBER(b))); \
+    } while (false)
+//< Optimization omit
 //< Types of Values binary-op
 
+//> Optimization omit
+#ifdef JIT
+  // Runs compiled code until a call or return leaves a frame whose function
+  // hasn't been compiled on top. The interpreter picks up from there.
+enterJit:
+  while (frame->closure->function->jit != NULL) {
+    frame->ip = ip;
+    JitStatus status = runCompiled(frame);
+    if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR;
+    if (status == JIT_DONE) return INTERPRET_OK;
+
+    frame = &vm.frames[vm.frameCount - 1];
+    ip = frame->ip;
+  }
+#endif
+
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+    [OP_CONSTANT]            = &&op_CONSTANT,
+    [OP_NIL]                 = &&op_NIL,
+    [OP_TRUE]                = &&op_TRUE,
+    [OP_FALSE]               = &&op_FALSE,
+    [OP_POP]                 = &&op_POP,
+    [OP_GET_LOCAL]           = &&op_GET_LOCAL,
+    [OP_SET_LOCAL]           = &&op_SET_LOCAL,
+    [OP_GET_GLOBAL]          = &&op_GET_GLOBAL,
+    [OP_DEFINE_GLOBAL]       = &&op_DEFINE_GLOBAL,
+    [OP_SET_GLOBAL]          = &&op_SET_GLOBAL,
+    [OP_GET_UPVALUE]         = &&op_GET_UPVALUE,
+    [OP_SET_UPVALUE]         = &&op_SET_UPVALUE,
+    [OP_GET_PROPERTY]        = &&op_GET_PROPERTY,
+    [OP_SET_PROPERTY]        = &&op_SET_PROPERTY,
+    [OP_GET_SUPER]           = &&op_GET_SUPER,
+    [OP_EQUAL]               = &&op_EQUAL,
+    [OP_GREATER]             = &&op_GREATER,
+    [OP_LESS]                = &&op_LESS,
+    [OP_ADD]                 = &&op_ADD,
+    [OP_SUBTRACT]            = &&op_SUBTRACT,
+    [OP_MULTIPLY]            = &&op_MULTIPLY,
+    [OP_DIVIDE]              = &&op_DIVIDE,
+    [OP_NOT]                 = &&op_NOT,
+    [OP_NEGATE]              = &&op_NEGATE,
+    [OP_PRINT]               = &&op_PRINT,
+    [OP_JUMP]                = &&op_JUMP,
+    [OP_JUMP_IF_FALSE]       = &&op_JUMP_IF_FALSE,
+    [OP_LOOP]                = &&op_LOOP,
+    [OP_CALL]                = &&op_CALL,
+    [OP_INVOKE]              = &&op_INVOKE,
+    [OP_SUPER_INVOKE]        = &&op_SUPER_INVOKE,
+    [OP_CLOSURE]             = &&op_CLOSURE,
+    [OP_CLOSE_UPVALUE]       = &&op_CLOSE_UPVALUE,
+    [OP_RETURN]              = &&op_RETURN,
+    [OP_SMALL_INT]           = &&op_SMALL_INT,
+    [OP_POPN]                = &&op_POPN,
+    [OP_ADD_LOCALS]          = &&op_ADD_LOCALS,
+    [OP_GET_THIS_FIELD]      = &&op_GET_THIS_FIELD,
+    [OP_POP_JUMP_IF_FALSE]   = &&op_POP_JUMP_IF_FALSE,
+    [OP_JUMP_IF_NOT_EQUAL]   = &&op_JUMP_IF_NOT_EQUAL,
+    [OP_JUMP_IF_NOT_GREATER] = &&op_JUMP_IF_NOT_GREATER,
+    [OP_JUMP_IF_NOT_LESS]    = &&op_JUMP_IF_NOT_LESS,
+    [OP_PICK]                = &&op_PICK,
+    [OP_ENTER_LOOP]          = &&op_ENTER_LOOP,
+    [OP_GET_HOISTED]         = &&op_GET_HOISTED,
+    [OP_SET_HOISTED]         = &&op_SET_HOISTED,
+    [OP_ADD_NUM]             = &&op_ADD_NUM,
+    [OP_ADD_STR]             = &&op_ADD_STR,
+    [OP_SUBTRACT_NUM]        = &&op_SUBTRACT_NUM,
+    [OP_MULTIPLY_NUM]        = &&op_MULTIPLY_NUM,
+    [OP_DIVIDE_NUM]          = &&op_DIVIDE_NUM,
+    [OP_GREATER_NUM]         = &&op_GREATER_NUM,
+    [OP_LESS_NUM]            = &&op_LESS_NUM,
+    [OP_TAIL_CALL]           = &&op_TAIL_CALL,
+    [OP_TAIL_INVOKE]         = &&op_TAIL_INVOKE,
+    [OP_TAIL_SUPER_INVOKE]   = &&op_TAIL_SUPER_INVOKE,
+    [OP_ADD_REG]             = &&op_ADD_REG,
+    [OP_SUBTRACT_REG]        = &&op_SUBTRACT_REG,
+    [OP_MULTIPLY_REG]        = &&op_MULTIPLY_REG,
+    [OP_DIVIDE_REG]          = &&op_DIVIDE_REG,
+    [OP_EQUAL_REG]           = &&op_EQUAL_REG,
+    [OP_GREATER_REG]         = &&op_GREATER_REG,
+    [OP_LESS_REG]            = &&op_LESS_REG,
+    [OP_MOVE]                = &&op_MOVE,
+    [OP_CONSTANT_LONG]       = &&op_CONSTANT_LONG,
+    [OP_WIDE]                = &&op_WIDE,
+    [OP_CLASS]               = &&op_CLASS,
+    [OP_INHERIT]             = &&op_INHERIT,
+    [OP_METHOD]              = &&op_METHOD,
+  };
+
+  // Every handler ends by jumping straight to the next instruction's
+  // handler. That gives the CPU a separate indirect branch to predict for
+  // each opcode instead of one shared branch at the top of a switch.
+#define CASE(name) op_##name
+#define DISPATCH() goto *dispatchTable[READ_BYTE()]
+
+  DISPATCH();
+#else
+#define CASE(name) case OP_##name
+#define DISPATCH() break
+
+//< Optimization omit
   for (;;) {
 //> trace-execution
 #ifdef DEBUG_TRACE_EXECUTION
@@ -467,16 +1309,30 @@ static InterpretResult run() {
         (int)(frame->ip - frame->function->chunk.code));
 */
 //> Closures disassemble-instruction
+/* Closures disassemble-instruction < Optimization omit
     disassembleInstruction(&frame->closure->function->chunk,
         (int)(frame->ip - frame->closure->function->chunk.code));
+*/
+//> Optimization omit
+    disassembleInstruction(&frame->closure->function->chunk,
+        (int)(ip - frame->closure->function->chunk.code));
+//< Optimization omit
 //< Closures disassemble-instruction
 #endif
 
 //< trace-execution
     uint8_t instruction;
     switch (instruction = READ_BYTE()) {
+//> Optimization omit
+#endif
+//< Optimization omit
 //> op-constant
+/* A Virtual Machine op-constant < Optimization omit
       case OP_CONSTANT: {
+*/
+//> Optimization omit
+      CASE(CONSTANT): {
+//< Optimization omit
         Value constant = READ_CONSTANT();
 /* A Virtual Machine op-constant < A Virtual Machine push-constant
         printValue(constant);
@@ -485,19 +1341,41 @@ static InterpretResult run() {
 //> push-constant
         push(constant);
 //< push-constant
+/* A Virtual Machine op-constant < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< op-constant
 //> Types of Values interpret-literals
+/* Types of Values interpret-literals < Optimization omit
       case OP_NIL: push(NIL_VAL); break;
       case OP_TRUE: push(BOOL_VAL(true)); break;
       case OP_FALSE: push(BOOL_VAL(false)); break;
+*/
+//> Optimization omit
+      CASE(NIL): push(NIL_VAL); DISPATCH();
+      CASE(TRUE): push(BOOL_VAL(true)); DISPATCH();
+      CASE(FALSE): push(BOOL_VAL(false)); DISPATCH();
+//< Optimization omit
 //< Types of Values interpret-literals
 //> Global Variables interpret-pop
+/* Global Variables interpret-pop < Optimization omit
       case OP_POP: pop(); break;
+*/
+//> Optimization omit
+      CASE(POP): pop(); DISPATCH();
+//< Optimization omit
 //< Global Variables interpret-pop
 //> Local Variables interpret-get-local
+/* Local Variables interpret-get-local < Optimization omit
       case OP_GET_LOCAL: {
+*/
+//> Optimization omit
+      CASE(GET_LOCAL): {
+//< Optimization omit
         uint8_t slot = READ_BYTE();
 /* Local Variables interpret-get-local < Calls and Functions push-local
         push(vm.stack[slot]); // [slot]
@@ -505,11 +1383,21 @@ static InterpretResult run() {
 //> Calls and Functions push-local
         push(frame->slots[slot]);
 //< Calls and Functions push-local
+/* Local Variables interpret-get-local < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Local Variables interpret-get-local
 //> Local Variables interpret-set-local
+/* Local Variables interpret-set-local < Optimization omit
       case OP_SET_LOCAL: {
+*/
+//> Optimization omit
+      CASE(SET_LOCAL): {
+//< Optimization omit
         uint8_t slot = READ_BYTE();
 /* Local Variables interpret-set-local < Calls and Functions set-local
         vm.stack[slot] = peek(0);
@@ -517,58 +1405,152 @@ static InterpretResult run() {
 //> Calls and Functions set-local
         frame->slots[slot] = peek(0);
 //< Calls and Functions set-local
+/* Local Variables interpret-set-local < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Local Variables interpret-set-local
 //> Global Variables interpret-get-global
+/* Global Variables interpret-get-global < Optimization omit
       case OP_GET_GLOBAL: {
+*/
+//> Optimization omit
+      CASE(GET_GLOBAL): {
+//< Optimization omit
+/* Global Variables interpret-get-global < Optimization omit
         ObjString* name = READ_STRING();
         Value value;
         if (!tableGet(&vm.globals, name, &value)) {
           runtimeError("Undefined variable '%s'.", name->chars);
           return INTERPRET_RUNTIME_ERROR;
         }
+*/
+//> Optimization omit
+        int slot = READ_SHORT();
+        Value value = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(value)) {
+          frame->ip = ip;
+          runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+//< Optimization omit
         push(value);
+/* Global Variables interpret-get-global < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Global Variables interpret-get-global
 //> Global Variables interpret-define-global
+/* Global Variables interpret-define-global < Optimization omit
       case OP_DEFINE_GLOBAL: {
+*/
+//> Optimization omit
+      CASE(DEFINE_GLOBAL): {
+//< Optimization omit
+/* Global Variables interpret-define-global < Optimization omit
         ObjString* name = READ_STRING();
         tableSet(&vm.globals, name, peek(0));
+*/
+//> Optimization omit
+        vm.globalValues.values[READ_SHORT()] = peek(0);
+//< Optimization omit
         pop();
+/* Global Variables interpret-define-global < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Global Variables interpret-define-global
 //> Global Variables interpret-set-global
+/* Global Variables interpret-set-global < Optimization omit
       case OP_SET_GLOBAL: {
+*/
+//> Optimization omit
+      CASE(SET_GLOBAL): {
+//< Optimization omit
+/* Global Variables interpret-set-global < Optimization omit
         ObjString* name = READ_STRING();
         if (tableSet(&vm.globals, name, peek(0))) {
           tableDelete(&vm.globals, name); // [delete]
           runtimeError("Undefined variable '%s'.", name->chars);
           return INTERPRET_RUNTIME_ERROR;
         }
+*/
+//> Optimization omit
+        int slot = READ_SHORT();
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          frame->ip = ip;
+          runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        vm.globalValues.values[slot] = peek(0);
+//< Optimization omit
+/* Global Variables interpret-set-global < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Global Variables interpret-set-global
 //> Closures interpret-get-upvalue
+/* Closures interpret-get-upvalue < Optimization omit
       case OP_GET_UPVALUE: {
+*/
+//> Optimization omit
+      CASE(GET_UPVALUE): {
+//< Optimization omit
         uint8_t slot = READ_BYTE();
         push(*frame->closure->upvalues[slot]->location);
+/* Closures interpret-get-upvalue < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Closures interpret-get-upvalue
 //> Closures interpret-set-upvalue
+/* Closures interpret-set-upvalue < Optimization omit
       case OP_SET_UPVALUE: {
+*/
+//> Optimization omit
+      CASE(SET_UPVALUE): {
+//< Optimization omit
         uint8_t slot = READ_BYTE();
         *frame->closure->upvalues[slot]->location = peek(0);
+//> Optimization omit
+        // Only matters once the upvalue is closed.
+        writeBarrier((Obj*)frame->closure->upvalues[slot], peek(0));
+//< Optimization omit
+/* Closures interpret-set-upvalue < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Closures interpret-set-upvalue
 //> Classes and Instances interpret-get-property
+/* Classes and Instances interpret-get-property < Optimization omit
       case OP_GET_PROPERTY: {
+*/
+//> Optimization omit
+      CASE(GET_PROPERTY): {
+//< Optimization omit
 //> get-not-instance
         if (!IS_INSTANCE(peek(0))) {
+//> Optimization omit
+          frame->ip = ip;
+//< Optimization omit
           runtimeError("Only instances have properties.");
           return INTERPRET_RUNTIME_ERROR;
         }
@@ -576,6 +1558,7 @@ static InterpretResult run() {
 //< get-not-instance
         ObjInstance* instance = AS_INSTANCE(peek(0));
         ObjString* name = READ_STRING();
+/* Classes and Instances interpret-get-property < Optimization omit
         
         Value value;
         if (tableGet(&instance->fields, name, &value)) {
@@ -583,6 +1566,7 @@ static InterpretResult run() {
           push(value);
           break;
         }
+*/
 //> get-undefined
 
 //< get-undefined
@@ -591,52 +1575,132 @@ static InterpretResult run() {
         return INTERPRET_RUNTIME_ERROR;
 */
 //> Methods and Initializers get-method
+/* Methods and Initializers get-method < Optimization omit
         if (!bindMethod(instance->klass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
         break;
+*/
 //< Methods and Initializers get-method
+//> Optimization omit
+        InlineCache* cache = READ_CACHE();
+        if (instance->shape == cache->shape && cache->shape != NULL) {
+          if (cache->slot != -1) {
+            vm.stackTop[-1] = instance->fields[cache->slot];
+          } else {
+            ObjBoundMethod* bound = newBoundMethod(
+                peek(0), AS_CLOSURE(cache->method));
+            vm.stackTop[-1] = OBJ_VAL(bound);
+          }
+          DISPATCH();
+        }
+
+        frame->ip = ip;
+        if (!getProperty(cache, instance, name)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+//< Optimization omit
       }
 //< Classes and Instances interpret-get-property
 //> Classes and Instances interpret-set-property
+/* Classes and Instances interpret-set-property < Optimization omit
       case OP_SET_PROPERTY: {
+*/
+//> Optimization omit
+      CASE(SET_PROPERTY): {
+//< Optimization omit
 //> set-not-instance
         if (!IS_INSTANCE(peek(1))) {
+//> Optimization omit
+          frame->ip = ip;
+//< Optimization omit
           runtimeError("Only instances have fields.");
           return INTERPRET_RUNTIME_ERROR;
         }
 
 //< set-not-instance
         ObjInstance* instance = AS_INSTANCE(peek(1));
+/* Classes and Instances interpret-set-property < Optimization omit
         tableSet(&instance->fields, READ_STRING(), peek(0));
+*/
+//> Optimization omit
+        ObjString* name = READ_STRING();
+        InlineCache* cache = READ_CACHE();
+        if (instance->shape == cache->shape && cache->shape != NULL &&
+            cache->slot < instance->fieldCapacity) {
+          instance->fields[cache->slot] = peek(0);
+          writeBarrier((Obj*)instance, peek(0));
+          if (cache->transition != NULL) {
+            instance->shape = cache->transition;
+            noteFieldCount(instance->klass, cache->transition->slotCount);
+          }
+        } else {
+          setProperty(cache, instance, name, peek(0));
+        }
+//< Optimization omit
         Value value = pop();
         pop();
         push(value);
+/* Classes and Instances interpret-set-property < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Classes and Instances interpret-set-property
 //> Superclasses interpret-get-super
+/* Superclasses interpret-get-super < Optimization omit
       case OP_GET_SUPER: {
+*/
+//> Optimization omit
+      CASE(GET_SUPER): {
+//< Optimization omit
         ObjString* name = READ_STRING();
         ObjClass* superclass = AS_CLASS(pop());
         
+//> Optimization omit
+        frame->ip = ip;
+//< Optimization omit
         if (!bindMethod(superclass, name)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+/* Superclasses interpret-get-super < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Superclasses interpret-get-super
 //> Types of Values interpret-equal
+/* Types of Values interpret-equal < Optimization omit
       case OP_EQUAL: {
+*/
+//> Optimization omit
+      CASE(EQUAL): {
+//< Optimization omit
         Value b = pop();
         Value a = pop();
         push(BOOL_VAL(valuesEqual(a, b)));
+/* Types of Values interpret-equal < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Types of Values interpret-equal
 //> Types of Values interpret-comparison
+/* Types of Values interpret-comparison < Optimization omit
       case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
       case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+*/
+//> Optimization omit
+      CASE(GREATER):  BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+      CASE(LESS):     BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+//< Optimization omit
 //< Types of Values interpret-comparison
 /* A Virtual Machine op-binary < Types of Values op-arithmetic
       case OP_ADD:      BINARY_OP(+); break;
@@ -651,127 +1715,334 @@ static InterpretResult run() {
       case OP_ADD:      BINARY_OP(NUMBER_VAL, +); break;
 */
 //> Strings add-strings
+/* Strings add-strings < Optimization omit
       case OP_ADD: {
+*/
+//> Optimization omit
+      CASE(ADD): {
+//< Optimization omit
         if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+//> Optimization omit
+          QUICKEN(OP_ADD_STR);
+//< Optimization omit
           concatenate();
         } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+//> Optimization omit
+          QUICKEN(OP_ADD_NUM);
+//< Optimization omit
           double b = AS_NUMBER(pop());
           double a = AS_NUMBER(pop());
           push(NUMBER_VAL(a + b));
         } else {
+//> Optimization omit
+          frame->ip = ip;
+//< Optimization omit
           runtimeError(
               "Operands must be two numbers or two strings.");
           return INTERPRET_RUNTIME_ERROR;
         }
+/* Strings add-strings < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Strings add-strings
 //> Types of Values op-arithmetic
+/* Types of Values op-arithmetic < Optimization omit
       case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
       case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
       case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+*/
+//> Optimization omit
+      CASE(SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+      CASE(MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+      CASE(DIVIDE):   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); DISPATCH();
+//< Optimization omit
 //< Types of Values op-arithmetic
 //> Types of Values op-not
+/* Types of Values op-not < Optimization omit
       case OP_NOT:
         push(BOOL_VAL(isFalsey(pop())));
         break;
+*/
+//> Optimization omit
+      CASE(NOT):
+        push(BOOL_VAL(isFalsey(pop())));
+        DISPATCH();
+//< Optimization omit
 //< Types of Values op-not
 //> Types of Values op-negate
+/* Types of Values op-negate < Optimization omit
       case OP_NEGATE:
+*/
+//> Optimization omit
+      CASE(NEGATE):
+//< Optimization omit
         if (!IS_NUMBER(peek(0))) {
+//> Optimization omit
+          frame->ip = ip;
+//< Optimization omit
           runtimeError("Operand must be a number.");
           return INTERPRET_RUNTIME_ERROR;
         }
         push(NUMBER_VAL(-AS_NUMBER(pop())));
+/* Types of Values op-negate < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
 //< Types of Values op-negate
 //> Global Variables interpret-print
+/* Global Variables interpret-print < Optimization omit
       case OP_PRINT: {
+*/
+//> Optimization omit
+      CASE(PRINT): {
+//< Optimization omit
         printValue(pop());
         printf("\n");
+/* Global Variables interpret-print < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Global Variables interpret-print
 //> Jumping Back and Forth op-jump
+/* Jumping Back and Forth op-jump < Optimization omit
       case OP_JUMP: {
+*/
+//> Optimization omit
+      CASE(JUMP): {
+//< Optimization omit
         uint16_t offset = READ_SHORT();
 /* Jumping Back and Forth op-jump < Calls and Functions jump
         vm.ip += offset;
 */
 //> Calls and Functions jump
+/* Calls and Functions jump < Optimization omit
         frame->ip += offset;
+*/
+//> Optimization omit
+        ip += offset;
+//< Optimization omit
 //< Calls and Functions jump
+/* Jumping Back and Forth op-jump < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Jumping Back and Forth op-jump
 //> Jumping Back and Forth op-jump-if-false
+/* Jumping Back and Forth op-jump-if-false < Optimization omit
       case OP_JUMP_IF_FALSE: {
+*/
+//> Optimization omit
+      CASE(JUMP_IF_FALSE): {
+//< Optimization omit
         uint16_t offset = READ_SHORT();
 /* Jumping Back and Forth op-jump-if-false < Calls and Functions jump-if-false
         if (isFalsey(peek(0))) vm.ip += offset;
 */
 //> Calls and Functions jump-if-false
+/* Calls and Functions jump-if-false < Optimization omit
         if (isFalsey(peek(0))) frame->ip += offset;
+*/
+//> Optimization omit
+        if (isFalsey(peek(0))) ip += offset;
+//< Optimization omit
 //< Calls and Functions jump-if-false
+/* Jumping Back and Forth op-jump-if-false < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Jumping Back and Forth op-jump-if-false
 //> Jumping Back and Forth op-loop
+/* Jumping Back and Forth op-loop < Optimization omit
       case OP_LOOP: {
+*/
+//> Optimization omit
+      CASE(LOOP): {
+//< Optimization omit
         uint16_t offset = READ_SHORT();
+//> Optimization omit
+#ifdef JIT
+        LoopSite* site =
+            &frame->closure->function->chunk.loopSites[READ_SHORT()];
+#else
+        ip += 2;
+#endif
+//< Optimization omit
 /* Jumping Back and Forth op-loop < Calls and Functions loop
         vm.ip -= offset;
 */
 //> Calls and Functions loop
+/* Calls and Functions loop < Optimization omit
         frame->ip -= offset;
+*/
+//> Optimization omit
+        ip -= offset;
+        SAFEPOINT();
+#ifdef JIT
+        if (site->trace != NULL || warmUpLoop(site)) {
+          ip = traceLoop(frame, site, ip);
+        }
+        warmUp(frame->closure->function);
+#endif
+        ENTER_JIT();
+//< Optimization omit
 //< Calls and Functions loop
+/* Jumping Back and Forth op-loop < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Jumping Back and Forth op-loop
 //> Calls and Functions interpret-call
+/* Calls and Functions interpret-call < Optimization omit
       case OP_CALL: {
+*/
+//> Optimization omit
+      CASE(CALL): {
+//< Optimization omit
         int argCount = READ_BYTE();
+//> Optimization omit
+        frame->ip = ip;
+//< Optimization omit
         if (!callValue(peek(argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
 //> update-frame-after-call
         frame = &vm.frames[vm.frameCount - 1];
+//> Optimization omit
+        ip = frame->ip;
+        ENTER_JIT();
+//< Optimization omit
 //< update-frame-after-call
+/* Calls and Functions interpret-call < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Calls and Functions interpret-call
 //> Methods and Initializers interpret-invoke
+/* Methods and Initializers interpret-invoke < Optimization omit
       case OP_INVOKE: {
+*/
+//> Optimization omit
+      CASE(INVOKE): {
+//< Optimization omit
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
+/* Methods and Initializers interpret-invoke < Optimization omit
         if (!invoke(method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+*/
+//> Optimization omit
+        InvokeCache* cache = READ_INVOKE_CACHE();
+        frame->ip = ip;
+
+        Value receiver = peek(argCount);
+        ObjClosure* closure = IS_INSTANCE(receiver)
+            ? probeInvokeCache(cache, (Obj*)AS_INSTANCE(receiver)->shape)
+            : NULL;
+        if (closure != NULL) {
+          if (!call(closure, argCount)) return INTERPRET_RUNTIME_ERROR;
+        } else if (!invoke(cache, method, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+//< Optimization omit
         frame = &vm.frames[vm.frameCount - 1];
+//> Optimization omit
+        ip = frame->ip;
+        ENTER_JIT();
+//< Optimization omit
+/* Methods and Initializers interpret-invoke < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Methods and Initializers interpret-invoke
 //> Superclasses interpret-super-invoke
+/* Superclasses interpret-super-invoke < Optimization omit
       case OP_SUPER_INVOKE: {
+*/
+//> Optimization omit
+      CASE(SUPER_INVOKE): {
+//< Optimization omit
         ObjString* method = READ_STRING();
         int argCount = READ_BYTE();
         ObjClass* superclass = AS_CLASS(pop());
+/* Superclasses interpret-super-invoke < Optimization omit
         if (!invokeFromClass(superclass, method, argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+*/
+//> Optimization omit
+        InvokeCache* cache = READ_INVOKE_CACHE();
+        frame->ip = ip;
+
+        ObjClosure* closure = probeInvokeCache(cache, (Obj*)superclass);
+        if (closure != NULL) {
+          if (!call(closure, argCount)) return INTERPRET_RUNTIME_ERROR;
+        } else if (!invokeFromClass(cache, (Obj*)superclass, superclass,
+                                    method, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+//< Optimization omit
         frame = &vm.frames[vm.frameCount - 1];
+//> Optimization omit
+        ip = frame->ip;
+        ENTER_JIT();
+//< Optimization omit
+/* Superclasses interpret-super-invoke < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Superclasses interpret-super-invoke
 //> Closures interpret-closure
+/* Closures interpret-closure < Optimization omit
       case OP_CLOSURE: {
+*/
+//> Optimization omit
+      CASE(CLOSURE): {
+//< Optimization omit
+/* Closures interpret-closure < Optimization omit
         ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+*/
+//> Optimization omit
+        ObjFunction* function = AS_FUNCTION(READ_WIDE_CONSTANT());
+//< Optimization omit
         ObjClosure* closure = newClosure(function);
         push(OBJ_VAL(closure));
 //> interpret-capture-upvalues
         for (int i = 0; i < closure->upvalueCount; i++) {
           uint8_t isLocal = READ_BYTE();
+/* Closures interpret-capture-upvalues < Optimization omit
           uint8_t index = READ_BYTE();
+*/
+//> Optimization omit
+          uint16_t index = READ_SHORT();
+//< Optimization omit
           if (isLocal) {
             closure->upvalues[i] =
                 captureUpvalue(frame->slots + index);
@@ -780,16 +2051,34 @@ static InterpretResult run() {
           }
         }
 //< interpret-capture-upvalues
+/* Closures interpret-closure < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Closures interpret-closure
 //> Closures interpret-close-upvalue
+/* Closures interpret-close-upvalue < Optimization omit
       case OP_CLOSE_UPVALUE:
         closeUpvalues(vm.stackTop - 1);
         pop();
         break;
+*/
+//> Optimization omit
+      CASE(CLOSE_UPVALUE):
+        closeUpvalues(vm.stackTop - 1);
+        pop();
+        DISPATCH();
+//< Optimization omit
 //< Closures interpret-close-upvalue
+/* A Virtual Machine op-return < Optimization omit
       case OP_RETURN: {
+*/
+//> Optimization omit
+      CASE(RETURN): {
+//< Optimization omit
 /* A Virtual Machine print-return < Global Variables op-return
         printValue(pop());
         printf("\n");
@@ -814,19 +2103,44 @@ static InterpretResult run() {
         vm.stackTop = frame->slots;
         push(result);
         frame = &vm.frames[vm.frameCount - 1];
+//> Optimization omit
+        ip = frame->ip;
+        SAFEPOINT();
+        ENTER_JIT();
+//< Optimization omit
+/* Calls and Functions interpret-return < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
 //< Calls and Functions interpret-return
       }
 //> Classes and Instances interpret-class
+/* Classes and Instances interpret-class < Optimization omit
       case OP_CLASS:
         push(OBJ_VAL(newClass(READ_STRING())));
         break;
+*/
+//> Optimization omit
+      CASE(CLASS):
+        push(OBJ_VAL(newClass(READ_STRING())));
+        DISPATCH();
+//< Optimization omit
 //< Classes and Instances interpret-class
 //> Superclasses interpret-inherit
+/* Superclasses interpret-inherit < Optimization omit
       case OP_INHERIT: {
+*/
+//> Optimization omit
+      CASE(INHERIT): {
+//< Optimization omit
         Value superclass = peek(1);
 //> inherit-non-class
         if (!IS_CLASS(superclass)) {
+//> Optimization omit
+          frame->ip = ip;
+//< Optimization omit
           runtimeError("Superclass must be a class.");
           return INTERPRET_RUNTIME_ERROR;
         }
@@ -836,16 +2150,294 @@ static InterpretResult run() {
         tableAddAll(&AS_CLASS(superclass)->methods,
                     &subclass->methods);
         pop(); // Subclass.
+/* Superclasses interpret-inherit < Optimization omit
         break;
+*/
+//> Optimization omit
+        DISPATCH();
+//< Optimization omit
       }
 //< Superclasses interpret-inherit
 //> Methods and Initializers interpret-method
+/* Methods and Initializers interpret-method < Optimization omit
       case OP_METHOD:
         defineMethod(READ_STRING());
         break;
+*/
+//> Optimization omit
+      CASE(METHOD):
+        defineMethod(READ_STRING());
+        DISPATCH();
+//< Optimization omit
 //< Methods and Initializers interpret-method
+//> Optimization omit
+      CASE(SMALL_INT):
+        push(NUMBER_VAL(READ_BYTE()));
+        DISPATCH();
+      CASE(POPN):
+        vm.stackTop -= READ_BYTE();
+        DISPATCH();
+      CASE(ADD_LOCALS): {
+        Value a = frame->slots[READ_BYTE()];
+        Value b = frame->slots[READ_BYTE()];
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        } else if (IS_STRING(a) && IS_STRING(b)) {
+          push(a);
+          push(b);
+          concatenate();
+        } else {
+          frame->ip = ip;
+          runtimeError(
+              "Operands must be two numbers or two strings.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+      }
+      CASE(GET_THIS_FIELD): {
+        // The receiver is always an instance, so unlike OP_GET_PROPERTY
+        // there's no need to check.
+        ObjInstance* instance = AS_INSTANCE(frame->slots[0]);
+        ObjString* name = READ_STRING();
+        InlineCache* cache = READ_CACHE();
+        if (instance->shape == cache->shape && cache->shape != NULL &&
+            cache->slot != -1) {
+          push(instance->fields[cache->slot]);
+          DISPATCH();
+        }
+
+        push(frame->slots[0]);
+        frame->ip = ip;
+        if (!getProperty(cache, instance, name)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+      }
+      CASE(PICK):
+        pickValue(READ_BYTE());
+        DISPATCH();
+      CASE(ENTER_LOOP): {
+        int first = READ_SHORT();
+        forgetHoisted(&frame->closure->function->chunk, first, READ_BYTE());
+        DISPATCH();
+      }
+      CASE(GET_HOISTED): {
+        Value value =
+            frame->closure->function->chunk.hoisted.values[READ_SHORT()];
+        uint8_t skip = READ_BYTE();
+        if (!IS_UNDEFINED(value)) {
+          push(value);
+          ip += skip;
+        }
+        DISPATCH();
+      }
+      CASE(SET_HOISTED):
+        setHoisted(frame->closure->function, READ_SHORT(), peek(0));
+        DISPATCH();
+      CASE(POP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(pop())) ip += offset;
+        DISPATCH();
+      }
+      CASE(JUMP_IF_NOT_EQUAL): {
+        uint16_t offset = READ_SHORT();
+        Value b = pop();
+        Value a = pop();
+        if (!valuesEqual(a, b)) ip += offset;
+        DISPATCH();
+      }
+      CASE(JUMP_IF_NOT_GREATER): {
+        uint16_t offset = READ_SHORT();
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          frame->ip = ip;
+          runtimeError("Operands must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        if (!(a > b)) ip += offset;
+        DISPATCH();
+      }
+      CASE(JUMP_IF_NOT_LESS): {
+        uint16_t offset = READ_SHORT();
+        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+          frame->ip = ip;
+          runtimeError("Operands must be numbers.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        if (!(a < b)) ip += offset;
+        DISPATCH();
+      }
+      CASE(ADD_NUM):      NUMBER_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+      CASE(SUBTRACT_NUM): NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+      CASE(MULTIPLY_NUM): NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+      CASE(DIVIDE_NUM):   NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+      CASE(GREATER_NUM):  NUMBER_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+      CASE(LESS_NUM):     NUMBER_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+      CASE(ADD_STR):
+        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+          concatenate();
+        } else {
+          DEQUICKEN(OP_ADD);
+        }
+        DISPATCH();
+      CASE(TAIL_CALL): {
+        int argCount = READ_BYTE();
+        frame->ip = ip;
+        if (!tailCall(frame, peek(argCount), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        SAFEPOINT();
+        ENTER_JIT();
+        DISPATCH();
+      }
+      CASE(TAIL_INVOKE): {
+        ObjString* method = READ_STRING();
+        int argCount = READ_BYTE();
+        InvokeCache* cache = READ_INVOKE_CACHE();
+        frame->ip = ip;
+        if (!tailInvoke(frame, cache, method, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        SAFEPOINT();
+        ENTER_JIT();
+        DISPATCH();
+      }
+      CASE(TAIL_SUPER_INVOKE): {
+        ObjString* method = READ_STRING();
+        int argCount = READ_BYTE();
+        ObjClass* superclass = AS_CLASS(pop());
+        InvokeCache* cache = READ_INVOKE_CACHE();
+        frame->ip = ip;
+        if (!tailSuperInvoke(frame, cache, superclass, method, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        SAFEPOINT();
+        ENTER_JIT();
+        DISPATCH();
+      }
+      CASE(ADD_REG): {
+        uint8_t kinds = READ_BYTE();
+        uint8_t slot = READ_BYTE();
+        Value a = readOperand(frame, LEFT_KIND(kinds), READ_BYTE());
+        Value b = readOperand(frame, RIGHT_KIND(kinds), READ_BYTE());
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+          writeResult(frame, kinds, slot,
+                      NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        } else if (IS_STRING(a) && IS_STRING(b)) {
+          concatenateOperands(frame, kinds, slot, a, b);
+        } else {
+          frame->ip = ip;
+          runtimeError(
+              "Operands must be two numbers or two strings.");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        DISPATCH();
+      }
+      CASE(SUBTRACT_REG): REGISTER_OP(NUMBER_VAL, -); DISPATCH();
+      CASE(MULTIPLY_REG): REGISTER_OP(NUMBER_VAL, *); DISPATCH();
+      CASE(DIVIDE_REG):   REGISTER_OP(NUMBER_VAL, /); DISPATCH();
+      CASE(GREATER_REG):  REGISTER_OP(BOOL_VAL, >); DISPATCH();
+      CASE(LESS_REG):     REGISTER_OP(BOOL_VAL, <); DISPATCH();
+      CASE(EQUAL_REG): {
+        uint8_t kinds = READ_BYTE();
+        uint8_t slot = READ_BYTE();
+        Value a = readOperand(frame, LEFT_KIND(kinds), READ_BYTE());
+        Value b = readOperand(frame, RIGHT_KIND(kinds), READ_BYTE());
+        writeResult(frame, kinds, slot, BOOL_VAL(valuesEqual(a, b)));
+        DISPATCH();
+      }
+      CASE(MOVE): {
+        uint8_t kinds = READ_BYTE();
+        uint8_t slot = READ_BYTE();
+        Value value = readOperand(frame, LEFT_KIND(kinds), READ_BYTE());
+        writeResult(frame, kinds, slot, value);
+        DISPATCH();
+      }
+      CASE(CONSTANT_LONG): {
+        uint32_t index = (uint32_t)READ_BYTE() << 16;
+        index |= READ_SHORT();
+        push(frame->closure->function->chunk.constants.values[index]);
+        DISPATCH();
+      }
+      CASE(WIDE): {
+        uint32_t high = READ_SHORT();
+
+        // A local slot past the first 256 is read or written here, as is a
+        // jump that's taken, with the whole operand. A jump that isn't taken
+        // runs as usual, which leaves its short offset unused.
+        bool jump = false;
+        int pops = 0;
+        switch (*ip) {
+          case OP_JUMP:
+          case OP_LOOP:
+            jump = true;
+            break;
+          case OP_JUMP_IF_FALSE:
+            jump = isFalsey(peek(0));
+            break;
+          case OP_POP_JUMP_IF_FALSE:
+            jump = isFalsey(peek(0));
+            pops = 1;
+            break;
+          case OP_JUMP_IF_NOT_EQUAL:
+            jump = !valuesEqual(peek(1), peek(0));
+            pops = 2;
+            break;
+          case OP_JUMP_IF_NOT_GREATER:
+          case OP_JUMP_IF_NOT_LESS:
+            // The instruction itself reports operands that aren't numbers.
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+              double b = AS_NUMBER(peek(0));
+              double a = AS_NUMBER(peek(1));
+              jump = *ip == OP_JUMP_IF_NOT_GREATER ? !(a > b) : !(a < b);
+            }
+            pops = 2;
+            break;
+          case OP_GET_LOCAL:
+            ip++;
+            push(frame->slots[(high << 8) | READ_BYTE()]);
+            DISPATCH();
+          case OP_SET_LOCAL:
+            ip++;
+            frame->slots[(high << 8) | READ_BYTE()] = peek(0);
+            DISPATCH();
+          default:
+            // An instruction with a constant index operand.
+            wide = high << 8;
+            break;
+        }
+
+        if (jump) {
+          vm.stackTop -= pops;
+          uint8_t op = READ_BYTE();
+          uint32_t offset = (high << 16) | READ_SHORT();
+          if (op == OP_LOOP) {
+            // Skip the loop site. A loop this long isn't worth tracing.
+            ip += 2;
+            ip -= offset;
+            SAFEPOINT();
+          } else {
+            ip += offset;
+          }
+        }
+        DISPATCH();
+      }
+#ifndef COMPUTED_GOTO
+//< Optimization omit
     }
   }
+//> Optimization omit
+#endif
+//< Optimization omit
 
 #undef READ_BYTE
 //> Jumping Back and Forth undef-read-short
@@ -856,12 +2448,394 @@ static InterpretResult run() {
 //< undef-read-constant
 //> Global Variables undef-read-string
 #undef READ_STRING
+//> Optimization omit
+#undef READ_WIDE_CONSTANT
+#undef READ_CACHE
+#undef READ_INVOKE_CACHE
+#undef SAFEPOINT
+#undef ENTER_JIT
+//< Optimization omit
 //< Global Variables undef-read-string
 //> undef-binary-op
 #undef BINARY_OP
 //< undef-binary-op
+//> Optimization omit
+#undef NUMBER_OP
+#undef REGISTER_OP
+#undef QUICKEN
+#undef DEQUICKEN
+#undef CASE
+#undef DISPATCH
+//< Optimization omit
 }
 //< run
+//> Optimization omit
+#ifdef JIT
+// The compiled code calls these for the instructions it doesn't do inline.
+// Each does what run() does, reading the operands through [ip]. Anything
+// that can report an error or push a frame stores the ip past the
+// instruction in the frame first, like run() does.
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() \
+    (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() \
+    (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define READ_INVOKE_CACHE() \
+    (&frame->closure->function->chunk.invokeCaches[READ_SHORT()])
+
+// The compiled code reads and writes defined globals itself. It only calls
+// this to report an undefined one.
+int jitUndefinedGlobal(CallFrame* frame, uint8_t* ip) {
+  int slot = READ_SHORT();
+  frame->ip = ip;
+  runtimeError("Undefined variable '%s'.", globalName(slot)->chars);
+  return JIT_ERROR;
+}
+
+int jitSetUpvalue(CallFrame* frame, uint8_t* ip) {
+  uint8_t slot = READ_BYTE();
+  *frame->closure->upvalues[slot]->location = peek(0);
+  writeBarrier((Obj*)frame->closure->upvalues[slot], peek(0));
+  return JIT_CONTINUE;
+}
+
+int jitGetProperty(CallFrame* frame, uint8_t* ip) {
+  if (!IS_INSTANCE(peek(0))) {
+    frame->ip = ip;
+    runtimeError("Only instances have properties.");
+    return JIT_ERROR;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(peek(0));
+  ObjString* name = READ_STRING();
+  InlineCache* cache = READ_CACHE();
+  if (instance->shape == cache->shape && cache->shape != NULL) {
+    if (cache->slot != -1) {
+      vm.stackTop[-1] = instance->fields[cache->slot];
+    } else {
+      ObjBoundMethod* bound = newBoundMethod(
+          peek(0), AS_CLOSURE(cache->method));
+      vm.stackTop[-1] = OBJ_VAL(bound);
+    }
+    return JIT_CONTINUE;
+  }
+
+  frame->ip = ip;
+  return getProperty(cache, instance, name) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+int jitSetProperty(CallFrame* frame, uint8_t* ip) {
+  if (!IS_INSTANCE(peek(1))) {
+    frame->ip = ip;
+    runtimeError("Only instances have fields.");
+    return JIT_ERROR;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(peek(1));
+  ObjString* name = READ_STRING();
+  InlineCache* cache = READ_CACHE();
+  if (instance->shape == cache->shape && cache->shape != NULL &&
+      cache->slot < instance->fieldCapacity) {
+    instance->fields[cache->slot] = peek(0);
+    writeBarrier((Obj*)instance, peek(0));
+    if (cache->transition != NULL) {
+      instance->shape = cache->transition;
+      noteFieldCount(instance->klass, cache->transition->slotCount);
+    }
+  } else {
+    setProperty(cache, instance, name, peek(0));
+  }
+
+  Value value = pop();
+  pop();
+  push(value);
+  return JIT_CONTINUE;
+}
+
+int jitGetSuper(CallFrame* frame, uint8_t* ip) {
+  ObjString* name = READ_STRING();
+  ObjClass* superclass = AS_CLASS(pop());
+  frame->ip = ip;
+  return bindMethod(superclass, name) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+int jitGetThisField(CallFrame* frame, uint8_t* ip) {
+  ObjInstance* instance = AS_INSTANCE(frame->slots[0]);
+  ObjString* name = READ_STRING();
+  InlineCache* cache = READ_CACHE();
+  if (instance->shape == cache->shape && cache->shape != NULL &&
+      cache->slot != -1) {
+    push(instance->fields[cache->slot]);
+    return JIT_CONTINUE;
+  }
+
+  push(frame->slots[0]);
+  frame->ip = ip;
+  return getProperty(cache, instance, name) ? JIT_CONTINUE : JIT_ERROR;
+}
+
+// The compiled code pushes anything but an object itself.
+int jitPick(CallFrame* frame, uint8_t* ip) {
+  pickValue(READ_BYTE());
+  return JIT_CONTINUE;
+}
+
+int jitEnterLoop(CallFrame* frame, uint8_t* ip) {
+  int first = READ_SHORT();
+  forgetHoisted(&frame->closure->function->chunk, first, READ_BYTE());
+  return JIT_CONTINUE;
+}
+
+int jitSetHoisted(CallFrame* frame, uint8_t* ip) {
+  setHoisted(frame->closure->function, READ_SHORT(), peek(0));
+  return JIT_CONTINUE;
+}
+
+// The compiled code has already handled two numbers.
+int jitAdd(CallFrame* frame, uint8_t* ip) {
+  if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    concatenate();
+    return JIT_CONTINUE;
+  }
+
+  frame->ip = ip;
+  runtimeError("Operands must be two numbers or two strings.");
+  return JIT_ERROR;
+}
+
+int jitAddLocals(CallFrame* frame, uint8_t* ip) {
+  Value a = frame->slots[READ_BYTE()];
+  Value b = frame->slots[READ_BYTE()];
+  if (IS_STRING(a) && IS_STRING(b)) {
+    push(a);
+    push(b);
+    concatenate();
+    return JIT_CONTINUE;
+  }
+
+  frame->ip = ip;
+  runtimeError("Operands must be two numbers or two strings.");
+  return JIT_ERROR;
+}
+
+// Only called once the compiled code has found that the operands aren't
+// both numbers.
+int jitRegisterOp(CallFrame* frame, uint8_t* ip) {
+  uint8_t instruction = ip[-1];
+  uint8_t kinds = READ_BYTE();
+  uint8_t slot = READ_BYTE();
+  Value a = readOperand(frame, LEFT_KIND(kinds), READ_BYTE());
+  Value b = readOperand(frame, RIGHT_KIND(kinds), READ_BYTE());
+  if (instruction == OP_ADD_REG && IS_STRING(a) && IS_STRING(b)) {
+    concatenateOperands(frame, kinds, slot, a, b);
+    return JIT_CONTINUE;
+  }
+
+  frame->ip = ip;
+  runtimeError(instruction == OP_ADD_REG
+      ? "Operands must be two numbers or two strings."
+      : "Operands must be numbers.");
+  return JIT_ERROR;
+}
+
+int jitOperandsError(CallFrame* frame, uint8_t* ip) {
+  frame->ip = ip;
+  runtimeError("Operands must be numbers.");
+  return JIT_ERROR;
+}
+
+int jitOperandError(CallFrame* frame, uint8_t* ip) {
+  frame->ip = ip;
+  runtimeError("Operand must be a number.");
+  return JIT_ERROR;
+}
+
+int jitPrint(CallFrame* frame, uint8_t* ip) {
+  printValue(pop());
+  printf("\n");
+  return JIT_CONTINUE;
+}
+
+// Returns JIT_SWITCH if the call pushed a frame for run() to carry on with.
+int jitCall(CallFrame* frame, uint8_t* ip) {
+  int argCount = READ_BYTE();
+  frame->ip = ip;
+
+  int frameCount = vm.frameCount;
+  if (!callValue(peek(argCount), argCount)) return JIT_ERROR;
+  return vm.frameCount == frameCount ? JIT_CONTINUE : JIT_SWITCH;
+}
+
+// Finishes a tail call the native code made from [frame] at [ip]. If the
+// callee didn't take over the frame, the code carries on to the OP_RETURN.
+static int finishTailCall(CallFrame* frame, uint8_t* ip, int frameCount) {
+  if (vm.frameCount == frameCount && frame->ip == ip) return JIT_CONTINUE;
+
+#ifdef DEBUG_STRESS_GC
+  collectAtSafepoint();
+#else
+  if (vm.nurseryFull || vm.gcRequested) collectAtSafepoint();
+#endif
+  return JIT_SWITCH;
+}
+
+int jitTailCall(CallFrame* frame, uint8_t* ip) {
+  int argCount = READ_BYTE();
+  frame->ip = ip;
+
+  int frameCount = vm.frameCount;
+  if (!tailCall(frame, peek(argCount), argCount)) return JIT_ERROR;
+  return finishTailCall(frame, ip, frameCount);
+}
+
+int jitInvoke(CallFrame* frame, uint8_t* ip) {
+  ObjString* method = READ_STRING();
+  int argCount = READ_BYTE();
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  frame->ip = ip;
+
+  int frameCount = vm.frameCount;
+  Value receiver = peek(argCount);
+  ObjClosure* closure = IS_INSTANCE(receiver)
+      ? probeInvokeCache(cache, (Obj*)AS_INSTANCE(receiver)->shape)
+      : NULL;
+  if (closure != NULL) {
+    if (!call(closure, argCount)) return JIT_ERROR;
+  } else if (!invoke(cache, method, argCount)) {
+    return JIT_ERROR;
+  }
+  return vm.frameCount == frameCount ? JIT_CONTINUE : JIT_SWITCH;
+}
+
+int jitSuperInvoke(CallFrame* frame, uint8_t* ip) {
+  ObjString* method = READ_STRING();
+  int argCount = READ_BYTE();
+  ObjClass* superclass = AS_CLASS(pop());
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  frame->ip = ip;
+
+  ObjClosure* closure = probeInvokeCache(cache, (Obj*)superclass);
+  if (closure != NULL) {
+    if (!call(closure, argCount)) return JIT_ERROR;
+  } else if (!invokeFromClass(cache, (Obj*)superclass, superclass,
+                              method, argCount)) {
+    return JIT_ERROR;
+  }
+  return JIT_SWITCH;
+}
+
+int jitTailInvoke(CallFrame* frame, uint8_t* ip) {
+  ObjString* method = READ_STRING();
+  int argCount = READ_BYTE();
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  frame->ip = ip;
+
+  int frameCount = vm.frameCount;
+  if (!tailInvoke(frame, cache, method, argCount)) return JIT_ERROR;
+  return finishTailCall(frame, ip, frameCount);
+}
+
+int jitTailSuperInvoke(CallFrame* frame, uint8_t* ip) {
+  ObjString* method = READ_STRING();
+  int argCount = READ_BYTE();
+  ObjClass* superclass = AS_CLASS(pop());
+  InvokeCache* cache = READ_INVOKE_CACHE();
+  frame->ip = ip;
+
+  int frameCount = vm.frameCount;
+  if (!tailSuperInvoke(frame, cache, superclass, method, argCount)) {
+    return JIT_ERROR;
+  }
+  return finishTailCall(frame, ip, frameCount);
+}
+
+int jitClosure(CallFrame* frame, uint8_t* ip) {
+  ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+  ObjClosure* closure = newClosure(function);
+  push(OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t isLocal = READ_BYTE();
+    uint16_t index = READ_SHORT();
+    if (isLocal) {
+      closure->upvalues[i] = captureUpvalue(frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+  }
+  return JIT_CONTINUE;
+}
+
+int jitCloseUpvalue(CallFrame* frame, uint8_t* ip) {
+  closeUpvalues(vm.stackTop - 1);
+  pop();
+  return JIT_CONTINUE;
+}
+
+// Returns JIT_DONE once the script itself returns.
+int jitReturn(CallFrame* frame, uint8_t* ip) {
+  Value result = pop();
+  closeUpvalues(frame->slots);
+  vm.frameCount--;
+  if (vm.frameCount == 0) {
+    pop();
+    return JIT_DONE;
+  }
+
+  vm.stackTop = frame->slots;
+  push(result);
+#ifdef DEBUG_STRESS_GC
+  collectAtSafepoint();
+#else
+  if (vm.nurseryFull || vm.gcRequested) collectAtSafepoint();
+#endif
+  return JIT_SWITCH;
+}
+
+int jitClass(CallFrame* frame, uint8_t* ip) {
+  push(OBJ_VAL(newClass(READ_STRING())));
+  return JIT_CONTINUE;
+}
+
+int jitInherit(CallFrame* frame, uint8_t* ip) {
+  Value superclass = peek(1);
+  if (!IS_CLASS(superclass)) {
+    frame->ip = ip;
+    runtimeError("Superclass must be a class.");
+    return JIT_ERROR;
+  }
+
+  ObjClass* subclass = AS_CLASS(peek(0));
+  tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+  pop(); // Subclass.
+  return JIT_CONTINUE;
+}
+
+int jitMethod(CallFrame* frame, uint8_t* ip) {
+  defineMethod(READ_STRING());
+  return JIT_CONTINUE;
+}
+
+int jitLoop(CallFrame* frame, uint8_t* ip) {
+  uint16_t offset = READ_SHORT();
+  LoopSite* site =
+      &frame->closure->function->chunk.loopSites[READ_SHORT()];
+  if (site->trace == NULL && !warmUpLoop(site)) return JIT_CONTINUE;
+
+  frame->ip = traceLoop(frame, site, ip - offset);
+  return JIT_SWITCH;
+}
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_STRING
+#undef READ_CACHE
+#undef READ_INVOKE_CACHE
+#endif
+//< Optimization omit
 //> omit
 void hack(bool b) {
   // Hack to avoid unused function error. run() is not used in the
@@ -898,6 +2872,14 @@ InterpretResult interpret(const char* source) {
 //> Calls and Functions interpret-stub
   ObjFunction* function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
+//> Optimization omit
+  return interpretFunction(function);
+}
+
+// Runs [function] as the top level of a script, whether it was just
+// compiled or loaded from a compiled file.
+InterpretResult interpretFunction(ObjFunction* function) {
+//< Optimization omit
 
   push(OBJ_VAL(function));
 //< Calls and Functions interpret-stub
@@ -11,6 +11,9 @@
 //> Hash Tables vm-include-table
 #include "table.h"
 //< Hash Tables vm-include-table
+//> Optimization omit
+#include "heap.h"
+//< Optimization omit
 //> vm-include-value
 #include "value.h"
 //< vm-include-value
@@ -21,8 +24,21 @@
 #define STACK_MAX 256
 */
 //> Calls and Functions frame-max
+/* Calls and Functions frame-max < Optimization omit
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+*/
+//> Optimization omit
+// How many frames the call stack holds before it's first grown, and how deep
+// it may grow unless --frames and --max-frames say otherwise. The value stack
+// is grown whenever a frame is pushed to have room for the function's
+// frameSize slots: the most values its code has on the stack at once, plus
+// STACK_HEADROOM for the ones the VM pushes to keep objects it's allocating
+// from being collected.
+#define FRAMES_INITIAL 8
+#define FRAMES_MAX 1024
+#define STACK_HEADROOM 8
+//< Optimization omit
 //< Calls and Functions frame-max
 //> Calls and Functions call-frame
 
@@ -35,8 +51,55 @@ typedef struct {
 //< Closures call-frame-closure
   uint8_t* ip;
   Value* slots;
+//> Optimization omit
+
+  // How many frames tail calls have replaced with this one. Only stack
+  // traces care.
+  uint64_t tailCalls;
+//< Optimization omit
 } CallFrame;
 //< Calls and Functions call-frame
+//> Optimization omit
+
+// The number of entries in the global method cache that call sites with too
+// many receiver types fall back to. Must be a power of two.
+#define METHOD_CACHE_SIZE 1024
+
+typedef struct {
+  ObjClass* klass;
+  ObjString* name;
+  Value method;
+} MethodCacheEntry;
+
+typedef enum {
+  GC_IDLE,
+  GC_MARKING
+} GcState;
+
+// Collection pauses are counted in power of two buckets of microseconds.
+#define GC_PAUSE_BUCKETS 24
+
+typedef enum {
+  GC_STATS_OFF,
+  GC_STATS_TEXT,
+  GC_STATS_JSON
+} GcStatsFormat;
+
+// What happened in one full collection. Times are in microseconds. Dead
+// objects are swept until the next collection starts, so the objects freed
+// and the time spent sweeping keep adding up until then.
+typedef struct {
+  bool incremental;
+  size_t bytesBefore;
+  size_t bytesAfter;
+  double markTime;
+  double stringTime;
+  double sweepTime;
+  double lazySweepTime;
+  int grayHighWater;
+  uint64_t freed[OBJ_TYPE_COUNT];
+} GcCycleStats;
+//< Optimization omit
 
 typedef struct {
 /* A Virtual Machine vm-h < Calls and Functions frame-array
@@ -46,17 +109,38 @@ typedef struct {
   uint8_t* ip;
 */
 //> Calls and Functions frame-array
+/* Calls and Functions frame-array < Optimization omit
   CallFrame frames[FRAMES_MAX];
+*/
+//> Optimization omit
+  // Both stacks are on the heap and grow as calls get deeper. When the value
+  // stack moves, everything pointing into it moves too. See resizeStack().
+  CallFrame* frames;
+  int frameCapacity;
+  int maxFrames;
+//< Optimization omit
   int frameCount;
   
 //< Calls and Functions frame-array
 //> vm-stack
+/* A Virtual Machine vm-stack < Optimization omit
   Value stack[STACK_MAX];
+*/
+//> Optimization omit
+  Value* stack;
+  int stackCapacity;
+//< Optimization omit
   Value* stackTop;
 //< vm-stack
 //> Global Variables vm-globals
   Table globals;
 //< Global Variables vm-globals
+//> Optimization omit
+  // The values of the global variables. The compiler gives each name a slot
+  // in here the first time it sees it, and [globals] maps names to their
+  // slot numbers.
+  ValueArray globalValues;
+//< Optimization omit
 //> Hash Tables vm-strings
   Table strings;
 //< Hash Tables vm-strings
@@ -72,13 +156,119 @@ typedef struct {
   size_t nextGC;
 //< Garbage Collection vm-fields
 //> Strings objects-root
+/* Strings objects-root < Optimization omit
   Obj* objects;
+*/
 //< Strings objects-root
 //> Garbage Collection vm-gray-stack
   int grayCount;
   int grayCapacity;
   Obj** grayStack;
 //< Garbage Collection vm-gray-stack
+//> Optimization omit
+  MethodCacheEntry methodCache[METHOD_CACHE_SIZE];
+
+  // The old space. See heap.c.
+  Page* pages[SIZE_CLASS_COUNT];
+  Page* unsweptPages[SIZE_CLASS_COUNT];
+  Obj* freeCells[SIZE_CLASS_COUNT];
+  Page* largePages;
+  Page* freePages;
+  int chunkCount;
+  int chunkCapacity;
+  void** chunks;
+
+  // The young generation. See nursery.c.
+  void* nurseryMemory;
+  uint8_t* nurseryStart;
+  uint8_t* nurseryTop;
+  uint8_t* nurseryEnd;
+  bool nurseryFull;
+
+  // Old objects that may refer to young ones.
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** remembered;
+
+  // Young objects that own memory outside the nursery.
+  int youngMemoryCount;
+  int youngMemoryCapacity;
+  Obj** youngMemory;
+
+  // Young objects found live while collecting the nursery.
+  int survivorCount;
+  int survivorCapacity;
+  Obj** survivors;
+
+  // How many gray objects each increment of an incremental collection
+  // blackens, or zero to collect all at once. See collectGarbage().
+  int gcSliceBudget;
+  GcState gcState;
+
+  // Set when the incremental collector needs a safepoint to start or
+  // finish a cycle.
+  bool gcRequested;
+
+  // How many threads mark the heap in a full collection.
+  int gcThreads;
+  bool markingInParallel;
+
+  // The heap targets, in bytes, and the measurements the pacer uses to
+  // meet them. Zero means no maximum or limit. See pacer.c.
+  int gcPercent;
+  size_t gcMinHeap;
+  size_t gcMaxHeap;
+  size_t gcSoftLimit;
+  size_t gcMarkStartBytes;
+  size_t gcRunway;
+  double gcLastCycleEnd;
+  double gcLastCycleWork;
+
+  // The collection in progress or being swept, and the ones before it when
+  // --gc-stats is on. See printGcStats().
+  GcStatsFormat gcStats;
+  GcCycleStats gcCycle;
+  int gcCycleCount;
+  int gcHistoryCount;
+  int gcHistoryCapacity;
+  GcCycleStats* gcHistory;
+  uint64_t gcNurseryCount;
+  uint64_t gcPromotedCount;
+
+  bool gcLogPauses;
+  uint64_t gcPauses[GC_PAUSE_BUCKETS];
+  double gcPauseTotal;
+  double gcLongestPause;
+
+  // Time spent marking, sweeping during collections, and sweeping while
+  // allocating in between them. See startSweeping(). The last is only
+  // measured for --gc-pauses since it's in the allocator's path.
+  double gcMarkTime;
+  double gcSweepTime;
+  double gcLazySweepTime;
+
+  // How many calls and loop iterations make a function hot enough to be
+  // compiled to native code, or zero to never compile. See jit.c.
+  int jitThreshold;
+
+  // How many trips around a loop make it hot enough to trace, or zero to
+  // never trace. See trace.c.
+  int traceThreshold;
+
+  // How much work the compiler puts into optimizing each function. See
+  // optimizeChunk().
+  int optimizeLevel;
+
+  // Whether function bodies are only compiled once they're called. See
+  // compileLazy().
+  bool lazyCompile;
+
+  // Copies of the source code compiled with lazyCompile on, which the
+  // functions that haven't been compiled yet still point into.
+  char** sources;
+  int sourceCount;
+  int sourceCapacity;
+//< Optimization omit
 } VM;
 
 //> interpret-result
@@ -101,9 +291,18 @@ InterpretResult interpret(Chunk* chunk);
 //> Scanning on Demand vm-interpret-h
 InterpretResult interpret(const char* source);
 //< Scanning on Demand vm-interpret-h
+//> Optimization omit
+InterpretResult interpretFunction(ObjFunction* function);
+//< Optimization omit
 //> push-pop
 void push(Value value);
 Value pop();
 //< push-pop
+//> Optimization omit
+void flushMethodCache();
+void reserveFrames(int count);
+int globalSlot(ObjString* name);
+ObjString* globalName(int slot);
+//< Optimization omit
 
 #endif
@@ -13,6 +13,7 @@ final _expectedOutputPattern = RegExp(r"// expect: ?(.*)");
 final _expectedErrorPattern = RegExp(r"// (Error.*)");
 final _errorLinePattern = RegExp(r"// \[((java|c) )?line (\d+)\] (Error.*)");
 final _expectedRuntimeErrorPattern = RegExp(r"// expect runtime error: (.+)");
+final _expectedStackTracePattern = RegExp(r"// expect stack trace: (.+)");
 final _syntaxErrorPattern = RegExp(r"\[.*line (\d+)\] (Error.+)");
 final _stackTracePattern = RegExp(r"\[line (\d+)\]");
 final _nonTestPattern = RegExp(r"// nontest");
@@ -196,6 +197,9 @@ class Test {
   /// If there is an expected runtime error, the line it should occur on.
   int _runtimeErrorLine = 0;
 
+  /// Lines that should appear in the runtime error's stack trace, in order.
+  final _expectedStackTrace = <String>[];
+
   int _expectedExitCode = 0;
 
   /// The list of failure message lines.
@@ -277,6 +281,13 @@ class Test {
         // If we expect a runtime error, it should exit with EX_SOFTWARE.
         _expectedExitCode = 70;
         _expectations++;
+        continue;
+      }
+
+      match = _expectedStackTracePattern.firstMatch(line);
+      if (match != null) {
+        _expectedStackTrace.add(match[1]);
+        _expectations++;
       }
     }
 
@@ -343,6 +354,20 @@ class Test {
             "but was on line $stackLine.");
       }
     }
+
+    // Make sure the stack trace has the expected lines, in order.
+    var index = 0;
+    for (var expected in _expectedStackTrace) {
+      while (index < stackLines.length && stackLines[index] != expected) {
+        index++;
+      }
+
+      if (index == stackLines.length) {
+        fail("Expected '$expected' in stack trace and got:", stackLines);
+        break;
+      }
+      index++;
+    }
   }
 
   void _validateCompileErrors(List<String> error_lines) {
@@ -451,17 +476,29 @@ void _defineTestSuites() {
   // JVM doesn't correctly implement IEEE equality on boxed doubles.
   var javaNaNEquality = {
     "test/number/nan_equality.lox": "skip",
+    "test/operator/constant_nan_operands.lox": "skip",
+  };
+
+  // Only the final clox reuses frames for calls in tail position.
+  var noTailCalls = {
+    "test/function/tail_call.lox": "skip",
+    "test/function/tail_call_other_callees.lox": "skip",
+    "test/function/tail_call_stack_trace.lox": "skip",
+    "test/method/tail_call.lox": "skip",
   };
 
   // No hardcoded limits in jlox.
   var noJavaLimits = {
-    "test/limit/loop_too_large.lox": "skip",
-    "test/limit/no_reuse_constants.lox": "skip",
-    "test/limit/too_many_constants.lox": "skip",
+    "test/limit/large_loop.lox": "skip",
+    "test/limit/many_constants.lox": "skip",
+    "test/limit/reuse_constants.lox": "skip",
+    "test/limit/many_locals.lox": "skip",
+    "test/limit/too_many_globals.lox": "skip",
     "test/limit/too_many_locals.lox": "skip",
     "test/limit/too_many_upvalues.lox": "skip",
 
     // Rely on JVM for stack overflow checking.
+    "test/limit/deep_temporaries.lox": "skip",
     "test/limit/stack_overflow.lox": "skip",
   };
 
@@ -496,11 +533,17 @@ void _defineTestSuites() {
     "test/for/return_inside.lox": "skip",
     "test/for/syntax.lox": "skip",
     "test/function": "skip",
+    "test/if/unreachable_error.lox": "skip",
+    "test/operator/add_changing_types.lox": "skip",
     "test/operator/not.lox": "skip",
+    "test/operator/subtract_changing_types.lox": "skip",
     "test/regression/40.lox": "skip",
     "test/return": "skip",
     "test/unexpected_character.lox": "skip",
+    "test/variable/define_after_use.lox": "skip",
     "test/while/closure_in_body.lox": "skip",
+    "test/while/constant_condition.lox": "skip",
+    "test/while/hot_loop_exits.lox": "skip",
     "test/while/return_closure.lox": "skip",
     "test/while/return_inside.lox": "skip",
   };
@@ -515,6 +558,7 @@ void _defineTestSuites() {
     "test/variable/early_bound.lox": "skip",
 
     // Broken because we haven"t fixed it yet by detecting the error.
+    "test/if/unreachable_error.lox": "skip",
     "test/return/at_top_level.lox": "skip",
     "test/variable/use_local_in_initializer.lox": "skip",
   };
@@ -524,8 +568,9 @@ void _defineTestSuites() {
     "test/block/empty.lox": "skip",
     "test/for": "skip",
     "test/if": "skip",
-    "test/limit/loop_too_large.lox": "skip",
+    "test/limit/large_loop.lox": "skip",
     "test/logical_operator": "skip",
+    "test/operator/constant_operands.lox": "skip",
     "test/variable/unreached_undefined.lox": "skip",
     "test/while": "skip",
   };
@@ -539,22 +584,46 @@ void _defineTestSuites() {
     "test/for/return_inside.lox": "skip",
     "test/for/syntax.lox": "skip",
     "test/function": "skip",
-    "test/limit/no_reuse_constants.lox": "skip",
+    "test/if/unreachable_error.lox": "skip",
+    "test/limit/deep_temporaries.lox": "skip",
+    "test/limit/many_constants.lox": "skip",
+    "test/limit/reuse_constants.lox": "skip",
     "test/limit/stack_overflow.lox": "skip",
-    "test/limit/too_many_constants.lox": "skip",
+    "test/limit/many_locals.lox": "skip",
     "test/limit/too_many_locals.lox": "skip",
     "test/limit/too_many_upvalues.lox": "skip",
+    "test/operator/add_changing_types.lox": "skip",
+    "test/operator/subtract_changing_types.lox": "skip",
     "test/regression/40.lox": "skip",
     "test/return": "skip",
     "test/unexpected_character.lox": "skip",
     "test/variable/collide_with_parameter.lox": "skip",
+    "test/variable/define_after_use.lox": "skip",
     "test/variable/duplicate_parameter.lox": "skip",
     "test/variable/early_bound.lox": "skip",
     "test/while/closure_in_body.lox": "skip",
+    "test/while/constant_condition.lox": "skip",
+    "test/while/hot_loop_exits.lox": "skip",
     "test/while/return_closure.lox": "skip",
     "test/while/return_inside.lox": "skip",
   };
 
+  // The chapters' C code has room for 64 frames and no more.
+  var noCGrowableStack = {
+    "test/function/deep_recursion.lox": "skip",
+  };
+
+  // The chapters' C code can only index 256 constants and locals and jump
+  // 64K. Each global variable's name takes up a constant.
+  var noCWideOperands = {
+    "test/limit/large_loop.lox": "skip",
+    "test/limit/many_constants.lox": "skip",
+    "test/limit/many_locals.lox": "skip",
+    "test/limit/too_many_globals.lox": "skip",
+    "test/limit/too_many_locals.lox": "skip",
+    "test/limit/reuse_constants.lox": "skip",
+  };
+
   // No classes in C yet.
   var noCClasses = {
     "test/assignment/to_this.lox": "skip",
@@ -594,6 +663,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noTailCalls,
   });
 
   java("chap04_scanning", {
@@ -621,6 +691,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noTailCalls,
     ...noJavaFunctions,
     ...noJavaResolution,
     ...noJavaClasses,
@@ -630,6 +701,7 @@ void _defineTestSuites() {
     "test/for": "skip",
     "test/if": "skip",
     "test/logical_operator": "skip",
+    "test/operator/constant_operands.lox": "skip",
     "test/while": "skip",
     "test/variable/unreached_undefined.lox": "skip",
   });
@@ -639,6 +711,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noTailCalls,
     ...noJavaFunctions,
     ...noJavaResolution,
     ...noJavaClasses,
@@ -649,6 +722,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noTailCalls,
     ...noJavaResolution,
     ...noJavaClasses,
   });
@@ -658,6 +732,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noTailCalls,
     ...noJavaClasses,
   });
 
@@ -665,6 +740,7 @@ void _defineTestSuites() {
     "test": "pass",
     ...earlyChapters,
     ...noJavaLimits,
+    ...noTailCalls,
     ...javaNaNEquality,
 
     // No inheritance.
@@ -682,6 +758,7 @@ void _defineTestSuites() {
     ...earlyChapters,
     ...javaNaNEquality,
     ...noJavaLimits,
+    ...noTailCalls,
   });
 
   c("clox", {
@@ -716,6 +793,7 @@ void _defineTestSuites() {
   c("chap21_global", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
     ...noCControlFlow,
     ...noCFunctions,
     ...noCClasses,
@@ -739,6 +817,7 @@ void _defineTestSuites() {
   c("chap22_local", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
     ...noCControlFlow,
     ...noCFunctions,
     ...noCClasses,
@@ -747,6 +826,8 @@ void _defineTestSuites() {
   c("chap23_jumping", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
+    ...noTailCalls,
     ...noCFunctions,
     ...noCClasses,
   });
@@ -754,6 +835,9 @@ void _defineTestSuites() {
   c("chap24_calls", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
+    ...noCGrowableStack,
+    ...noTailCalls,
     ...noCClasses,
 
     // No closures.
@@ -770,18 +854,27 @@ void _defineTestSuites() {
   c("chap25_closures", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
+    ...noCGrowableStack,
+    ...noTailCalls,
     ...noCClasses,
   });
 
   c("chap26_garbage", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
+    ...noCGrowableStack,
+    ...noTailCalls,
     ...noCClasses,
   });
 
   c("chap27_classes", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
+    ...noCGrowableStack,
+    ...noTailCalls,
     ...noCInheritance,
 
     // No methods.
@@ -791,6 +884,7 @@ void _defineTestSuites() {
     "test/closure/close_over_method_parameter.lox": "skip",
     "test/constructor": "skip",
     "test/field/get_and_set_method.lox": "skip",
+    "test/field/load_in_loop.lox": "skip",
     "test/field/method.lox": "skip",
     "test/field/method_binds_this.lox": "skip",
     "test/method": "skip",
@@ -804,16 +898,25 @@ void _defineTestSuites() {
   c("chap28_methods", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
+    ...noCGrowableStack,
+    ...noTailCalls,
     ...noCInheritance,
   });
 
   c("chap29_superclasses", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
+    ...noCGrowableStack,
+    ...noTailCalls,
   });
 
   c("chap30_optimization", {
     "test": "pass",
     ...earlyChapters,
+    ...noCWideOperands,
+    ...noCGrowableStack,
+    ...noTailCalls,
   });
 }